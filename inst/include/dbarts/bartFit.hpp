@@ -10,6 +10,7 @@
 
 #include "control.hpp"
 #include "data.hpp"
+#include "memoryUsage.hpp"
 #include "model.hpp"
 #include "scratch.hpp"
 #include "state.hpp"
@@ -20,6 +21,7 @@ extern "C" {
 }
 
 namespace dbarts {
+  struct LeafCooccurrences;
   struct Results;
   struct SharedScratch;
   
@@ -46,9 +48,50 @@ namespace dbarts {
     Results* runSampler();
     Results* runSampler(std::size_t numBurnIn, std::size_t numSamples);
     void runSampler(std::size_t numBurnIn, Results* results);
+    // draws numSamples into results, which may hold fewer; it then keeps only the most recent draws,
+    // so that control.callback can consume each one as it is stored
+    void runSampler(std::size_t numBurnIn, std::size_t numSamples, Results* results);
     
     
     void predict(const double* x_test, std::size_t numTestObservations, const double* testOffset, double* result) const;
+    // Summaries of the predictions for each test observation, pooled across samples and chains and
+    // computed in blocks of observations so that the draws are never held at once. The result is
+    // numTestObservations x (mean, variance, quantiles), with only the requested columns present.
+    void predictSummaries(const double* x_test, std::size_t numTestObservations, const double* testOffset,
+                          bool includeMean, bool includeVariance, const double* quantiles, std::size_t numQuantiles,
+                          double* result) const;
+    // For every tree of every kept sample, the bottom node that each test observation falls into,
+    // numbered left to right from zero. The result is numTestObservations x numTrees x numSamples x
+    // numChains. Trees with more bottom nodes than a uint16 can number raise an error.
+    void getLeafMemberships(const double* x_test, std::size_t numTestObservations, std::uint16_t* result) const;
+    // Accumulates, for each pair of test observations, the number of trees across the kept samples in
+    // which they share a bottom node, keeping only pairs that do at least minCount times. Memory
+    // grows with the number of pairs that share a leaf, not with the square of the observations.
+    LeafCooccurrences* getLeafCooccurrences(const double* x_test, std::size_t numTestObservations, std::size_t minCount) const;
+    
+    // Estimates the posterior mean of each test observation from a subset of the draws, taken in
+    // drawOrder (indexed by chainNum * numSamples + sampleNum, a permutation of all of them). Draws
+    // are added to a row until its Monte Carlo standard error, corrected for sampling without
+    // replacement, is at most absoluteTolerance + relativeTolerance * |mean|, or the draws run out.
+    void predictApproximateMeans(const double* x_test, std::size_t numTestObservations, const double* testOffset,
+                                 const std::size_t* drawOrder, std::size_t minNumDraws,
+                                 double absoluteTolerance, double relativeTolerance,
+                                 double* means, double* standardErrors, std::size_t* numDrawsUsed) const;
+    // Scores test observations that are too many to hold in memory. The input file is the
+    // numTestObservations x numPredictors matrix, column-major as big-endian doubles. Chunks of rows
+    // are read, predicted, and written in a pipeline, so that reading the next chunk and writing the
+    // last overlap computing the current. The output file is laid out in the same way, with the
+    // columns of predictSummaries or, when writeDraws is true, of predict.
+    void predictFromFile(const char* x_testFileName, std::size_t numTestObservations, const char* resultFileName,
+                         std::size_t chunkSize, bool writeDraws,
+                         bool includeMean, bool includeVariance, const double* quantiles, std::size_t numQuantiles) const;
+    
+    // planMemory gives what a fit with the given settings would hold after running for numSamples,
+    // sizing trees from the tree prior or, once this fit has run, from its own trees and kept
+    // samples; getMemoryUsage measures what this one holds now, with results for numSamples draws
+    static MemoryUsage planMemory(const Control& control, const Data& data, const Model& model, std::size_t numSamples);
+    MemoryUsage planMemory(const Control& newControl, std::size_t numSamples) const;
+    MemoryUsage getMemoryUsage(std::size_t numSamples) const;
     // settors simply replace local pointers to variables. dimensions much match
     // update modifies the local copy (which may belong to someone else)
     void setResponse(const double* newResponse); 
@@ -0,0 +1,65 @@
+#ifndef DBARTS_COMPACT_FIT_HPP
+#define DBARTS_COMPACT_FIT_HPP
+
+#include <cstddef> // size_t
+#include "cstdint.hpp" // uint32_t
+
+#include "types.hpp"
+
+namespace dbarts {
+  struct BARTFit;
+  
+  // The kept trees of a saved fit together with the cut points needed to route observations
+  // through them, and nothing else. Loading one skips the training data and sampler state, so it
+  // is much smaller and faster to load than a BARTFit when all that is wanted is to predict.
+  struct CompactFit {
+    struct Node {
+      std::int32_t variableIndex;     // -1 for bottom nodes
+      std::uint16_t numCategoryWords; // as in Rule
+      bool missingGoesRight;
+      std::size_t rightChild;         // into nodes; left children immediately follow their parents
+
+      union {
+        std::int32_t splitIndex;
+        std::uint32_t categoryDirections;
+        std::size_t categoryWordsOffset; // into categoryDirectionsWide
+        double value;                    // bottom nodes
+      };
+    };
+
+    std::size_t numPredictors;
+    std::size_t numTrees;
+    std::size_t numChains;  // as loaded, which can be fewer than were saved
+    std::size_t numSamples; // per chain, as loaded
+
+    VariableType* variableTypes;
+    std::uint32_t* numCutsPerVariable;
+    double** cutPoints;
+    double dataScaleMin;
+    double dataScaleRange;
+
+    Node* nodes;
+    std::size_t* treeStarts; // numTrees x numSamples x numChains, into nodes
+    std::uint64_t* categoryDirectionsWide;
+
+    CompactFit();
+    ~CompactFit();
+
+    // result is numTestObservations x numSamples x numChains, as from BARTFit::predict
+    void predict(const double* x_test, std::size_t numTestObservations, const double* testOffset, double* result) const;
+    
+    // The posterior mean is linear in the leaf values, so the samples can be collapsed into a
+    // single one whose trees are the distinct tree structures, each with its leaf values summed
+    // over the samples it appears in and divided by their number. Predicting from the result
+    // gives the posterior mean with one traversal per distinct structure.
+    CompactFit* collapseSamples() const;
+    static CompactFit* collapseSamples(const BARTFit& fit);
+
+    // chains and samples are increasing, zero-based indices into those saved and can be NULL to
+    // load all; returns NULL on failure
+    static CompactFit* loadFromFile(const char* fileName, const std::size_t* chains, std::size_t numChains,
+                                    const std::size_t* samples, std::size_t numSamples);
+  };
+} // namespace dbarts
+
+#endif // DBARTS_COMPACT_FIT_HPP
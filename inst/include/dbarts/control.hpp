@@ -20,6 +20,8 @@ namespace dbarts {
     bool keepTrainingFits;
     bool useQuantiles;
     bool keepTrees;
+    bool compressTrees; // hold kept samples as compact byte streams, decoding them when read
+    bool reorderObservations; // hold observations internally so that those with similar predictors are adjacent
     
     std::size_t defaultNumSamples;
     std::size_t defaultNumBurnIn;
@@ -29,6 +31,7 @@ namespace dbarts {
     std::uint32_t treeThinningRate;
     std::uint32_t printEvery;
     std::uint32_t printCutoffs;
+    std::size_t memoryBudget; // in bytes; 0 for none. see BARTFit::planMemory
     
     // these should be from external/random.h with the exception that we catch "INVALID" codes
     // and use them to construct a default RNG (e.g., one that matches the environment's)
@@ -40,8 +43,8 @@ namespace dbarts {
     
     Control() :
       responseIsBinary(false), verbose(true), keepTrainingFits(true), useQuantiles(false), keepTrees(false),
-      defaultNumSamples(800), defaultNumBurnIn(200), numTrees(75), numChains(1), numThreads(1), treeThinningRate(1),
-      printEvery(100), printCutoffs(0), rng_algorithm(EXT_RNG_ALGORITHM_MERSENNE_TWISTER),
+      compressTrees(false), reorderObservations(false), defaultNumSamples(800), defaultNumBurnIn(200), numTrees(75), numChains(1), numThreads(1), treeThinningRate(1),
+      printEvery(100), printCutoffs(0), memoryBudget(0), rng_algorithm(EXT_RNG_ALGORITHM_MERSENNE_TWISTER),
       rng_standardNormal(EXT_RNG_STANDARD_NORMAL_INVERSION), callback(NULL), callbackData(NULL)
     { }
     Control(std::size_t defaultNumSamples,
@@ -62,9 +65,9 @@ namespace dbarts {
             CallbackFunction callback,
             void* callbackData) :
       responseIsBinary(responseIsBinary), verbose(verbose), keepTrainingFits(keepTrainingFits), useQuantiles(useQuantiles),
-      keepTrees(keepTrees), defaultNumSamples(defaultNumSamples), defaultNumBurnIn(defaultNumBurnIn), numTrees(numTrees),
+      keepTrees(keepTrees), compressTrees(false), reorderObservations(false), defaultNumSamples(defaultNumSamples), defaultNumBurnIn(defaultNumBurnIn), numTrees(numTrees),
       numChains(numChains), numThreads(numThreads), treeThinningRate(treeThinningRate), printEvery(printEvery),
-      printCutoffs(printCutoffs), rng_algorithm(rng_algorithm), rng_standardNormal(rng_standardNormal),
+      printCutoffs(printCutoffs), memoryBudget(0), rng_algorithm(rng_algorithm), rng_standardNormal(rng_standardNormal),
       callback(callback), callbackData(callbackData)
     { }
   };
@@ -7,9 +7,20 @@
 #include "types.hpp"
 
 namespace dbarts {
+  // compressed sparse column storage, as in Matrix's dgCMatrix; entries that are not stored are
+  // zero and row indices are sorted within each column
+  struct SparseMatrix {
+    const double* values;
+    const std::int32_t* rowIndices;
+    const std::int32_t* columnStarts; // length = numColumns + 1
+    
+    SparseMatrix() : values(NULL), rowIndices(NULL), columnStarts(NULL) { }
+  };
+  
   struct Data {
     const double* y;
     const double* x;
+    SparseMatrix x_sparse; // used in place of x when x is NULL
     const double* x_test;
     
     const double* weights;
@@ -24,6 +35,8 @@ namespace dbarts {
     const VariableType* variableTypes;
     const std::uint32_t* maxNumCuts; // length = numPredictors if control.useQuantiles is true
     
+    bool predictorsAreSparse() const { return x == NULL && x_sparse.columnStarts != NULL; }
+    
     Data() :
       y(NULL), x(NULL), x_test(NULL), weights(NULL), offset(NULL), testOffset(NULL),
       numObservations(0), numPredictors(0), numTestObservations(0),
@@ -0,0 +1,38 @@
+#ifndef DBARTS_LEAF_COOCCURRENCES_HPP
+#define DBARTS_LEAF_COOCCURRENCES_HPP
+
+#include <cstddef> // size_t
+#include "cstdint.hpp" // uint32_t
+
+namespace dbarts {
+  // Pairs of observations that fall into the same leaf, stored as triplets with row < column,
+  // ordered by row and then column. counts are the number of (sample, tree) combinations in which
+  // the pair share a leaf, out of numTreeSamples; pairs that never do are not stored.
+  struct LeafCooccurrences {
+    std::size_t numObservations;
+    std::size_t numTreeSamples; // numTrees x numSamples x numChains
+    std::size_t numPairs;
+    
+    std::uint32_t* rows;
+    std::uint32_t* columns;
+    std::uint32_t* counts;
+    
+    LeafCooccurrences(std::size_t numObservations, std::size_t numTreeSamples, std::size_t numPairs) :
+      numObservations(numObservations), numTreeSamples(numTreeSamples), numPairs(numPairs),
+      rows(new std::uint32_t[numPairs > 0 ? numPairs : 1]),
+      columns(new std::uint32_t[numPairs > 0 ? numPairs : 1]),
+      counts(new std::uint32_t[numPairs > 0 ? numPairs : 1])
+    { }
+    ~LeafCooccurrences() {
+      delete [] counts;
+      delete [] columns;
+      delete [] rows;
+    }
+    
+  private:
+    LeafCooccurrences(const LeafCooccurrences&);
+    LeafCooccurrences& operator=(const LeafCooccurrences&);
+  };
+} // namespace dbarts
+
+#endif // DBARTS_LEAF_COOCCURRENCES_HPP
@@ -0,0 +1,24 @@
+#ifndef DBARTS_MEMORY_USAGE_HPP
+#define DBARTS_MEMORY_USAGE_HPP
+
+#include <cstddef> // size_t
+
+namespace dbarts {
+  // Bytes held by a fit, by component. Arrays are counted exactly; tree nodes are counted exactly
+  // when measuring a live fit. When planning one, trees are sized by the expected number of nodes
+  // under the tree prior until the fit has run and by the average of its current trees afterwards,
+  // and compressed samples by the lengths of those already kept when there are any.
+  struct MemoryUsage {
+    std::size_t data;         // transposed predictors, rescaled response, and cut points
+    std::size_t chainScratch; // per-chain residuals, fits, and latent variables
+    std::size_t trees;        // current trees with their fits and observation indices
+    std::size_t savedSamples; // kept trees, either in full or compressed
+    std::size_t results;      // posterior draws returned by runSampler
+
+    MemoryUsage() : data(0), chainScratch(0), trees(0), savedSamples(0), results(0) { }
+
+    std::size_t getTotal() const { return data + chainScratch + trees + savedSamples + results; }
+  };
+} // namespace dbarts
+
+#endif // DBARTS_MEMORY_USAGE_HPP
@@ -59,10 +59,15 @@ namespace dbarts {
     virtual double computeRuleForVariableLogProbability(const BARTFit& fit, const Node& node) const = 0;
     
 
-    virtual Rule drawRuleAndVariable(const BARTFit& fit, ext_rng* rng, const Node& node, bool* exhaustedLeftSplits, bool* exhaustedRightSplits) const = 0;
-    virtual std::int32_t drawSplitVariable(const BARTFit& fit, ext_rng* rng, const Node& node) const = 0;
+    virtual Rule drawRuleAndVariable(const BARTFit& fit, std::size_t chainNum, ext_rng* rng, const Node& node, bool* exhaustedLeftSplits, bool* exhaustedRightSplits) const = 0;
+    virtual std::int32_t drawSplitVariable(const BARTFit& fit, std::size_t chainNum, ext_rng* rng, const Node& node) const = 0;
     virtual Rule drawRuleForVariable(const BARTFit& fit, ext_rng* rng, const Node& node, std::int32_t variableIndex, bool* exhaustedLeftSplits, bool* exhaustedRightSplits) const = 0;
     
+    // priors that weight split variables keep per-chain weights in State::splitProbabilities and
+    // redraw them once per iteration from the current variable counts
+    virtual bool usesSplitProbabilities() const = 0;
+    virtual void updateSplitProbabilities(const BARTFit& fit, std::size_t chainNum, ext_rng* rng, const std::uint32_t* variableCounts) const = 0;
+    
     virtual ~TreePrior() { }
   };
   
@@ -87,12 +92,18 @@ namespace dbarts {
   // for lack of a better name, calling it the Chipman, George, and McCullough prior
   // Pr(node splits) = base / (1 + depth)^power
   
+  //
+  // When sparse, split variables are drawn with probabilities s ~ Dirichlet(concentration / p, ...)
+  // instead of uniformly (Linero's DART); otherwise those are ignored.
   struct CGMPrior : TreePrior {
     double base;
     double power;
     
-    CGMPrior() { }
-    CGMPrior(double base, double power) : base(base), power(power) { }
+    bool sparse;
+    double concentration;
+    
+    CGMPrior() : sparse(false), concentration(1.0) { }
+    CGMPrior(double base, double power) : base(base), power(power), sparse(false), concentration(1.0) { }
     virtual ~CGMPrior() { }
     
     virtual double computeGrowthProbability(const BARTFit& fit, const Node& node) const;
@@ -101,9 +112,12 @@ namespace dbarts {
     virtual double computeSplitVariableLogProbability(const BARTFit& fit, const Node& node) const;
     virtual double computeRuleForVariableLogProbability(const BARTFit& fit, const Node& node) const;
     
-    virtual Rule drawRuleAndVariable(const BARTFit& fit, ext_rng* rng, const Node& node, bool* exhaustedLeftSplits, bool* exhaustedRightSplits) const;
-    virtual std::int32_t drawSplitVariable(const BARTFit& fit, ext_rng* rng, const Node& node) const;
+    virtual Rule drawRuleAndVariable(const BARTFit& fit, std::size_t chainNum, ext_rng* rng, const Node& node, bool* exhaustedLeftSplits, bool* exhaustedRightSplits) const;
+    virtual std::int32_t drawSplitVariable(const BARTFit& fit, std::size_t chainNum, ext_rng* rng, const Node& node) const;
     virtual Rule drawRuleForVariable(const BARTFit& fit, ext_rng* rng, const Node& node, std::int32_t variableIndex, bool* exhaustedLeftSplits, bool* exhaustedRightSplits) const;
+    
+    virtual bool usesSplitProbabilities() const { return sparse; }
+    virtual void updateSplitProbabilities(const BARTFit& fit, std::size_t chainNum, ext_rng* rng, const std::uint32_t* variableCounts) const;
   };
   
   // nodeMu ~ normal(0, 1 / precision)
@@ -13,10 +13,19 @@ namespace dbarts {
     const double* xt; // x transpose
     const double* xt_test;
     
+    // Internally, observation i is observation observationOrder[i] of the data, with y, weights,
+    // and offset as copies in that order. Without control.reorderObservations, observationOrder
+    // is NULL and the rest point into the data.
+    const std::size_t* observationOrder;
+    const double* y;
+    const double* weights;
+    const double* offset;
+    
     ScaleFactor dataScale;
     
     const std::uint32_t* numCutsPerVariable;
     const double* const* cutPoints;
+    const bool* variableHasMissingValues; // rules on these also draw a direction for NaN
   };
   struct ChainScratch {
     double* treeY;
@@ -25,6 +34,11 @@ namespace dbarts {
     double* totalFits;     // numObs
     double* totalTestFits; // numTestObs
     
+    // for drawing split variables when most of the weight is on unavailable ones; both NULL
+    // unless the tree prior weights variables
+    std::size_t* unavailableVariables; // numPredictors
+    double* unavailableSums;           // numPredictors + 1
+    
     std::size_t taskId;
   };
 } // namespace dbarts
@@ -16,11 +16,22 @@ namespace dbarts {
     Tree* trees;              // numTrees
     double* treeFits;         // numObs x numTrees; vals for tree <=> obsNum + treeNum * numObs
     
-    std::size_t* savedTreeIndices; // numObs x numTrees x numSamples
-    Tree* savedTrees;              // numTrees x numSamples
-    double* savedTreeFits;         // numObs x numTrees x numSamples; vals for tree <=> obsNum + treeNum * numObs + sampleNum * numTrees * numSamples
+    // Kept samples form a ring indexed by sample; each sample owns its own block so that
+    // changing the number of samples only allocates or frees the samples that differ.
+    std::size_t** savedTreeIndices; // numSamples x (numObs x numTrees)
+    Tree** savedTrees;              // numSamples x numTrees
+    double** savedTreeFits;         // numSamples x (numObs x numTrees); vals for tree <=> savedTreeFits[sampleNum][obsNum + treeNum * numObs]
+    
+    // With control.compressTrees, samples are held encoded and at most one is decoded into the
+    // saved blocks at a time; the blocks of every other sample are NULL. Call decompressSample
+    // before reading a saved sample and storeSample to replace one. The single decoded slot only
+    // avoids decoding the same sample twice in a row; there is no larger cache.
+    unsigned char** compressedSamples; // numSamples; NULL unless samples are compressed
+    mutable std::size_t decodedSampleNum;
+    mutable bool decodedSampleHasObservations;
 
     double sigma;
+    double* splitProbabilities; // numPredictors, as a partial sum tree; NULL unless the tree prior weights variables
     
     ext_rng* rng;
     
@@ -33,6 +44,20 @@ namespace dbarts {
     
     const char* const* createTreeStrings(const BARTFit& fit, bool useSavedTrees) const;
     void recreateTreesFromStrings(const BARTFit& fit, const char* const* treeStrings, bool useSavedTrees);
+    void recreateSavedSampleFromStrings(const BARTFit& fit, std::size_t sampleNum, const char* const* treeStrings, const double* treeFits);
+    
+    // makes the saved trees of a sample readable; when not withObservations, the observations are
+    // not partitioned, the fits are not filled in, and the bottom nodes hold their values instead
+    void decompressSample(const BARTFit& fit, std::size_t sampleNum, bool withObservations) const;
+    // copies trees and their fits (numObs x numTrees) in as the given sample
+    void storeSample(const BARTFit& fit, std::size_t sampleNum, const Tree* trees, const double* treeFits);
+    void discardDecodedSample(const BARTFit& fit);
+    std::size_t getCompressedSampleLength(std::size_t sampleNum) const; // in bytes
+    
+    // split probabilities as plain weights, numPredictors long; neither does anything when the
+    // tree prior does not use them
+    void getSplitProbabilities(std::size_t numPredictors, double* result) const;
+    void setSplitProbabilities(std::size_t numPredictors, const double* probabilities);
   };
 } // namespace dbarts
 
@@ -0,0 +1,31 @@
+#ifndef DBARTS_XBART_LOSS_H
+#define DBARTS_XBART_LOSS_H
+
+#include <stddef.h> // size_t
+
+// Compiled loss functions for xbart. A package fills in a dbarts_xbartLoss, wraps its address in
+// an external pointer tagged with the symbol named by DBARTS_XBART_LOSS_TAG, and has that pointer
+// passed as the 'loss' argument. Losses are calculated in the worker threads concurrently, so
+// calculateLoss must be thread safe and must not use the R API.
+
+#define DBARTS_XBART_LOSS_TAG "dbarts_xbartLoss"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  size_t numResults;
+
+  // testSamples is numTestObservations x numSamples; numResults values are written to results
+  void (*calculateLoss)(const double* y_test, size_t numTestObservations,
+                        const double* testSamples, size_t numSamples,
+                        double* results, void* data);
+  void* data;
+} dbarts_xbartLoss;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DBARTS_XBART_LOSS_H
@@ -4,9 +4,15 @@
 #include <cstddef> // size_t
 #include <dbarts/cstdint.hpp>
 #include <cstring> // memcpy
+#include <cmath> // log
 
+#include <R_ext/Random.h> // GetRNGstate, PutRNGState
 #include <R_ext/Rdynload.h>
 
+#include <external/random.h>
+#include <external/sliceSample.h>
+
+#include <rc/bounds.h>
 #include <rc/util.h>
 
 #include <dbarts/bartFit.hpp>
@@ -36,6 +42,26 @@ bool compareExternalPointers(const SEXP& lhs, const SEXP& rhs) {
   return R_ExternalPtrAddr(const_cast<SEXP>(lhs)) < R_ExternalPtrAddr(const_cast<SEXP>(rhs));
 }
 
+namespace {
+  enum RanefScalePrior {
+    RANEF_SCALE_PRIOR_CAUCHY,
+    RANEF_SCALE_PRIOR_GAMMA,
+    RANEF_SCALE_PRIOR_FUNCTION
+  };
+  
+  // posterior of the random effect standard deviation in rbart_vi; the built-in priors are
+  // evaluated directly, while user functions are called back as prior(x, rel.scale)
+  struct RanefScalePosterior {
+    double numRanef;
+    double sumOfSquaredRanef;
+    double priorScale;
+    RanefScalePrior priorType;
+    SEXP priorCall;
+    double* priorArgument;
+    bool callbackFailed;
+  };
+}
+
 extern "C" {
   
   static SEXP assignInPlace(SEXP targetExpr, SEXP indexExpr, SEXP sourceExpr)
@@ -131,6 +157,96 @@ extern "C" {
     
     return R_NilValue;
   }
+  
+  static double ranefScaleLogPosterior(double x, void* dataPtr)
+  {
+    RanefScalePosterior& data(*static_cast<RanefScalePosterior*>(dataPtr));
+    
+    double result = -data.numRanef * std::log(x) - 0.5 * data.sumOfSquaredRanef / (x * x);
+    
+    // constants of the built-in priors are dropped, as only differences matter to the sampler
+    switch (data.priorType) {
+      case RANEF_SCALE_PRIOR_CAUCHY:
+      {
+        double z = x / data.priorScale;
+        result -= std::log(1.0 + z * z);
+      }
+      break;
+      case RANEF_SCALE_PRIOR_GAMMA:
+      result += 1.5 * std::log(x) - x / data.priorScale;
+      break;
+      case RANEF_SCALE_PRIOR_FUNCTION:
+      {
+        // errors are caught so that the generator is released before returning to R
+        *data.priorArgument = x;
+        int errorOccurred;
+        SEXP priorExpr = R_tryEval(data.priorCall, R_GlobalEnv, &errorOccurred);
+        if (errorOccurred || !Rf_isReal(priorExpr) || XLENGTH(priorExpr) != 1) {
+          data.callbackFailed = true;
+          return -HUGE_VAL;
+        }
+        result += REAL(priorExpr)[0];
+      }
+      break;
+    }
+    
+    return result;
+  }
+  
+  static SEXP sampleRanefScale(SEXP scaleExpr, SEXP sumOfSquaresExpr, SEXP numRanefExpr, SEXP relScaleExpr, SEXP priorExpr, SEXP numIterationsExpr)
+  {
+    double scale = rc_getDouble(scaleExpr, "scale", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_VALUE | RC_GT, 0.0, RC_END);
+    double relScale = rc_getDouble(relScaleExpr, "relative scale", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_VALUE | RC_GT, 0.0, RC_END);
+    int numIterations = rc_getInt(numIterationsExpr, "number of iterations", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_VALUE | RC_GEQ, 0, RC_END);
+    
+    RanefScalePosterior data;
+    data.numRanef = static_cast<double>(rc_getInt(numRanefExpr, "number of random effects", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_VALUE | RC_GT, 0, RC_END));
+    data.sumOfSquaredRanef = rc_getDouble(sumOfSquaresExpr, "sum of squared random effects", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_VALUE | RC_GEQ, 0.0, RC_END);
+    data.priorScale = 2.5 * relScale;
+    data.priorCall = R_NilValue;
+    data.priorArgument = NULL;
+    data.callbackFailed = false;
+    
+    int numProtected = 0;
+    if (Rf_isString(priorExpr) && XLENGTH(priorExpr) == 1) {
+      const char* priorName = CHAR(STRING_ELT(priorExpr, 0));
+      if (std::strcmp(priorName, "cauchy") == 0) data.priorType = RANEF_SCALE_PRIOR_CAUCHY;
+      else if (std::strcmp(priorName, "gamma") == 0) data.priorType = RANEF_SCALE_PRIOR_GAMMA;
+      else Rf_error("unrecognized prior '%s'", priorName);
+    } else if (Rf_isFunction(priorExpr)) {
+      data.priorType = RANEF_SCALE_PRIOR_FUNCTION;
+      
+      SEXP argumentExpr = PROTECT(Rf_allocVector(REALSXP, 1));
+      data.priorCall = PROTECT(Rf_lang3(priorExpr, argumentExpr, relScaleExpr));
+      data.priorArgument = REAL(argumentExpr);
+      numProtected = 2;
+    } else {
+      Rf_error("prior must be the name of a built-in prior or a function");
+    }
+    
+    GetRNGstate();
+    
+    ext_rng* generator = ext_rng_createDefault(true);
+    if (generator == NULL) {
+      PutRNGstate();
+      Rf_error("could not allocate random number generator");
+    }
+    
+    // bracket width is fixed so that the transition does not depend on the current state
+    int errorCode = ext_sliceSample(generator, &ranefScaleLogPosterior, &data, &scale, relScale,
+                                    0.0, HUGE_VAL, 100, static_cast<size_t>(numIterations));
+    
+    ext_rng_destroy(generator);
+    
+    PutRNGstate();
+    
+    if (data.callbackFailed) Rf_error("prior did not evaluate to a numeric scalar");
+    if (errorCode != 0) Rf_error("log posterior of scale not finite at %f", scale);
+    
+    UNPROTECT(numProtected);
+    
+    return Rf_ScalarReal(scale);
+  }
     
   static SEXP isValidPointer(SEXP fitExpr)
   {
@@ -276,9 +392,17 @@ namespace {
   static R_CallMethodDef R_callMethods[] = {
     DEF_FUNC("dbarts_create", create, 3),
     DEF_FUNC("dbarts_run", run, 3),
+    DEF_FUNC("dbarts_getMemoryUsage", getMemoryUsage, 2),
     DEF_FUNC("dbarts_sampleTreesFromPrior", sampleTreesFromPrior, 1),
     DEF_FUNC("dbarts_printTrees", printTrees, 4),
     DEF_FUNC("dbarts_predict", predict, 3),
+    DEF_FUNC("dbarts_predictSummaries", predictSummaries, 6),
+    DEF_FUNC("dbarts_predictApproximateMeans", predictApproximateMeans, 7),
+    DEF_FUNC("dbarts_getLeafMemberships", getLeafMemberships, 2),
+    DEF_FUNC("dbarts_getLeafCooccurrences", getLeafCooccurrences, 3),
+    DEF_FUNC("dbarts_collapseSamples", collapseSamples, 1),
+    DEF_FUNC("dbarts_predictCollapsed", predictCollapsed, 3),
+    DEF_FUNC("dbarts_predictFromFile", predictFromFile, 9),
     DEF_FUNC("dbarts_setResponse", setResponse, 2),
     DEF_FUNC("dbarts_setOffset", setOffset, 2),
     DEF_FUNC("dbarts_setPredictor", setPredictor, 2),
@@ -298,13 +422,16 @@ namespace {
     DEF_FUNC("dbarts_deepCopy", deepCopy, 1),
     //DEF_FUNC("dbarts_getPointerAddress", getPointerAddress, 1),
     //DEF_FUNC("dbarts_getXAddress", getXAddress, 1),
-    DEF_FUNC("dbarts_makeModelMatrixFromDataFrame", dbarts_makeModelMatrixFromDataFrame, 2),
-    DEF_FUNC("dbarts_xbart", xbart, 14),
+    DEF_FUNC("dbarts_makeModelMatrixFromDataFrame", dbarts_makeModelMatrixFromDataFrame, 4),
+    DEF_FUNC("dbarts_xbart", xbart, 15),
     DEF_FUNC("dbarts_guessNumCores", ::guessNumCores, 0),
     // experimental
     DEF_FUNC("dbarts_saveToFile", saveToFile, 2),
     DEF_FUNC("dbarts_loadFromFile", loadFromFile, 1),
+    DEF_FUNC("dbarts_loadCompactFit", loadCompactFit, 3),
+    DEF_FUNC("dbarts_predictCompact", predictCompact, 3),
     DEF_FUNC("dbarts_assignInPlace", assignInPlace, 3),
+    DEF_FUNC("dbarts_sampleRanefScale", sampleRanefScale, 6),
     // below: testing
     { NULL, NULL, 0 }
   };
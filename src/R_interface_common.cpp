@@ -48,6 +48,36 @@ namespace {
     "Kinderman-Ramage",
     "default"
   };
+  
+  using dbarts::Data;
+  
+  // x as a dgCMatrix from package Matrix; the slots are used in place
+  void initializeSparsePredictorsFromExpression(Data& data, SEXP xExpr)
+  {
+    SEXP slotExpr = R_do_slot(xExpr, Rf_install("Dim"));
+    rc_assertIntConstraints(slotExpr, "dimensions of x", RC_LENGTH | RC_EQ, rc_asRLength(2), RC_END);
+    int* dims = INTEGER(slotExpr);
+    if (static_cast<size_t>(dims[0]) != data.numObservations) Rf_error("number of rows of x and length of y must be equal");
+    
+    data.numPredictors = static_cast<size_t>(dims[1]);
+    
+    slotExpr = R_do_slot(xExpr, Rf_install("p"));
+    rc_assertIntConstraints(slotExpr, "column starts of x", RC_LENGTH | RC_EQ, rc_asRLength(data.numPredictors + 1), RC_END);
+    const int* columnStarts = INTEGER(slotExpr);
+    size_t numNonZeros = static_cast<size_t>(columnStarts[data.numPredictors]);
+    
+    SEXP rowIndicesExpr = R_do_slot(xExpr, Rf_install("i"));
+    rc_assertIntConstraints(rowIndicesExpr, "row indices of x", RC_LENGTH | RC_EQ, rc_asRLength(numNonZeros), RC_END);
+    
+    SEXP valuesExpr = R_do_slot(xExpr, Rf_install("x"));
+    if (!Rf_isReal(valuesExpr)) Rf_error("x must be of type real");
+    if (rc_getLength(valuesExpr) != numNonZeros) Rf_error("number of values in x must equal number of row indices");
+    
+    data.x = NULL;
+    data.x_sparse.values       = REAL(valuesExpr);
+    data.x_sparse.rowIndices   = INTEGER(rowIndicesExpr);
+    data.x_sparse.columnStarts = columnStarts;
+  }
 }
 
 namespace dbarts {
@@ -88,6 +118,17 @@ namespace dbarts {
     if (rc_getLength(slotExpr) != 1) Rf_error("slot 'keepTrees' must be of length 1");
     control.keepTrees = rc_getBool(slotExpr, "keep trees", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_END);
     
+    // absent from controls created by older versions
+    slotExpr = Rf_getAttrib(controlExpr, Rf_install("compressTrees"));
+    control.compressTrees = Rf_isNull(slotExpr) ? false : rc_getBool(slotExpr, "compress trees", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_END);
+    
+    slotExpr = Rf_getAttrib(controlExpr, Rf_install("reorderObservations"));
+    control.reorderObservations = Rf_isNull(slotExpr) ? false : rc_getBool(slotExpr, "reorder observations", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_END);
+    
+    slotExpr = Rf_getAttrib(controlExpr, Rf_install("memoryBudget"));
+    control.memoryBudget = Rf_isNull(slotExpr) ? 0 :
+      static_cast<size_t>(rc_getDouble(slotExpr, "memory budget", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_VALUE | RC_GEQ, 0.0, RC_END));
+    
     slotExpr = Rf_getAttrib(controlExpr, Rf_install("n.samples"));
     i_temp = rc_getInt(slotExpr, "number of samples", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_VALUE | RC_GEQ, 0, RC_END);
     control.defaultNumSamples = static_cast<size_t>(i_temp);
@@ -188,6 +229,16 @@ namespace dbarts {
       rc_getDouble(slotExpr, "tree prior base", RC_LENGTH | RC_EQ, rc_asRLength(1),
                    RC_VALUE | RC_GT, 0.0, RC_VALUE | RC_LT, 1.0, RC_END);
     
+    slotExpr = Rf_getAttrib(priorExpr, Rf_install("sparse"));
+    if (!Rf_isNull(slotExpr)) {
+      treePrior->sparse = rc_getBool(slotExpr, "tree prior sparse", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_END);
+      
+      slotExpr = Rf_getAttrib(priorExpr, Rf_install("concentration"));
+      treePrior->concentration =
+        rc_getDouble(slotExpr, "tree prior concentration", RC_LENGTH | RC_EQ, rc_asRLength(1),
+                     RC_VALUE | RC_GT, 0.0, RC_END);
+    }
+    
     
     priorExpr = Rf_getAttrib(modelExpr, Rf_install("node.prior"));
       
@@ -230,15 +281,20 @@ namespace dbarts {
     data.numObservations = rc_getLength(slotExpr);
     
     slotExpr = Rf_getAttrib(dataExpr, Rf_install("x"));
-    if (!Rf_isReal(slotExpr)) Rf_error("x must be of type real");
-    rc_assertDimConstraints(slotExpr, "dimensions of x", RC_LENGTH | RC_EQ, rc_asRLength(2), RC_VALUE | RC_EQ, static_cast<int>(data.numObservations), RC_END);
-    dims = INTEGER(Rf_getAttrib(slotExpr, R_DimSymbol));
-    
-    // rc_assertIntConstraints(dimsExpr = Rf_getAttrib(slotExpr, R_DimSymbol), "dimensions of x", RC_LENGTH | RC_EQ, rc_asRLength(2), RC_END);
-    // dims = INTEGER(dimsExpr);
-    // if (static_cast<size_t>(dims[0]) != data.numObservations) Rf_error("number of rows of x and length of y must be equal");
-    data.x = REAL(slotExpr);
-    data.numPredictors = static_cast<size_t>(dims[1]);
+    if (Rf_isS4(slotExpr) && Rf_inherits(slotExpr, "dgCMatrix")) {
+      initializeSparsePredictorsFromExpression(data, slotExpr);
+    } else {
+      if (!Rf_isReal(slotExpr)) Rf_error("x must be of type real");
+      rc_assertDimConstraints(slotExpr, "dimensions of x", RC_LENGTH | RC_EQ, rc_asRLength(2), RC_VALUE | RC_EQ, static_cast<int>(data.numObservations), RC_END);
+      dims = INTEGER(Rf_getAttrib(slotExpr, R_DimSymbol));
+      
+      // rc_assertIntConstraints(dimsExpr = Rf_getAttrib(slotExpr, R_DimSymbol), "dimensions of x", RC_LENGTH | RC_EQ, rc_asRLength(2), RC_END);
+      // dims = INTEGER(dimsExpr);
+      // if (static_cast<size_t>(dims[0]) != data.numObservations) Rf_error("number of rows of x and length of y must be equal");
+      data.x = REAL(slotExpr);
+      data.x_sparse = SparseMatrix();
+      data.numPredictors = static_cast<size_t>(dims[1]);
+    }
     
     slotExpr = Rf_getAttrib(dataExpr, Rf_install("varTypes"));
     rc_assertIntConstraints(slotExpr, "variable types", RC_LENGTH | RC_EQ, rc_asRLength(data.numPredictors), RC_END);
@@ -317,6 +373,7 @@ namespace dbarts {
     SEXP savedTreeFitsSym = Rf_install("savedTreeFits");
     SEXP sigmaSym         = Rf_install("sigma");
     SEXP rngStateSym      = Rf_install("rng.state");
+    SEXP splitProbabilitiesSym = Rf_install("splitProbabilities");
     
     SEXP result = PROTECT(rc_newList(control.numChains));
     
@@ -358,7 +415,10 @@ namespace dbarts {
         
         slotExpr = rc_allocateInSlot(result_i, savedTreeFitsSym, REALSXP, static_cast<R_xlen_t>(data.numObservations * control.numTrees * fit.currentNumSamples));
         rc_setDims(slotExpr, static_cast<int>(data.numObservations), static_cast<int>(control.numTrees), static_cast<int>(fit.currentNumSamples), -1);
-        std::memcpy(REAL(slotExpr), state[chainNum].savedTreeFits, data.numObservations * control.numTrees * fit.currentNumSamples * sizeof(double));
+        for (size_t sampleNum = 0; sampleNum < fit.currentNumSamples; ++sampleNum) {
+          state[chainNum].decompressSample(fit, sampleNum, true);
+          std::memcpy(REAL(slotExpr) + sampleNum * data.numObservations * control.numTrees, state[chainNum].savedTreeFits[sampleNum], data.numObservations * control.numTrees * sizeof(double));
+        }
       } else {
         rc_allocateInSlot(result_i, savedTreesSym, STRSXP, 0);
         rc_allocateInSlot(result_i, savedTreeFitsSym, REALSXP, 0);
@@ -372,6 +432,10 @@ namespace dbarts {
       size_t rngStateLength = ext_rng_getSerializedStateLength(state[chainNum].rng) / sizeof(int);
       slotExpr = rc_allocateInSlot(result_i, rngStateSym, INTSXP, rc_asRLength(rngStateLength));
       ext_rng_writeSerializedState(state[chainNum].rng, INTEGER(slotExpr));
+      
+      size_t numSplitProbabilities = state[chainNum].splitProbabilities != NULL ? data.numPredictors : 0;
+      slotExpr = rc_allocateInSlot(result_i, splitProbabilitiesSym, REALSXP, rc_asRLength(numSplitProbabilities));
+      state[chainNum].getSplitProbabilities(numSplitProbabilities, REAL(slotExpr));
     }
     
     slotExpr = rc_allocateInSlot(result, Rf_install("runningTime"), REALSXP, 1);
@@ -394,6 +458,7 @@ namespace dbarts {
     SEXP savedTreeFitsSym = Rf_install("savedTreeFits");
     SEXP sigmaSym         = Rf_install("sigma");
     SEXP rngStateSym      = Rf_install("rng.state");
+    SEXP splitProbabilitiesSym = Rf_install("splitProbabilities");
     
     // check to see if it is an old-style saved object with only a single state
     SEXP classExpr = rc_getClass(stateExpr);
@@ -472,7 +537,10 @@ namespace dbarts {
         delete [] treeStrings;
         
         slotExpr = Rf_getAttrib(stateExpr_i, savedTreeFitsSym);
-        std::memcpy(REAL(slotExpr), state[chainNum].savedTreeFits, data.numObservations * control.numTrees * fit.currentNumSamples * sizeof(double));
+        for (size_t sampleNum = 0; sampleNum < fit.currentNumSamples; ++sampleNum) {
+          state[chainNum].decompressSample(fit, sampleNum, true);
+          std::memcpy(REAL(slotExpr) + sampleNum * data.numObservations * control.numTrees, state[chainNum].savedTreeFits[sampleNum], data.numObservations * control.numTrees * sizeof(double));
+        }
       }
             
       slotExpr = Rf_getAttrib(stateExpr_i, sigmaSym);
@@ -483,6 +551,12 @@ namespace dbarts {
       if (rc_getLength(slotExpr) != rngStateLength)
         slotExpr = rc_allocateInSlot(stateExpr_i, rngStateSym, INTSXP, rc_asRLength(rngStateLength));
       ext_rng_writeSerializedState(state[chainNum].rng, INTEGER(slotExpr));
+      
+      size_t numSplitProbabilities = state[chainNum].splitProbabilities != NULL ? data.numPredictors : 0;
+      slotExpr = Rf_getAttrib(stateExpr_i, splitProbabilitiesSym);
+      if (!Rf_isReal(slotExpr) || rc_getLength(slotExpr) != numSplitProbabilities)
+        slotExpr = rc_allocateInSlot(stateExpr_i, splitProbabilitiesSym, REALSXP, rc_asRLength(numSplitProbabilities));
+      state[chainNum].getSplitProbabilities(numSplitProbabilities, REAL(slotExpr));
     }
     
     slotExpr = Rf_getAttrib(stateExpr, Rf_install("runningTime"));
@@ -533,17 +607,25 @@ namespace dbarts {
         for (size_t treeNum = 0; treeNum < control.numTrees * fit.currentNumSamples; ++treeNum) {
           treeStrings[treeNum] = CHAR(STRING_ELT(slotExpr, rc_asRLength(static_cast<R_xlen_t>(treeNum))));
         }
-        state[chainNum].recreateTreesFromStrings(fit, treeStrings, true);
-        delete [] treeStrings;
         
+        // samples are rebuilt one at a time so that compressed ones never all need to be decoded
         slotExpr = Rf_getAttrib(stateExpr_i, Rf_install("savedTreeFits"));
-        std::memcpy(state[chainNum].treeFits, const_cast<const double*>(REAL(slotExpr)), data.numObservations * control.numTrees * fit.currentNumSamples * sizeof(double));
+        for (size_t sampleNum = 0; sampleNum < fit.currentNumSamples; ++sampleNum)
+          state[chainNum].recreateSavedSampleFromStrings(fit, sampleNum, treeStrings + sampleNum * control.numTrees,
+                                                         const_cast<const double*>(REAL(slotExpr)) + sampleNum * data.numObservations * control.numTrees);
+        delete [] treeStrings;
       }
             
       slotExpr = Rf_getAttrib(stateExpr_i, Rf_install("sigma"));
       state[chainNum].sigma = REAL(slotExpr)[0];
       
       ext_rng_readSerializedState(state[chainNum].rng, INTEGER(Rf_getAttrib(stateExpr_i, Rf_install("rng.state"))));
+      
+      // states from before split probabilities were kept, or from a prior without them, leave the
+      // current ones in place
+      slotExpr = Rf_getAttrib(stateExpr_i, Rf_install("splitProbabilities"));
+      if (state[chainNum].splitProbabilities != NULL && Rf_isReal(slotExpr) && rc_getLength(slotExpr) == data.numPredictors)
+        state[chainNum].setSplitProbabilities(data.numPredictors, REAL(slotExpr));
     }
     
     fit.rebuildScratchFromState();
@@ -18,6 +18,7 @@
 #include <dbarts/control.hpp>
 #include <dbarts/data.hpp>
 #include <dbarts/model.hpp>
+#include <dbarts/xbartLoss.h>
 
 #include "crossvalidate.hpp"
 
@@ -29,8 +30,8 @@ namespace {
   using namespace dbarts;
   using namespace dbarts::xval;
   
-  const char* const lossTypeNames[] = { "rmse", "log", "mcr", "custom" };
-  typedef enum { RMSE, LOG, MCR, CUSTOM, INVALID } LossFunctorType;
+  const char* const lossTypeNames[] = { "rmse", "log", "mcr", "custom", "native" };
+  typedef enum { RMSE, LOG, MCR, CUSTOM, NATIVE, INVALID } LossFunctorType;
   
   SEXP allocateResult(size_t numNTrees, size_t numKs, size_t numPowers, size_t numBases, size_t numReps, bool dropUnusedDims);
   LossFunctorDefinition* createLossFunctorDefinition(LossFunctorType lossType, SEXP lossTypeExpr, size_t numTestObservations, size_t numSamples,
@@ -45,7 +46,7 @@ extern "C" {
   SEXP xbart(SEXP controlExpr, SEXP modelExpr, SEXP dataExpr, SEXP methodExpr,
              SEXP testSampleSizeExpr, SEXP numRepsExpr, SEXP numBurnInExpr, SEXP lossTypeExpr, SEXP numThreadsExpr,
              SEXP numTreesExpr, SEXP kExpr, SEXP powerExpr, SEXP baseExpr,
-             SEXP dropExpr)
+             SEXP sharedTreesExpr, SEXP dropExpr)
   {
     rc_assertIntConstraints(numTreesExpr, "num trees", RC_LENGTH | RC_GEQ, rc_asRLength(1), RC_VALUE | RC_GT, 0, RC_END);
     rc_assertDoubleConstraints(kExpr, "k", RC_LENGTH | RC_GEQ, rc_asRLength(1), RC_VALUE | RC_GT, 0.0, RC_END);
@@ -96,6 +97,7 @@ extern "C" {
     size_t numContextShiftBurnIn = rc_getLength(numBurnInExpr) >= 2 ? static_cast<size_t>(INTEGER(numBurnInExpr)[1]) : ((3 * numInitialBurnIn) / 4);
     size_t numRepBurnIn          = rc_getLength(numBurnInExpr) == 3 ? static_cast<size_t>(INTEGER(numBurnInExpr)[2]) : numInitialBurnIn / 4;
     
+    bool shareTrees     = rc_getBool(sharedTreesExpr, "shared trees", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_NA | RC_NO, RC_END);
     bool dropUnusedDims = rc_getBool(dropExpr, "drop", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_END);
     
     size_t maxNumTestObservations;
@@ -119,20 +121,32 @@ extern "C" {
       
       lossType = static_cast<LossFunctorType>(lossTypeNumber);
     } else if (Rf_isVectorList(lossTypeExpr)) {
-      if (rc_getLength(lossTypeExpr) != 2) Rf_error("length of lossType for functions must be 2");
+      if (rc_getLength(lossTypeExpr) != 2 && rc_getLength(lossTypeExpr) != 3) Rf_error("length of lossType for functions must be 2 or 3");
       
       if (!Rf_isFunction(VECTOR_ELT(lossTypeExpr, 0))) Rf_error("first element of list for function lossType must be a closure");
       if (!Rf_isEnvironment(VECTOR_ELT(lossTypeExpr, 1))) Rf_error("second element of list for function lossType must be an environment");
+      if (rc_getLength(lossTypeExpr) == 3)
+        rc_getBool(VECTOR_ELT(lossTypeExpr, 2), "batch", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_NA | RC_NO, RC_END);
       
       lossType = CUSTOM;
+    } else if (TYPEOF(lossTypeExpr) == EXTPTRSXP) {
+      if (R_ExternalPtrTag(lossTypeExpr) != Rf_install(DBARTS_XBART_LOSS_TAG))
+        Rf_error("external pointer lossType must be tagged '%s'", DBARTS_XBART_LOSS_TAG);
+      const dbarts_xbartLoss* nativeLoss = static_cast<const dbarts_xbartLoss*>(R_ExternalPtrAddr(lossTypeExpr));
+      if (nativeLoss == NULL || nativeLoss->calculateLoss == NULL || nativeLoss->numResults == 0)
+        Rf_error("external pointer lossType does not refer to a valid loss");
+      
+      lossType = NATIVE;
     } else {
-      Rf_error("lossType must be a character string or list(closure, env)");
+      Rf_error("lossType must be a character string, list(closure, env), or external pointer");
     }
     
     size_t protectCount = 0;
     
+    bool lossIsBatched = lossType == CUSTOM && rc_getLength(lossTypeExpr) == 3 && LOGICAL(VECTOR_ELT(lossTypeExpr, 2))[0] != 0;
+    
     SEXP scratch = R_NilValue;
-    if (lossType == CUSTOM) {
+    if (lossType == CUSTOM && !lossIsBatched) {
       R_xlen_t scratchLength = rc_asRLength(numThreads * 3 * (method == K_FOLD ? 2 : 1));
       scratch = PROTECT(rc_newList(scratchLength));
       ++protectCount;
@@ -162,6 +176,14 @@ extern "C" {
       if (protectCount > 0) UNPROTECT(protectCount);
       Rf_error("xbart called on empty data set");
     }
+    if (data.predictorsAreSparse()) {
+      invalidateData(data);
+      invalidateModel(model);
+      delete lossFunctionDef;
+      
+      if (protectCount > 0) UNPROTECT(protectCount);
+      Rf_error("xbart does not support sparse predictors");
+    }
     
     size_t numNTrees = rc_getLength(numTreesExpr);
     size_t numKs     = rc_getLength(kExpr);
@@ -186,7 +208,7 @@ extern "C" {
                   numInitialBurnIn, numContextShiftBurnIn, numRepBurnIn,
                   *lossFunctionDef, numThreads,
                   nTrees, numNTrees, k, numKs, power, numPowers, base, numBases,
-                  REAL(result));
+                  shareTrees, REAL(result));
     
     PutRNGstate();
     
@@ -235,19 +257,28 @@ namespace {
   
   struct LogLossFunctor : LossFunctor {
     double* scratch;
+    double* probabilitySums;
   };
   
+  // streamed losses never see all of the draws at once, so only the others need room for them; see
+  // lossIsStreamed in crossvalidate.cpp, which also streams losses that need a mutex when there
+  // are no threads
+  bool lossMayBeCalculatedFromAllSamples(const LossFunctorDefinition& def)
+  {
+    return def.accumulateLoss == NULL || def.requiresMutex;
+  }
+  
   LossFunctor* createLogLoss(const LossFunctorDefinition& def, Method, std::size_t numTestObservations, std::size_t numSamples)
   {
-    (void) def; (void) numSamples;
-    
     LogLossFunctor* result = new LogLossFunctor;
-    result->scratch = new double[numSamples];
+    result->scratch = lossMayBeCalculatedFromAllSamples(def) ? new double[numSamples] : NULL;
+    result->probabilitySums = new double[numTestObservations];
     return result;
   }
   
   void deleteLogLoss(LossFunctor* instance)
   {
+    delete [] static_cast<LogLossFunctor*>(instance)->probabilitySums;
     delete [] static_cast<LogLossFunctor*>(instance)->scratch;
     delete static_cast<LogLossFunctor*>(instance);
   }
@@ -271,6 +302,43 @@ namespace {
     results[0] /= static_cast<double>(numTestObservations);
   }
   
+  // the streamed losses for binary responses sum the probabilities of each test observation
+  void beginProbabilityLoss(double* restrict probabilitySums, size_t numTestObservations)
+  {
+    ext_setVectorToConstant(probabilitySums, numTestObservations, 0.0);
+  }
+  
+  void accumulateProbabilityLoss(double* restrict probabilitySums, const double* restrict testSample, size_t numTestObservations)
+  {
+    for (size_t i = 0; i < numTestObservations; ++i)
+      probabilitySums[i] += ext_cumulativeProbabilityOfNormal(testSample[i], 0.0, 1.0);
+  }
+  
+  void beginLogLoss(LossFunctor& restrict instance, size_t numTestObservations)
+  {
+    beginProbabilityLoss(static_cast<LogLossFunctor&>(instance).probabilitySums, numTestObservations);
+  }
+  
+  void accumulateLogLoss(LossFunctor& restrict instance, const double* restrict testSample, size_t numTestObservations)
+  {
+    accumulateProbabilityLoss(static_cast<LogLossFunctor&>(instance).probabilitySums, testSample, numTestObservations);
+  }
+  
+  void finalizeLogLoss(LossFunctor& restrict instance,
+                       const double* restrict y_test, size_t numTestObservations, size_t numSamples,
+                       double* restrict results)
+  {
+    const double* restrict probabilitySums = static_cast<LogLossFunctor&>(instance).probabilitySums;
+    
+    results[0] = 0.0;
+    for (size_t i = 0; i < numTestObservations; ++i) {
+      double y_test_hat = probabilitySums[i] / static_cast<double>(numSamples);
+      
+      results[0] +=  -y_test[i] * y_test_hat - (1.0 - y_test[i]) * (1.0 - y_test_hat);
+    }
+    results[0] /= static_cast<double>(numTestObservations);
+  }
+  
   struct RMSELossFunctor : LossFunctor {
     double* scratch;
   };
@@ -305,23 +373,44 @@ namespace {
     
     results[0] = std::sqrt(ext_computeSumOfSquaredResiduals(y_test, numTestObservations, y_test_hat) / static_cast<double>(numTestObservations));
   }
+  
+  void beginRMSELoss(LossFunctor& restrict instance, size_t numTestObservations)
+  {
+    ext_setVectorToConstant(static_cast<RMSELossFunctor&>(instance).scratch, numTestObservations, 0.0);
+  }
+  
+  void accumulateRMSELoss(LossFunctor& restrict instance, const double* restrict testSample, size_t numTestObservations)
+  {
+    ext_addVectorsInPlace(testSample, numTestObservations, 1.0, static_cast<RMSELossFunctor&>(instance).scratch);
+  }
+  
+  void finalizeRMSELoss(LossFunctor& restrict instance,
+                        const double* restrict y_test, size_t numTestObservations, size_t numSamples,
+                        double* restrict results)
+  {
+    double* restrict y_test_hat = static_cast<RMSELossFunctor&>(instance).scratch;
+    for (size_t i = 0; i < numTestObservations; ++i) y_test_hat[i] /= static_cast<double>(numSamples);
+    
+    results[0] = std::sqrt(ext_computeSumOfSquaredResiduals(y_test, numTestObservations, y_test_hat) / static_cast<double>(numTestObservations));
+  }
 
   
   struct MCRLossFunctor : LossFunctor {
     double* scratch;
+    double* probabilitySums;
   };
   
   LossFunctor* createMCRLoss(const LossFunctorDefinition& def, Method, std::size_t numTestObservations, std::size_t numSamples)
   {
-    (void) def; (void) numTestObservations;
-    
     MCRLossFunctor* result = new MCRLossFunctor;
-    result->scratch = new double[numSamples];
+    result->scratch = lossMayBeCalculatedFromAllSamples(def) ? new double[numSamples] : NULL;
+    result->probabilitySums = new double[numTestObservations];
     return result;
   }
   
   void deleteMCRLoss(LossFunctor* instance)
   {
+    delete [] static_cast<MCRLossFunctor*>(instance)->probabilitySums;
     delete [] static_cast<MCRLossFunctor*>(instance)->scratch;
     delete static_cast<MCRLossFunctor*>(instance);
   }
@@ -347,6 +436,33 @@ namespace {
     results[0] = static_cast<double>(fp + fn) / static_cast<double>(numTestObservations);
   }
   
+  void beginMCRLoss(LossFunctor& restrict instance, size_t numTestObservations)
+  {
+    beginProbabilityLoss(static_cast<MCRLossFunctor&>(instance).probabilitySums, numTestObservations);
+  }
+  
+  void accumulateMCRLoss(LossFunctor& restrict instance, const double* restrict testSample, size_t numTestObservations)
+  {
+    accumulateProbabilityLoss(static_cast<MCRLossFunctor&>(instance).probabilitySums, testSample, numTestObservations);
+  }
+  
+  void finalizeMCRLoss(LossFunctor& restrict instance,
+                       const double* restrict y_test, size_t numTestObservations, size_t numSamples,
+                       double* restrict results)
+  {
+    const double* restrict probabilitySums = static_cast<MCRLossFunctor&>(instance).probabilitySums;
+    
+    size_t fp = 0, fn = 0;
+    for (size_t i = 0; i < numTestObservations; ++i) {
+      double y_test_hat = probabilitySums[i] / static_cast<double>(numSamples) > 0.5 ? 1.0 : 0.0;
+      
+      if (y_test[i] != y_test_hat) {
+        if (y_test[i] == 1.0) ++fn; else ++fp;
+      }
+    }
+    results[0] = static_cast<double>(fp + fn) / static_cast<double>(numTestObservations);
+  }
+  
   /*
    * Custom loss is created from a function and the environment to evaluate that function in.
    * In order to call the function, we allocate and store R vectors for y_test, samples 
@@ -428,6 +544,87 @@ namespace {
     delete static_cast<CustomLossFunctor*>(v_instance);
   }
   
+  /*
+   * Batched custom losses are called with lists of test responses and of test draws, one
+   * element per block, and return numResults values per block. They are only ever called
+   * from the main thread, so functors have nothing to hold.
+   */
+  LossFunctor* createBatchCustomLoss(const LossFunctorDefinition&, Method, std::size_t, std::size_t)
+  {
+    return new LossFunctor;
+  }
+  
+  void deleteBatchCustomLoss(LossFunctor* instance)
+  {
+    delete instance;
+  }
+  
+  void calculateCustomLossBatch(const LossFunctorDefinition& v_def,
+                                const double* const* y_tests, const size_t* numTestObservations,
+                                const double* const* testSamples, size_t numSamples, size_t numBlocks,
+                                double* results)
+  {
+    const CustomLossFunctorDefinition& def(static_cast<const CustomLossFunctorDefinition&>(v_def));
+    
+    SEXP y_testsExpr      = PROTECT(rc_newList(rc_asRLength(numBlocks)));
+    SEXP testSamplesExpr  = PROTECT(rc_newList(rc_asRLength(numBlocks)));
+    for (size_t i = 0; i < numBlocks; ++i) {
+      SEXP y_testExpr = Rf_allocVector(REALSXP, rc_asRLength(numTestObservations[i]));
+      SET_VECTOR_ELT(y_testsExpr, static_cast<R_xlen_t>(i), y_testExpr);
+      std::memcpy(REAL(y_testExpr), y_tests[i], numTestObservations[i] * sizeof(double));
+      
+      SEXP testSampleExpr = Rf_allocVector(REALSXP, rc_asRLength(numTestObservations[i] * numSamples));
+      SET_VECTOR_ELT(testSamplesExpr, static_cast<R_xlen_t>(i), testSampleExpr);
+      rc_setDims(testSampleExpr, static_cast<int>(numTestObservations[i]), static_cast<int>(numSamples), -1);
+      std::memcpy(REAL(testSampleExpr), testSamples[i], numTestObservations[i] * numSamples * sizeof(double));
+    }
+    
+    SEXP closure = PROTECT(Rf_lang3(def.function, y_testsExpr, testSamplesExpr));
+    SEXP customResult = PROTECT(Rf_coerceVector(Rf_eval(closure, def.environment), REALSXP));
+    
+    // other threads are still running, so this can't longjmp out with an error
+    if (rc_getLength(customResult) != numBlocks * def.numResults) {
+      Rf_warning("batch loss function returned %lu values, expected %lu", static_cast<unsigned long int>(rc_getLength(customResult)),
+                 static_cast<unsigned long int>(numBlocks * def.numResults));
+      ext_setVectorToConstant(results, numBlocks * def.numResults, NA_REAL);
+    } else {
+      std::memcpy(results, const_cast<const double*>(REAL(customResult)), numBlocks * def.numResults * sizeof(double));
+    }
+    
+    UNPROTECT(4);
+  }
+  
+  // compiled losses are called from the worker threads directly
+  struct NativeLossFunctorDefinition : LossFunctorDefinition {
+    const dbarts_xbartLoss* loss;
+    
+    ~NativeLossFunctorDefinition() { }
+  };
+  
+  struct NativeLossFunctor : LossFunctor {
+    const dbarts_xbartLoss* loss;
+  };
+  
+  LossFunctor* createNativeLoss(const LossFunctorDefinition& v_def, Method, std::size_t, std::size_t)
+  {
+    NativeLossFunctor* result = new NativeLossFunctor;
+    result->loss = static_cast<const NativeLossFunctorDefinition&>(v_def).loss;
+    return result;
+  }
+  
+  void deleteNativeLoss(LossFunctor* instance)
+  {
+    delete static_cast<NativeLossFunctor*>(instance);
+  }
+  
+  void calculateNativeLoss(LossFunctor& restrict v_instance,
+                           const double* restrict y_test, size_t numTestObservations, const double* restrict testSamples, size_t numSamples,
+                           double* restrict results)
+  {
+    const dbarts_xbartLoss& loss(*static_cast<NativeLossFunctor&>(v_instance).loss);
+    loss.calculateLoss(y_test, numTestObservations, testSamples, numSamples, results, loss.data);
+  }
+  
   void calculateCustomLoss(LossFunctor& restrict v_instance,
                            const double* restrict, size_t numTestObservations, const double* restrict, size_t numSamples,
                            double* restrict results)
@@ -460,6 +657,9 @@ namespace {
       result->displayString = lossTypeNames[RMSE];
       result->requiresMutex = false;
       result->calculateLoss = &calculateRMSELoss;
+      result->beginLoss = &beginRMSELoss;
+      result->accumulateLoss = &accumulateRMSELoss;
+      result->finalizeLoss = &finalizeRMSELoss;
       result->createFunctor = &createRMSELoss;
       result->deleteFunctor = &deleteRMSELoss;
       break;
@@ -471,6 +671,9 @@ namespace {
       result->displayString = lossTypeNames[LOG];
       result->requiresMutex = false;
       result->calculateLoss = &calculateLogLoss;
+      result->beginLoss = &beginLogLoss;
+      result->accumulateLoss = &accumulateLogLoss;
+      result->finalizeLoss = &finalizeLogLoss;
       result->createFunctor = &createLogLoss;
       result->deleteFunctor = &deleteLogLoss;
       break;
@@ -482,6 +685,9 @@ namespace {
       result->displayString = lossTypeNames[MCR];
       result->requiresMutex = false;
       result->calculateLoss = &calculateMCRLoss;
+      result->beginLoss = &beginMCRLoss;
+      result->accumulateLoss = &accumulateMCRLoss;
+      result->finalizeLoss = &finalizeMCRLoss;
       result->createFunctor = &createMCRLoss;
       result->deleteFunctor = &deleteMCRLoss;
       break;
@@ -490,10 +696,12 @@ namespace {
         SEXP function    = VECTOR_ELT(lossTypeExpr, 0);
         SEXP environment = VECTOR_ELT(lossTypeExpr, 1);
         
+        bool isBatched = rc_getLength(lossTypeExpr) == 3 && LOGICAL(VECTOR_ELT(lossTypeExpr, 2))[0] != 0;
+        
         CustomLossFunctorDefinition* c_result = new CustomLossFunctorDefinition;
         result = c_result;
-        result->y_testOffset = 0;
-        result->testSamplesOffset = sizeof(double*);
+        result->y_testOffset = isBatched ? -1 : 0;
+        result->testSamplesOffset = isBatched ? -1 : static_cast<std::ptrdiff_t>(sizeof(double*));
         
         SEXP tempY_test      = PROTECT(Rf_allocVector(REALSXP, numTestObservations));
         SEXP tempTestSamples = PROTECT(Rf_allocVector(REALSXP, numTestObservations * numSamples));
@@ -505,22 +713,56 @@ namespace {
         ext_setVectorToConstant(REAL(tempTestSamples) + 1, numTestObservations - 1, 1.0);
         ext_setVectorToConstant(REAL(tempTestSamples) + numTestObservations, numTestObservations * (numSamples - 1), 0.0);
         
-        SEXP tempClosure = PROTECT(Rf_lang3(function, tempY_test, tempTestSamples));
-        
-        result->numResults = rc_getLength(Rf_eval(tempClosure, environment));
-        UNPROTECT(3);
-        
+        if (isBatched) {
+          SEXP tempY_tests      = PROTECT(rc_newList(1));
+          SEXP tempTestSampless = PROTECT(rc_newList(1));
+          SET_VECTOR_ELT(tempY_tests, 0, tempY_test);
+          SET_VECTOR_ELT(tempTestSampless, 0, tempTestSamples);
+          
+          SEXP tempClosure = PROTECT(Rf_lang3(function, tempY_tests, tempTestSampless));
+          
+          result->numResults = rc_getLength(Rf_eval(tempClosure, environment));
+          UNPROTECT(5);
+          
+          result->requiresMutex = false;
+          result->calculateLoss = NULL;
+          result->calculateLossBatch = &calculateCustomLossBatch;
+          result->createFunctor = &createBatchCustomLoss;
+          result->deleteFunctor = &deleteBatchCustomLoss;
+        } else {
+          SEXP tempClosure = PROTECT(Rf_lang3(function, tempY_test, tempTestSamples));
+          
+          result->numResults = rc_getLength(Rf_eval(tempClosure, environment));
+          UNPROTECT(3);
+          
+          result->requiresMutex = true;
+          result->calculateLoss = &calculateCustomLoss;
+          result->createFunctor = &createCustomLoss;
+          result->deleteFunctor = &deleteCustomLoss;
+        }
         result->displayString = lossTypeNames[CUSTOM];
-        result->requiresMutex = true;
-        result->calculateLoss = &calculateCustomLoss;
-        result->createFunctor = &createCustomLoss;
-        result->deleteFunctor = &deleteCustomLoss;
         
         c_result->function = function;
         c_result->environment = environment;
         c_result->scratch = scratch;
       }
       break;
+      case NATIVE:
+      {
+        NativeLossFunctorDefinition* n_result = new NativeLossFunctorDefinition;
+        result = n_result;
+        n_result->loss = static_cast<const dbarts_xbartLoss*>(R_ExternalPtrAddr(lossTypeExpr));
+        
+        result->y_testOffset = -1;
+        result->testSamplesOffset = -1;
+        result->numResults = n_result->loss->numResults;
+        result->displayString = lossTypeNames[NATIVE];
+        result->requiresMutex = false;
+        result->calculateLoss = &calculateNativeLoss;
+        result->createFunctor = &createNativeLoss;
+        result->deleteFunctor = &deleteNativeLoss;
+      }
+      break;
       case INVALID:
       Rf_error("internal error: invalid type enumeration");
       break;
@@ -6,14 +6,17 @@
 
 #include <external/alloca.h>
 
+#include <R_ext/Memory.h> // R_alloc
 #include <R_ext/Random.h> // GetRNGstate, PutRNGState
 
 #include <rc/bounds.h>
 #include <rc/util.h>
 
 #include <dbarts/bartFit.hpp>
+#include <dbarts/compactFit.hpp>
 #include <dbarts/control.hpp>
 #include <dbarts/data.hpp>
+#include <dbarts/leafCooccurrences.hpp>
 #include <dbarts/model.hpp>
 #include <dbarts/results.hpp>
 
@@ -25,8 +28,23 @@
 using std::size_t;
 using namespace dbarts;
 
+namespace {
+  // uses R's generator, which must already be loaded
+  void permuteIndices(size_t* indices, size_t length)
+  {
+    for (size_t i = length; i > 1; --i) {
+      size_t j = static_cast<size_t>(unif_rand() * static_cast<double>(i));
+      if (j >= i) j = i - 1;
+      size_t temp = indices[i - 1];
+      indices[i - 1] = indices[j];
+      indices[j] = temp;
+    }
+  }
+}
+
 extern "C" {
   static void fitFinalizer(SEXP fitExpr);
+  static void compactFitFinalizer(SEXP compactFitExpr);
 
   SEXP create(SEXP controlExpr, SEXP modelExpr, SEXP dataExpr)
   {
@@ -166,6 +184,39 @@ extern "C" {
     return resultExpr;
   }
   
+  SEXP getMemoryUsage(SEXP fitExpr, SEXP numSamplesExpr)
+  {
+    BARTFit* fit = static_cast<BARTFit*>(R_ExternalPtrAddr(fitExpr));
+    if (fit == NULL) Rf_error("dbarts_getMemoryUsage called on NULL external pointer");
+    
+    int i_temp = rc_getInt(numSamplesExpr, "number of samples", RC_LENGTH | RC_GEQ, asRXLen(1), RC_VALUE | RC_GEQ, 0, RC_NA | RC_YES, RC_END);
+    size_t numSamples = i_temp == NA_INTEGER ? fit->control.defaultNumSamples : static_cast<size_t>(i_temp);
+    
+    MemoryUsage usage = fit->getMemoryUsage(numSamples);
+    
+    SEXP resultExpr = PROTECT(rc_newNumeric(6));
+    double* result = REAL(resultExpr);
+    result[0] = static_cast<double>(usage.data);
+    result[1] = static_cast<double>(usage.chainScratch);
+    result[2] = static_cast<double>(usage.trees);
+    result[3] = static_cast<double>(usage.savedSamples);
+    result[4] = static_cast<double>(usage.results);
+    result[5] = static_cast<double>(usage.getTotal());
+    
+    SEXP namesExpr;
+    rc_setNames(resultExpr, namesExpr = rc_newCharacter(6));
+    SET_STRING_ELT(namesExpr, 0, Rf_mkChar("data"));
+    SET_STRING_ELT(namesExpr, 1, Rf_mkChar("chainScratch"));
+    SET_STRING_ELT(namesExpr, 2, Rf_mkChar("trees"));
+    SET_STRING_ELT(namesExpr, 3, Rf_mkChar("savedSamples"));
+    SET_STRING_ELT(namesExpr, 4, Rf_mkChar("results"));
+    SET_STRING_ELT(namesExpr, 5, Rf_mkChar("total"));
+    
+    UNPROTECT(1);
+    
+    return resultExpr;
+  }
+  
   SEXP sampleTreesFromPrior(SEXP fitExpr)
   {
     BARTFit* fit = static_cast<BARTFit*>(R_ExternalPtrAddr(fitExpr));
@@ -293,6 +344,288 @@ extern "C" {
     return result;
   }
   
+  SEXP predictSummaries(SEXP fitExpr, SEXP x_testExpr, SEXP offset_testExpr, SEXP includeMeanExpr, SEXP includeVarianceExpr, SEXP quantilesExpr)
+  {
+    const BARTFit* fit = static_cast<const BARTFit*>(R_ExternalPtrAddr(fitExpr));
+    if (fit == NULL) Rf_error("dbarts_predictSummaries called on NULL external pointer");
+    
+    if (fit->control.keepTrees == FALSE) Rf_error("predict requires keepTrees to be TRUE");
+    
+    if (!Rf_isReal(x_testExpr)) Rf_error("x.test must be of type real");
+    
+    rc_assertDimConstraints(x_testExpr, "dimensions of x_test", RC_LENGTH | RC_EQ, rc_asRLength(2),
+                            RC_NA,
+                            RC_VALUE | RC_EQ, static_cast<int>(fit->data.numPredictors),
+                            RC_END);
+    size_t numTestObservations = static_cast<size_t>(INTEGER(Rf_getAttrib(x_testExpr, R_DimSymbol))[0]);
+    
+    double* testOffset = NULL;
+    if (!Rf_isNull(offset_testExpr)) {
+      if (!Rf_isReal(offset_testExpr)) Rf_error("offset.test must be of type real");
+      if (rc_getLength(offset_testExpr) != 1 || !ISNA(REAL(offset_testExpr)[0])) {
+        if (rc_getLength(offset_testExpr) != numTestObservations) Rf_error("length of offset.test must equal number of rows in x.test");
+        testOffset = REAL(offset_testExpr);
+      }
+    }
+    
+    bool includeMean     = rc_getBool(includeMeanExpr, "include mean", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_NA | RC_NO, RC_END);
+    bool includeVariance = rc_getBool(includeVarianceExpr, "include variance", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_NA | RC_NO, RC_END);
+    rc_assertDoubleConstraints(quantilesExpr, "quantiles", RC_VALUE | RC_GEQ, 0.0, RC_VALUE | RC_LEQ, 1.0, RC_NA | RC_NO, RC_END);
+    size_t numQuantiles = rc_getLength(quantilesExpr);
+    
+    size_t numColumns = (includeMean ? 1 : 0) + (includeVariance ? 1 : 0) + numQuantiles;
+    if (numColumns == 0) Rf_error("at least one summary must be requested");
+    if (fit->currentNumSamples == 0) Rf_error("predict requires at least one kept sample");
+    
+    SEXP result = PROTECT(Rf_allocVector(REALSXP, numTestObservations * numColumns));
+    rc_setDims(result, static_cast<int>(numTestObservations), static_cast<int>(numColumns), -1);
+    
+    fit->predictSummaries(REAL(x_testExpr), numTestObservations, testOffset,
+                          includeMean, includeVariance, REAL(quantilesExpr), numQuantiles, REAL(result));
+    
+    UNPROTECT(1);
+    
+    return result;
+  }
+  
+  SEXP predictApproximateMeans(SEXP fitExpr, SEXP x_testExpr, SEXP offset_testExpr, SEXP minNumDrawsExpr,
+                               SEXP absoluteToleranceExpr, SEXP relativeToleranceExpr, SEXP stratifyExpr)
+  {
+    const BARTFit* fit = static_cast<const BARTFit*>(R_ExternalPtrAddr(fitExpr));
+    if (fit == NULL) Rf_error("dbarts_predictApproximateMeans called on NULL external pointer");
+    
+    if (fit->control.keepTrees == FALSE) Rf_error("predict requires keepTrees to be TRUE");
+    
+    if (!Rf_isReal(x_testExpr)) Rf_error("x.test must be of type real");
+    
+    rc_assertDimConstraints(x_testExpr, "dimensions of x_test", RC_LENGTH | RC_EQ, rc_asRLength(2),
+                            RC_NA,
+                            RC_VALUE | RC_EQ, static_cast<int>(fit->data.numPredictors),
+                            RC_END);
+    size_t numTestObservations = static_cast<size_t>(INTEGER(Rf_getAttrib(x_testExpr, R_DimSymbol))[0]);
+    
+    double* testOffset = NULL;
+    if (!Rf_isNull(offset_testExpr)) {
+      if (!Rf_isReal(offset_testExpr)) Rf_error("offset.test must be of type real");
+      if (rc_getLength(offset_testExpr) != 1 || !ISNA(REAL(offset_testExpr)[0])) {
+        if (rc_getLength(offset_testExpr) != numTestObservations) Rf_error("length of offset.test must equal number of rows in x.test");
+        testOffset = REAL(offset_testExpr);
+      }
+    }
+    
+    int minNumDraws = rc_getInt(minNumDrawsExpr, "minimum number of draws", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_VALUE | RC_GEQ, 1, RC_NA | RC_NO, RC_END);
+    double absoluteTolerance = rc_getDouble(absoluteToleranceExpr, "absolute tolerance", RC_LENGTH | RC_EQ, rc_asRLength(1),
+                                            RC_VALUE | RC_GEQ, 0.0, RC_NA | RC_NO, RC_END);
+    double relativeTolerance = rc_getDouble(relativeToleranceExpr, "relative tolerance", RC_LENGTH | RC_EQ, rc_asRLength(1),
+                                            RC_VALUE | RC_GEQ, 0.0, RC_NA | RC_NO, RC_END);
+    bool stratify = rc_getBool(stratifyExpr, "stratify", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_NA | RC_NO, RC_END);
+    
+    size_t numSamples = fit->currentNumSamples;
+    size_t numChains  = fit->control.numChains;
+    if (numSamples == 0) Rf_error("predict requires at least one kept sample");
+    
+    // stratified orders take the chains in turn, so that every prefix draws evenly from each
+    size_t* drawOrder = new size_t[numSamples * numChains];
+    GetRNGstate();
+    if (stratify) {
+      size_t* sampleOrder = new size_t[numSamples];
+      for (size_t chainNum = 0; chainNum < numChains; ++chainNum) {
+        for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum) sampleOrder[sampleNum] = sampleNum;
+        permuteIndices(sampleOrder, numSamples);
+        for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum)
+          drawOrder[sampleNum * numChains + chainNum] = chainNum * numSamples + sampleOrder[sampleNum];
+      }
+      delete [] sampleOrder;
+    } else {
+      for (size_t i = 0; i < numSamples * numChains; ++i) drawOrder[i] = i;
+      permuteIndices(drawOrder, numSamples * numChains);
+    }
+    PutRNGstate();
+    
+    SEXP result = PROTECT(Rf_allocVector(REALSXP, numTestObservations * 3));
+    rc_setDims(result, static_cast<int>(numTestObservations), 3, -1);
+    double* means = REAL(result);
+    double* standardErrors = means + numTestObservations;
+    size_t* numDrawsUsed = new size_t[numTestObservations];
+    
+    fit->predictApproximateMeans(REAL(x_testExpr), numTestObservations, testOffset,
+                                 drawOrder, static_cast<size_t>(minNumDraws), absoluteTolerance, relativeTolerance,
+                                 means, standardErrors, numDrawsUsed);
+    
+    double* numDrawsUsedResult = means + 2 * numTestObservations;
+    for (size_t i = 0; i < numTestObservations; ++i) numDrawsUsedResult[i] = static_cast<double>(numDrawsUsed[i]);
+    
+    delete [] numDrawsUsed;
+    delete [] drawOrder;
+    
+    UNPROTECT(1);
+    
+    return result;
+  }
+  
+  SEXP getLeafMemberships(SEXP fitExpr, SEXP x_testExpr)
+  {
+    const BARTFit* fit = static_cast<const BARTFit*>(R_ExternalPtrAddr(fitExpr));
+    if (fit == NULL) Rf_error("dbarts_getLeafMemberships called on NULL external pointer");
+    
+    if (fit->control.keepTrees == FALSE) Rf_error("leaf memberships require keepTrees to be TRUE");
+    
+    if (!Rf_isReal(x_testExpr)) Rf_error("x.test must be of type real");
+    
+    rc_assertDimConstraints(x_testExpr, "dimensions of x_test", RC_LENGTH | RC_EQ, rc_asRLength(2),
+                            RC_NA,
+                            RC_VALUE | RC_EQ, static_cast<int>(fit->data.numPredictors),
+                            RC_END);
+    size_t numTestObservations = static_cast<size_t>(INTEGER(Rf_getAttrib(x_testExpr, R_DimSymbol))[0]);
+    
+    size_t numMemberships = numTestObservations * fit->control.numTrees * fit->currentNumSamples * fit->control.numChains;
+    SEXP result = PROTECT(Rf_allocVector(INTSXP, asRXLen(numMemberships)));
+    rc_setDims(result, static_cast<int>(numTestObservations), static_cast<int>(fit->control.numTrees),
+               static_cast<int>(fit->currentNumSamples), static_cast<int>(fit->control.numChains), -1);
+    
+    // allocated by R, so that it is released if the fit throws an error
+    uint16_t* memberships = reinterpret_cast<uint16_t*>(R_alloc(numMemberships > 0 ? numMemberships : 1, sizeof(uint16_t)));
+    fit->getLeafMemberships(REAL(x_testExpr), numTestObservations, memberships);
+    
+    // one-based, as R indexes
+    int* resultMemberships = INTEGER(result);
+    for (size_t i = 0; i < numMemberships; ++i) resultMemberships[i] = static_cast<int>(memberships[i]) + 1;
+    
+    UNPROTECT(1);
+    
+    return result;
+  }
+  
+  SEXP getLeafCooccurrences(SEXP fitExpr, SEXP x_testExpr, SEXP minCountExpr)
+  {
+    const BARTFit* fit = static_cast<const BARTFit*>(R_ExternalPtrAddr(fitExpr));
+    if (fit == NULL) Rf_error("dbarts_getLeafCooccurrences called on NULL external pointer");
+    
+    if (fit->control.keepTrees == FALSE) Rf_error("leaf co-occurrences require keepTrees to be TRUE");
+    
+    if (!Rf_isReal(x_testExpr)) Rf_error("x.test must be of type real");
+    
+    rc_assertDimConstraints(x_testExpr, "dimensions of x_test", RC_LENGTH | RC_EQ, rc_asRLength(2),
+                            RC_NA,
+                            RC_VALUE | RC_EQ, static_cast<int>(fit->data.numPredictors),
+                            RC_END);
+    size_t numTestObservations = static_cast<size_t>(INTEGER(Rf_getAttrib(x_testExpr, R_DimSymbol))[0]);
+    
+    int minCount = rc_getInt(minCountExpr, "minimum count", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_VALUE | RC_GEQ, 1, RC_NA | RC_NO, RC_END);
+    
+    LeafCooccurrences* cooccurrences = fit->getLeafCooccurrences(REAL(x_testExpr), numTestObservations, static_cast<size_t>(minCount));
+    
+    SEXP result = PROTECT(rc_newList(4));
+    SEXP rowsExpr    = SET_VECTOR_ELT(result, 0, Rf_allocVector(INTSXP, asRXLen(cooccurrences->numPairs)));
+    SEXP columnsExpr = SET_VECTOR_ELT(result, 1, Rf_allocVector(INTSXP, asRXLen(cooccurrences->numPairs)));
+    SEXP countsExpr  = SET_VECTOR_ELT(result, 2, Rf_allocVector(REALSXP, asRXLen(cooccurrences->numPairs)));
+    SET_VECTOR_ELT(result, 3, Rf_ScalarReal(static_cast<double>(cooccurrences->numTreeSamples)));
+    
+    int* rows = INTEGER(rowsExpr);
+    int* columns = INTEGER(columnsExpr);
+    double* counts = REAL(countsExpr);
+    for (size_t pairNum = 0; pairNum < cooccurrences->numPairs; ++pairNum) {
+      rows[pairNum]    = static_cast<int>(cooccurrences->rows[pairNum]) + 1;
+      columns[pairNum] = static_cast<int>(cooccurrences->columns[pairNum]) + 1;
+      counts[pairNum]  = static_cast<double>(cooccurrences->counts[pairNum]);
+    }
+    delete cooccurrences;
+    
+    SEXP namesExpr;
+    rc_setNames(result, namesExpr = rc_newCharacter(4));
+    SET_STRING_ELT(namesExpr, 0, Rf_mkChar("i"));
+    SET_STRING_ELT(namesExpr, 1, Rf_mkChar("j"));
+    SET_STRING_ELT(namesExpr, 2, Rf_mkChar("count"));
+    SET_STRING_ELT(namesExpr, 3, Rf_mkChar("total"));
+    
+    UNPROTECT(1);
+    
+    return result;
+  }
+  
+  SEXP collapseSamples(SEXP fitExpr)
+  {
+    const BARTFit* fit = static_cast<const BARTFit*>(R_ExternalPtrAddr(fitExpr));
+    if (fit == NULL) Rf_error("dbarts_collapseSamples called on NULL external pointer");
+    
+    if (fit->control.keepTrees == FALSE) Rf_error("collapsing samples requires keepTrees to be TRUE");
+    if (fit->currentNumSamples == 0) Rf_error("collapsing samples requires at least one kept sample");
+    
+    CompactFit* collapsedFit = CompactFit::collapseSamples(*fit);
+    
+    SEXP result = PROTECT(R_MakeExternalPtr(collapsedFit, Rf_install("dbarts_collapsedFit"), R_NilValue));
+    R_RegisterCFinalizerEx(result, compactFitFinalizer, static_cast<Rboolean>(TRUE));
+    
+    Rf_setAttrib(result, Rf_install("n.trees"), Rf_ScalarReal(static_cast<double>(collapsedFit->numTrees)));
+    
+    UNPROTECT(1);
+    
+    return result;
+  }
+  
+  SEXP predictCollapsed(SEXP collapsedFitExpr, SEXP x_testExpr, SEXP offset_testExpr)
+  {
+    if (TYPEOF(collapsedFitExpr) != EXTPTRSXP || R_ExternalPtrTag(collapsedFitExpr) != Rf_install("dbarts_collapsedFit"))
+      Rf_error("dbarts_predictCollapsed called on an object that is not a collapsed fit");
+    const CompactFit* collapsedFit = static_cast<const CompactFit*>(R_ExternalPtrAddr(collapsedFitExpr));
+    if (collapsedFit == NULL) Rf_error("collapsed fit is no longer valid; collapsed fits cannot be saved and reloaded");
+    
+    if (!Rf_isReal(x_testExpr)) Rf_error("x.test must be of type real");
+    
+    rc_assertDimConstraints(x_testExpr, "dimensions of x_test", RC_LENGTH | RC_EQ, rc_asRLength(2),
+                            RC_NA,
+                            RC_VALUE | RC_EQ, static_cast<int>(collapsedFit->numPredictors),
+                            RC_END);
+    size_t numTestObservations = static_cast<size_t>(INTEGER(Rf_getAttrib(x_testExpr, R_DimSymbol))[0]);
+    
+    double* testOffset = NULL;
+    if (!Rf_isNull(offset_testExpr)) {
+      if (!Rf_isReal(offset_testExpr)) Rf_error("offset.test must be of type real");
+      if (rc_getLength(offset_testExpr) != 1 || !ISNA(REAL(offset_testExpr)[0])) {
+        if (rc_getLength(offset_testExpr) != numTestObservations) Rf_error("length of offset.test must equal number of rows in x.test");
+        testOffset = REAL(offset_testExpr);
+      }
+    }
+    
+    SEXP result = PROTECT(Rf_allocVector(REALSXP, numTestObservations));
+    collapsedFit->predict(REAL(x_testExpr), numTestObservations, testOffset, REAL(result));
+    UNPROTECT(1);
+    
+    return result;
+  }
+  
+  SEXP predictFromFile(SEXP fitExpr, SEXP x_testFileNameExpr, SEXP numTestObservationsExpr, SEXP resultFileNameExpr, SEXP chunkSizeExpr,
+                       SEXP writeDrawsExpr, SEXP includeMeanExpr, SEXP includeVarianceExpr, SEXP quantilesExpr)
+  {
+    const BARTFit* fit = static_cast<const BARTFit*>(R_ExternalPtrAddr(fitExpr));
+    if (fit == NULL) Rf_error("dbarts_predictFromFile called on NULL external pointer");
+    
+    if (fit->control.keepTrees == FALSE) Rf_error("predict requires keepTrees to be TRUE");
+    
+    if (!Rf_isString(x_testFileNameExpr) || rc_getLength(x_testFileNameExpr) != 1) Rf_error("x.test file name must be a single character string");
+    if (!Rf_isString(resultFileNameExpr) || rc_getLength(resultFileNameExpr) != 1) Rf_error("output file name must be a single character string");
+    
+    // doubles, so that row counts past the range of an integer can be given
+    double numTestObservations = rc_getDouble(numTestObservationsExpr, "number of test observations", RC_LENGTH | RC_EQ, rc_asRLength(1),
+                                              RC_VALUE | RC_GEQ, 0.0, RC_NA | RC_NO, RC_END);
+    int chunkSize = rc_getInt(chunkSizeExpr, "chunk size", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_VALUE | RC_GT, 0, RC_NA | RC_NO, RC_END);
+    
+    bool writeDraws      = rc_getBool(writeDrawsExpr, "write draws", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_NA | RC_NO, RC_END);
+    bool includeMean     = rc_getBool(includeMeanExpr, "include mean", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_NA | RC_NO, RC_END);
+    bool includeVariance = rc_getBool(includeVarianceExpr, "include variance", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_NA | RC_NO, RC_END);
+    rc_assertDoubleConstraints(quantilesExpr, "quantiles", RC_VALUE | RC_GEQ, 0.0, RC_VALUE | RC_LEQ, 1.0, RC_NA | RC_NO, RC_END);
+    size_t numQuantiles = rc_getLength(quantilesExpr);
+    
+    if (!writeDraws && !includeMean && !includeVariance && numQuantiles == 0) Rf_error("at least one summary must be requested");
+    if (fit->currentNumSamples == 0) Rf_error("predict requires at least one kept sample");
+    
+    fit->predictFromFile(CHAR(STRING_ELT(x_testFileNameExpr, 0)), static_cast<size_t>(numTestObservations),
+                         CHAR(STRING_ELT(resultFileNameExpr, 0)), static_cast<size_t>(chunkSize), writeDraws,
+                         includeMean, includeVariance, REAL(quantilesExpr), numQuantiles);
+    
+    return R_NilValue;
+  }
+  
   SEXP setResponse(SEXP fitExpr, SEXP y)
   {
     BARTFit* fit = static_cast<BARTFit*>(R_ExternalPtrAddr(fitExpr));
@@ -622,6 +955,90 @@ extern "C" {
     return Rf_ScalarLogical(fit->saveToFile(CHAR(STRING_ELT(fileName, 0))));
   }
 
+  SEXP loadCompactFit(SEXP fileName, SEXP chainsExpr, SEXP samplesExpr)
+  {
+    size_t numChains = 0, numSamples = 0;
+    size_t* chains = NULL;
+    size_t* samples = NULL;
+    
+    if (!Rf_isNull(chainsExpr)) {
+      if (!Rf_isInteger(chainsExpr)) Rf_error("chains must be of type integer");
+      numChains = rc_getLength(chainsExpr);
+      for (size_t i = 0; i < numChains; ++i)
+        if (INTEGER(chainsExpr)[i] == NA_INTEGER || INTEGER(chainsExpr)[i] < 1) Rf_error("chains must be positive");
+    }
+    if (!Rf_isNull(samplesExpr)) {
+      if (!Rf_isInteger(samplesExpr)) Rf_error("samples must be of type integer");
+      numSamples = rc_getLength(samplesExpr);
+      for (size_t i = 0; i < numSamples; ++i)
+        if (INTEGER(samplesExpr)[i] == NA_INTEGER || INTEGER(samplesExpr)[i] < 1) Rf_error("samples must be positive");
+    }
+    
+    // indices come in one-based
+    if (numChains > 0) {
+      chains = new size_t[numChains];
+      for (size_t i = 0; i < numChains; ++i) chains[i] = static_cast<size_t>(INTEGER(chainsExpr)[i] - 1);
+    }
+    if (numSamples > 0) {
+      samples = new size_t[numSamples];
+      for (size_t i = 0; i < numSamples; ++i) samples[i] = static_cast<size_t>(INTEGER(samplesExpr)[i] - 1);
+    }
+    
+    CompactFit* compactFit = CompactFit::loadFromFile(CHAR(STRING_ELT(fileName, 0)), chains, numChains, samples, numSamples);
+    
+    delete [] samples;
+    delete [] chains;
+    
+    if (compactFit == NULL) Rf_error("unable to load fit from file");
+    
+    SEXP result = PROTECT(R_MakeExternalPtr(compactFit, Rf_install("dbarts_compactFit"), R_NilValue));
+    R_RegisterCFinalizerEx(result, compactFitFinalizer, static_cast<Rboolean>(TRUE));
+    
+    UNPROTECT(1);
+    
+    return result;
+  }
+  
+  SEXP predictCompact(SEXP compactFitExpr, SEXP x_testExpr, SEXP offset_testExpr)
+  {
+    if (TYPEOF(compactFitExpr) != EXTPTRSXP || R_ExternalPtrTag(compactFitExpr) != Rf_install("dbarts_compactFit"))
+      Rf_error("dbarts_predictCompact called on an object that is not a compact fit");
+    const CompactFit* compactFit = static_cast<const CompactFit*>(R_ExternalPtrAddr(compactFitExpr));
+    if (compactFit == NULL) Rf_error("compact fit is no longer valid");
+    
+    if (!Rf_isReal(x_testExpr)) Rf_error("x.test must be of type real");
+    
+    rc_assertDimConstraints(x_testExpr, "dimensions of x_test", RC_LENGTH | RC_EQ, rc_asRLength(2),
+                            RC_NA,
+                            RC_VALUE | RC_EQ, static_cast<int>(compactFit->numPredictors),
+                            RC_END);
+    size_t numTestObservations = static_cast<size_t>(INTEGER(Rf_getAttrib(x_testExpr, R_DimSymbol))[0]);
+    
+    double* testOffset = NULL;
+    if (!Rf_isNull(offset_testExpr)) {
+      if (!Rf_isReal(offset_testExpr)) Rf_error("offset.test must be of type real");
+      if (rc_getLength(offset_testExpr) != 1 || !ISNA(REAL(offset_testExpr)[0])) {
+        if (rc_getLength(offset_testExpr) != numTestObservations) Rf_error("length of offset.test must equal number of rows in x.test");
+        testOffset = REAL(offset_testExpr);
+      }
+    }
+    
+    size_t numSamples = compactFit->numSamples;
+    size_t numChains  = compactFit->numChains;
+    
+    SEXP result = PROTECT(Rf_allocVector(REALSXP, numTestObservations * numSamples * numChains));
+    if (numChains <= 1)
+      rc_setDims(result, static_cast<int>(numTestObservations), static_cast<int>(numSamples), -1);
+    else
+      rc_setDims(result, static_cast<int>(numTestObservations), static_cast<int>(numSamples), static_cast<int>(numChains), -1);
+    
+    compactFit->predict(REAL(x_testExpr), numTestObservations, testOffset, REAL(result));
+    
+    UNPROTECT(1);
+    
+    return result;
+  }
+  
   SEXP loadFromFile(SEXP fileName)
   {
     BARTFit* fit = BARTFit::loadFromFile(CHAR(STRING_ELT(fileName, 0)));
@@ -641,6 +1058,16 @@ extern "C" {
   }
   
   
+  static void compactFitFinalizer(SEXP compactFitExpr)
+  {
+    CompactFit* compactFit = static_cast<CompactFit*>(R_ExternalPtrAddr(compactFitExpr));
+    if (compactFit == NULL) return;
+    
+    delete compactFit;
+    
+    R_ClearExternalPtr(compactFitExpr);
+  }
+  
   static void fitFinalizer(SEXP fitExpr)
   {
 #ifdef THREAD_SAFE_UNLOAD
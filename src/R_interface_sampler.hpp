@@ -9,6 +9,7 @@ extern "C" {
   
   SEXP create(SEXP control, SEXP model, SEXP data);
   SEXP run(SEXP fit, SEXP numBurnIn, SEXP numSamples);
+  SEXP getMemoryUsage(SEXP fit, SEXP numSamples);
   SEXP sampleTreesFromPrior(SEXP fit);
   
   SEXP setData(SEXP fit, SEXP data);
@@ -16,6 +17,15 @@ extern "C" {
   SEXP setModel(SEXP fit, SEXP model);
   
   SEXP predict(SEXP fit, SEXP x_test, SEXP offset_test);
+  SEXP predictSummaries(SEXP fit, SEXP x_test, SEXP offset_test, SEXP includeMean, SEXP includeVariance, SEXP quantiles);
+  SEXP predictApproximateMeans(SEXP fit, SEXP x_test, SEXP offset_test, SEXP minNumDraws,
+                               SEXP absoluteTolerance, SEXP relativeTolerance, SEXP stratify);
+  SEXP getLeafMemberships(SEXP fit, SEXP x_test);
+  SEXP getLeafCooccurrences(SEXP fit, SEXP x_test, SEXP minCount);
+  SEXP collapseSamples(SEXP fit);
+  SEXP predictCollapsed(SEXP collapsedFit, SEXP x_test, SEXP offset_test);
+  SEXP predictFromFile(SEXP fit, SEXP x_testFileName, SEXP numTestObservations, SEXP resultFileName, SEXP chunkSize,
+                       SEXP writeDraws, SEXP includeMean, SEXP includeVariance, SEXP quantiles);
   SEXP setResponse(SEXP fit, SEXP y);
   SEXP setOffset(SEXP fit, SEXP offset);
   SEXP setPredictor(SEXP fit, SEXP x);
@@ -34,6 +44,8 @@ extern "C" {
   
   SEXP saveToFile(SEXP fit, SEXP fileName);
   SEXP loadFromFile(SEXP fileName);
+  SEXP loadCompactFit(SEXP fileName, SEXP chains, SEXP samples);
+  SEXP predictCompact(SEXP compactFit, SEXP x_test, SEXP offset_test);
   
 }
 
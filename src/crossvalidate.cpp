@@ -3,7 +3,8 @@
 
 #include <algorithm> // sort
 #include <cstddef> // size_t
-#include <cmath>   // sqrt, floor
+#include <cmath>   // sqrt, floor, ceil, log, fabs
+#include <cstring> // memcpy
 
 #include <external/alloca.h>
 #include <external/io.h>
@@ -45,6 +46,13 @@ namespace {
   void updateFitForCell(BARTFit& fit, Control& repControl, Model& repModel, const CellParameters& parameters,
                         size_t threadId, size_t cellIndex, ext_btm_manager_t manager, bool verbose);
   
+  // Orders cells so that consecutive ones differ in one parameter by one grid step, with the
+  // number of trees only ever increasing, and scales the burn-in for each step by how far the
+  // parameters moved relative to the span of the grid.
+  void orderCells(const CellParameters* parameters, const std::size_t* nTrees, size_t numNTrees, const double* k, size_t numKs,
+                  const double* power, size_t numPowers, const double* base, size_t numBases,
+                  size_t numContextShiftBurnIn, size_t numRepBurnIn, size_t* cellOrder, size_t* numShiftBurnIns);
+  
   struct SharedData {
     ext_btm_manager_t threadManager;
     Method method;
@@ -63,6 +71,18 @@ namespace {
     
     size_t numReps;
     const CellParameters* parameters;
+    
+    // cells are visited in path order; results are stored by cell number
+    const size_t* cellOrder;
+    const size_t* numShiftBurnIns;
+    double* results;
+    
+    // when not NULL, each visited cell is fit with the most trees and also scores the other tree
+    // counts, whose results are numCells * numReps apart; ordered from most to fewest trees
+    const std::size_t* nTrees;
+    const size_t* treeSizeOrder;
+    size_t numTreeSizes;
+    size_t treeSizeResultsStride;
   };
   
   struct ThreadData {
@@ -72,8 +92,6 @@ namespace {
     size_t repCellOffset;
     size_t numRepCells;
     size_t threadId;
-    
-    double* results;
   };
 }
 
@@ -87,7 +105,7 @@ namespace dbarts { namespace xval {
                        const LossFunctorDefinition& lossFunctorDef, size_t numThreads,
                        const std::size_t* nTrees, size_t numNTrees, const double* k, size_t numKs,
                        const double* power, size_t numPowers, const double* base, size_t numBases,
-                       double* results)
+                       bool shareTrees, double* results)
 
   {
     if (origControl.verbose) {
@@ -101,26 +119,44 @@ namespace dbarts { namespace xval {
                  numNTrees, numKs, numPowers, numBases);
       ext_printf("  results of type: %s\n", lossFunctorDef.displayString);
       ext_printf("  num samp: %lu, num reps: %lu\n", origControl.defaultNumSamples, numReps);
-      ext_printf("  burn in: %lu first, %lu shift, %lu rep\n\n", numInitialBurnIn, numContextShiftBurnIn, numRepBurnIn);
+      ext_printf("  burn in: %lu first, up to %lu shift, %lu rep\n\n", numInitialBurnIn, numContextShiftBurnIn, numRepBurnIn);
 
       if (numThreads > 1)
         ext_printf("  parameters for [thread num, cell number]; some cells may be split across multiple threads:\n\n");
       ext_fflush_stdout();
     }
     
-    size_t numRepCells = numNTrees * numKs * numPowers * numBases * numReps;
+    // with shared trees, each fold is fit once with the most trees and the smaller ensembles are
+    // taken from it, so only the cells with the most trees are visited
+    shareTrees = shareTrees && method == K_FOLD && numNTrees > 1;
+    
+    size_t* treeSizeOrder = NULL;
+    size_t maxNumTrees = nTrees[0];
+    if (shareTrees) {
+      treeSizeOrder = new size_t[numNTrees];
+      for (size_t i = 0; i < numNTrees; ++i) {
+        size_t j = i;
+        for ( ; j > 0 && nTrees[treeSizeOrder[j - 1]] < nTrees[i]; --j) treeSizeOrder[j] = treeSizeOrder[j - 1];
+        treeSizeOrder[j] = i;
+      }
+      maxNumTrees = nTrees[treeSizeOrder[0]];
+    }
+    const std::size_t* visitedNTrees = shareTrees ? &maxNumTrees : nTrees;
+    size_t numVisitedNTrees = shareTrees ? 1 : numNTrees;
+    
+    size_t numRepCells = numVisitedNTrees * numKs * numPowers * numBases * numReps;
     if (numRepCells < numThreads) numThreads = numRepCells;
     
     size_t numCells = numRepCells / numReps;
     CellParameters* cellParameters = new CellParameters[numCells];
     
     size_t cellNumber = 0;
-    for (size_t nIndex = 0; nIndex < numNTrees; ++nIndex) {
+    for (size_t nIndex = 0; nIndex < numVisitedNTrees; ++nIndex) {
       for (size_t kIndex = 0; kIndex < numKs; ++kIndex) {
         for (size_t pIndex = 0; pIndex < numPowers; ++pIndex) {
           for (size_t bIndex = 0; bIndex < numBases; ++bIndex) {
             
-            cellParameters[cellNumber].numTrees = nTrees[nIndex];
+            cellParameters[cellNumber].numTrees = visitedNTrees[nIndex];
             cellParameters[cellNumber].k        = k[kIndex];
             cellParameters[cellNumber].power    = power[pIndex];
             cellParameters[cellNumber].base     = base[bIndex];
@@ -130,12 +166,19 @@ namespace dbarts { namespace xval {
       }
     }
     
+    size_t* cellOrder       = new size_t[numCells];
+    size_t* numShiftBurnIns = new size_t[numCells];
+    orderCells(cellParameters, visitedNTrees, numVisitedNTrees, k, numKs, power, numPowers, base, numBases,
+               numContextShiftBurnIn, numRepBurnIn, cellOrder, numShiftBurnIns);
+    
     Control threadControl = origControl;
     
     SharedData sharedData = { 0, method, threadControl, origModel, origData,
                               numInitialBurnIn, numContextShiftBurnIn, numRepBurnIn,
                               testSampleSize,
-                              lossFunctorDef, numReps, cellParameters };
+                              lossFunctorDef, numReps, cellParameters,
+                              cellOrder, numShiftBurnIns, results,
+                              nTrees, treeSizeOrder, shareTrees ? numNTrees : 1, numRepCells * lossFunctorDef.numResults };
     
     if (numThreads <= 1) {
       ext_rng* rng;
@@ -152,7 +195,7 @@ namespace dbarts { namespace xval {
           ext_throwError("could not allocate rng");
       }
       
-      ThreadData threadData = { &sharedData, rng, 0, numRepCells, 0, results };
+      ThreadData threadData = { &sharedData, rng, 0, numRepCells, 0 };
       
       crossvalidationTask(&threadData);
       
@@ -182,7 +225,6 @@ namespace dbarts { namespace xval {
         threadData[i].repCellOffset = i * numRepCellsPerThread;
         threadData[i].numRepCells   = numRepCellsPerThread;
         threadData[i].threadId = i;
-        threadData[i].results = results + i * numRepCellsPerThread * lossFunctorDef.numResults;
         threadDataPtrs[i] = threadData + i;
       }
       
@@ -193,7 +235,6 @@ namespace dbarts { namespace xval {
         threadData[i].repCellOffset = offByOneIndex * numRepCellsPerThread + (i - offByOneIndex) * (numRepCellsPerThread - 1);
         threadData[i].numRepCells   = numRepCellsPerThread - 1;
         threadData[i].threadId = i;
-        threadData[i].results = results + threadData[i].repCellOffset * lossFunctorDef.numResults;
         threadDataPtrs[i] = threadData + i;
       }
       
@@ -209,6 +250,9 @@ namespace dbarts { namespace xval {
       
     }
     
+    delete [] treeSizeOrder;
+    delete [] numShiftBurnIns;
+    delete [] cellOrder;
     delete [] cellParameters;
     
   }
@@ -226,6 +270,9 @@ namespace {
     size_t maxNumTestObservations;
     double* y_test;
     Results* samples;
+    const LossFunctorDefinition* lfDef;
+    bool lossIsStreamed;
+    bool lossIsQueued;
     LossFunctor* lf;
     ext_rng* generator;
     size_t* permutation;
@@ -239,6 +286,23 @@ namespace {
     size_t numResults;
     size_t numRepBurnIn;
   };
+  // Trees are dropped from the end of the ensemble to reach each smaller size, after which the
+  // full ensemble is restored from a copy made on the same training data before the next fold.
+  struct SharedTreesKFoldThreadScratch : KFoldThreadScratch {
+    const std::size_t* nTrees;
+    const size_t* treeSizeOrder;
+    size_t numTreeSizes;
+    size_t treeSizeResultsStride;
+    
+    Control* repControl;
+    Model* repModel;
+    CellParameters parameters;
+    
+    const char* const* savedTrees;
+    double* savedTreeFits;
+    double savedSigma;
+    bool treesAreSubset;
+  };
   
   void randomSubsampleCrossvalidate(CrossvalidationData& xvalData,
                                     Results* restrict samples, size_t numSamples, double* restrict results,
@@ -250,6 +314,19 @@ namespace {
                           LossFunction calculateLoss,
                           ext_btm_manager_t manager, size_t threadId, bool lossRequiresMutex,
                           ThreadScratch* v_scratch);
+  void sharedTreesKFoldCrossvalidate(CrossvalidationData& data,
+                                     Results* restrict samples, size_t numSamples, double* restrict results,
+                                     LossFunction calculateLoss,
+                                     ext_btm_manager_t manager, size_t threadId, bool lossRequiresMutex,
+                                     ThreadScratch* v_scratch);
+  void getKFoldPermutation(KFoldThreadScratch& threadScratch, size_t numObservations);
+  
+  // when the loss is queued, queuedWeight times the loss is later added to results instead
+  void sampleAndCalculateLoss(CrossvalidationData& xvalData,
+                              Results* restrict samples, size_t numSamples, size_t numTestObservations, double* restrict results,
+                              double queuedWeight, LossFunction calculateLoss,
+                              ext_btm_manager_t manager, size_t threadId, bool lossRequiresMutex,
+                              ThreadScratch& scratch);
   
   void randomSubsampleDivideData(const Data& restrict origData, Data& restrict repData, double* restrict y_test,
                                  ext_rng* restrict generator, size_t* restrict permutation);
@@ -270,6 +347,63 @@ namespace {
     const LossFunctorDefinition& lfDef;
     LossFunctor* lf;
   };
+  
+  struct StreamedLoss {
+    const LossFunctorDefinition* lfDef;
+    LossFunctor* lf;
+  };
+  
+  void accumulateLossCallback(void* data, BARTFit& fit, bool isBurningIn, const double*, const double* testDraw, double)
+  {
+    if (isBurningIn) return;
+    
+    StreamedLoss& streamedLoss(*static_cast<StreamedLoss*>(data));
+    streamedLoss.lfDef->accumulateLoss(*streamedLoss.lf, testDraw, fit.data.numTestObservations);
+  }
+  
+  // copies of a test set and its draws, waiting for the calling thread
+  struct QueuedLoss {
+    const LossFunctorDefinition* lfDef;
+    double* y_test;
+    double* testSamples;
+    size_t numTestObservations;
+    size_t numSamples;
+    double* results;
+    double weight;
+  };
+}
+
+extern "C" void queuedLossTask(void** data, size_t numItems) {
+  QueuedLoss** queuedLosses = reinterpret_cast<QueuedLoss**>(data);
+  const LossFunctorDefinition& lfDef(*queuedLosses[0]->lfDef);
+  
+  const double** y_tests      = new const double*[numItems];
+  const double** testSamples  = new const double*[numItems];
+  size_t* numTestObservations = new size_t[numItems];
+  double* results             = new double[numItems * lfDef.numResults];
+  
+  for (size_t i = 0; i < numItems; ++i) {
+    y_tests[i]             = queuedLosses[i]->y_test;
+    testSamples[i]         = queuedLosses[i]->testSamples;
+    numTestObservations[i] = queuedLosses[i]->numTestObservations;
+  }
+  
+  lfDef.calculateLossBatch(lfDef, y_tests, numTestObservations, testSamples, queuedLosses[0]->numSamples, numItems, results);
+  
+  for (size_t i = 0; i < numItems; ++i) {
+    QueuedLoss* queuedLoss = queuedLosses[i];
+    for (size_t j = 0; j < lfDef.numResults; ++j)
+      queuedLoss->results[j] += queuedLoss->weight * results[j + i * lfDef.numResults];
+    
+    delete [] queuedLoss->testSamples;
+    delete [] queuedLoss->y_test;
+    delete queuedLoss;
+  }
+  
+  delete [] results;
+  delete [] numTestObservations;
+  delete [] testSamples;
+  delete [] y_tests;
 }
 
 extern "C" void lossFunctorCreatorTask(void* data) {
@@ -312,6 +446,9 @@ extern "C" {
     const LossFunctorDefinition& lfDef(sharedData.lossFunctorDef);
     bool lossRequiresMutex = lfDef.requiresMutex && !ext_btm_isNull(sharedData.threadManager);
     
+    // draws are consumed as they are stored, so only the most recent is held
+    bool lossIsStreamed = lfDef.accumulateLoss != NULL && !lossRequiresMutex;
+    
     LossFunctor* lf = NULL;
     if (lossRequiresMutex) {
       LossFunctorCreatorData lfcd = { lfDef, sharedData.method, maxNumTestObservations, numSamples, &lf };
@@ -330,7 +467,7 @@ extern "C" {
     
     Results* samples =
       suppliedTestSamples == NULL ?
-        new Results(maxNumTrainingObservations, origData.numPredictors, maxNumTestObservations, numSamples, 1) :
+        new Results(maxNumTrainingObservations, origData.numPredictors, maxNumTestObservations, lossIsStreamed ? 1 : numSamples, 1) :
         new Results(maxNumTrainingObservations, origData.numPredictors, maxNumTestObservations, numSamples, 1,
                     new double[numSamples],
                     new double[maxNumTrainingObservations * numSamples],
@@ -340,6 +477,13 @@ extern "C" {
     Control repControl = origControl;
     repControl.numThreads = 1;
     repControl.verbose = false;
+    repControl.keepTrainingFits = false;
+    
+    StreamedLoss streamedLoss = { &lfDef, lf };
+    if (lossIsStreamed) {
+      repControl.callback = &accumulateLossCallback;
+      repControl.callbackData = &streamedLoss;
+    }
     bool verbose = origControl.verbose;
     
     BARTFit* fit = new BARTFit(repControl, origModel, origData);
@@ -359,19 +503,37 @@ extern "C" {
 
     
     ThreadScratch* v_threadScratch;
+    SharedTreesKFoldThreadScratch* sharedTreesScratch = NULL;
     if (sharedData.method == K_FOLD) {
       const size_t& numFolds(sharedData.testSampleSize.n);
       size_t numFullSizedFolds = maxNumTestObservations * numFolds == origData.numObservations ? numFolds : origData.numObservations % numFolds;
       
-      KFoldThreadScratch* threadScratch = new KFoldThreadScratch;
+      KFoldThreadScratch* threadScratch;
+      if (sharedData.treeSizeOrder != NULL) {
+        sharedTreesScratch = new SharedTreesKFoldThreadScratch;
+        sharedTreesScratch->nTrees = sharedData.nTrees;
+        sharedTreesScratch->treeSizeOrder = sharedData.treeSizeOrder;
+        sharedTreesScratch->numTreeSizes = sharedData.numTreeSizes;
+        sharedTreesScratch->treeSizeResultsStride = sharedData.treeSizeResultsStride;
+        sharedTreesScratch->repControl = &repControl;
+        sharedTreesScratch->repModel = &repModel;
+        sharedTreesScratch->savedTrees = NULL;
+        sharedTreesScratch->savedTreeFits = new double[maxNumTrainingObservations * sharedData.nTrees[sharedData.treeSizeOrder[0]]];
+        sharedTreesScratch->savedSigma = 1.0;
+        sharedTreesScratch->treesAreSubset = false;
+        
+        threadScratch = sharedTreesScratch;
+        crossvalidate = &sharedTreesKFoldCrossvalidate;
+      } else {
+        threadScratch = new KFoldThreadScratch;
+        crossvalidate = &kFoldCrossvalidate;
+      }
       threadScratch->numFolds = numFolds;
       threadScratch->numFullSizedFolds = numFullSizedFolds;
       threadScratch->numResults = lfDef.numResults;
       threadScratch->numRepBurnIn = sharedData.numRepBurnIn;
       
       v_threadScratch = threadScratch;
-      
-      crossvalidate = &kFoldCrossvalidate;
     } else {
       RandomSubsampleThreadScratch* threadScratch = new RandomSubsampleThreadScratch;
       v_threadScratch = threadScratch;
@@ -382,67 +544,41 @@ extern "C" {
     v_threadScratch->maxNumTestObservations = maxNumTestObservations;
     v_threadScratch->y_test = y_test;
     v_threadScratch->samples = samples;
+    v_threadScratch->lfDef = &lfDef;
+    v_threadScratch->lossIsStreamed = lossIsStreamed;
+    v_threadScratch->lossIsQueued = lfDef.calculateLossBatch != NULL && !ext_btm_isNull(sharedData.threadManager);
     v_threadScratch->lf = lf;
     v_threadScratch->generator = threadData.rng;
     v_threadScratch->permutation = new size_t[origData.numObservations];
     for (size_t i = 0; i < origData.numObservations; ++i) v_threadScratch->permutation[i] = i;
     
         
-    size_t firstCell    = threadData.repCellOffset / sharedData.numReps;
-    size_t firstCellRep = threadData.repCellOffset % sharedData.numReps;
-    size_t lastCell     = (threadData.repCellOffset + threadData.numRepCells) / sharedData.numReps;
-    size_t lastCellRep  = (threadData.repCellOffset + threadData.numRepCells) % sharedData.numReps;
+    // positions are along the path in sharedData.cellOrder
+    size_t firstPosition    = threadData.repCellOffset / sharedData.numReps;
+    size_t firstPositionRep = threadData.repCellOffset % sharedData.numReps;
+    size_t endPosition      = (threadData.repCellOffset + threadData.numRepCells) / sharedData.numReps;
+    size_t endPositionRep   = (threadData.repCellOffset + threadData.numRepCells) % sharedData.numReps;
+    if (endPositionRep != 0) ++endPosition;
     
-    size_t resultIndex = 0;
     xvalData.numBurnIn = sharedData.numInitialBurnIn;
     
-    // first and last cells are a bit of a mess, since there can be a lot of off-by-one stuff
-    if (firstCellRep != 0) {
-      updateFitForCell(*fit, repControl, repModel, sharedData.parameters[firstCell],
-                       threadData.threadId, firstCell, sharedData.threadManager, verbose);
-      
-      for (size_t repIndex = firstCellRep; repIndex < sharedData.numReps; ++repIndex)
-      {
-        crossvalidate(xvalData, samples, numSamples, threadData.results + resultIndex,
-                      lfDef.calculateLoss, sharedData.threadManager, threadData.threadId, lossRequiresMutex, v_threadScratch);
-
-        resultIndex += lfDef.numResults;
-        
-        xvalData.numBurnIn = sharedData.numRepBurnIn;
-      }
+    // first and last positions may only be partially ours
+    for (size_t position = firstPosition; position < endPosition; ++position) {
+      size_t cellIndex = sharedData.cellOrder[position];
+      size_t firstRep = position == firstPosition ? firstPositionRep : 0;
+      size_t endRep   = position + 1 == endPosition && endPositionRep != 0 ? endPositionRep : sharedData.numReps;
       
-      ++firstCell;
-      firstCellRep = 0;
+      if (position != firstPosition) xvalData.numBurnIn = sharedData.numShiftBurnIns[position];
       
-      xvalData.numBurnIn = sharedData.numContextShiftBurnIn;
-    }
-    
-    for (size_t cellIndex = firstCell; cellIndex < lastCell; ++cellIndex) {
       updateFitForCell(*fit, repControl, repModel, sharedData.parameters[cellIndex],
                        threadData.threadId, cellIndex, sharedData.threadManager, verbose);
+      if (sharedTreesScratch != NULL) sharedTreesScratch->parameters = sharedData.parameters[cellIndex];
       
-      for (size_t repIndex = 0; repIndex < sharedData.numReps; ++repIndex)
+      double* cellResults = sharedData.results + cellIndex * sharedData.numReps * lfDef.numResults;
+      for (size_t repIndex = firstRep; repIndex < endRep; ++repIndex)
       {
-        crossvalidate(xvalData, samples, numSamples, threadData.results + resultIndex,
+        crossvalidate(xvalData, samples, numSamples, cellResults + repIndex * lfDef.numResults,
                       lfDef.calculateLoss, sharedData.threadManager, threadData.threadId, lossRequiresMutex, v_threadScratch);
-        resultIndex += lfDef.numResults;
-        
-        xvalData.numBurnIn = sharedData.numRepBurnIn;
-      }
-      
-      xvalData.numBurnIn = sharedData.numContextShiftBurnIn;
-    }
-    
-    if (lastCellRep != 0) {
-      updateFitForCell(*fit, repControl, repModel, sharedData.parameters[lastCell],
-                       threadData.threadId, lastCell, sharedData.threadManager, verbose);
-      
-      for (size_t repIndex = 0; repIndex < lastCellRep; ++repIndex)
-      {
-        crossvalidate(xvalData, samples, numSamples, threadData.results + resultIndex,
-                      lfDef.calculateLoss, sharedData.threadManager, threadData.threadId, lossRequiresMutex, v_threadScratch);
-        
-        resultIndex += lfDef.numResults;
         
         xvalData.numBurnIn = sharedData.numRepBurnIn;
       }
@@ -450,7 +586,15 @@ extern "C" {
     
     
     delete [] v_threadScratch->permutation;
-    if (sharedData.method == K_FOLD) {
+    if (sharedTreesScratch != NULL) {
+      if (sharedTreesScratch->savedTrees != NULL) {
+        for (size_t treeNum = 0; treeNum < sharedData.nTrees[sharedData.treeSizeOrder[0]]; ++treeNum)
+          delete [] sharedTreesScratch->savedTrees[treeNum];
+        delete [] sharedTreesScratch->savedTrees;
+      }
+      delete [] sharedTreesScratch->savedTreeFits;
+      delete sharedTreesScratch;
+    } else if (sharedData.method == K_FOLD) {
       delete reinterpret_cast<KFoldThreadScratch*>(v_threadScratch);
     } else {
       delete reinterpret_cast<RandomSubsampleThreadScratch*>(v_threadScratch);
@@ -505,14 +649,10 @@ namespace {
                               threadScratch.generator, threadScratch.permutation);
     xvalData.fit.setData(xvalData.repData);
     
-    xvalData.fit.runSampler(xvalData.numBurnIn, samples);
+    for (size_t i = 0; i < threadScratch.lfDef->numResults; ++i) results[i] = 0.0;
     
-    if (lossRequiresMutex) {
-      LossFunctorData ldf = { calculateLoss, *threadScratch.lf, threadScratch.y_test, threadScratch.maxNumTestObservations, samples->testSamples, numSamples, results };
-      ext_btm_runTaskInParentThread(manager, threadId, &lossFunctorTask, &ldf);
-    } else {
-      calculateLoss(*threadScratch.lf, threadScratch.y_test, threadScratch.maxNumTestObservations, samples->testSamples, numSamples, results);
-    }
+    sampleAndCalculateLoss(xvalData, samples, numSamples, threadScratch.maxNumTestObservations, results,
+                           1.0, calculateLoss, manager, threadId, lossRequiresMutex, threadScratch);
   }
   
   void kFoldCrossvalidate(CrossvalidationData& xvalData,
@@ -522,7 +662,45 @@ namespace {
   {
     KFoldThreadScratch& threadScratch(*reinterpret_cast<KFoldThreadScratch *>(v_scratch));
     
-    permuteIndexArray(threadScratch.generator, threadScratch.permutation, xvalData.origData.numObservations);
+    getKFoldPermutation(threadScratch, xvalData.origData.numObservations);
+    
+    double* foldResults = ext_stackAllocate(threadScratch.numResults, double);
+    
+    for (size_t i = 0; i < threadScratch.numResults; ++i) results[i] = 0.0;
+    
+    for (size_t k = 0; k < threadScratch.numFolds; ++k) {
+      size_t numTestObservations = k < threadScratch.numFullSizedFolds ? threadScratch.maxNumTestObservations : threadScratch.maxNumTestObservations - 1;
+      size_t numTrainingObservations = xvalData.origData.numObservations - numTestObservations;
+      
+      xvalData.repData.numObservations = numTrainingObservations;
+      xvalData.repData.numTestObservations = numTestObservations;
+      
+      kFoldDivideData(xvalData.origData, xvalData.repData, threadScratch.y_test,
+                      k, threadScratch.maxNumTestObservations, threadScratch.numFullSizedFolds, threadScratch.permutation);
+      xvalData.fit.setData(xvalData.repData);
+      
+      if (threadScratch.lossIsQueued) {
+        sampleAndCalculateLoss(xvalData, samples, numSamples, numTestObservations, results,
+                               1.0 / static_cast<double>(threadScratch.numFolds), calculateLoss, manager, threadId, lossRequiresMutex, threadScratch);
+      } else {
+        sampleAndCalculateLoss(xvalData, samples, numSamples, numTestObservations, foldResults,
+                               1.0, calculateLoss, manager, threadId, lossRequiresMutex, threadScratch);
+        
+        for (size_t i = 0; i < threadScratch.numResults; ++i) results[i] += foldResults[i];
+      }
+      
+      if (k > 0) xvalData.numBurnIn = threadScratch.numRepBurnIn;
+    }
+    
+    if (!threadScratch.lossIsQueued)
+      for (size_t i = 0; i < threadScratch.numResults; ++i) results[i] /= static_cast<double>(threadScratch.numFolds);
+    
+    ext_stackFree(foldResults);
+  }
+  
+  void getKFoldPermutation(KFoldThreadScratch& threadScratch, size_t numObservations)
+  {
+    permuteIndexArray(threadScratch.generator, threadScratch.permutation, numObservations);
     
     for (size_t k = 0; k < threadScratch.numFolds; ++k) {
       size_t numTestObservations, foldStartIndex;
@@ -536,15 +714,60 @@ namespace {
       
       std::sort(threadScratch.permutation + foldStartIndex, threadScratch.permutation + foldStartIndex + numTestObservations);
     }
+  }
+  
+  void saveTrees(BARTFit& fit, SharedTreesKFoldThreadScratch& threadScratch)
+  {
+    // xbart always runs a single chain
+    State& state(fit.state[0]);
+    size_t numTrees = fit.control.numTrees;
+    
+    if (threadScratch.savedTrees != NULL) {
+      for (size_t treeNum = 0; treeNum < numTrees; ++treeNum) delete [] threadScratch.savedTrees[treeNum];
+      delete [] threadScratch.savedTrees;
+    }
+    threadScratch.savedTrees = state.createTreeStrings(fit, false);
+    std::memcpy(threadScratch.savedTreeFits, state.treeFits, fit.data.numObservations * numTrees * sizeof(double));
+    threadScratch.savedSigma = state.sigma;
+  }
+  
+  void restoreTrees(BARTFit& fit, SharedTreesKFoldThreadScratch& threadScratch)
+  {
+    if (threadScratch.repControl->numTrees != threadScratch.parameters.numTrees)
+      updateFitForCell(fit, *threadScratch.repControl, *threadScratch.repModel, threadScratch.parameters, 0, 0, NULL, false);
+    
+    State& state(fit.state[0]);
+    state.recreateTreesFromStrings(fit, threadScratch.savedTrees, false);
+    std::memcpy(state.treeFits, threadScratch.savedTreeFits, fit.data.numObservations * fit.control.numTrees * sizeof(double));
+    state.sigma = threadScratch.savedSigma;
+    fit.rebuildScratchFromState();
+    
+    threadScratch.treesAreSubset = false;
+  }
+  
+  void sharedTreesKFoldCrossvalidate(CrossvalidationData& xvalData,
+                                     Results* restrict samples, size_t numSamples, double* restrict results,
+                                     LossFunction calculateLoss, ext_btm_manager_t manager, size_t threadId, bool lossRequiresMutex,
+                                     ThreadScratch* v_scratch)
+  {
+    SharedTreesKFoldThreadScratch& threadScratch(*static_cast<SharedTreesKFoldThreadScratch*>(v_scratch));
+    
+    getKFoldPermutation(threadScratch, xvalData.origData.numObservations);
     
     double* foldResults = ext_stackAllocate(threadScratch.numResults, double);
     
-    for (size_t i = 0; i < threadScratch.numResults; ++i) results[i] = 0.0;
+    for (size_t sizeIndex = 0; sizeIndex < threadScratch.numTreeSizes; ++sizeIndex) {
+      double* sizeResults = results + threadScratch.treeSizeOrder[sizeIndex] * threadScratch.treeSizeResultsStride;
+      for (size_t i = 0; i < threadScratch.numResults; ++i) sizeResults[i] = 0.0;
+    }
     
     for (size_t k = 0; k < threadScratch.numFolds; ++k) {
       size_t numTestObservations = k < threadScratch.numFullSizedFolds ? threadScratch.maxNumTestObservations : threadScratch.maxNumTestObservations - 1;
       size_t numTrainingObservations = xvalData.origData.numObservations - numTestObservations;
       
+      // the copy was made on the training data still held by the fit
+      if (threadScratch.treesAreSubset) restoreTrees(xvalData.fit, threadScratch);
+      
       xvalData.repData.numObservations = numTrainingObservations;
       xvalData.repData.numTestObservations = numTestObservations;
       
@@ -552,25 +775,87 @@ namespace {
                       k, threadScratch.maxNumTestObservations, threadScratch.numFullSizedFolds, threadScratch.permutation);
       xvalData.fit.setData(xvalData.repData);
       
-      xvalData.fit.runSampler(xvalData.numBurnIn, samples);
-    
-      if (lossRequiresMutex) {
-        LossFunctorData ldf = { calculateLoss, *threadScratch.lf, threadScratch.y_test, numTestObservations, samples->testSamples, numSamples, foldResults };
-        ext_btm_runTaskInParentThread(manager, threadId, &lossFunctorTask, &ldf);
-      } else {
-        calculateLoss(*threadScratch.lf, threadScratch.y_test, numTestObservations, samples->testSamples, numSamples, foldResults);
+      CellParameters parameters = threadScratch.parameters;
+      for (size_t sizeIndex = 0; sizeIndex < threadScratch.numTreeSizes; ++sizeIndex) {
+        size_t numTrees = threadScratch.nTrees[threadScratch.treeSizeOrder[sizeIndex]];
+        double* sizeResults = results + threadScratch.treeSizeOrder[sizeIndex] * threadScratch.treeSizeResultsStride;
+        
+        if (sizeIndex > 0) {
+          // the kept trees already fit this fold, so burn-in scales with the share of trees dropped
+          xvalData.numBurnIn = static_cast<size_t>(std::ceil(static_cast<double>(threadScratch.numRepBurnIn) *
+            (1.0 - static_cast<double>(numTrees) / static_cast<double>(parameters.numTrees))));
+          parameters.numTrees = numTrees;
+          updateFitForCell(xvalData.fit, *threadScratch.repControl, *threadScratch.repModel, parameters, 0, 0, NULL, false);
+        }
+        
+        if (threadScratch.lossIsQueued) {
+          sampleAndCalculateLoss(xvalData, samples, numSamples, numTestObservations, sizeResults,
+                                 1.0 / static_cast<double>(threadScratch.numFolds), calculateLoss, manager, threadId, lossRequiresMutex, threadScratch);
+        } else {
+          sampleAndCalculateLoss(xvalData, samples, numSamples, numTestObservations, foldResults,
+                                 1.0, calculateLoss, manager, threadId, lossRequiresMutex, threadScratch);
+          
+          for (size_t i = 0; i < threadScratch.numResults; ++i) sizeResults[i] += foldResults[i];
+        }
+        
+        if (sizeIndex == 0 && threadScratch.numTreeSizes > 1) saveTrees(xvalData.fit, threadScratch);
       }
+      threadScratch.treesAreSubset = true;
       
-      for (size_t i = 0; i < threadScratch.numResults; ++i) results[i] += foldResults[i];
-      
-      if (k > 0) xvalData.numBurnIn = threadScratch.numRepBurnIn;
+      xvalData.numBurnIn = threadScratch.numRepBurnIn;
     }
     
-    for (size_t i = 0; i < threadScratch.numResults; ++i) results[i] /= static_cast<double>(threadScratch.numFolds);
+    if (!threadScratch.lossIsQueued) {
+      for (size_t sizeIndex = 0; sizeIndex < threadScratch.numTreeSizes; ++sizeIndex) {
+        double* sizeResults = results + threadScratch.treeSizeOrder[sizeIndex] * threadScratch.treeSizeResultsStride;
+        for (size_t i = 0; i < threadScratch.numResults; ++i) sizeResults[i] /= static_cast<double>(threadScratch.numFolds);
+      }
+    }
     
     ext_stackFree(foldResults);
   }
   
+  void sampleAndCalculateLoss(CrossvalidationData& xvalData,
+                              Results* restrict samples, size_t numSamples, size_t numTestObservations, double* restrict results,
+                              double queuedWeight, LossFunction calculateLoss,
+                              ext_btm_manager_t manager, size_t threadId, bool lossRequiresMutex,
+                              ThreadScratch& scratch)
+  {
+    if (scratch.lossIsStreamed) {
+      scratch.lfDef->beginLoss(*scratch.lf, numTestObservations);
+      xvalData.fit.runSampler(xvalData.numBurnIn, numSamples, samples);
+      scratch.lfDef->finalizeLoss(*scratch.lf, scratch.y_test, numTestObservations, numSamples, results);
+      return;
+    }
+    
+    xvalData.fit.runSampler(xvalData.numBurnIn, samples);
+    
+    if (scratch.lossIsQueued) {
+      QueuedLoss* queuedLoss = new QueuedLoss;
+      queuedLoss->lfDef = scratch.lfDef;
+      queuedLoss->y_test = new double[numTestObservations];
+      queuedLoss->testSamples = new double[numTestObservations * numSamples];
+      queuedLoss->numTestObservations = numTestObservations;
+      queuedLoss->numSamples = numSamples;
+      queuedLoss->results = results;
+      queuedLoss->weight = queuedWeight;
+      
+      std::memcpy(queuedLoss->y_test, scratch.y_test, numTestObservations * sizeof(double));
+      std::memcpy(queuedLoss->testSamples, samples->testSamples, numTestObservations * numSamples * sizeof(double));
+      
+      ext_btm_queueForParentThread(manager, &queuedLossTask, queuedLoss);
+    } else if (scratch.lfDef->calculateLossBatch != NULL) {
+      const double* y_test = scratch.y_test;
+      const double* testSamples = samples->testSamples;
+      scratch.lfDef->calculateLossBatch(*scratch.lfDef, &y_test, &numTestObservations, &testSamples, numSamples, 1, results);
+    } else if (lossRequiresMutex) {
+      LossFunctorData ldf = { calculateLoss, *scratch.lf, scratch.y_test, numTestObservations, samples->testSamples, numSamples, results };
+      ext_btm_runTaskInParentThread(manager, threadId, &lossFunctorTask, &ldf);
+    } else {
+      calculateLoss(*scratch.lf, scratch.y_test, numTestObservations, samples->testSamples, numSamples, results);
+    }
+  }
+  
   void permuteIndexArray(ext_rng* restrict generator, size_t* restrict indices, size_t length)
   {
     size_t temp, swapPos;
@@ -685,6 +970,8 @@ namespace {
     const CGMPrior* oldTreePrior = static_cast<CGMPrior*>(origModel.treePrior);
     repTreePrior->base = oldTreePrior->base;
     repTreePrior->power = oldTreePrior->power;
+    repTreePrior->sparse = oldTreePrior->sparse;
+    repTreePrior->concentration = oldTreePrior->concentration;
     
     repModel.treePrior = repTreePrior;
     
@@ -805,3 +1092,92 @@ namespace {
   }
 }
 
+namespace {
+  // grids are short, so an insertion sort suffices
+  void getSortedOrder(const double* values, size_t length, size_t* order)
+  {
+    for (size_t i = 0; i < length; ++i) {
+      size_t j = i;
+      for ( ; j > 0 && values[order[j - 1]] > values[i]; --j) order[j] = order[j - 1];
+      order[j] = i;
+    }
+  }
+  
+  double getSpan(const double* values, size_t length)
+  {
+    double min = values[0], max = values[0];
+    for (size_t i = 1; i < length; ++i) {
+      if (values[i] < min) min = values[i];
+      if (values[i] > max) max = values[i];
+    }
+    return max - min;
+  }
+  
+  void orderCells(const CellParameters* parameters, const std::size_t* nTrees, size_t numNTrees, const double* k, size_t numKs,
+                  const double* power, size_t numPowers, const double* base, size_t numBases,
+                  size_t numContextShiftBurnIn, size_t numRepBurnIn, size_t* cellOrder, size_t* numShiftBurnIns)
+  {
+    // number of trees and k act multiplicatively on the prior, so they are compared on the log scale
+    double* logNTrees = new double[numNTrees];
+    double* logK      = new double[numKs];
+    for (size_t i = 0; i < numNTrees; ++i) logNTrees[i] = std::log(static_cast<double>(nTrees[i]));
+    for (size_t i = 0; i < numKs; ++i) logK[i] = std::log(k[i]);
+    
+    size_t* nOrder = new size_t[numNTrees];
+    size_t* kOrder = new size_t[numKs];
+    size_t* pOrder = new size_t[numPowers];
+    size_t* bOrder = new size_t[numBases];
+    getSortedOrder(logNTrees, numNTrees, nOrder);
+    getSortedOrder(logK, numKs, kOrder);
+    getSortedOrder(power, numPowers, pOrder);
+    getSortedOrder(base, numBases, bOrder);
+    
+    // inner loops reverse direction each pass, so every step moves a single parameter
+    size_t position = 0;
+    bool kForward = true, pForward = true, bForward = true;
+    for (size_t nIndex = 0; nIndex < numNTrees; ++nIndex) {
+      for (size_t kIndex = 0; kIndex < numKs; ++kIndex) {
+        size_t kCell = kOrder[kForward ? kIndex : numKs - 1 - kIndex];
+        for (size_t pIndex = 0; pIndex < numPowers; ++pIndex) {
+          size_t pCell = pOrder[pForward ? pIndex : numPowers - 1 - pIndex];
+          for (size_t bIndex = 0; bIndex < numBases; ++bIndex) {
+            size_t bCell = bOrder[bForward ? bIndex : numBases - 1 - bIndex];
+            cellOrder[position++] = ((nOrder[nIndex] * numKs + kCell) * numPowers + pCell) * numBases + bCell;
+          }
+          bForward = !bForward;
+        }
+        pForward = !pForward;
+      }
+      kForward = !kForward;
+    }
+    
+    double nSpan = getSpan(logNTrees, numNTrees);
+    double kSpan = getSpan(logK, numKs);
+    double pSpan = getSpan(power, numPowers);
+    double bSpan = getSpan(base, numBases);
+    
+    // a move across the full span of any parameter gets the full context shift burn-in
+    numShiftBurnIns[0] = numContextShiftBurnIn;
+    for (size_t i = 1; i < position; ++i) {
+      const CellParameters& from(parameters[cellOrder[i - 1]]);
+      const CellParameters& to(parameters[cellOrder[i]]);
+      
+      double distance = 0.0;
+      if (nSpan > 0.0) distance += std::fabs(std::log(static_cast<double>(to.numTrees) / static_cast<double>(from.numTrees))) / nSpan;
+      if (kSpan > 0.0) distance += std::fabs(std::log(to.k / from.k)) / kSpan;
+      if (pSpan > 0.0) distance += std::fabs(to.power - from.power) / pSpan;
+      if (bSpan > 0.0) distance += std::fabs(to.base - from.base) / bSpan;
+      if (distance > 1.0) distance = 1.0;
+      
+      size_t numBurnIn = static_cast<size_t>(std::ceil(distance * static_cast<double>(numContextShiftBurnIn)));
+      numShiftBurnIns[i] = numBurnIn > numRepBurnIn ? numBurnIn : numRepBurnIn;
+    }
+    
+    delete [] bOrder;
+    delete [] pOrder;
+    delete [] kOrder;
+    delete [] nOrder;
+    delete [] logK;
+    delete [] logNTrees;
+  }
+}
@@ -27,6 +27,25 @@ namespace dbarts {
                                 const double* restrict testSamples, std::size_t numSamples, // numTestObservations x numSamples
                                 double* restrict results);
     
+    // Losses that can be computed a draw at a time: begin resets the functor for a test set,
+    // accumulate is called with each draw as the sampler stores it, and finalize writes the results.
+    typedef void(*LossBeginFunction)(LossFunctor& restrict instance, std::size_t numTestObservations);
+    typedef void(*LossAccumulateFunction)(LossFunctor& restrict instance,
+                                          const double* restrict testSample, std::size_t numTestObservations);
+    typedef void(*LossFinalizeFunction)(LossFunctor& restrict instance,
+                                        const double* restrict y_test, std::size_t numTestObservations, std::size_t numSamples,
+                                        double* restrict results);
+    
+    struct LossFunctorDefinition;
+    
+    // Losses evaluated for several test sets at once in the calling thread. With multiple threads,
+    // workers queue copies of their test draws and keep sampling while the calling thread works
+    // through whatever has been queued. Results are numResults x numBlocks.
+    typedef void(*LossBatchFunction)(const LossFunctorDefinition& def,
+                                     const double* const* y_tests, const std::size_t* numTestObservations,
+                                     const double* const* testSamples, std::size_t numSamples, std::size_t numBlocks,
+                                     double* results);
+    
     struct LossFunctorDefinition {
       std::ptrdiff_t y_testOffset;         // offset into functor that points to y_test, or negative if not supplied
       std::ptrdiff_t testSamplesOffset;    // offset into functor that points to testSamples, or negative if not supplied
@@ -36,9 +55,16 @@ namespace dbarts {
       
       // member functions
       LossFunction calculateLoss;
+      // optional; when accumulateLoss is supplied and no mutex is required, test draws are not kept
+      LossBeginFunction beginLoss;
+      LossAccumulateFunction accumulateLoss;
+      LossFinalizeFunction finalizeLoss;
+      // optional; when supplied, calculateLoss is not used
+      LossBatchFunction calculateLossBatch;
       LossFunctor* (*createFunctor)(const LossFunctorDefinition& def, Method method, std::size_t numTestObservations, std::size_t numSamples);
       void (*deleteFunctor)(LossFunctor* instance);
       
+      LossFunctorDefinition() : beginLoss(NULL), accumulateLoss(NULL), finalizeLoss(NULL), calculateLossBatch(NULL) { }
       virtual ~LossFunctorDefinition() { }
     };
     
@@ -49,7 +75,7 @@ namespace dbarts {
                        const LossFunctorDefinition& lossFunctorDef, std::size_t numThreads,
                        const std::size_t* nTrees, std::size_t numNTrees, const double* k, std::size_t numKs,
                        const double* power, std::size_t numPowers, const double* base, std::size_t numBases,
-                       double* results);
+                       bool shareTrees, double* results);
   }                       
 }
 
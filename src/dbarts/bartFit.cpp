@@ -1,7 +1,7 @@
 #include "config.hpp"
 #include <dbarts/bartFit.hpp>
 
-#include <cmath>     // sqrt
+#include <cmath>     // sqrt, pow
 #include <cstring>   // memcpy
 #include <cstddef>   // size_t
 
@@ -21,6 +21,8 @@
 #include <set>       // used to sort and find 
 #include <vector>    //   split points
 #include <algorithm> // integer min
+#include <utility>   // pair
+#include <map>       // leaf co-occurrences
 
 #include <external/alloca.h>
 #include <external/io.h>
@@ -29,17 +31,26 @@
 #include <external/stats_mt.h>
 #include <external/linearAlgebra.h>
 
+#include <dbarts/leafCooccurrences.hpp>
 #include <dbarts/results.hpp>
+#include "compressedSample.hpp"
 #include "functions.hpp"
 #include "tree.hpp"
 
 using std::size_t;
 using std::uint32_t;
+using std::uint64_t;
 
 namespace {
   using namespace dbarts;
 
+  struct TreeSizes;
+  void applyMemoryBudget(Control& control, const Data& data, const TreeSizes& treeSizes);
   void allocateMemory(BARTFit& fit);
+  void allocateSplitProbabilities(BARTFit& fit);
+  void setObservationOrder(BARTFit& fit);
+  void permuteObservations(BARTFit& fit);
+  void transposePredictors(BARTFit& fit);
   void createRNG(BARTFit& fit);
   void destroyRNG(BARTFit& fit);
   void setInitialCutPoints(BARTFit& fit);
@@ -48,11 +59,14 @@ namespace {
   void setPrior(BARTFit& fit);
   
   void setCutPoints(BARTFit& fit, const size_t* columns, size_t numColumns);
-  void setCutPointsFromQuantiles(BARTFit& fit, const double* x, uint32_t maxNumCuts,
+  const double* getPredictorColumn(const BARTFit& fit, size_t column, std::vector<double>& sparseColumn, size_t& length);
+  void setCutPointsFromQuantiles(BARTFit& fit, const double* x, size_t length, uint32_t maxNumCuts,
                                  uint32_t& numCutsPerVariable, double*& cutPoints,
                                  std::set<double>& uniqueElements, std::vector<double>& sortedElements);
-  void setCutPointsUniformly(BARTFit& fit, const double* x, uint32_t maxNumCuts,
+  void setCutPointsUniformly(BARTFit& fit, const double* x, size_t length, uint32_t maxNumCuts,
                              uint32_t& numCutsPerVariable, double*& cutPoints);
+  void setCategories(BARTFit& fit, const double* x, size_t length, uint32_t& numCutsPerVariable, double*& cutPoints);
+  bool columnHasMissingValues(const double* x, size_t length);
   
   void printInitialSummary(const BARTFit& fit);
   void printTerminalSummary(const BARTFit& fit);
@@ -123,6 +137,7 @@ namespace dbarts {
       double priorUnscaled = model.sigmaSqPrior->getScale() * sharedScratch.dataScale.range * sharedScratch.dataScale.range;
       
       data.y = newY;
+      permuteObservations(*this);
       
       rescaleResponse(*this);
       
@@ -135,6 +150,7 @@ namespace dbarts {
      
     } else {
       data.y = newY;
+      permuteObservations(*this);
       
       for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum)
         sampleProbitLatentVariables(*this, state[chainNum], const_cast<const double*>(chainScratch[chainNum].totalFits), chainScratch[chainNum].probitLatents);
@@ -152,6 +168,7 @@ namespace dbarts {
       double priorUnscaled = model.sigmaSqPrior->getScale() * sharedScratch.dataScale.range * sharedScratch.dataScale.range;
       
       data.offset = newOffset;
+      permuteObservations(*this);
       
       rescaleResponse(*this);
       
@@ -164,6 +181,7 @@ namespace dbarts {
       
     } else {
       data.offset = newOffset;
+      permuteObservations(*this);
       
       for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum)
         sampleProbitLatentVariables(*this, state[chainNum], const_cast<const double*>(chainScratch[chainNum].totalFits), chainScratch[chainNum].probitLatents);
@@ -234,8 +252,468 @@ updateTreesWithNewPredictor_cleanup:
   }
 }
 
+namespace {
+  using namespace dbarts;
+  
+  struct PredictionSummaryData {
+    const BARTFit* fit;
+    const double* x_test;
+    size_t numTestObservations;
+    const double* testOffset;
+    bool includeMean;
+    bool includeVariance;
+    const double* quantiles;
+    size_t numQuantiles;
+    double* result;
+    
+    size_t blockSize;
+    size_t numBlocks;
+    size_t numTasks;
+    // by (chainNum * numSamples + sampleNum) * numTrees + treeNum; NULL when samples are compressed,
+    // in which case each is decoded as the blocks are visited and only one task is run
+    const double* const* nodePredictions;
+  };
+  struct PredictionSummaryTaskData {
+    const PredictionSummaryData* shared;
+    size_t taskNum;
+  };
+  
+  void summarizePredictionBlock(const PredictionSummaryData& data, size_t blockStart, size_t blockLength,
+                                double* xt, double* totalFits, double* draws, double* means, double* sumsOfSquares,
+                                size_t** observationNodeMaps, const Tree** mappedTrees);
+}
+
+extern "C" void predictionSummaryTask(std::size_t, void* v_data)
+{
+  PredictionSummaryTaskData& taskData(*static_cast<PredictionSummaryTaskData*>(v_data));
+  const PredictionSummaryData& data(*taskData.shared);
+  const BARTFit& fit(*data.fit);
+  
+  size_t numTrees = fit.control.numTrees;
+  size_t numDraws = fit.currentNumSamples * fit.control.numChains;
+  bool keepDraws = data.numQuantiles > 0;
+  
+  double* xt            = new double[data.blockSize * fit.data.numPredictors];
+  double* totalFits     = new double[data.blockSize];
+  double* draws         = keepDraws ? new double[data.blockSize * numDraws] : NULL;
+  double* means         = keepDraws ? NULL : new double[data.blockSize];
+  double* sumsOfSquares = keepDraws ? NULL : new double[data.blockSize];
+  
+  size_t** observationNodeMaps = new size_t*[numTrees];
+  const Tree** mappedTrees = new const Tree*[numTrees];
+  for (size_t treeNum = 0; treeNum < numTrees; ++treeNum) observationNodeMaps[treeNum] = NULL;
+  
+  for (size_t blockNum = taskData.taskNum; blockNum < data.numBlocks; blockNum += data.numTasks) {
+    size_t blockStart = blockNum * data.blockSize;
+    size_t blockLength = blockStart + data.blockSize <= data.numTestObservations ? data.blockSize : data.numTestObservations - blockStart;
+    
+    summarizePredictionBlock(data, blockStart, blockLength, xt, totalFits, draws, means, sumsOfSquares,
+                             observationNodeMaps, mappedTrees);
+  }
+  
+  for (size_t treeNum = 0; treeNum < numTrees; ++treeNum) delete [] observationNodeMaps[treeNum];
+  delete [] mappedTrees;
+  delete [] observationNodeMaps;
+  
+  delete [] sumsOfSquares;
+  delete [] means;
+  delete [] draws;
+  delete [] totalFits;
+  delete [] xt;
+}
+
+namespace {
+  void summarizePredictionBlock(const PredictionSummaryData& data, size_t blockStart, size_t blockLength,
+                                double* xt, double* totalFits, double* draws, double* means, double* sumsOfSquares,
+                                size_t** observationNodeMaps, const Tree** mappedTrees)
+  {
+    const BARTFit& fit(*data.fit);
+    size_t numPredictors = fit.data.numPredictors;
+    size_t numTrees      = fit.control.numTrees;
+    size_t numSamples    = fit.currentNumSamples;
+    size_t numDraws      = numSamples * fit.control.numChains;
+    
+    for (size_t i = 0; i < blockLength; ++i)
+      for (size_t j = 0; j < numPredictors; ++j)
+        xt[i * numPredictors + j] = data.x_test[blockStart + i + j * data.numTestObservations];
+    
+    // maps from the previous block are for other observations
+    for (size_t treeNum = 0; treeNum < numTrees; ++treeNum) {
+      delete [] observationNodeMaps[treeNum];
+      observationNodeMaps[treeNum] = NULL;
+      mappedTrees[treeNum] = NULL;
+    }
+    
+    double center = fit.sharedScratch.dataScale.range * 0.5 + fit.sharedScratch.dataScale.min;
+    double scale  = fit.sharedScratch.dataScale.range;
+    
+    size_t drawNum = 0;
+    for (size_t chainNum = 0; chainNum < fit.control.numChains; ++chainNum) {
+      for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum) {
+        bool samplesAreCompressed = data.nodePredictions == NULL;
+        if (samplesAreCompressed) fit.state[chainNum].decompressSample(fit, sampleNum, false);
+        
+        ext_setVectorToConstant(totalFits, blockLength, 0.0);
+        
+        for (size_t treeNum = 0; treeNum < numTrees; ++treeNum) {
+          Tree& tree(fit.state[chainNum].savedTrees[sampleNum][treeNum]);
+          
+          const double* nodePosteriorPredictions = samplesAreCompressed ?
+            tree.recoverAveragesFromNodes() :
+            data.nodePredictions[(chainNum * numSamples + sampleNum) * numTrees + treeNum];
+          
+          if (samplesAreCompressed || mappedTrees[treeNum] == NULL || !tree.hasSameStructureAs(*mappedTrees[treeNum])) {
+            delete [] observationNodeMaps[treeNum];
+            observationNodeMaps[treeNum] = samplesAreCompressed ?
+              tree.mapObservationsToBottomNodes(fit, xt, blockLength) :
+              tree.mapObservationsToEnumeratedBottomNodes(fit, xt, blockLength);
+            mappedTrees[treeNum] = &tree;
+          }
+          
+          const size_t* observationNodeMap = observationNodeMaps[treeNum];
+          for (size_t i = 0; i < blockLength; ++i) totalFits[i] += nodePosteriorPredictions[observationNodeMap[i]];
+          
+          if (samplesAreCompressed) delete [] nodePosteriorPredictions;
+        }
+        
+        for (size_t i = 0; i < blockLength; ++i) {
+          double prediction = center + scale * totalFits[i] + (data.testOffset != NULL ? data.testOffset[blockStart + i] : 0.0);
+          if (draws != NULL) {
+            draws[i * numDraws + drawNum] = prediction;
+          } else if (drawNum == 0) {
+            means[i] = prediction;
+            sumsOfSquares[i] = 0.0;
+          } else {
+            // Welford's update
+            double delta = prediction - means[i];
+            means[i] += delta / static_cast<double>(drawNum + 1);
+            sumsOfSquares[i] += delta * (prediction - means[i]);
+          }
+        }
+        ++drawNum;
+      }
+    }
+    
+    for (size_t i = 0; i < blockLength; ++i) {
+      double mean, sumOfSquares = 0.0;
+      if (draws != NULL) {
+        double* rowDraws = draws + i * numDraws;
+        mean = ext_computeMean(rowDraws, numDraws);
+        if (data.includeVariance)
+          for (size_t j = 0; j < numDraws; ++j) sumOfSquares += (rowDraws[j] - mean) * (rowDraws[j] - mean);
+      } else {
+        mean = means[i];
+        sumOfSquares = sumsOfSquares[i];
+      }
+      
+      double* result_i = data.result + blockStart + i;
+      if (data.includeMean) {
+        *result_i = mean;
+        result_i += data.numTestObservations;
+      }
+      if (data.includeVariance) {
+        *result_i = numDraws > 1 ? sumOfSquares / static_cast<double>(numDraws - 1) : 0.0;
+        result_i += data.numTestObservations;
+      }
+      
+      if (data.numQuantiles > 0) {
+        // interpolates between order statistics, as in R's default quantile type
+        double* rowDraws = draws + i * numDraws;
+        std::sort(rowDraws, rowDraws + numDraws);
+        for (size_t j = 0; j < data.numQuantiles; ++j) {
+          double position = data.quantiles[j] * static_cast<double>(numDraws - 1);
+          size_t lower = static_cast<size_t>(position);
+          size_t upper = lower + 1 < numDraws ? lower + 1 : lower;
+          *result_i = rowDraws[lower] + (position - static_cast<double>(lower)) * (rowDraws[upper] - rowDraws[lower]);
+          result_i += data.numTestObservations;
+        }
+      }
+    }
+  }
+}
+
+namespace {
+  using namespace dbarts;
+  
+  // Leaf memberships are found for a batch of draws at a time. Each tree's column of memberships
+  // is also sorted by leaf, so that the observations sharing a leaf can be listed.
+  struct LeafMembershipData {
+    const BARTFit* fit;
+    const double* xt;
+    size_t numTestObservations;
+    size_t firstDraw;
+    size_t numDraws;
+    size_t numTasks;
+    bool samplesAreCompressed;
+    
+    uint16_t* memberships;  // numTestObservations x numTrees x numDraws
+    uint32_t* sortedRows;   // as above, or NULL to skip sorting
+    uint32_t* sortedStarts; // for each observation, where its leaf starts in sortedRows
+    uint32_t* sortedEnds;   //   and ends
+    
+    bool tooManyLeaves;
+  };
+  // each task flags its own trees with too many leaves, which are combined once all have finished
+  struct LeafMembershipTaskData {
+    LeafMembershipData* shared;
+    size_t taskNum;
+    bool tooManyLeaves;
+  };
+  
+  // rows are interleaved across tasks, as those with low indices have more partners
+  struct LeafCooccurrenceTaskData {
+    const LeafMembershipData* memberships;
+    size_t taskNum;
+    size_t numTasks;
+    std::map<uint32_t, uint32_t>* partnerCounts; // for each observation, of those with higher indices
+  };
+  
+  bool findLeafMembershipsForDraw(const LeafMembershipData& data, size_t drawNum);
+}
+
+extern "C" void leafMembershipTask(std::size_t, void* v_data)
+{
+  LeafMembershipTaskData& taskData(*static_cast<LeafMembershipTaskData*>(v_data));
+  const LeafMembershipData& data(*taskData.shared);
+  
+  for (size_t drawNum = taskData.taskNum; drawNum < data.numDraws; drawNum += data.numTasks)
+    if (!findLeafMembershipsForDraw(data, drawNum)) taskData.tooManyLeaves = true;
+}
+
+extern "C" void leafCooccurrenceTask(std::size_t, void* v_data)
+{
+  LeafCooccurrenceTaskData& taskData(*static_cast<LeafCooccurrenceTaskData*>(v_data));
+  const LeafMembershipData& data(*taskData.memberships);
+  
+  size_t numColumns = data.fit->control.numTrees * data.numDraws;
+  size_t numObservations = data.numTestObservations;
+  
+  for (size_t columnNum = 0; columnNum < numColumns; ++columnNum) {
+    const uint32_t* sortedRows   = data.sortedRows   + columnNum * numObservations;
+    const uint32_t* sortedStarts = data.sortedStarts + columnNum * numObservations;
+    const uint32_t* sortedEnds   = data.sortedEnds   + columnNum * numObservations;
+    
+    for (size_t i = taskData.taskNum; i < numObservations; i += taskData.numTasks) {
+      // rows are sorted within each leaf, so the partners with higher indices come last
+      const uint32_t* partner = std::upper_bound(sortedRows + sortedStarts[i], sortedRows + sortedEnds[i], static_cast<uint32_t>(i));
+      std::map<uint32_t, uint32_t>& partnerCounts(taskData.partnerCounts[i]);
+      for ( ; partner != sortedRows + sortedEnds[i]; ++partner) ++partnerCounts[*partner];
+    }
+  }
+}
+
+namespace {
+  // returns false if any tree in the draw has too many leaves to number
+  bool findLeafMembershipsForDraw(const LeafMembershipData& data, size_t drawNum)
+  {
+    const BARTFit& fit(*data.fit);
+    size_t numTrees = fit.control.numTrees;
+    size_t numObservations = data.numTestObservations;
+    
+    size_t chainNum  = (data.firstDraw + drawNum) / fit.currentNumSamples;
+    size_t sampleNum = (data.firstDraw + drawNum) % fit.currentNumSamples;
+    if (data.samplesAreCompressed) fit.state[chainNum].decompressSample(fit, sampleNum, false);
+    
+    bool allNumbered = true;
+    for (size_t treeNum = 0; treeNum < numTrees; ++treeNum) {
+      const Tree& tree(fit.state[chainNum].savedTrees[sampleNum][treeNum]);
+      size_t columnOffset = (drawNum * numTrees + treeNum) * numObservations;
+      
+      size_t numLeaves = tree.getNumBottomNodes();
+      if (numLeaves > static_cast<size_t>(static_cast<uint16_t>(-1)) + 1) {
+        allNumbered = false;
+        continue;
+      }
+      
+      size_t* observationNodeMap = data.samplesAreCompressed ?
+        const_cast<Tree&>(tree).mapObservationsToBottomNodes(fit, data.xt, numObservations) :
+        tree.mapObservationsToEnumeratedBottomNodes(fit, data.xt, numObservations);
+      
+      uint16_t* memberships = data.memberships + columnOffset;
+      for (size_t i = 0; i < numObservations; ++i) memberships[i] = static_cast<uint16_t>(observationNodeMap[i]);
+      delete [] observationNodeMap;
+      
+      if (data.sortedRows == NULL) continue;
+      
+      // counting sort, which keeps the rows of each leaf in increasing order
+      uint32_t* leafStarts = new uint32_t[numLeaves + 1];
+      for (size_t leafNum = 0; leafNum <= numLeaves; ++leafNum) leafStarts[leafNum] = 0;
+      for (size_t i = 0; i < numObservations; ++i) ++leafStarts[memberships[i] + 1];
+      for (size_t leafNum = 0; leafNum < numLeaves; ++leafNum) leafStarts[leafNum + 1] += leafStarts[leafNum];
+      
+      uint32_t* sortedRows   = data.sortedRows   + columnOffset;
+      uint32_t* sortedStarts = data.sortedStarts + columnOffset;
+      uint32_t* sortedEnds   = data.sortedEnds   + columnOffset;
+      for (size_t i = 0; i < numObservations; ++i) {
+        sortedStarts[i] = leafStarts[memberships[i]];
+        sortedEnds[i]   = leafStarts[memberships[i] + 1];
+      }
+      for (size_t i = 0; i < numObservations; ++i) sortedRows[leafStarts[memberships[i]]++] = static_cast<uint32_t>(i);
+      
+      delete [] leafStarts;
+    }
+    
+    return allNumbered;
+  }
+  
+  // bottom nodes of uncompressed samples are enumerated up front, so that tasks only read the trees
+  void runLeafMembershipTasks(const BARTFit& fit, LeafMembershipData& data)
+  {
+    data.numTasks = 1;
+    if (fit.threadManager != NULL && !data.samplesAreCompressed && data.numDraws > 1)
+      data.numTasks = fit.control.numThreads < data.numDraws ? fit.control.numThreads : data.numDraws;
+    
+    if (data.numTasks <= 1) {
+      LeafMembershipTaskData taskData = { &data, 0, false };
+      leafMembershipTask(static_cast<size_t>(-1), &taskData);
+      data.tooManyLeaves = taskData.tooManyLeaves;
+      return;
+    }
+    
+    LeafMembershipTaskData* taskData = new LeafMembershipTaskData[data.numTasks];
+    void** taskDataPtrs = new void*[data.numTasks];
+    for (size_t taskNum = 0; taskNum < data.numTasks; ++taskNum) {
+      taskData[taskNum].shared = &data;
+      taskData[taskNum].taskNum = taskNum;
+      taskData[taskNum].tooManyLeaves = false;
+      taskDataPtrs[taskNum] = &taskData[taskNum];
+    }
+    
+    ext_htm_runTopLevelTasks(fit.threadManager, &leafMembershipTask, taskDataPtrs, data.numTasks);
+    
+    data.tooManyLeaves = false;
+    for (size_t taskNum = 0; taskNum < data.numTasks; ++taskNum)
+      if (taskData[taskNum].tooManyLeaves) data.tooManyLeaves = true;
+    
+    delete [] taskDataPtrs;
+    delete [] taskData;
+  }
+  
+  void enumerateSavedBottomNodes(const BARTFit& fit)
+  {
+    if (fit.state[0].compressedSamples != NULL) return;
+    for (size_t chainNum = 0; chainNum < fit.control.numChains; ++chainNum)
+      for (size_t sampleNum = 0; sampleNum < fit.currentNumSamples; ++sampleNum)
+        for (size_t treeNum = 0; treeNum < fit.control.numTrees; ++treeNum)
+          fit.state[chainNum].savedTrees[sampleNum][treeNum].top.enumerateBottomNodes();
+  }
+}
+
 namespace dbarts {
   
+  void BARTFit::getLeafMemberships(const double* x_test, size_t numTestObservations, uint16_t* result) const
+  {
+    if (!control.keepTrees) ext_throwError("leaf memberships require 'keepTrees' to be true");
+    if (numTestObservations == 0 || currentNumSamples == 0) return;
+    
+    double* xt = new double[numTestObservations * data.numPredictors];
+    ext_transposeMatrix(x_test, numTestObservations, data.numPredictors, xt);
+    
+    enumerateSavedBottomNodes(*this);
+    
+    LeafMembershipData membershipData = { this, xt, numTestObservations, 0, currentNumSamples * control.numChains, 1,
+                                          state[0].compressedSamples != NULL, result, NULL, NULL, NULL, false };
+    runLeafMembershipTasks(*this, membershipData);
+    
+    delete [] xt;
+    
+    if (membershipData.tooManyLeaves) ext_throwError("tree has too many leaves to number with 16 bits");
+  }
+  
+  LeafCooccurrences* BARTFit::getLeafCooccurrences(const double* x_test, size_t numTestObservations, size_t minCount) const
+  {
+    if (!control.keepTrees) ext_throwError("leaf co-occurrences require 'keepTrees' to be true");
+    if (numTestObservations > static_cast<size_t>(static_cast<uint32_t>(-1)))
+      ext_throwError("leaf co-occurrences are limited to 2^32 - 1 observations");
+    
+    size_t numDraws = currentNumSamples * control.numChains;
+    size_t numTreeSamples = numDraws * control.numTrees;
+    
+    std::map<uint32_t, uint32_t>* partnerCounts = new std::map<uint32_t, uint32_t>[numTestObservations > 0 ? numTestObservations : 1];
+    bool tooManyLeaves = false;
+    
+    if (numTestObservations > 0 && numDraws > 0) {
+      double* xt = new double[numTestObservations * data.numPredictors];
+      ext_transposeMatrix(x_test, numTestObservations, data.numPredictors, xt);
+      
+      enumerateSavedBottomNodes(*this);
+      
+      // batches hold around 64 MB of memberships and their sorts
+      size_t bytesPerDraw = numTestObservations * control.numTrees * (sizeof(uint16_t) + 3 * sizeof(uint32_t));
+      size_t batchSize = (static_cast<size_t>(1) << 26) / bytesPerDraw;
+      if (batchSize == 0) batchSize = 1;
+      if (batchSize > numDraws) batchSize = numDraws;
+      
+      size_t batchLength = numTestObservations * control.numTrees * batchSize;
+      uint16_t* memberships  = new uint16_t[batchLength];
+      uint32_t* sortedRows   = new uint32_t[batchLength];
+      uint32_t* sortedStarts = new uint32_t[batchLength];
+      uint32_t* sortedEnds   = new uint32_t[batchLength];
+      
+      size_t numAccumulationTasks = threadManager != NULL && numTestObservations > 1 ?
+        (control.numThreads < numTestObservations ? control.numThreads : numTestObservations) : 1;
+      LeafCooccurrenceTaskData* accumulationData = new LeafCooccurrenceTaskData[numAccumulationTasks];
+      void** accumulationDataPtrs = new void*[numAccumulationTasks];
+      
+      for (size_t firstDraw = 0; firstDraw < numDraws && !tooManyLeaves; firstDraw += batchSize) {
+        LeafMembershipData membershipData = { this, xt, numTestObservations, firstDraw,
+                                              firstDraw + batchSize <= numDraws ? batchSize : numDraws - firstDraw, 1,
+                                              state[0].compressedSamples != NULL,
+                                              memberships, sortedRows, sortedStarts, sortedEnds, false };
+        runLeafMembershipTasks(*this, membershipData);
+        tooManyLeaves = membershipData.tooManyLeaves;
+        if (tooManyLeaves) break;
+        
+        for (size_t taskNum = 0; taskNum < numAccumulationTasks; ++taskNum) {
+          LeafCooccurrenceTaskData taskData = { &membershipData, taskNum, numAccumulationTasks, partnerCounts };
+          accumulationData[taskNum] = taskData;
+          accumulationDataPtrs[taskNum] = &accumulationData[taskNum];
+        }
+        if (numAccumulationTasks <= 1)
+          leafCooccurrenceTask(static_cast<size_t>(-1), accumulationDataPtrs[0]);
+        else
+          ext_htm_runTopLevelTasks(threadManager, &leafCooccurrenceTask, accumulationDataPtrs, numAccumulationTasks);
+      }
+      
+      delete [] accumulationDataPtrs;
+      delete [] accumulationData;
+      delete [] sortedEnds;
+      delete [] sortedStarts;
+      delete [] sortedRows;
+      delete [] memberships;
+      delete [] xt;
+    }
+    
+    if (tooManyLeaves) {
+      delete [] partnerCounts;
+      ext_throwError("tree has too many leaves to number with 16 bits");
+    }
+    
+    size_t numPairs = 0;
+    for (size_t i = 0; i < numTestObservations; ++i) {
+      for (std::map<uint32_t, uint32_t>::const_iterator it = partnerCounts[i].begin(); it != partnerCounts[i].end(); ++it)
+        if (it->second >= minCount) ++numPairs;
+    }
+    
+    LeafCooccurrences* result = new LeafCooccurrences(numTestObservations, numTreeSamples, numPairs);
+    size_t pairNum = 0;
+    for (size_t i = 0; i < numTestObservations; ++i) {
+      for (std::map<uint32_t, uint32_t>::const_iterator it = partnerCounts[i].begin(); it != partnerCounts[i].end(); ++it) {
+        if (it->second < minCount) continue;
+        result->rows[pairNum]    = static_cast<uint32_t>(i);
+        result->columns[pairNum] = it->first;
+        result->counts[pairNum]  = it->second;
+        ++pairNum;
+      }
+      // released as they are copied, since together they can be much larger than the result
+      std::map<uint32_t, uint32_t>().swap(partnerCounts[i]);
+    }
+    
+    delete [] partnerCounts;
+    
+    return result;
+  }
+  
   void BARTFit::predict(const double* x_test, size_t numTestObservations, const double* testOffset, double* result) const
   {
     double* xt_test = new double[numTestObservations * data.numPredictors];
@@ -246,19 +724,42 @@ namespace dbarts {
     
     ext_transposeMatrix(x_test, numTestObservations, data.numPredictors, xt_test);
     
+    // Most saved trees have the same splits as the previous sample of that tree and differ only
+    // in their leaf values, so the test observations are routed once per distinct structure and
+    // the bottom node map is reused for as long as the structure repeats.
+    size_t** observationNodeMaps = new size_t*[control.numTrees];
+    const Tree** mappedTrees = new const Tree*[control.numTrees];
+    for (size_t treeNum = 0; treeNum < control.numTrees; ++treeNum) {
+      observationNodeMaps[treeNum] = NULL;
+      mappedTrees[treeNum] = NULL;
+    }
+    
     for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum) {
       for (size_t sampleNum = 0; sampleNum < currentNumSamples; ++sampleNum) {
         
         ext_setVectorToConstant(totalTestFits, numTestObservations, 0.0);
         
+        // compressed samples are decoded into the same storage each time, so there is no
+        // earlier tree to compare against
+        bool samplesAreCompressed = state[chainNum].compressedSamples != NULL;
+        state[chainNum].decompressSample(*this, sampleNum, false);
+        
         for (size_t treeNum = 0; treeNum < control.numTrees; ++treeNum) {
-          size_t treeOffset = treeNum + sampleNum * control.numTrees;
-          const double* treeFits = state[chainNum].savedTreeFits + treeOffset * data.numObservations;
+          Tree& tree(state[chainNum].savedTrees[sampleNum][treeNum]);
           
-          const double* nodePosteriorPredictions = state[chainNum].savedTrees[treeOffset].recoverAveragesFromFits(*this, treeFits);
+          const double* nodePosteriorPredictions = samplesAreCompressed ?
+            tree.recoverAveragesFromNodes() :
+            tree.recoverAveragesFromFits(*this, state[chainNum].savedTreeFits[sampleNum] + treeNum * data.numObservations);
+          
+          if (samplesAreCompressed || mappedTrees[treeNum] == NULL || !tree.hasSameStructureAs(*mappedTrees[treeNum])) {
+            delete [] observationNodeMaps[treeNum];
+            observationNodeMaps[treeNum] = tree.mapObservationsToBottomNodes(*this, xt_test, numTestObservations);
+            mappedTrees[treeNum] = &tree;
+          }
+          
+          const size_t* observationNodeMap = observationNodeMaps[treeNum];
+          for (size_t i = 0; i < numTestObservations; ++i) currTestFits[i] = nodePosteriorPredictions[observationNodeMap[i]];
           
-          state[chainNum].savedTrees[treeOffset].setCurrentFitsFromAverages(*this, nodePosteriorPredictions, xt_test, numTestObservations, currTestFits);
-      
           ext_addVectorsInPlace(const_cast<const double*>(currTestFits), numTestObservations, 1.0, totalTestFits);
           
           delete [] nodePosteriorPredictions;
@@ -271,14 +772,195 @@ namespace dbarts {
       }
     }
     
+    for (size_t treeNum = 0; treeNum < control.numTrees; ++treeNum) delete [] observationNodeMaps[treeNum];
+    delete [] mappedTrees;
+    delete [] observationNodeMaps;
+    
     delete [] totalTestFits;
     delete [] currTestFits;
     delete [] xt_test;
   }
+  
+  void BARTFit::predictSummaries(const double* x_test, size_t numTestObservations, const double* testOffset,
+                                 bool includeMean, bool includeVariance, const double* quantiles, size_t numQuantiles,
+                                 double* result) const
+  {
+    if (!control.keepTrees) ext_throwError("predict requires 'keepTrees' to be true");
+    if (numTestObservations == 0 || currentNumSamples == 0) return;
+    
+    size_t numDraws = currentNumSamples * control.numChains;
+    
+    // blocks are sized so that their draws, when kept for quantiles, are around 8 MB
+    size_t blockSize = 4096;
+    if (numQuantiles > 0 && blockSize * numDraws > (static_cast<size_t>(1) << 20))
+      blockSize = numDraws < (static_cast<size_t>(1) << 20) ? (static_cast<size_t>(1) << 20) / numDraws : 1;
+    if (blockSize > numTestObservations) blockSize = numTestObservations;
+    
+    // leaf values are recovered and bottom nodes enumerated once, so that tasks only read the trees
+    bool samplesAreCompressed = state[0].compressedSamples != NULL;
+    double** nodePredictions = NULL;
+    if (!samplesAreCompressed) {
+      nodePredictions = new double*[numDraws * control.numTrees];
+      for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum) {
+        for (size_t sampleNum = 0; sampleNum < currentNumSamples; ++sampleNum) {
+          for (size_t treeNum = 0; treeNum < control.numTrees; ++treeNum) {
+            Tree& tree(state[chainNum].savedTrees[sampleNum][treeNum]);
+            nodePredictions[(chainNum * currentNumSamples + sampleNum) * control.numTrees + treeNum] =
+              tree.recoverAveragesFromFits(*this, state[chainNum].savedTreeFits[sampleNum] + treeNum * data.numObservations);
+            tree.top.enumerateBottomNodes();
+          }
+        }
+      }
+    }
+    
+    PredictionSummaryData summaryData = { this, x_test, numTestObservations, testOffset,
+                                          includeMean, includeVariance, quantiles, numQuantiles, result,
+                                          blockSize, (numTestObservations + blockSize - 1) / blockSize, 1,
+                                          const_cast<const double* const*>(nodePredictions) };
+    
+    if (threadManager == NULL || samplesAreCompressed || summaryData.numBlocks <= 1) {
+      PredictionSummaryTaskData taskData = { &summaryData, 0 };
+      predictionSummaryTask(static_cast<size_t>(-1), &taskData);
+    } else {
+      summaryData.numTasks = control.numThreads < summaryData.numBlocks ? control.numThreads : summaryData.numBlocks;
+      
+      PredictionSummaryTaskData* taskData = new PredictionSummaryTaskData[summaryData.numTasks];
+      void** taskDataPtrs = new void*[summaryData.numTasks];
+      for (size_t taskNum = 0; taskNum < summaryData.numTasks; ++taskNum) {
+        taskData[taskNum].shared = &summaryData;
+        taskData[taskNum].taskNum = taskNum;
+        taskDataPtrs[taskNum] = &taskData[taskNum];
+      }
+      
+      ext_htm_runTopLevelTasks(threadManager, &predictionSummaryTask, taskDataPtrs, summaryData.numTasks);
+      
+      delete [] taskDataPtrs;
+      delete [] taskData;
+    }
+    
+    if (nodePredictions != NULL) {
+      for (size_t i = 0; i < numDraws * control.numTrees; ++i) delete [] nodePredictions[i];
+      delete [] nodePredictions;
+    }
+  }
+  
+  void BARTFit::predictApproximateMeans(const double* x_test, size_t numTestObservations, const double* testOffset,
+                                        const size_t* drawOrder, size_t minNumDraws,
+                                        double absoluteTolerance, double relativeTolerance,
+                                        double* means, double* standardErrors, size_t* numDrawsUsed) const
+  {
+    if (!control.keepTrees) ext_throwError("predict requires 'keepTrees' to be true");
+    
+    size_t numDraws = currentNumSamples * control.numChains;
+    if (numTestObservations == 0 || numDraws == 0) return;
+    
+    // a variance needs two draws
+    if (minNumDraws < 2) minNumDraws = 2;
+    if (minNumDraws > numDraws) minNumDraws = numDraws;
+    
+    // rows that have converged are dropped from the transposed predictors, so that later draws only
+    // route those still active
+    double* xt = new double[numTestObservations * data.numPredictors];
+    size_t* activeRows = new size_t[numTestObservations];
+    double* sumsOfSquares = new double[numTestObservations];
+    double* totalFits = new double[numTestObservations];
+    
+    ext_transposeMatrix(x_test, numTestObservations, data.numPredictors, xt);
+    for (size_t i = 0; i < numTestObservations; ++i) {
+      activeRows[i] = i;
+      means[i] = 0.0;
+      sumsOfSquares[i] = 0.0;
+    }
+    size_t numActiveRows = numTestObservations;
+    
+    double center = sharedScratch.dataScale.range * 0.5 + sharedScratch.dataScale.min;
+    double N = static_cast<double>(numDraws);
+    
+    size_t numDrawsDone = 0;
+    size_t targetNumDraws = minNumDraws;
+    while (true) {
+      for ( ; numDrawsDone < targetNumDraws; ++numDrawsDone) {
+        size_t chainNum  = drawOrder[numDrawsDone] / currentNumSamples;
+        size_t sampleNum = drawOrder[numDrawsDone] % currentNumSamples;
+        
+        bool samplesAreCompressed = state[chainNum].compressedSamples != NULL;
+        state[chainNum].decompressSample(*this, sampleNum, false);
+        
+        ext_setVectorToConstant(totalFits, numActiveRows, 0.0);
+        for (size_t treeNum = 0; treeNum < control.numTrees; ++treeNum) {
+          Tree& tree(state[chainNum].savedTrees[sampleNum][treeNum]);
+          
+          const double* nodePosteriorPredictions = samplesAreCompressed ?
+            tree.recoverAveragesFromNodes() :
+            tree.recoverAveragesFromFits(*this, state[chainNum].savedTreeFits[sampleNum] + treeNum * data.numObservations);
+          size_t* observationNodeMap = tree.mapObservationsToBottomNodes(*this, xt, numActiveRows);
+          
+          for (size_t i = 0; i < numActiveRows; ++i) totalFits[i] += nodePosteriorPredictions[observationNodeMap[i]];
+          
+          delete [] observationNodeMap;
+          delete [] nodePosteriorPredictions;
+        }
+        
+        double n = static_cast<double>(numDrawsDone + 1);
+        for (size_t i = 0; i < numActiveRows; ++i) {
+          size_t row = activeRows[i];
+          double draw = center + sharedScratch.dataScale.range * totalFits[i];
+          double delta = draw - means[row];
+          means[row] += delta / n;
+          sumsOfSquares[row] += delta * (draw - means[row]);
+        }
+      }
+      
+      double n = static_cast<double>(numDrawsDone);
+      double maxNumDrawsRequired = 0.0;
+      size_t numStillActive = 0;
+      for (size_t i = 0; i < numActiveRows; ++i) {
+        size_t row = activeRows[i];
+        
+        double variance = sumsOfSquares[row] / (n - 1.0);
+        double standardError = numDrawsDone >= numDraws ? 0.0 : std::sqrt(variance / n * (N - n) / (N - 1.0));
+        standardErrors[row] = standardError;
+        numDrawsUsed[row] = numDrawsDone;
+        
+        double tolerance = absoluteTolerance +
+          relativeTolerance * std::fabs(means[row] + (testOffset != NULL ? testOffset[row] : 0.0));
+        if (standardError <= tolerance) continue;
+        
+        // smallest n with variance / n * (N - n) / (N - 1) <= tolerance^2
+        double numDrawsRequired = variance * N / (tolerance * tolerance * (N - 1.0) + variance);
+        if (numDrawsRequired > maxNumDrawsRequired) maxNumDrawsRequired = numDrawsRequired;
+        
+        if (numStillActive != i) {
+          activeRows[numStillActive] = row;
+          std::memmove(xt + numStillActive * data.numPredictors, xt + i * data.numPredictors, data.numPredictors * sizeof(double));
+        }
+        ++numStillActive;
+      }
+      numActiveRows = numStillActive;
+      
+      if (numActiveRows == 0 || numDrawsDone >= numDraws) break;
+      
+      // aims for the slowest row, but grows by at most a factor of two so that an early, noisy
+      // variance estimate doesn't commit to evaluating every draw
+      size_t nextNumDraws = static_cast<size_t>(std::ceil(maxNumDrawsRequired));
+      if (nextNumDraws > 2 * numDrawsDone) nextNumDraws = 2 * numDrawsDone;
+      if (nextNumDraws <= numDrawsDone) nextNumDraws = numDrawsDone + 1;
+      targetNumDraws = nextNumDraws < numDraws ? nextNumDraws : numDraws;
+    }
+    
+    if (testOffset != NULL) ext_addVectorsInPlace(testOffset, numTestObservations, 1.0, means);
+    
+    delete [] totalFits;
+    delete [] sumsOfSquares;
+    delete [] activeRows;
+    delete [] xt;
+  }
 
   // this can leave the tree structures in an invalid state and doesn't roll-back
   bool BARTFit::setPredictor(const double* newPredictor)
   {
+    if (data.predictorsAreSparse()) ext_throwError("sparse predictors cannot be replaced by a dense matrix");
+    
     size_t* columns = ext_stackAllocate(data.numPredictors, size_t);
     for (size_t i = 0; i < data.numPredictors; ++i) columns[i] = i;
     
@@ -286,9 +968,10 @@ namespace dbarts {
     
     ext_stackFree(columns);
     
+    // the observation order is kept, as the trees' observation indices follow it
     data.x = newPredictor;
     
-    ext_transposeMatrix(data.x, data.numObservations, data.numPredictors, const_cast<double*>(sharedScratch.xt));
+    transposePredictors(*this);
     
     return updateTreesWithNewPredictor(*this, state, chainScratch, true);
   }
@@ -300,6 +983,8 @@ namespace dbarts {
   
   bool BARTFit::updatePredictors(const double* newPredictor, const size_t* columns, size_t numColumns)
   {
+    if (data.predictorsAreSparse()) ext_throwError("columns of sparse predictors cannot be updated");
+    
     // store current
     double* oldPredictor = new double[data.numObservations * numColumns];
     double** oldCutPoints = new double*[numColumns];
@@ -316,10 +1001,11 @@ namespace dbarts {
     
     double* x  = const_cast<double*>(data.x);
     double* xt = const_cast<double*>(sharedScratch.xt);
+    const size_t* order = sharedScratch.observationOrder;
     for (size_t j = 0; j < numColumns; ++j) {
       std::memcpy(x + columns[j] * data.numObservations, newPredictor + j * data.numObservations, data.numObservations * sizeof(double));
       for (size_t i = 0; i < data.numObservations; ++i) {
-        xt[i * data.numPredictors + columns[j]] = newPredictor[i + j * data.numObservations];
+        xt[i * data.numPredictors + columns[j]] = newPredictor[(order != NULL ? order[i] : i) + j * data.numObservations];
       }
     }
     
@@ -333,7 +1019,7 @@ namespace dbarts {
         std::memcpy(const_cast<double**>(sharedScratch.cutPoints)[columns[j]], oldCutPoints[j], sharedScratch.numCutsPerVariable[columns[j]] * sizeof(double));
           
         for (size_t i = 0; i < data.numObservations; ++i)
-          xt[i * data.numPredictors + columns[j]] = oldPredictor[i + j * data.numObservations];
+          xt[i * data.numPredictors + columns[j]] = oldPredictor[(order != NULL ? order[i] : i) + j * data.numObservations];
       }
       
       for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum) {
@@ -386,6 +1072,165 @@ namespace {
     
     delete [] currTestFits;
   }
+  
+  size_t getVarintLength(uint64_t u) {
+    size_t result = 1;
+    for ( ; u >= 0x80; u >>= 7) ++result;
+    return result;
+  }
+  
+  // bytes taken by a tree in the format of compressedSample.hpp when its splits are ordinal: each
+  // bottom node is a tag and a double, each split a tag, a word count, and a split index
+  double getCompressedTreeBytes(const Data& data, double numNodes) {
+    size_t maxNumCuts = 0;
+    for (size_t j = 0; j < data.numPredictors; ++j)
+      maxNumCuts = std::max(maxNumCuts, data.maxNumCuts != NULL ? std::min<size_t>(data.maxNumCuts[j], data.numObservations) : data.numObservations);
+    
+    double numBottomNodes = 0.5 * (numNodes + 1.0);
+    double splitBytes = static_cast<double>(getVarintLength(4 * data.numPredictors) + 1 + getVarintLength(maxNumCuts));
+    return numBottomNodes * static_cast<double>(1 + sizeof(double)) + (numNodes - numBottomNodes) * splitBytes;
+  }
+  
+  // expected number of nodes in a tree drawn from the CGM prior, level by level, since a node at
+  // depth d splits with probability base / (1 + d)^power; a tree can't have more bottom nodes than
+  // there are observations
+  double getPriorNumNodes(const Model& model, const Data& data) {
+    const CGMPrior& treePrior(*static_cast<const CGMPrior*>(model.treePrior));
+    double maxNumNodes = 2.0 * static_cast<double>(data.numObservations > 0 ? data.numObservations : 1) - 1.0;
+    
+    double result = 0.0, levelWidth = 1.0;
+    for (size_t depth = 0; levelWidth > 1.0e-6 && result < maxNumNodes; ++depth) {
+      result += levelWidth;
+      levelWidth *= 2.0 * treePrior.base / std::pow(1.0 + static_cast<double>(depth), treePrior.power);
+    }
+    return std::min(result, maxNumNodes);
+  }
+  
+  // average size of a tree, used to plan for those that haven't been drawn yet
+  struct TreeSizes {
+    double numNodes;
+    double numCompressedBytes;
+  };
+  
+  TreeSizes getPriorTreeSizes(const Model& model, const Data& data) {
+    TreeSizes result;
+    result.numNodes = getPriorNumNodes(model, data);
+    result.numCompressedBytes = getCompressedTreeBytes(data, result.numNodes);
+    return result;
+  }
+  
+  // everything in the shared scratch but the cut points themselves
+  size_t getSharedDataBytes(const Control& control, const Data& data) {
+    size_t numValues = (control.responseIsBinary ? 0 : data.numObservations) +
+                       (data.predictorsAreSparse() ? 0 : data.numObservations * data.numPredictors) +
+                       data.numTestObservations * data.numPredictors;
+    size_t result = numValues * sizeof(double) + data.numPredictors * (sizeof(uint32_t) + sizeof(bool) + sizeof(double*));
+    
+    // the order and the response, weights, and offset copied into it
+    if (control.reorderObservations && !data.predictorsAreSparse() && data.numObservations > 1) {
+      numValues = 1 + (data.weights != NULL ? 1 : 0) + (data.offset != NULL ? 1 : 0);
+      result += data.numObservations * (sizeof(size_t) + numValues * sizeof(double));
+    }
+    return result;
+  }
+  
+  size_t getChainScratchBytes(const Control& control, const Data& data) {
+    size_t numValues = (control.responseIsBinary ? 3 : 2) * data.numObservations + data.numTestObservations;
+    return sizeof(ChainScratch) + numValues * sizeof(double);
+  }
+  
+  // tree objects and their top nodes are counted with the nodes
+  size_t getTreeArrayBytes(size_t numObservations, size_t numTrees) {
+    return numObservations * numTrees * (sizeof(size_t) + sizeof(double));
+  }
+  
+  size_t getNodeBytes(size_t numNodes, size_t numTrees, size_t numPredictors) {
+    return numTrees * sizeof(Tree) + (numNodes - numTrees) * sizeof(Node) + numNodes * numPredictors * sizeof(bool);
+  }
+  
+  size_t countNodes(const Tree* trees, size_t numTrees) {
+    size_t result = numTrees;
+    for (size_t treeNum = 0; treeNum < numTrees; ++treeNum) result += trees[treeNum].top.getNumNodesBelow();
+    return result;
+  }
+  
+  size_t getResultsBytes(size_t numObservations, size_t numPredictors, size_t numTestObservations, size_t numSamples, size_t numChains) {
+    return sizeof(Results) + (1 + numObservations + numTestObservations + numPredictors) * numSamples * numChains * sizeof(double);
+  }
+  
+  // once the sampler has run, sizes come from the trees the chains hold and the samples kept so far,
+  // skipping those that are still the empty placeholder
+  TreeSizes getTreeSizes(const BARTFit& fit) {
+    const Control& control(fit.control);
+    const Data& data(fit.data);
+    
+    if (fit.runningTime <= 0.0 || fit.state == NULL || control.numTrees == 0) return getPriorTreeSizes(fit.model, data);
+    
+    size_t numNodes = 0;
+    for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum)
+      numNodes += countNodes(fit.state[chainNum].trees, control.numTrees);
+    
+    TreeSizes result;
+    result.numNodes = static_cast<double>(numNodes) / static_cast<double>(control.numChains * control.numTrees);
+    result.numCompressedBytes = getCompressedTreeBytes(data, result.numNodes);
+    
+    size_t emptySampleLength = DBARTS_COMPRESSED_SAMPLE_HEADER_LENGTH + control.numTrees * (1 + sizeof(double));
+    size_t numCompressedBytes = 0, numCompressedSamples = 0;
+    for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum) {
+      const State& chainState(fit.state[chainNum]);
+      if (!control.keepTrees || chainState.compressedSamples == NULL) continue;
+      
+      for (size_t sampleNum = 0; sampleNum < fit.currentNumSamples; ++sampleNum) {
+        size_t sampleLength = chainState.getCompressedSampleLength(sampleNum);
+        if (sampleLength == emptySampleLength) continue;
+        
+        numCompressedBytes += sampleLength - DBARTS_COMPRESSED_SAMPLE_HEADER_LENGTH;
+        ++numCompressedSamples;
+      }
+    }
+    if (numCompressedSamples > 0)
+      result.numCompressedBytes = static_cast<double>(numCompressedBytes) / static_cast<double>(numCompressedSamples * control.numTrees);
+    
+    return result;
+  }
+  
+  MemoryUsage planMemory(const Control& control, const Data& data, const TreeSizes& treeSizes, size_t numSamples)
+  {
+    MemoryUsage result;
+    
+    size_t numObservations = data.numObservations, numPredictors = data.numPredictors;
+    size_t numTestObservations = data.numTestObservations;
+    size_t numTrees = control.numTrees, numChains = control.numChains;
+    
+    result.data = getSharedDataBytes(control, data);
+    for (size_t j = 0; j < numPredictors; ++j) {
+      size_t maxNumCuts = data.maxNumCuts != NULL ? data.maxNumCuts[j] : numObservations;
+      result.data += std::min(maxNumCuts, numObservations) * sizeof(double);
+    }
+    
+    result.chainScratch = numChains * getChainScratchBytes(control, data);
+    
+    size_t numPlannedNodes = numTrees + static_cast<size_t>(static_cast<double>(numTrees) * (treeSizes.numNodes - 1.0) + 0.5);
+    size_t numPlannedCompressedBytes = static_cast<size_t>(static_cast<double>(numTrees) * treeSizes.numCompressedBytes + 0.5);
+    result.trees = numChains * (sizeof(State) + getTreeArrayBytes(numObservations, numTrees) +
+                                getNodeBytes(numPlannedNodes, numTrees, numPredictors));
+    
+    if (control.keepTrees) {
+      size_t sampleBytes = getTreeArrayBytes(numObservations, numTrees) + getNodeBytes(numPlannedNodes, numTrees, numPredictors);
+      result.savedSamples = numChains * 3 * numSamples * sizeof(void*);
+      if (control.compressTrees) {
+        // one sample per chain can be decoded at a time
+        result.savedSamples += numChains * (numSamples * (sizeof(unsigned char*) + DBARTS_COMPRESSED_SAMPLE_HEADER_LENGTH + numPlannedCompressedBytes) +
+                                            sampleBytes);
+      } else {
+        result.savedSamples += numChains * numSamples * sampleBytes;
+      }
+    }
+    
+    result.results = getResultsBytes(numObservations, numPredictors, numTestObservations, numSamples, numChains);
+    
+    return result;
+  }
 }
 
 namespace dbarts {
@@ -468,12 +1313,20 @@ namespace dbarts {
     
     data = newData;
     
+    setObservationOrder(*this);
+    permuteObservations(*this);
+    
+    // sparse predictors are read in place, so xt only exists for dense ones
+    if (data.predictorsAreSparse()) {
+      deleteAlignedArray(sharedScratch.xt);
+      sharedScratch.xt = NULL;
+    } else if (oldNumObservations != data.numObservations || sharedScratch.xt == NULL) {
+      deleteAlignedArray(sharedScratch.xt);
+      sharedScratch.xt = createAlignedArray<double>(data.numObservations * data.numPredictors);
+    }
+    
     if (oldNumObservations != data.numObservations) {
       // handle resizing arrays
-      delete [] sharedScratch.xt;
-      
-      sharedScratch.xt = new double[data.numObservations * data.numPredictors];
-      
       if (!control.responseIsBinary) {
         delete [] sharedScratch.yRescaled;
         sharedScratch.yRescaled = new double[data.numObservations];
@@ -482,8 +1335,6 @@ namespace dbarts {
     
     size_t** oldTreeIndices      = ext_stackAllocate(control.numChains, size_t*);
     double** oldTreeFits         = ext_stackAllocate(control.numChains, double*);
-    size_t** oldSavedTreeIndices = ext_stackAllocate(control.numChains, size_t*);
-    double** oldSavedTreeFits    = ext_stackAllocate(control.numChains, double*);
     
     double** currTestFits = ext_stackAllocate(control.numChains, double*);
     
@@ -491,29 +1342,23 @@ namespace dbarts {
       // extract from old data what we'll need to update
       oldTreeIndices[chainNum]      = state[chainNum].treeIndices;
       oldTreeFits[chainNum]         = state[chainNum].treeFits;
-      oldSavedTreeIndices[chainNum] = state[chainNum].savedTreeIndices;
-      oldSavedTreeFits[chainNum]    = state[chainNum].savedTreeFits;
       
       currTestFits[chainNum] = NULL;
       
       if (oldNumObservations != data.numObservations) {
-        delete [] chainScratch[chainNum].totalFits;
-        delete [] chainScratch[chainNum].treeY;
+        deleteAlignedArray(chainScratch[chainNum].totalFits);
+        deleteAlignedArray(chainScratch[chainNum].treeY);
       
-        chainScratch[chainNum].treeY     = new double[data.numObservations];
-        chainScratch[chainNum].totalFits = new double[data.numObservations];
+        chainScratch[chainNum].treeY     = createAlignedArray<double>(data.numObservations);
+        chainScratch[chainNum].totalFits = createAlignedArray<double>(data.numObservations);
         
         if (control.responseIsBinary) {
           delete [] chainScratch[chainNum].probitLatents;
           chainScratch[chainNum].probitLatents = new double[data.numObservations];
         }
         
-        state[chainNum].treeIndices = new size_t[data.numObservations * control.numTrees];
-        state[chainNum].treeFits    = new double[data.numObservations * control.numTrees];
-        if (control.keepTrees) {
-          state[chainNum].savedTreeIndices = new size_t[data.numObservations * control.numTrees * currentNumSamples];
-          state[chainNum].savedTreeFits    = new double[data.numObservations * control.numTrees * currentNumSamples];
-        }
+        state[chainNum].treeIndices = createAlignedArray<size_t>(data.numObservations * control.numTrees);
+        state[chainNum].treeFits    = createAlignedArray<double>(data.numObservations * control.numTrees);
       }
     }
     
@@ -552,7 +1397,7 @@ namespace dbarts {
     ext_stackFree(columns);
     
     // now initialize remaining arrays that use numObs
-    ext_transposeMatrix(data.x, data.numObservations, data.numPredictors, const_cast<double*>(sharedScratch.xt)); 
+    if (!data.predictorsAreSparse()) transposePredictors(*this);
     for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum)
       ext_setVectorToConstant(chainScratch[chainNum].totalFits, data.numObservations, 0.0);
     
@@ -621,30 +1466,71 @@ namespace dbarts {
         delete [] nodePosteriorPredictions;
       }
       
-      if (control.keepTrees) for (size_t sampleNum = 0; sampleNum < currentNumSamples; ++sampleNum) {
+      if (control.keepTrees && state[chainNum].compressedSamples != NULL) for (size_t sampleNum = 0; sampleNum < currentNumSamples; ++sampleNum) {
+        // decoding allocates for the new number of observations and leaves the values in the nodes
+        state[chainNum].discardDecodedSample(*this);
+        state[chainNum].decompressSample(*this, sampleNum, false);
+        
+        for (size_t treeNum = 0; treeNum < control.numTrees; ++treeNum) {
+          Tree& savedTree(state[chainNum].savedTrees[sampleNum][treeNum]);
+          
+          savedTree.top.enumerateBottomNodes();
+          
+          double* nodePosteriorPredictions = savedTree.recoverAveragesFromNodes();
+          
+          savedTree.mapOldCutPointsOntoNew(*this, oldCutPoints, nodePosteriorPredictions);
+          savedTree.top.addObservationsToChildren(*this);
+          savedTree.collapseEmptyNodes(*this, nodePosteriorPredictions);
+          for (int32_t i = 0; i < static_cast<int32_t>(data.numPredictors); ++i)
+            updateVariablesAvailable(*this, savedTree.top, i);
+          
+          savedTree.setCurrentFitsFromAverages(*this, nodePosteriorPredictions, state[chainNum].savedTreeFits[sampleNum] + treeNum * data.numObservations, NULL);
+          
+          delete [] nodePosteriorPredictions;
+        }
+        
+        state[chainNum].storeSample(*this, sampleNum, state[chainNum].savedTrees[sampleNum], state[chainNum].savedTreeFits[sampleNum]);
+        state[chainNum].discardDecodedSample(*this);
+      } else if (control.keepTrees) for (size_t sampleNum = 0; sampleNum < currentNumSamples; ++sampleNum) {
+        // samples are reallocated one at a time, as they are stored separately
+        size_t* oldSavedTreeIndices = state[chainNum].savedTreeIndices[sampleNum];
+        double* oldSavedTreeFits    = state[chainNum].savedTreeFits[sampleNum];
+        if (oldNumObservations != data.numObservations) {
+          state[chainNum].savedTreeIndices[sampleNum] = createAlignedArray<size_t>(data.numObservations * control.numTrees);
+          state[chainNum].savedTreeFits[sampleNum]    = createAlignedArray<double>(data.numObservations * control.numTrees);
+        }
+        
         for (size_t treeNum = 0; treeNum < control.numTrees; ++treeNum) {
-          size_t treeOffset = treeNum + sampleNum * control.numTrees;
+          Tree& savedTree(state[chainNum].savedTrees[sampleNum][treeNum]);
           
-          const double* oldTreeFits_i = oldSavedTreeFits[chainNum] + treeOffset * oldNumObservations;
+          const double* oldTreeFits_i = oldSavedTreeFits + treeNum * oldNumObservations;
           
-          state[chainNum].savedTrees[treeOffset].top.enumerateBottomNodes();
+          savedTree.top.enumerateBottomNodes();
           
-          double* nodePosteriorPredictions = state[chainNum].savedTrees[treeOffset].recoverAveragesFromFits(*this, oldTreeFits_i);
+          double* nodePosteriorPredictions = savedTree.recoverAveragesFromFits(*this, oldTreeFits_i);
           
-          state[chainNum].savedTrees[treeOffset].mapOldCutPointsOntoNew(*this, oldCutPoints, nodePosteriorPredictions);
+          savedTree.mapOldCutPointsOntoNew(*this, oldCutPoints, nodePosteriorPredictions);
           
           if (oldNumObservations != data.numObservations) {
-            state[chainNum].savedTrees[treeOffset].top.observationIndices = state[chainNum].savedTreeIndices + treeOffset * data.numObservations;
-            state[chainNum].savedTrees[treeOffset].top.numObservations = data.numObservations;
+            savedTree.top.observationIndices = state[chainNum].savedTreeIndices[sampleNum] + treeNum * data.numObservations;
+            savedTree.top.numObservations = data.numObservations;
           }
           
-          state[chainNum].savedTrees[treeOffset].top.addObservationsToChildren(*this);
-          state[chainNum].savedTrees[treeOffset].collapseEmptyNodes(*this, nodePosteriorPredictions);
+          savedTree.top.addObservationsToChildren(*this);
+          savedTree.collapseEmptyNodes(*this, nodePosteriorPredictions);
           for (int32_t i = 0; i < static_cast<int32_t>(data.numPredictors); ++i)
-            updateVariablesAvailable(*this, state[chainNum].savedTrees[treeOffset].top, i);
+            updateVariablesAvailable(*this, savedTree.top, i);
+          
+          // saved fits are indexed by observation, so they have to follow the new data
+          savedTree.setCurrentFitsFromAverages(*this, nodePosteriorPredictions, state[chainNum].savedTreeFits[sampleNum] + treeNum * data.numObservations, NULL);
           
           delete [] nodePosteriorPredictions;
         }
+        
+        if (oldNumObservations != data.numObservations) {
+          deleteAlignedArray(oldSavedTreeFits);
+          deleteAlignedArray(oldSavedTreeIndices);
+        }
       }
     }
     
@@ -656,23 +1542,22 @@ namespace dbarts {
     
     if (oldNumObservations != data.numObservations) {
       for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum) {
-        delete [] oldSavedTreeFits[chainNum];
-        delete [] oldSavedTreeIndices[chainNum];
-        delete [] oldTreeFits[chainNum];
-        delete [] oldTreeIndices[chainNum];
+        deleteAlignedArray(oldTreeFits[chainNum]);
+        deleteAlignedArray(oldTreeIndices[chainNum]);
       }
     }
     
     ext_stackFree(currTestFits);
     
-    ext_stackFree(oldSavedTreeFits);
-    ext_stackFree(oldSavedTreeIndices);
     ext_stackFree(oldTreeFits);
     ext_stackFree(oldTreeIndices);
   }
   
-  void BARTFit::setControl(const Control& newControl)
+  void BARTFit::setControl(const Control& requestedControl)
   {
+    Control newControl(requestedControl);
+    applyMemoryBudget(newControl, data, getTreeSizes(*this));
+    
     bool stateResized = false;
     if (control.numChains == newControl.numChains) {
       for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum)
@@ -708,9 +1593,12 @@ namespace dbarts {
     
     ext_rng_algorithm_t old_rng_algorithm = control.rng_algorithm;
     ext_rng_standardNormal_t old_rng_standardNormal = control.rng_standardNormal;
+    bool reorderingChanged = control.reorderObservations != newControl.reorderObservations;
     
     control = newControl;
     
+    allocateSplitProbabilities(*this); // for any new chains
+    
     if (old_rng_algorithm != control.rng_algorithm || old_rng_standardNormal != control.rng_standardNormal) {
       destroyRNG(*this);
       createRNG(*this);
@@ -720,6 +1608,12 @@ namespace dbarts {
       rebuildScratchFromState();
       currentSampleNum = 0;
     }
+    
+    // trees hold observations in the internal order, so they are redistributed as with new data
+    if (reorderingChanged) {
+      Data currentData(data);
+      setData(currentData);
+    }
   }
   
   void BARTFit::setModel(const Model& newModel)
@@ -728,6 +1622,8 @@ namespace dbarts {
     
     model = newModel;
     
+    allocateSplitProbabilities(*this);
+    
     // TODO: currently new model is assumed to be tweaked like model is internally,
     // which won't work for sigmasq priors with different specified quantiles or DoF
     
@@ -769,17 +1665,21 @@ namespace dbarts {
         for (size_t k = 0; k < numTreeIndices; ++k) {
           size_t treeNum = treeIndices[k];
           
-          size_t treeOffset = treeNum + sampleNum * control.numTrees;
+          // decoded trees already hold their values
+          state[chainNum].decompressSample(*this, sampleNum, true);
+          Tree& savedTree(state[chainNum].savedTrees[sampleNum][treeNum]);
           
-          const double* treeFits = state[chainNum].treeFits + treeOffset * data.numObservations;
-          double* nodePosteriorPredictions = state[chainNum].trees[treeOffset].recoverAveragesFromFits(*this, treeFits);
-          
-          NodeVector bottomNodes(const_cast<Tree*>(&state[chainNum].trees[treeOffset])->top.getBottomVector());
-          size_t numBottomNodes = bottomNodes.size();
-          for (size_t k = 0; k < numBottomNodes; ++k) bottomNodes[k]->setAverage(nodePosteriorPredictions[k]);
-          delete [] nodePosteriorPredictions;
+          if (state[chainNum].compressedSamples == NULL) {
+            const double* treeFits = state[chainNum].savedTreeFits[sampleNum] + treeNum * data.numObservations;
+            double* nodePosteriorPredictions = savedTree.recoverAveragesFromFits(*this, treeFits);
+            
+            NodeVector bottomNodes(savedTree.top.getBottomVector());
+            size_t numBottomNodes = bottomNodes.size();
+            for (size_t k = 0; k < numBottomNodes; ++k) bottomNodes[k]->setAverage(nodePosteriorPredictions[k]);
+            delete [] nodePosteriorPredictions;
+          }
           
-          state[chainNum].trees[treeOffset].top.print(*this, indent);
+          savedTree.top.print(*this, indent);
         }
         if (numSampleIndices > 1) indent -= 2;
       }
@@ -791,6 +1691,8 @@ namespace dbarts {
     control(control), model(model), data(data), sharedScratch(), chainScratch(NULL), state(NULL),
     runningTime(0.0), currentNumSamples(control.defaultNumSamples), currentSampleNum(0), threadManager(NULL)
   {
+    applyMemoryBudget(this->control, data, getPriorTreeSizes(this->model, data));
+    
     allocateMemory(*this);
     
     if (control.responseIsBinary) initializeLatents(*this);
@@ -810,17 +1712,27 @@ namespace dbarts {
     destroyRNG(*this);
     
     delete [] sharedScratch.yRescaled; sharedScratch.yRescaled = NULL;
-    delete [] sharedScratch.xt; sharedScratch.xt = NULL;
+    deleteAlignedArray(sharedScratch.xt); sharedScratch.xt = NULL;
+    if (sharedScratch.observationOrder != NULL) {
+      delete [] sharedScratch.offset;
+      delete [] sharedScratch.weights;
+      delete [] sharedScratch.y;
+      delete [] sharedScratch.observationOrder;
+    }
+    sharedScratch.observationOrder = NULL;
     delete [] sharedScratch.xt_test; sharedScratch.xt_test = NULL;
     for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum) {
       delete [] chainScratch[chainNum].totalTestFits; chainScratch[chainNum].totalTestFits = NULL;
-      delete [] chainScratch[chainNum].totalFits; chainScratch[chainNum].totalFits = NULL;
+      deleteAlignedArray(chainScratch[chainNum].totalFits); chainScratch[chainNum].totalFits = NULL;
       delete [] chainScratch[chainNum].probitLatents; chainScratch[chainNum].probitLatents = NULL;
-      delete [] chainScratch[chainNum].treeY; chainScratch[chainNum].treeY = NULL;
+      deleteAlignedArray(chainScratch[chainNum].treeY); chainScratch[chainNum].treeY = NULL;
+      delete [] chainScratch[chainNum].unavailableVariables; chainScratch[chainNum].unavailableVariables = NULL;
+      delete [] chainScratch[chainNum].unavailableSums; chainScratch[chainNum].unavailableSums = NULL;
     }
     
     delete [] chainScratch;
     
+    delete [] sharedScratch.variableHasMissingValues; sharedScratch.variableHasMissingValues = NULL;
     delete [] sharedScratch.numCutsPerVariable; sharedScratch.numCutsPerVariable = NULL;
     if (sharedScratch.cutPoints != NULL) {
       for (size_t i = 0; i < data.numPredictors; ++i) delete [] sharedScratch.cutPoints[i];
@@ -855,6 +1767,15 @@ namespace dbarts {
   
   Results* BARTFit::runSampler(size_t numBurnIn, size_t numSamples)
   {
+    // trees are already in place, so the only thing left to decide is whether the results fit
+    if (control.memoryBudget > 0) {
+      MemoryUsage usage = getMemoryUsage(numSamples == 0 ? 1 : numSamples);
+      if (usage.getTotal() > control.memoryBudget)
+        ext_throwError("running for %lu samples requires %lu bytes, exceeding the memory budget of %lu",
+                       static_cast<unsigned long int>(numSamples), static_cast<unsigned long int>(usage.getTotal()),
+                       static_cast<unsigned long int>(control.memoryBudget));
+    }
+    
     Results* resultsPointer = new Results(data.numObservations, data.numPredictors,
                                           data.numTestObservations,
                                           numSamples == 0 ? 1 : numSamples,
@@ -870,12 +1791,60 @@ namespace dbarts {
     return resultsPointer;
   }
   
+  
+  MemoryUsage BARTFit::planMemory(const Control& control, const Data& data, const Model& model, size_t numSamples)
+  {
+    return ::planMemory(control, data, getPriorTreeSizes(model, data), numSamples);
+  }
+  
+  MemoryUsage BARTFit::planMemory(const Control& newControl, size_t numSamples) const
+  {
+    return ::planMemory(newControl, data, getTreeSizes(*this), numSamples);
+  }
+  
+  MemoryUsage BARTFit::getMemoryUsage(size_t numSamples) const
+  {
+    MemoryUsage result;
+    
+    size_t numObservations = data.numObservations, numPredictors = data.numPredictors;
+    size_t numTrees = control.numTrees, numChains = control.numChains;
+    
+    result.data = getSharedDataBytes(control, data);
+    for (size_t j = 0; j < numPredictors; ++j) result.data += sharedScratch.numCutsPerVariable[j] * sizeof(double);
+    
+    result.chainScratch = numChains * getChainScratchBytes(control, data);
+    
+    for (size_t chainNum = 0; chainNum < numChains; ++chainNum) {
+      const State& chainState(state[chainNum]);
+      
+      result.trees += sizeof(State) + getTreeArrayBytes(numObservations, numTrees) +
+                      getNodeBytes(countNodes(chainState.trees, numTrees), numTrees, numPredictors);
+      if (chainState.splitProbabilities != NULL) result.trees += numPredictors * sizeof(double);
+      if (chainScratch[chainNum].unavailableVariables != NULL)
+        result.chainScratch += numPredictors * sizeof(size_t) + (numPredictors + 1) * sizeof(double);
+      
+      if (!control.keepTrees || chainState.savedTrees == NULL) continue;
+      
+      result.savedSamples += 3 * currentNumSamples * sizeof(void*);
+      for (size_t sampleNum = 0; sampleNum < currentNumSamples; ++sampleNum) {
+        if (chainState.compressedSamples != NULL)
+          result.savedSamples += sizeof(unsigned char*) + chainState.getCompressedSampleLength(sampleNum);
+        if (chainState.savedTrees[sampleNum] != NULL)
+          result.savedSamples += getTreeArrayBytes(numObservations, numTrees) +
+                                 getNodeBytes(countNodes(chainState.savedTrees[sampleNum], numTrees), numTrees, numPredictors);
+      }
+    }
     
+    result.results = getResultsBytes(numObservations, numPredictors, data.numTestObservations, numSamples, numChains);
+    
+    return result;
+  }
+  
   void BARTFit::sampleTreesFromPrior()
   {
     for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum) {
       for (size_t treeNum = 0; treeNum < control.numTrees; ++treeNum) {
-        state[chainNum].trees[treeNum].sampleFromPrior(*this, state[chainNum].rng);
+        state[chainNum].trees[treeNum].sampleFromPrior(*this, chainNum, state[chainNum].rng);
       }
     }
   }
@@ -886,6 +1855,7 @@ extern "C" {
     BARTFit* fit;
     size_t chainNum;
     size_t numBurnIn;
+    size_t numSamples;
     Results* results;
   };
   
@@ -910,7 +1880,7 @@ extern "C" {
     bool stepTaken;
     StepType ignored;
     
-    size_t numSamples = results.numSamples;
+    size_t numSamples = threadData->numSamples;
     
     double* currFits = new double[data.numObservations];
     double* currTestFits = data.numTestObservations > 0 ? new double[data.numTestObservations] : NULL;
@@ -973,37 +1943,45 @@ extern "C" {
       if (control.keepTrees & !isBurningIn && !isThinningIteration) {
         size_t treeSampleNum = (fit.currentSampleNum + resultSampleNum) % fit.currentNumSamples;
         
-        for (size_t treeNum = 0; treeNum < control.numTrees; ++treeNum)
-          state.savedTrees[treeNum + treeSampleNum * control.numTrees].copyFrom(fit, state.trees[treeNum]);
-        std::memcpy(state.savedTreeFits + treeSampleNum * control.numTrees * data.numObservations, const_cast<const double*>(state.treeFits), control.numTrees * data.numObservations * sizeof(double));
+        state.storeSample(fit, treeSampleNum, state.trees, state.treeFits);
       }
       
       if (control.responseIsBinary) {
         sampleProbitLatentVariables(fit, state, chainScratch.totalFits, y);
       } else {
         double sumOfSquaredResiduals;
-        if (data.weights != NULL) {
-          sumOfSquaredResiduals = ext_htm_computeWeightedSumOfSquaredResiduals(fit.threadManager, taskId, y, data.numObservations, data.weights, chainScratch.totalFits);
+        if (fit.sharedScratch.weights != NULL) {
+          sumOfSquaredResiduals = ext_htm_computeWeightedSumOfSquaredResiduals(fit.threadManager, taskId, y, data.numObservations, fit.sharedScratch.weights, chainScratch.totalFits);
         } else {
           sumOfSquaredResiduals = ext_htm_computeSumOfSquaredResiduals(fit.threadManager, taskId, y, data.numObservations, chainScratch.totalFits);
         }
         state.sigma = std::sqrt(model.sigmaSqPrior->drawFromPosterior(state.rng, static_cast<double>(data.numObservations), sumOfSquaredResiduals));
       }
       
-      if (!isThinningIteration) {
-        // if not out of burn-in, store result in first result; start
-        // overwriting after that
+      // as in DART, leave the split probabilities alone for the first half of burn-in so that they
+      // don't lock on to the variables used by the initial trees
+      bool splitProbabilitiesAreUpdated = model.treePrior->usesSplitProbabilities() && (!isBurningIn || 2 * majorIterationNum >= numBurnIn);
+      
+      if (!isThinningIteration || splitProbabilitiesAreUpdated) {
         for (size_t j = 0; j < fit.data.numPredictors; ++j) variableCounts[j] = 0;
         countVariableUses(fit, state, variableCounts);
-        
-        storeSamples(fit, chainNum, results, chainScratch.totalFits, chainScratch.totalTestFits, state.sigma, variableCounts, resultSampleNum);
+      }
+      
+      if (splitProbabilitiesAreUpdated)
+        model.treePrior->updateSplitProbabilities(fit, chainNum, state.rng, variableCounts);
+      
+      if (!isThinningIteration) {
+        // if not out of burn-in, store result in first result; start
+        // overwriting after that, wrapping around when results are shorter than the run
+        size_t storedSampleNum = resultSampleNum % results.numSamples;
+        storeSamples(fit, chainNum, results, chainScratch.totalFits, chainScratch.totalTestFits, state.sigma, variableCounts, storedSampleNum);
         
         if (control.callback != NULL) {
-          size_t chainStride = chainNum * numSamples;
+          size_t chainStride = chainNum * results.numSamples;
           control.callback(control.callbackData, fit, isBurningIn,
-                           results.trainingSamples + (resultSampleNum + chainStride) * data.numObservations,
-                           results.testSamples + (resultSampleNum + chainStride) * data.numTestObservations,
-                           results.sigmaSamples[resultSampleNum + chainStride]);
+                           results.trainingSamples + (storedSampleNum + chainStride) * data.numObservations,
+                           results.testSamples + (storedSampleNum + chainStride) * data.numTestObservations,
+                           results.sigmaSamples[storedSampleNum + chainStride]);
         }
       }
     }
@@ -1017,6 +1995,11 @@ extern "C" {
 namespace dbarts {
   
   void BARTFit::runSampler(size_t numBurnIn, Results* resultsPointer)
+  {
+    runSampler(numBurnIn, resultsPointer->numSamples, resultsPointer);
+  }
+  
+  void BARTFit::runSampler(size_t numBurnIn, size_t numSamples, Results* resultsPointer)
   {
     if (control.verbose) ext_printf("Running mcmc loop:\n");
     
@@ -1039,7 +2022,7 @@ namespace dbarts {
     
     if (control.numThreads <= 1) {
       // run single threaded, chains in sequence
-      ThreadData threadData = { this, 0, numBurnIn, resultsPointer };
+      ThreadData threadData = { this, 0, numBurnIn, numSamples, resultsPointer };
       for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum) {
         threadData.chainNum = chainNum;
         samplerThreadFunction(static_cast<size_t>(-1), reinterpret_cast<void*>(&threadData));
@@ -1052,6 +2035,7 @@ namespace dbarts {
         threadData[chainNum].fit = this;
         threadData[chainNum].chainNum = chainNum;
         threadData[chainNum].numBurnIn = numBurnIn;
+        threadData[chainNum].numSamples = numSamples;
         threadData[chainNum].results = resultsPointer;
         threadDataPtr[chainNum] = reinterpret_cast<void*>(&threadData[chainNum]);
       }
@@ -1070,7 +2054,7 @@ namespace dbarts {
     }
     
     if (control.keepTrees)
-      currentSampleNum = (currentSampleNum + resultsPointer->numSamples) % currentNumSamples;
+      currentSampleNum = (currentSampleNum + numSamples) % currentNumSamples;
     
 #ifdef HAVE_SYS_TIME_H
     gettimeofday(&endTime, NULL);
@@ -1117,6 +2101,7 @@ namespace {
     }
     CGMPrior* treePrior = static_cast<CGMPrior*>(model.treePrior);
     ext_printf("\tpower and base for tree prior: %f %f\n", treePrior->power, treePrior->base);
+    if (treePrior->sparse) ext_printf("\tsparse split variable prior, concentration: %f\n", treePrior->concentration);
     ext_printf("\tuse quantiles for rule cut points: %s\n", control.useQuantiles ? "true" : "false");
     ext_printf("data:\n");
     ext_printf("\tnumber of training observations: %u\n", data.numObservations);
@@ -1202,6 +2187,32 @@ namespace {
     ext_printf("\nDONE BART\n\n");
   }
   
+  // Shrinks the fit to the budget by holding kept trees compressed, which saves the most of
+  // anything that doesn't change what's returned; throws if that isn't enough.
+  void applyMemoryBudget(Control& control, const Data& data, const TreeSizes& treeSizes)
+  {
+    if (control.memoryBudget == 0) return;
+    
+    MemoryUsage plan = planMemory(control, data, treeSizes, control.defaultNumSamples);
+    if (plan.getTotal() <= control.memoryBudget) return;
+    
+    if (control.keepTrees && !control.compressTrees) {
+      control.compressTrees = true;
+      plan = planMemory(control, data, treeSizes, control.defaultNumSamples);
+      if (plan.getTotal() <= control.memoryBudget) {
+        if (control.verbose) ext_printf("compressing kept trees to stay within memory budget\n");
+        return;
+      }
+    }
+    
+    ext_throwError("fit requires an estimated %lu bytes (data: %lu, chain scratch: %lu, trees: %lu, saved samples: %lu, "
+                   "results: %lu), exceeding the memory budget of %lu",
+                   static_cast<unsigned long int>(plan.getTotal()), static_cast<unsigned long int>(plan.data),
+                   static_cast<unsigned long int>(plan.chainScratch), static_cast<unsigned long int>(plan.trees),
+                   static_cast<unsigned long int>(plan.savedSamples), static_cast<unsigned long int>(plan.results),
+                   static_cast<unsigned long int>(control.memoryBudget));
+  }
+  
   void allocateMemory(BARTFit& fit) {
     Control& control(fit.control);
     Data& data(fit.data);
@@ -1220,8 +2231,16 @@ namespace {
         chainScratch[chainNum].probitLatents = new double[data.numObservations];
     }
     
-    sharedScratch.xt = new double[data.numObservations * data.numPredictors];
-    ext_transposeMatrix(data.x, data.numObservations, data.numPredictors, const_cast<double*>(sharedScratch.xt));
+    sharedScratch.observationOrder = NULL;
+    setObservationOrder(fit);
+    permuteObservations(fit);
+    
+    if (data.predictorsAreSparse()) {
+      sharedScratch.xt = NULL;
+    } else {
+      sharedScratch.xt = createAlignedArray<double>(data.numObservations * data.numPredictors);
+      transposePredictors(fit);
+    }
     
     if (data.numTestObservations > 0) {
       sharedScratch.xt_test = new double[data.numTestObservations * data.numPredictors];
@@ -1230,19 +2249,23 @@ namespace {
     
     // chain scratches
     for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum) {
-      chainScratch[chainNum].treeY = new double[data.numObservations];
+      chainScratch[chainNum].treeY = createAlignedArray<double>(data.numObservations);
       double* y = control.responseIsBinary ? chainScratch[chainNum].probitLatents : const_cast<double*>(sharedScratch.yRescaled);
       
       for (size_t i = 0; i < data.numObservations; ++i) chainScratch[chainNum].treeY[i] = y[i];
       
-      chainScratch[chainNum].totalFits = new double[data.numObservations];
+      chainScratch[chainNum].totalFits = createAlignedArray<double>(data.numObservations);
       chainScratch[chainNum].totalTestFits = data.numTestObservations > 0 ? new double[data.numTestObservations] : NULL;
       
+      chainScratch[chainNum].unavailableVariables = NULL;
+      chainScratch[chainNum].unavailableSums = NULL;
+      
       chainScratch[chainNum].taskId = static_cast<size_t>(-1);
     }
     
     // shared scratch
     sharedScratch.numCutsPerVariable = new uint32_t[data.numPredictors];
+    sharedScratch.variableHasMissingValues = new bool[data.numPredictors];
 
     sharedScratch.cutPoints = new double*[data.numPredictors];
     const double** cutPoints = const_cast<const double**>(sharedScratch.cutPoints);
@@ -1252,6 +2275,7 @@ namespace {
     fit.state = static_cast<State*>(::operator new (control.numChains * sizeof(State)));
     for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum)
       new (fit.state + chainNum) State(control, data);
+    allocateSplitProbabilities(fit);
     
     if (control.numThreads > 1 && ext_htm_create(&fit.threadManager, control.numThreads) != 0) {
       ext_printMessage("Unable to multi-thread, defaulting to single.");
@@ -1259,6 +2283,157 @@ namespace {
     }
   }
   
+  // split probabilities start uniform and are dropped when the tree prior stops using them, as
+  // is the scratch used to draw from them
+  void allocateSplitProbabilities(BARTFit& fit) {
+    Data& data(fit.data);
+    bool priorUsesSplitProbabilities = fit.model.treePrior->usesSplitProbabilities();
+    
+    for (size_t chainNum = 0; chainNum < fit.control.numChains; ++chainNum) {
+      State& state(fit.state[chainNum]);
+      ChainScratch& chainScratch(fit.chainScratch[chainNum]);
+      if (!priorUsesSplitProbabilities) {
+        delete [] state.splitProbabilities;
+        state.splitProbabilities = NULL;
+        delete [] chainScratch.unavailableVariables;
+        chainScratch.unavailableVariables = NULL;
+        delete [] chainScratch.unavailableSums;
+        chainScratch.unavailableSums = NULL;
+        continue;
+      }
+      
+      if (state.splitProbabilities == NULL) {
+        state.splitProbabilities = new double[data.numPredictors];
+        ext_setVectorToConstant(state.splitProbabilities, data.numPredictors, 1.0 / static_cast<double>(data.numPredictors));
+        buildPartialSumTree(state.splitProbabilities, data.numPredictors);
+      }
+      if (chainScratch.unavailableVariables == NULL) {
+        chainScratch.unavailableVariables = new size_t[data.numPredictors];
+        chainScratch.unavailableSums = new double[data.numPredictors + 1];
+      }
+    }
+  }
+  
+  // at most this many predictors define the ordering, each binned to 8 bits
+  const size_t maxNumCurveVariables = 8;
+  const size_t numCurveBins = 255; // bin 255 holds missing values
+  
+  // Orders observations along a Z-order (Morton) curve through the binned values of the predictors
+  // with the most distinct bins, so that observations that tend to fall into the same bottom nodes
+  // sit near one another in memory. Sparse predictors are read in place and are not reordered.
+  void setObservationOrder(BARTFit& fit) {
+    const Data& data(fit.data);
+    SharedScratch& sharedScratch(fit.sharedScratch);
+    
+    if (sharedScratch.observationOrder != NULL) {
+      delete [] sharedScratch.offset;  sharedScratch.offset = NULL;
+      delete [] sharedScratch.weights; sharedScratch.weights = NULL;
+      delete [] sharedScratch.y;       sharedScratch.y = NULL;
+      delete [] sharedScratch.observationOrder;
+      sharedScratch.observationOrder = NULL;
+    }
+    
+    if (!fit.control.reorderObservations || data.predictorsAreSparse() || data.numObservations < 2 || data.numPredictors == 0) return;
+    
+    size_t numObservations = data.numObservations;
+    
+    unsigned char* bins = new unsigned char[numObservations * data.numPredictors];
+    std::vector<std::pair<size_t, size_t> > columnRanks(data.numPredictors);
+    
+    for (size_t j = 0; j < data.numPredictors; ++j) {
+      const double* x_j = data.x + j * numObservations;
+      unsigned char* bins_j = bins + j * numObservations;
+      
+      double min = 0.0, max = 0.0;
+      bool anyPresent = false;
+      for (size_t i = 0; i < numObservations; ++i) {
+        if (isMissing(x_j[i])) continue;
+        if (!anyPresent || x_j[i] < min) min = x_j[i];
+        if (!anyPresent || x_j[i] > max) max = x_j[i];
+        anyPresent = true;
+      }
+      double scale = max > min ? static_cast<double>(numCurveBins - 1) / (max - min) : 0.0;
+      
+      bool binIsUsed[numCurveBins + 1];
+      for (size_t b = 0; b <= numCurveBins; ++b) binIsUsed[b] = false;
+      size_t numDistinctBins = 0;
+      
+      for (size_t i = 0; i < numObservations; ++i) {
+        size_t bin = isMissing(x_j[i]) ? numCurveBins : static_cast<size_t>((x_j[i] - min) * scale + 0.5);
+        bins_j[i] = static_cast<unsigned char>(bin);
+        if (!binIsUsed[bin]) { binIsUsed[bin] = true; ++numDistinctBins; }
+      }
+      // sorts by decreasing number of bins, then by column
+      columnRanks[j] = std::make_pair(numCurveBins + 1 - numDistinctBins, j);
+    }
+    
+    size_t numCurveVariables = std::min(data.numPredictors, maxNumCurveVariables);
+    std::partial_sort(columnRanks.begin(), columnRanks.begin() + numCurveVariables, columnRanks.end());
+    
+    std::vector<std::pair<uint64_t, size_t> > keys(numObservations);
+    for (size_t i = 0; i < numObservations; ++i) {
+      uint64_t key = 0;
+      for (size_t c = 0; c < numCurveVariables; ++c) {
+        uint64_t bin = bins[columnRanks[c].second * numObservations + i];
+        for (size_t bit = 0; bit < 8; ++bit)
+          key |= ((bin >> (7 - bit)) & 1) << (63 - (bit * numCurveVariables + c));
+      }
+      keys[i] = std::make_pair(key, i);
+    }
+    delete [] bins;
+    
+    std::sort(keys.begin(), keys.end());
+    
+    size_t* order = new size_t[numObservations];
+    for (size_t i = 0; i < numObservations; ++i) order[i] = keys[i].second;
+    sharedScratch.observationOrder = order;
+  }
+  
+  const double* permuteVector(const double* x, const size_t* order, size_t length, const double* copy) {
+    if (x == NULL) {
+      delete [] copy;
+      return NULL;
+    }
+    double* result = copy != NULL ? const_cast<double*>(copy) : new double[length];
+    for (size_t i = 0; i < length; ++i) result[i] = x[order[i]];
+    
+    return result;
+  }
+  
+  // brings the response, weights, and offset into the internal order
+  void permuteObservations(BARTFit& fit) {
+    const Data& data(fit.data);
+    SharedScratch& sharedScratch(fit.sharedScratch);
+    const size_t* order = sharedScratch.observationOrder;
+    
+    if (order == NULL) {
+      sharedScratch.y = data.y;
+      sharedScratch.weights = data.weights;
+      sharedScratch.offset = data.offset;
+      return;
+    }
+    
+    sharedScratch.y       = permuteVector(data.y, order, data.numObservations, sharedScratch.y);
+    sharedScratch.weights = permuteVector(data.weights, order, data.numObservations, sharedScratch.weights);
+    sharedScratch.offset  = permuteVector(data.offset, order, data.numObservations, sharedScratch.offset);
+  }
+  
+  void transposePredictors(BARTFit& fit) {
+    const Data& data(fit.data);
+    const size_t* order = fit.sharedScratch.observationOrder;
+    double* xt = const_cast<double*>(fit.sharedScratch.xt);
+    
+    if (order == NULL) {
+      ext_transposeMatrix(data.x, data.numObservations, data.numPredictors, xt);
+      return;
+    }
+    
+    for (size_t i = 0; i < data.numObservations; ++i) {
+      double* xt_i = xt + i * data.numPredictors;
+      for (size_t j = 0; j < data.numPredictors; ++j) xt_i[j] = data.x[order[i] + j * data.numObservations];
+    }
+  }
+  
   void setPrior(BARTFit& fit) {
     Control& control(fit.control);
     Data& data(fit.data);
@@ -1303,7 +2478,10 @@ namespace {
     
     uint32_t* numCutsPerVariable = const_cast<uint32_t*>(sharedScratch.numCutsPerVariable);
     double** cutPoints = const_cast<double**>(sharedScratch.cutPoints);
-        
+    bool* variableHasMissingValues = const_cast<bool*>(sharedScratch.variableHasMissingValues);
+    
+    std::vector<double> sparseColumn;
+    
     if (control.useQuantiles) {
       if (data.maxNumCuts == NULL) ext_throwError("Num cuts cannot be NULL if useQuantiles is true.");
       
@@ -1313,35 +2491,74 @@ namespace {
       
       for (size_t j = 0; j < numColumns; ++j) {
         size_t col = columns[j];
+        size_t length;
+        const double* x = getPredictorColumn(fit, col, sparseColumn, length);
+        variableHasMissingValues[col] = columnHasMissingValues(x, length);
         
-        setCutPointsFromQuantiles(fit, data.x + col * data.numObservations, data.maxNumCuts[col],
+        if (data.variableTypes[col] == CATEGORICAL) {
+          setCategories(fit, x, length, numCutsPerVariable[col], cutPoints[col]);
+          continue;
+        }
+        
+        setCutPointsFromQuantiles(fit, x, length, data.maxNumCuts[col],
                                   numCutsPerVariable[col], cutPoints[col],
                                   uniqueElements, sortedElements);
       }
     } else {
       for (size_t j = 0; j < numColumns; ++j) {
         size_t col = columns[j];
+        size_t length;
+        const double* x = getPredictorColumn(fit, col, sparseColumn, length);
+        variableHasMissingValues[col] = columnHasMissingValues(x, length);
+        
+        if (data.variableTypes[col] == CATEGORICAL) {
+          setCategories(fit, x, length, numCutsPerVariable[col], cutPoints[col]);
+          continue;
+        }
         
-        setCutPointsUniformly(fit, data.x + col * data.numObservations, data.maxNumCuts[col],
+        setCutPointsUniformly(fit, x, length, data.maxNumCuts[col],
                               numCutsPerVariable[col], cutPoints[col]);
       }
     }
   }
   
-  void setCutPointsFromQuantiles(BARTFit& fit, const double* x, uint32_t maxNumCuts,
+  // Cut points only depend on the unique values in a column and its range, so a sparse column is
+  // reduced to its non-zeros plus a single zero standing in for all of the entries not stored.
+  const double* getPredictorColumn(const BARTFit& fit, size_t column, std::vector<double>& sparseColumn, size_t& length)
+  {
+    const Data& data(fit.data);
+    
+    if (!data.predictorsAreSparse()) {
+      length = data.numObservations;
+      return data.x + column * data.numObservations;
+    }
+    
+    size_t start = static_cast<size_t>(data.x_sparse.columnStarts[column]);
+    size_t numNonZeros = static_cast<size_t>(data.x_sparse.columnStarts[column + 1]) - start;
+    
+    sparseColumn.assign(data.x_sparse.values + start, data.x_sparse.values + start + numNonZeros);
+    if (numNonZeros < data.numObservations) sparseColumn.push_back(0.0);
+    
+    length = sparseColumn.size();
+    return &sparseColumn[0];
+  }
+  
+  void setCutPointsFromQuantiles(BARTFit&, const double* x, size_t length, uint32_t maxNumCuts,
                                  uint32_t& numCutsPerVariable, double*& cutPoints,
                                  std::set<double>& uniqueElements, std::vector<double>& sortedElements)
   {
-    Data& data(fit.data);
-    
     // sets are inherently sorted, should be a binary tree back there somewhere
     uniqueElements.clear();
-    for (size_t i = 0; i < data.numObservations; ++i) uniqueElements.insert(x[i]);
+    for (size_t i = 0; i < length; ++i) if (!isMissing(x[i])) uniqueElements.insert(x[i]);
     
     size_t numUniqueElements = uniqueElements.size();
       
     size_t step, numCuts, offset;
-    if (numUniqueElements <= maxNumCuts + 1) {
+    if (numUniqueElements == 0) {
+      step = 1;
+      numCuts = 0;
+      offset = 0;
+    } else if (numUniqueElements <= maxNumCuts + 1) {
       step = 1;
       numCuts = numUniqueElements - 1;
       offset = 0;
@@ -1368,16 +2585,18 @@ namespace {
     }
   }
   
-  void setCutPointsUniformly(BARTFit& fit, const double* x, uint32_t maxNumCuts,
+  void setCutPointsUniformly(BARTFit&, const double* x, size_t length, uint32_t maxNumCuts,
                              uint32_t& numCutsPerVariable, double*& cutPoints)
   {
-    Data& data(fit.data);
-    
     double xMax, xMin, xIncrement;
     
-    xMax = x[0]; xMin = x[0];
-    for (size_t i = 1; i < data.numObservations; ++i) {
+    size_t i = 0;
+    while (i < length && isMissing(x[i])) ++i;
+    
+    xMax = i < length ? x[i] : 0.0; xMin = xMax;
+    for ( ; i < length; ++i) {
       double x_i = x[i];
+      if (isMissing(x_i)) continue;
       if (x_i < xMin) xMin = x_i;
       if (x_i > xMax) xMax = x_i;
     }
@@ -1392,6 +2611,39 @@ namespace {
     for (size_t k = 0; k < numCutsPerVariable; ++k) cutPoints[k] = xMin + (static_cast<double>(k + 1)) * xIncrement;
   }
     
+  // Categorical columns hold integer codes 0, ..., k - 1 and their "cut points" are just the codes,
+  // so that numCutsPerVariable is the number of categories.
+  void setCategories(BARTFit&, const double* x, size_t length, uint32_t& numCutsPerVariable, double*& cutPoints)
+  {
+    double xMax = 0.0;
+    for (size_t i = 0; i < length; ++i) {
+      double x_i = x[i];
+      if (isMissing(x_i)) continue;
+      if (x_i < 0.0 || x_i != static_cast<double>(static_cast<uint32_t>(x_i)))
+        ext_throwError("categorical predictors must be coded as non-negative integers");
+      if (x_i > xMax) xMax = x_i;
+    }
+    if (xMax >= static_cast<double>(DBARTS_MAX_NUM_CATEGORIES))
+      ext_throwError("categorical predictors cannot have more than %u levels", DBARTS_MAX_NUM_CATEGORIES);
+    
+    uint32_t numCategories = static_cast<uint32_t>(xMax) + 1;
+    
+    if (numCutsPerVariable != static_cast<uint32_t>(-1)) {
+      if (numCategories > numCutsPerVariable) ext_throwError("number of categories in new predictor greater than previous: old splits would be invalid");
+      return;
+    }
+    
+    numCutsPerVariable = numCategories;
+    cutPoints = new double[numCategories];
+    for (uint32_t k = 0; k < numCategories; ++k) cutPoints[k] = static_cast<double>(k);
+  }
+  
+  bool columnHasMissingValues(const double* x, size_t length)
+  {
+    for (size_t i = 0; i < length; ++i) if (isMissing(x[i])) return true;
+    return false;
+  }
+  
   void createRNG(BARTFit& fit) {
     Control& control(fit.control);
     State* state(fit.state);
@@ -1536,19 +2788,20 @@ namespace {
   
   void initializeLatents(BARTFit& fit, size_t chainNum) {
     const Data& data(fit.data);
+    const SharedScratch& sharedScratch(fit.sharedScratch);
     
     double* z = fit.chainScratch[chainNum].probitLatents;
     
     // z = 2.0 * y - 1.0 - offset; so -1 if y == 0 and 1 if y == 1 when offset == 0
 #ifndef MATCH_BAYES_TREE
     ext_setVectorToConstant(z, data.numObservations, -1.0);
-    if (data.offset != NULL) ext_addVectorsInPlace(data.offset, data.numObservations, -1.0, z);
-    ext_addVectorsInPlace(data.y, data.numObservations, 2.0, z);
+    if (sharedScratch.offset != NULL) ext_addVectorsInPlace(sharedScratch.offset, data.numObservations, -1.0, z);
+    ext_addVectorsInPlace(sharedScratch.y, data.numObservations, 2.0, z);
 #else
     // BayesTree initialized the latents to be -2 and 0; was probably a bug
     ext_setVectorToConstant(z, data.numObservations, -2.0);
-    if (data.offset != NULL) ext_addVectorsInPlace(data.offset, data.numObservations, -1.0, z);
-    ext_addVectorsInPlace(data.y, data.numObservations, 2.0, z);
+    if (sharedScratch.offset != NULL) ext_addVectorsInPlace(sharedScratch.offset, data.numObservations, -1.0, z);
+    ext_addVectorsInPlace(sharedScratch.y, data.numObservations, 2.0, z);
 #endif
   }
   
@@ -1558,10 +2811,10 @@ namespace {
     
     double* yRescaled = const_cast<double*>(fit.sharedScratch.yRescaled);
     
-    if (data.offset != NULL) {
-      ext_addVectors(data.offset, data.numObservations, -1.0, data.y, yRescaled);
+    if (sharedScratch.offset != NULL) {
+      ext_addVectors(sharedScratch.offset, data.numObservations, -1.0, sharedScratch.y, yRescaled);
     } else {
-      std::memcpy(yRescaled, data.y, data.numObservations * sizeof(double));
+      std::memcpy(yRescaled, sharedScratch.y, data.numObservations * sizeof(double));
     }
     
     sharedScratch.dataScale.min = yRescaled[0];
@@ -1586,9 +2839,9 @@ namespace {
 #ifndef MATCH_BAYES_TREE
       double mean = fits[i];
       double offset = 0.0;
-      if (fit.data.offset != NULL) offset = fit.data.offset[i];
+      if (fit.sharedScratch.offset != NULL) offset = fit.sharedScratch.offset[i];
       
-      if (fit.data.y[i] > 0.0) {
+      if (fit.sharedScratch.y[i] > 0.0) {
         z[i] = ext_rng_simulateLowerTruncatedNormalScale1(state.rng, mean, -offset);
       } else {
         z[i] = ext_rng_simulateUpperTruncatedNormalScale1(state.rng, mean, -offset);
@@ -1597,10 +2850,10 @@ namespace {
       double prob;
       
       double mean = fits[i];
-      if (fit.data.offset != NULL) mean += fit.data.offset[i];
+      if (fit.sharedScratch.offset != NULL) mean += fit.sharedScratch.offset[i];
       
       double u = ext_rng_simulateContinuousUniform(state.rng);
-      if (fit.data.y[i] > 0.0) {
+      if (fit.sharedScratch.y[i] > 0.0) {
         prob = u + (1.0 - u) * ext_cumulativeProbabilityOfNormal(0.0, mean, 1.0);
         z[i] = ext_quantileOfNormal(prob, mean, 1.0);
       } else {
@@ -1620,11 +2873,17 @@ namespace {
     const Control& control(fit.control);
     const SharedScratch& sharedScratch(fit.sharedScratch);
     
+    const size_t* order = sharedScratch.observationOrder;
+    
     size_t chainStride = chainNum * results.numSamples;
     if (control.responseIsBinary) {
       if (control.keepTrainingFits) {
         double* trainingSamples = results.trainingSamples + (simNum + chainStride) * data.numObservations;
-        std::memcpy(trainingSamples, trainingSample, data.numObservations * sizeof(double));
+        if (order == NULL) {
+          std::memcpy(trainingSamples, trainingSample, data.numObservations * sizeof(double));
+        } else {
+          for (size_t i = 0; i < data.numObservations; ++i) trainingSamples[order[i]] = trainingSample[i];
+        }
         if (data.offset != NULL) ext_addVectorsInPlace(data.offset, data.numObservations, 1.0, trainingSamples);
       }
       
@@ -1640,8 +2899,13 @@ namespace {
       if (control.keepTrainingFits) {
         double* trainingSamples = results.trainingSamples + (simNum + chainStride) * data.numObservations;
         // set training to dataScale.range * (totalFits + 0.5) + dataScale.min + offset
-        ext_setVectorToConstant(trainingSamples, data.numObservations, sharedScratch.dataScale.range * 0.5 + sharedScratch.dataScale.min);
-        ext_addVectorsInPlace(trainingSample, data.numObservations, sharedScratch.dataScale.range, trainingSamples);
+        if (order == NULL) {
+          ext_setVectorToConstant(trainingSamples, data.numObservations, sharedScratch.dataScale.range * 0.5 + sharedScratch.dataScale.min);
+          ext_addVectorsInPlace(trainingSample, data.numObservations, sharedScratch.dataScale.range, trainingSamples);
+        } else {
+          for (size_t i = 0; i < data.numObservations; ++i)
+            trainingSamples[order[i]] = sharedScratch.dataScale.range * (trainingSample[i] + 0.5) + sharedScratch.dataScale.min;
+        }
         if (data.offset != NULL) ext_addVectorsInPlace(data.offset, data.numObservations, 1.0, trainingSamples);
       }
       
@@ -1679,6 +2943,7 @@ namespace {
 #include <sys/stat.h> // permissions
 #include <fcntl.h>    // open flags
 #include <unistd.h>   // unlink
+#include <cerrno>     // errno
 #include "binaryIO.hpp"
 
 #ifndef S_IRGRP
@@ -1689,10 +2954,176 @@ namespace {
 #endif
 
 #define FILE_VERSION_STRING_LENGTH 8
-#define FILE_VERSION_STRING "00.09.02"
+#define FILE_VERSION_STRING "00.09.05"
+
+namespace {
+  using namespace dbarts;
+  
+  enum StreamingPredictionStage {
+    STREAMING_READ,
+    STREAMING_COMPUTE,
+    STREAMING_WRITE
+  };
+  
+  struct StreamingPredictionData {
+    const BARTFit* fit;
+    ext_binaryIO* input;
+    ext_binaryIO* output;
+    size_t numTestObservations;
+    size_t chunkSize;
+    size_t numResultColumns;
+    bool writeDraws;
+    bool includeMean;
+    bool includeVariance;
+    const double* quantiles;
+    size_t numQuantiles;
+  };
+  struct StreamingPredictionTaskData {
+    const StreamingPredictionData* shared;
+    StreamingPredictionStage stage;
+    size_t chunkNum;
+    const double* x_test; // compute only
+    double* buffer;       // destination of reads and computes, source of writes
+    int errorCode;
+  };
+}
+
+extern "C" void streamingPredictionTask(void* v_data)
+{
+  StreamingPredictionTaskData& taskData(*static_cast<StreamingPredictionTaskData*>(v_data));
+  const StreamingPredictionData& data(*taskData.shared);
+  
+  size_t chunkStart  = taskData.chunkNum * data.chunkSize;
+  size_t chunkLength = std::min(data.chunkSize, data.numTestObservations - chunkStart);
+  
+  taskData.errorCode = 0;
+  switch (taskData.stage) {
+    case STREAMING_READ:
+    // each column of the chunk is contiguous in the file
+    for (size_t j = 0; j < data.fit->data.numPredictors && taskData.errorCode == 0; ++j)
+      taskData.errorCode = ext_bio_readNDoublesAt(data.input, (j * data.numTestObservations + chunkStart) * sizeof(double),
+                                                  taskData.buffer + j * chunkLength, chunkLength);
+    break;
+    
+    case STREAMING_COMPUTE:
+    if (data.writeDraws)
+      data.fit->predict(taskData.x_test, chunkLength, NULL, taskData.buffer);
+    else
+      data.fit->predictSummaries(taskData.x_test, chunkLength, NULL, data.includeMean, data.includeVariance,
+                                 data.quantiles, data.numQuantiles, taskData.buffer);
+    break;
+    
+    case STREAMING_WRITE:
+    for (size_t j = 0; j < data.numResultColumns && taskData.errorCode == 0; ++j)
+      taskData.errorCode = ext_bio_writeNDoublesAt(data.output, (j * data.numTestObservations + chunkStart) * sizeof(double),
+                                                   taskData.buffer + j * chunkLength, chunkLength);
+    break;
+  }
+}
 
 namespace dbarts {
   
+  void BARTFit::predictFromFile(const char* x_testFileName, size_t numTestObservations, const char* resultFileName,
+                                size_t chunkSize, bool writeDraws,
+                                bool includeMean, bool includeVariance, const double* quantiles, size_t numQuantiles) const
+  {
+    if (!control.keepTrees) ext_throwError("predict requires 'keepTrees' to be true");
+    if (chunkSize == 0) ext_throwError("chunk size must be positive");
+    
+    StreamingPredictionData streamingData = { this, NULL, NULL, numTestObservations, std::min(chunkSize, numTestObservations),
+      writeDraws ? currentNumSamples * control.numChains : (includeMean ? 1 : 0) + (includeVariance ? 1 : 0) + numQuantiles,
+      writeDraws, includeMean, includeVariance, quantiles, numQuantiles };
+    
+    ext_binaryIO input, output;
+    int errorCode = ext_bio_initialize(&input, x_testFileName, O_RDONLY, 0);
+    if (errorCode != 0) ext_throwError("unable to open file '%s': %s", x_testFileName, std::strerror(errorCode));
+    
+    // checked up front so that a short file doesn't fail partway through writing the results
+    struct stat fileStatus;
+    if (fstat(input.fileDescriptor, &fileStatus) != 0) {
+      errorCode = errno;
+      ext_bio_invalidate(&input);
+      ext_throwError("unable to stat file '%s': %s", x_testFileName, std::strerror(errorCode));
+    }
+    if (static_cast<size_t>(fileStatus.st_size) < numTestObservations * data.numPredictors * sizeof(double)) {
+      ext_bio_invalidate(&input);
+      ext_throwError("file '%s' is too short to hold %lu observations of %lu predictors", x_testFileName,
+                     static_cast<unsigned long>(numTestObservations), static_cast<unsigned long>(data.numPredictors));
+    }
+    
+    errorCode = ext_bio_initialize(&output, resultFileName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (errorCode != 0) {
+      ext_bio_invalidate(&input);
+      ext_throwError("unable to open file '%s': %s", resultFileName, std::strerror(errorCode));
+    }
+    streamingData.input = &input;
+    streamingData.output = &output;
+    
+    if (numTestObservations == 0 || streamingData.numResultColumns == 0) {
+      ext_bio_invalidate(&output);
+      ext_bio_invalidate(&input);
+      return;
+    }
+    
+    // at step s, chunk s is read, chunk s - 1 computed, and chunk s - 2 written; chunks alternate
+    // between two sets of buffers so that no stage touches those of another
+    size_t numChunks = (numTestObservations - 1) / streamingData.chunkSize + 1;
+    double* inputBuffers[2];
+    double* outputBuffers[2];
+    for (size_t i = 0; i < 2; ++i) {
+      inputBuffers[i]  = new double[streamingData.chunkSize * data.numPredictors];
+      outputBuffers[i] = new double[streamingData.chunkSize * streamingData.numResultColumns];
+    }
+    
+    // reads and writes run beside the computation, which itself uses the fit's threads
+    ext_mt_manager_t ioThreadManager = NULL;
+    if (numChunks > 1 && ext_mt_create(&ioThreadManager, 3) != 0) ioThreadManager = NULL;
+    
+    StreamingPredictionTaskData taskData[3];
+    void* taskDataPtrs[3];
+    
+    for (size_t stepNum = 0; stepNum < numChunks + 2 && errorCode == 0; ++stepNum) {
+      size_t numTasks = 0;
+      if (stepNum < numChunks) {
+        StreamingPredictionTaskData readData = { &streamingData, STREAMING_READ, stepNum, NULL, inputBuffers[stepNum % 2], 0 };
+        taskData[numTasks++] = readData;
+      }
+      if (stepNum >= 1 && stepNum - 1 < numChunks) {
+        StreamingPredictionTaskData computeData = { &streamingData, STREAMING_COMPUTE, stepNum - 1, inputBuffers[(stepNum - 1) % 2], outputBuffers[(stepNum - 1) % 2], 0 };
+        taskData[numTasks++] = computeData;
+      }
+      if (stepNum >= 2) {
+        StreamingPredictionTaskData writeData = { &streamingData, STREAMING_WRITE, stepNum - 2, NULL, outputBuffers[stepNum % 2], 0 };
+        taskData[numTasks++] = writeData;
+      }
+      for (size_t i = 0; i < numTasks; ++i) taskDataPtrs[i] = &taskData[i];
+      
+      if (ioThreadManager != NULL && numTasks > 1) {
+        ext_mt_runTasks(ioThreadManager, &streamingPredictionTask, taskDataPtrs, numTasks);
+      } else {
+        for (size_t i = 0; i < numTasks; ++i) streamingPredictionTask(taskDataPtrs[i]);
+      }
+      
+      for (size_t i = 0; i < numTasks && errorCode == 0; ++i) errorCode = taskData[i].errorCode;
+    }
+    
+    if (ioThreadManager != NULL) ext_mt_destroy(ioThreadManager);
+    
+    for (size_t i = 0; i < 2; ++i) {
+      delete [] outputBuffers[i];
+      delete [] inputBuffers[i];
+    }
+    
+    ext_bio_invalidate(&output);
+    ext_bio_invalidate(&input);
+    
+    if (errorCode != 0) {
+      unlink(resultFileName);
+      ext_throwError("error streaming predictions: %s", std::strerror(errorCode));
+    }
+  }
+  
+  
   bool BARTFit::saveToFile(const char* fileName) const
   {
     ext_binaryIO bio;
@@ -1713,9 +3144,11 @@ namespace dbarts {
     if (ext_bio_writeNChars(&bio, FILE_VERSION_STRING, FILE_VERSION_STRING_LENGTH) != 0) goto save_failed;
     
     if (ext_bio_writeSizeType(&bio, currentNumSamples) != 0) goto save_failed;
+    if (ext_bio_writeSizeType(&bio, currentSampleNum) != 0) goto save_failed;
     
     if (writeControl(&bio, control) == false) goto save_failed;
     ext_printf("wrote control\n");
+    if (writeCutPoints(&bio, data, sharedScratch) == false) goto save_failed;
     if (writeModel(&bio, model) == false) goto save_failed;
     ext_printf("wrote model\n");
     if (writeData(&bio, data) == false) goto save_failed;
@@ -1726,6 +3159,11 @@ namespace dbarts {
     
     if (ext_bio_writeDouble(&bio, runningTime) != 0) goto save_failed;
     
+    // writes are buffered, so this is where a full disk shows up
+    if ((errorCode = ext_bio_flush(&bio)) != 0) {
+      ext_issueWarning("error writing to file: %s", std::strerror(errorCode));
+      goto save_failed;
+    }
     ext_bio_invalidate(&bio);
     
     model.sigmaSqPrior->setScale(originalScale);
@@ -1770,13 +3208,23 @@ save_failed:
     
     if (readControl(&bio, control, version) == false) goto load_failed;
     ext_printf("read control\n");
-    if (readModel(&bio, model) == false) goto load_failed;
+    // recomputed from the data
+    if ((version.major > 0 || version.minor > 9 || (version.minor == 9 && version.revision > 4)) &&
+        skipCutPoints(&bio) == false) goto load_failed;
+    if (readModel(&bio, model, version) == false) goto load_failed;
     ext_printf("read model\n");
     if (readData(&bio, data) == false) goto load_failed;
     ext_printf("read data\n");
     
     result = new BARTFit(control, model, data);
     
+    // the fit is created with the default number of samples, which need not match what was saved
+    if (result->control.keepTrees) {
+      for (size_t chainNum = 0; chainNum < result->control.numChains; ++chainNum)
+        result->state[chainNum].resize(*result, currentNumSamples);
+    }
+    result->currentNumSamples = currentNumSamples;
+    
     if (readState(&bio, result->state, result->control, result->data, currentNumSamples, version) == false) goto load_failed;
     ext_printf("read state\n");
     
@@ -1803,6 +3251,9 @@ load_failed:
     delete [] data.offset;
     delete [] data.weights;
     delete [] data.x_test;
+    delete [] data.x_sparse.values;
+    delete [] data.x_sparse.rowIndices;
+    delete [] data.x_sparse.columnStarts;
     delete [] data.x;
     delete [] data.y;
     
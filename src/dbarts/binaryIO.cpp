@@ -11,11 +11,16 @@
 #include <external/io.h>
 #include <external/random.h>
 
+#include <vector>
+
+#include <dbarts/compactFit.hpp>
 #include <dbarts/control.hpp>
 #include <dbarts/data.hpp>
 #include <dbarts/model.hpp>
+#include <dbarts/scratch.hpp>
 #include <dbarts/state.hpp>
 
+#include "compressedSample.hpp"
 #include "tree.hpp"
 
 #define VERSION_STRING_LENGTH 8
@@ -27,6 +32,9 @@ namespace dbarts {
 #define CONTROL_VERBOSE         2
 #define CONTROL_KEEP_TRAINING   4
 #define CONTROL_USE_QUANTILES   8
+#define CONTROL_KEEP_TREES      16
+#define CONTROL_COMPRESS_TREES  32
+#define CONTROL_REORDER_OBSERVATIONS 64
   
   bool writeControl(ext_binaryIO* bio, const Control& control) {
     int errorCode = 0;
@@ -36,6 +44,9 @@ namespace dbarts {
     controlFlags += control.verbose ? CONTROL_VERBOSE : 0;
     controlFlags += control.keepTrainingFits ? CONTROL_KEEP_TRAINING : 0;
     controlFlags += control.useQuantiles ? CONTROL_USE_QUANTILES : 0;
+    controlFlags += control.keepTrees ? CONTROL_KEEP_TREES : 0;
+    controlFlags += control.compressTrees ? CONTROL_COMPRESS_TREES : 0;
+    controlFlags += control.reorderObservations ? CONTROL_REORDER_OBSERVATIONS : 0;
     
     if ((errorCode = ext_bio_writeUnsigned32BitInteger(bio, controlFlags)) != 0) goto write_control_cleanup;
     
@@ -80,6 +91,12 @@ write_control_cleanup:
     control.verbose = (controlFlags & CONTROL_VERBOSE) != 0;
     control.keepTrainingFits = (controlFlags & CONTROL_KEEP_TRAINING) != 0;
     control.useQuantiles = (controlFlags & CONTROL_USE_QUANTILES) != 0;
+    // not written before version 00.09.04
+    if (version.major > 0 || version.minor > 9 || (version.minor == 9 && version.revision > 3)) {
+      control.keepTrees = (controlFlags & CONTROL_KEEP_TREES) != 0;
+      control.compressTrees = (controlFlags & CONTROL_COMPRESS_TREES) != 0;
+      control.reorderObservations = (controlFlags & CONTROL_REORDER_OBSERVATIONS) != 0;
+    }
     
     if ((errorCode = ext_bio_readSizeType(bio, &control.defaultNumSamples)) != 0) goto read_control_cleanup;
     if ((errorCode = ext_bio_readSizeType(bio, &control.defaultNumBurnIn)) != 0) goto read_control_cleanup;
@@ -121,6 +138,7 @@ read_control_cleanup:
 #define DATA_HAS_OFFSET       2
 #define DATA_HAS_TEST_OFFSET  4
 #define DATA_HAS_MAX_NUM_CUTS 8
+#define DATA_HAS_SPARSE_X     16
     
   bool writeData(ext_binaryIO* bio, const Data& data) {
     int errorCode = 0;
@@ -131,6 +149,7 @@ read_control_cleanup:
     dataFlags |= ((data.offset != NULL) ?  DATA_HAS_OFFSET : 0);
     dataFlags |= ((data.testOffset != NULL) ? DATA_HAS_TEST_OFFSET : 0);
     dataFlags |= ((data.maxNumCuts != NULL) ? DATA_HAS_MAX_NUM_CUTS : 0);
+    dataFlags |= (data.predictorsAreSparse() ? DATA_HAS_SPARSE_X : 0);
     
     if ((errorCode = ext_bio_writeUnsigned32BitInteger(bio, dataFlags)) != 0) goto write_data_cleanup;
     
@@ -140,7 +159,15 @@ read_control_cleanup:
     if ((errorCode = ext_bio_writeDouble(bio, data.sigmaEstimate)) != 0) goto write_data_cleanup;
     
     if ((errorCode = ext_bio_writeNDoubles(bio, data.y, data.numObservations)) != 0) goto write_data_cleanup;
-    if ((errorCode = ext_bio_writeNDoubles(bio, data.x, data.numObservations * data.numPredictors)) != 0) goto write_data_cleanup;
+    if (data.predictorsAreSparse()) {
+      // column starts, then row indices and values of the non-zeros
+      size_t numNonZeros = static_cast<size_t>(data.x_sparse.columnStarts[data.numPredictors]);
+      if ((errorCode = ext_bio_writeNInts(bio, data.x_sparse.columnStarts, data.numPredictors + 1)) != 0) goto write_data_cleanup;
+      if ((errorCode = ext_bio_writeNInts(bio, data.x_sparse.rowIndices, numNonZeros)) != 0) goto write_data_cleanup;
+      if ((errorCode = ext_bio_writeNDoubles(bio, data.x_sparse.values, numNonZeros)) != 0) goto write_data_cleanup;
+    } else {
+      if ((errorCode = ext_bio_writeNDoubles(bio, data.x, data.numObservations * data.numPredictors)) != 0) goto write_data_cleanup;
+    }
     if (data.numTestObservations > 0 &&
       (errorCode = ext_bio_writeNDoubles(bio, data.x_test, data.numTestObservations * data.numPredictors)) != 0) goto write_data_cleanup;
     
@@ -183,8 +210,22 @@ write_data_cleanup:
     data.y = new double[data.numObservations];
     if ((errorCode = ext_bio_readNDoubles(bio, const_cast<double*>(data.y), data.numObservations)) != 0) goto read_data_cleanup;
     
-    data.x = new double[data.numObservations * data.numPredictors];
-    if ((errorCode = ext_bio_readNDoubles(bio, const_cast<double*>(data.x), data.numObservations * data.numPredictors)) != 0) goto read_data_cleanup;
+    if (dataFlags & DATA_HAS_SPARSE_X) {
+      data.x = NULL;
+      int32_t* columnStarts = new int32_t[data.numPredictors + 1];
+      data.x_sparse.columnStarts = columnStarts;
+      if ((errorCode = ext_bio_readNInts(bio, columnStarts, data.numPredictors + 1)) != 0) goto read_data_cleanup;
+      if (columnStarts[0] != 0 || columnStarts[data.numPredictors] < 0) { errorCode = EINVAL; goto read_data_cleanup; }
+      
+      size_t numNonZeros = static_cast<size_t>(columnStarts[data.numPredictors]);
+      data.x_sparse.rowIndices = new int32_t[numNonZeros];
+      if ((errorCode = ext_bio_readNInts(bio, const_cast<int32_t*>(data.x_sparse.rowIndices), numNonZeros)) != 0) goto read_data_cleanup;
+      data.x_sparse.values = new double[numNonZeros];
+      if ((errorCode = ext_bio_readNDoubles(bio, const_cast<double*>(data.x_sparse.values), numNonZeros)) != 0) goto read_data_cleanup;
+    } else {
+      data.x = new double[data.numObservations * data.numPredictors];
+      if ((errorCode = ext_bio_readNDoubles(bio, const_cast<double*>(data.x), data.numObservations * data.numPredictors)) != 0) goto read_data_cleanup;
+    }
     
     if (data.numTestObservations > 0) {
       data.x_test = new double[data.numTestObservations * data.numPredictors];
@@ -226,6 +267,9 @@ read_data_cleanup:
       delete [] data.offset;
       delete [] data.weights;
       delete [] data.x_test;
+      delete [] data.x_sparse.values;
+      delete [] data.x_sparse.rowIndices;
+      delete [] data.x_sparse.columnStarts;
       delete [] data.x;
       delete [] data.y;
     
@@ -235,6 +279,138 @@ read_data_cleanup:
     return errorCode == 0;
   }
   
+  bool skipData(ext_binaryIO* bio, size_t& numObservations, size_t& numPredictors)
+  {
+    int errorCode = 0;
+    uint32_t dataFlags = 0;
+    size_t numTestObservations;
+    
+    if ((errorCode = ext_bio_readNUnsigned32BitIntegers(bio, &dataFlags, 1)) != 0) goto skip_data_cleanup;
+    
+    if ((errorCode = ext_bio_readSizeType(bio, &numObservations)) != 0) goto skip_data_cleanup;
+    if ((errorCode = ext_bio_readSizeType(bio, &numPredictors)) != 0) goto skip_data_cleanup;
+    if ((errorCode = ext_bio_readSizeType(bio, &numTestObservations)) != 0) goto skip_data_cleanup;
+    
+    // sigma estimate and y
+    if ((errorCode = ext_bio_skip(bio, sizeof(double) * (1 + numObservations))) != 0) goto skip_data_cleanup;
+    
+    if (dataFlags & DATA_HAS_SPARSE_X) {
+      // the last column start gives the number of non-zeros
+      int numNonZeros;
+      if ((errorCode = ext_bio_skip(bio, sizeof(uint64_t) * numPredictors)) != 0) goto skip_data_cleanup;
+      if ((errorCode = ext_bio_readNInts(bio, &numNonZeros, 1)) != 0) goto skip_data_cleanup;
+      if (numNonZeros < 0) { errorCode = EINVAL; goto skip_data_cleanup; }
+      if ((errorCode = ext_bio_skip(bio, (sizeof(uint64_t) + sizeof(double)) * static_cast<size_t>(numNonZeros))) != 0) goto skip_data_cleanup;
+    } else {
+      if ((errorCode = ext_bio_skip(bio, sizeof(double) * numObservations * numPredictors)) != 0) goto skip_data_cleanup;
+    }
+    if ((errorCode = ext_bio_skip(bio, sizeof(double) * numTestObservations * numPredictors)) != 0) goto skip_data_cleanup;
+    
+    if ((dataFlags & DATA_HAS_WEIGHTS) &&
+        (errorCode = ext_bio_skip(bio, sizeof(double) * numObservations)) != 0) goto skip_data_cleanup;
+    if ((dataFlags & DATA_HAS_OFFSET) &&
+        (errorCode = ext_bio_skip(bio, sizeof(double) * numObservations)) != 0) goto skip_data_cleanup;
+    if ((dataFlags & DATA_HAS_TEST_OFFSET) &&
+        (errorCode = ext_bio_skip(bio, sizeof(double) * numTestObservations)) != 0) goto skip_data_cleanup;
+    
+    // variable types and max num cuts
+    errorCode = ext_bio_skip(bio, sizeof(uint32_t) * numPredictors * ((dataFlags & DATA_HAS_MAX_NUM_CUTS) ? 2 : 1));
+    
+skip_data_cleanup:
+    if (errorCode != 0) ext_issueWarning("error skipping data object: %s", std::strerror(errorCode));
+    
+    return errorCode == 0;
+  }
+  
+  // New as of version 00.09.05. Cut points depend on the data, so without them the data would
+  // have to be read to use the trees. The section starts with its length so that it can be
+  // skipped.
+  bool writeCutPoints(ext_binaryIO* bio, const Data& data, const SharedScratch& sharedScratch)
+  {
+    int errorCode = 0;
+    uint32_t* variableTypes = NULL;
+    double dataScale[3];
+    
+    size_t sectionLength = sizeof(uint64_t) + 2 * sizeof(uint32_t) * data.numPredictors + 3 * sizeof(double);
+    for (size_t j = 0; j < data.numPredictors; ++j) sectionLength += sizeof(double) * sharedScratch.numCutsPerVariable[j];
+    
+    if ((errorCode = ext_bio_writeSizeType(bio, sectionLength)) != 0) goto write_cut_points_cleanup;
+    if ((errorCode = ext_bio_writeSizeType(bio, data.numPredictors)) != 0) goto write_cut_points_cleanup;
+    
+    variableTypes = ext_stackAllocate(data.numPredictors, uint32_t);
+    for (size_t j = 0; j < data.numPredictors; ++j) variableTypes[j] = static_cast<uint32_t>(data.variableTypes[j]);
+    if ((errorCode = ext_bio_writeNUnsigned32BitIntegers(bio, variableTypes, data.numPredictors)) != 0) goto write_cut_points_cleanup;
+    
+    if ((errorCode = ext_bio_writeNUnsigned32BitIntegers(bio, sharedScratch.numCutsPerVariable, data.numPredictors)) != 0) goto write_cut_points_cleanup;
+    for (size_t j = 0; j < data.numPredictors; ++j) {
+      if ((errorCode = ext_bio_writeNDoubles(bio, sharedScratch.cutPoints[j], sharedScratch.numCutsPerVariable[j])) != 0) goto write_cut_points_cleanup;
+    }
+    
+    dataScale[0] = sharedScratch.dataScale.min;
+    dataScale[1] = sharedScratch.dataScale.max;
+    dataScale[2] = sharedScratch.dataScale.range;
+    if ((errorCode = ext_bio_writeNDoubles(bio, dataScale, 3)) != 0) goto write_cut_points_cleanup;
+    
+write_cut_points_cleanup:
+    if (variableTypes != NULL) { ext_stackFree(variableTypes); }
+    
+    if (errorCode != 0) ext_issueWarning("error writing cut points: %s", std::strerror(errorCode));
+    
+    return errorCode == 0;
+  }
+  
+  bool skipCutPoints(ext_binaryIO* bio)
+  {
+    int errorCode = 0;
+    size_t sectionLength;
+    
+    if ((errorCode = ext_bio_readSizeType(bio, &sectionLength)) == 0)
+      errorCode = ext_bio_skip(bio, sectionLength);
+    
+    if (errorCode != 0) ext_issueWarning("error skipping cut points: %s", std::strerror(errorCode));
+    
+    return errorCode == 0;
+  }
+  
+  bool readCutPoints(ext_binaryIO* bio, CompactFit& fit)
+  {
+    int errorCode = 0;
+    size_t sectionLength;
+    uint32_t* variableTypes = NULL;
+    double dataScale[3];
+    
+    if ((errorCode = ext_bio_readSizeType(bio, &sectionLength)) != 0) goto read_cut_points_cleanup;
+    if ((errorCode = ext_bio_readSizeType(bio, &fit.numPredictors)) != 0) goto read_cut_points_cleanup;
+    
+    variableTypes = new uint32_t[fit.numPredictors];
+    if ((errorCode = ext_bio_readNUnsigned32BitIntegers(bio, variableTypes, fit.numPredictors)) != 0) goto read_cut_points_cleanup;
+    fit.variableTypes = new VariableType[fit.numPredictors];
+    for (size_t j = 0; j < fit.numPredictors; ++j) fit.variableTypes[j] = static_cast<VariableType>(variableTypes[j]);
+    
+    fit.numCutsPerVariable = new uint32_t[fit.numPredictors];
+    if ((errorCode = ext_bio_readNUnsigned32BitIntegers(bio, fit.numCutsPerVariable, fit.numPredictors)) != 0) goto read_cut_points_cleanup;
+    
+    fit.cutPoints = new double*[fit.numPredictors];
+    for (size_t j = 0; j < fit.numPredictors; ++j) fit.cutPoints[j] = NULL;
+    for (size_t j = 0; j < fit.numPredictors; ++j) {
+      fit.cutPoints[j] = new double[fit.numCutsPerVariable[j]];
+      if ((errorCode = ext_bio_readNDoubles(bio, fit.cutPoints[j], fit.numCutsPerVariable[j])) != 0) goto read_cut_points_cleanup;
+    }
+    
+    // min, max, range
+    if ((errorCode = ext_bio_readNDoubles(bio, dataScale, 3)) != 0) goto read_cut_points_cleanup;
+    fit.dataScaleMin   = dataScale[0];
+    fit.dataScaleRange = dataScale[2];
+    
+read_cut_points_cleanup:
+    delete [] variableTypes;
+    
+    // anything allocated is released with the fit
+    if (errorCode != 0) ext_issueWarning("error reading cut points: %s", std::strerror(errorCode));
+    
+    return errorCode == 0;
+  }
+  
   bool writeModel(ext_binaryIO* bio, const Model& model)
   {
     int errorCode = 0;
@@ -249,6 +425,9 @@ read_data_cleanup:
     if ((errorCode = ext_bio_writeNChars(bio, "cgm ", 4)) != 0) goto write_model_cleanup;
     if ((errorCode = ext_bio_writeDouble(bio, static_cast<CGMPrior*>(model.treePrior)->base)) != 0) goto write_model_cleanup;
     if ((errorCode = ext_bio_writeDouble(bio, static_cast<CGMPrior*>(model.treePrior)->power)) != 0) goto write_model_cleanup;
+    // new as of version 00.09.03
+    if ((errorCode = ext_bio_writeChar(bio, static_cast<CGMPrior*>(model.treePrior)->sparse ? 1 : 0)) != 0) goto write_model_cleanup;
+    if ((errorCode = ext_bio_writeDouble(bio, static_cast<CGMPrior*>(model.treePrior)->concentration)) != 0) goto write_model_cleanup;
     
     
     if ((errorCode = ext_bio_writeNChars(bio, "nrml", 4)) != 0) goto write_model_cleanup;
@@ -264,7 +443,7 @@ write_model_cleanup:
     return errorCode == 0;
   }
   
-  bool readModel(ext_binaryIO* bio, Model& model)
+  bool readModel(ext_binaryIO* bio, Model& model, const Version& version)
   {
     int errorCode = 0;
     char priorName[4];
@@ -281,6 +460,12 @@ write_model_cleanup:
     model.treePrior = new CGMPrior;
     if ((errorCode = ext_bio_readDouble(bio, &static_cast<CGMPrior*>(model.treePrior)->base)) != 0) goto read_model_cleanup;
     if ((errorCode = ext_bio_readDouble(bio, &static_cast<CGMPrior*>(model.treePrior)->power)) != 0) goto read_model_cleanup;
+    if (version.major > 0 || version.minor > 9 || (version.minor == 9 && version.revision > 2)) {
+      char sparse;
+      if ((errorCode = ext_bio_readChar(bio, &sparse)) != 0) goto read_model_cleanup;
+      static_cast<CGMPrior*>(model.treePrior)->sparse = sparse != 0;
+      if ((errorCode = ext_bio_readDouble(bio, &static_cast<CGMPrior*>(model.treePrior)->concentration)) != 0) goto read_model_cleanup;
+    }
     
     
     if ((errorCode = ext_bio_readNChars(bio, priorName, 4)) != 0) goto read_model_cleanup;
@@ -332,20 +517,32 @@ namespace dbarts {
       if ((errorCode = ext_bio_writeNDoubles(bio, state[chainNum].treeFits, data.numObservations * control.numTrees)) != 0) goto write_state_cleanup;
       
       // saved trees
-      if (control.keepTrees) {
-        if ((errorCode = ext_bio_writeNSizeTypes(bio, state[chainNum].savedTreeIndices, data.numObservations * control.numTrees * numSamples)) != 0) goto write_state_cleanup;
-
+      if (control.keepTrees && control.compressTrees) {
+        // written as encoded, each preceded by its length
+        for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum) {
+          size_t length = state[chainNum].getCompressedSampleLength(sampleNum);
+          if ((errorCode = ext_bio_writeSizeType(bio, length)) != 0) goto write_state_cleanup;
+          if ((errorCode = ext_bio_writeNChars(bio, reinterpret_cast<const char*>(state[chainNum].compressedSamples[sampleNum]), length)) != 0) goto write_state_cleanup;
+        }
+      } else if (control.keepTrees) {
+        // samples are stored separately but written contiguously, as in earlier versions
+        for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum) {
+          if ((errorCode = ext_bio_writeNSizeTypes(bio, state[chainNum].savedTreeIndices[sampleNum], data.numObservations * control.numTrees)) != 0) goto write_state_cleanup;
+        }
         for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum) {
           for (treeNum = 0; treeNum < control.numTrees; ++treeNum) {
-            size_t treeOffset = treeNum + sampleNum * control.numTrees;
-            if ((errorCode = writeTree(bio, state[chainNum].savedTrees[treeOffset], data, state[chainNum].savedTreeIndices + treeOffset * data.numObservations)) != 0) goto write_state_cleanup;
+            if ((errorCode = writeTree(bio, state[chainNum].savedTrees[sampleNum][treeNum], data, state[chainNum].savedTreeIndices[sampleNum] + treeNum * data.numObservations)) != 0) goto write_state_cleanup;
           }
         }
-        if ((errorCode = ext_bio_writeNDoubles(bio, state[chainNum].savedTreeFits, data.numObservations * control.numTrees * numSamples)) != 0) goto write_state_cleanup;
+        for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum) {
+          if ((errorCode = ext_bio_writeNDoubles(bio, state[chainNum].savedTreeFits[sampleNum], data.numObservations * control.numTrees)) != 0) goto write_state_cleanup;
+        }
       }
       
       
       if ((errorCode = ext_bio_writeDouble(bio, state[chainNum].sigma)) != 0) goto write_state_cleanup;
+      if (state[chainNum].splitProbabilities != NULL &&
+          (errorCode = ext_bio_writeNDoubles(bio, state[chainNum].splitProbabilities, data.numPredictors)) != 0) goto write_state_cleanup;
       
       rngStateLength = ext_rng_getSerializedStateLength(state[chainNum].rng) / sizeof(int);
       if ((errorCode = ext_bio_writeSizeType(bio, rngStateLength)) != 0) goto write_state_cleanup;
@@ -387,19 +584,46 @@ write_state_cleanup:
       }
       if ((errorCode = ext_bio_readNDoubles(bio, state[chainNum].treeFits, data.numObservations * control.numTrees)) != 0) goto read_state_cleanup;
       
-      if (control.keepTrees) {
-        if ((errorCode = ext_bio_readNSizeTypes(bio, state[chainNum].savedTreeIndices, data.numObservations * control.numTrees * numSamples)) != 0) goto read_state_cleanup;
-        
+      if (control.keepTrees && control.compressTrees) {
+        for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum) {
+          size_t length;
+          if ((errorCode = ext_bio_readSizeType(bio, &length)) != 0) goto read_state_cleanup;
+          if (length < 8) {
+            errorCode = EINVAL;
+            goto read_state_cleanup;
+          }
+          unsigned char* buffer = new unsigned char[length];
+          if ((errorCode = ext_bio_readNChars(bio, reinterpret_cast<char*>(buffer), length)) != 0) {
+            delete [] buffer;
+            goto read_state_cleanup;
+          }
+          // the header repeats the length, and decompression trusts it
+          if (readCompressedSampleLength(buffer) != length) {
+            delete [] buffer;
+            errorCode = EINVAL;
+            goto read_state_cleanup;
+          }
+          delete [] state[chainNum].compressedSamples[sampleNum];
+          state[chainNum].compressedSamples[sampleNum] = buffer;
+        }
+      } else if (control.keepTrees) {
+        for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum) {
+          if ((errorCode = ext_bio_readNSizeTypes(bio, state[chainNum].savedTreeIndices[sampleNum], data.numObservations * control.numTrees)) != 0) goto read_state_cleanup;
+        }
         for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum) {
           for (treeNum = 0; treeNum < control.numTrees; ++treeNum) {
-            size_t treeOffset = treeNum + sampleNum * control.numTrees;
-            if ((errorCode = readTree(bio, state[chainNum].savedTrees[treeOffset], data, state[chainNum].savedTreeIndices + treeOffset * data.numObservations)) != 0) goto read_state_cleanup;
+            if ((errorCode = readTree(bio, state[chainNum].savedTrees[sampleNum][treeNum], data, state[chainNum].savedTreeIndices[sampleNum] + treeNum * data.numObservations)) != 0) goto read_state_cleanup;
           }
         }
-        if ((errorCode = ext_bio_readNDoubles(bio, state[chainNum].savedTreeFits, data.numObservations * control.numTrees * numSamples)) != 0) goto read_state_cleanup;
+        for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum) {
+          if ((errorCode = ext_bio_readNDoubles(bio, state[chainNum].savedTreeFits[sampleNum], data.numObservations * control.numTrees)) != 0) goto read_state_cleanup;
+        }
       }
       
       if ((errorCode = ext_bio_readDouble(bio, &state[chainNum].sigma)) != 0) goto read_state_cleanup;
+      // allocated by the fit when the model is sparse, which older versions never were
+      if (state[chainNum].splitProbabilities != NULL &&
+          (errorCode = ext_bio_readNDoubles(bio, state[chainNum].splitProbabilities, data.numPredictors)) != 0) goto read_state_cleanup;
       
       if (version.major > 0 || version.minor > 8) {
         if ((errorCode = ext_bio_readSizeType(bio, &rngStateLength)) != 0) goto read_state_cleanup;
@@ -494,7 +718,9 @@ ext_bio_readVersion_error:
   }
 }
 
-#define NODE_HAS_CHILDREN 1
+#define NODE_HAS_CHILDREN   1
+#define NODE_HAS_WIDE_RULE  2
+#define NODE_MISSING_GOES_RIGHT 4
 namespace {
   int writeNode(ext_binaryIO* bio, const dbarts::Node& node, const dbarts::Data& data, const size_t* treeIndices)
   {
@@ -519,11 +745,19 @@ namespace {
     
     if (node.leftChild != NULL) {
       nodeFlags += NODE_HAS_CHILDREN;
+      if (node.p.rule.numCategoryWords != 0) nodeFlags += NODE_HAS_WIDE_RULE;
+      if (node.p.rule.missingGoesRight) nodeFlags += NODE_MISSING_GOES_RIGHT;
       
       if ((errorCode = ext_bio_writeChar(bio, *reinterpret_cast<char*>(&nodeFlags))) != 0) goto write_node_cleanup;
       
       if ((errorCode = ext_bio_writeUnsigned32BitInteger(bio, *(reinterpret_cast<const uint32_t*>(&node.p.rule.variableIndex)))) != 0) goto write_node_cleanup;
-      if ((errorCode = ext_bio_writeUnsigned32BitInteger(bio, node.p.rule.categoryDirections)) != 0) goto write_node_cleanup;
+      if (nodeFlags & NODE_HAS_WIDE_RULE) {
+        if ((errorCode = ext_bio_writeUnsigned32BitInteger(bio, node.p.rule.numCategoryWords)) != 0) goto write_node_cleanup;
+        for (uint32_t i = 0; i < node.p.rule.numCategoryWords; ++i)
+          if ((errorCode = ext_bio_writeUnsigned64BitInteger(bio, node.p.rule.categoryDirectionsWide[i])) != 0) goto write_node_cleanup;
+      } else {
+        if ((errorCode = ext_bio_writeUnsigned32BitInteger(bio, node.p.rule.categoryDirections)) != 0) goto write_node_cleanup;
+      }
       
       if ((errorCode = writeNode(bio, *node.leftChild, data, treeIndices))) goto write_node_cleanup;
       if ((errorCode = writeNode(bio, *node.p.rightChild, data, treeIndices))) goto write_node_cleanup;
@@ -568,11 +802,23 @@ write_node_cleanup:
     
     if ((errorCode = ext_bio_readChar(bio, reinterpret_cast<char*>(&nodeFlags))) != 0) goto read_node_cleanup;
     
-    if (nodeFlags > NODE_HAS_CHILDREN) { errorCode = EINVAL; goto read_node_cleanup; }
+    node.p.rule.numCategoryWords = 0;
+    if (nodeFlags > (NODE_HAS_CHILDREN | NODE_HAS_WIDE_RULE | NODE_MISSING_GOES_RIGHT)) { errorCode = EINVAL; goto read_node_cleanup; }
+    node.p.rule.missingGoesRight = (nodeFlags & NODE_MISSING_GOES_RIGHT) != 0;
     
     if (nodeFlags & NODE_HAS_CHILDREN) {
       if ((errorCode = ext_bio_readUnsigned32BitInteger(bio, reinterpret_cast<uint32_t*>(&node.p.rule.variableIndex))) != 0) goto read_node_cleanup;
-      if ((errorCode = ext_bio_readUnsigned32BitInteger(bio, &node.p.rule.categoryDirections)) != 0) goto read_node_cleanup;
+      if (nodeFlags & NODE_HAS_WIDE_RULE) {
+        uint32_t numCategoryWords;
+        if ((errorCode = ext_bio_readUnsigned32BitInteger(bio, &numCategoryWords)) != 0) goto read_node_cleanup;
+        if (numCategoryWords == 0 || numCategoryWords > 0xFFFFu) { errorCode = EINVAL; goto read_node_cleanup; }
+        node.p.rule.categoryDirectionsWide = new uint64_t[numCategoryWords];
+        node.p.rule.numCategoryWords = static_cast<uint16_t>(numCategoryWords);
+        for (uint32_t i = 0; i < numCategoryWords; ++i)
+          if ((errorCode = ext_bio_readUnsigned64BitInteger(bio, node.p.rule.categoryDirectionsWide + i)) != 0) goto read_node_cleanup;
+      } else {
+        if ((errorCode = ext_bio_readUnsigned32BitInteger(bio, &node.p.rule.categoryDirections)) != 0) goto read_node_cleanup;
+      }
       
       leftChild = new dbarts::Node(node, data.numPredictors);
       node.leftChild = leftChild;
@@ -593,6 +839,7 @@ read_node_cleanup:
       delete rightChild;
       delete leftChild;
       
+      if (nodeFlags & NODE_HAS_CHILDREN) node.p.rule.releaseCategoryDirections();
       node.leftChild = NULL;
     }
     
@@ -604,3 +851,242 @@ read_node_cleanup:
     return readNode(bio, tree.top, data, treeIndices);
   }
 }
+
+namespace {
+  using dbarts::CompactFit;
+  
+  // where the value of a bottom node of a sample saved without compression can be found
+  struct BottomNodeLocation {
+    size_t nodeIndex;
+    size_t sampleTreeNum; // sampleNum * numTrees + treeNum
+    size_t observationOffset;
+    bool isTop;
+  };
+  
+  struct CompactTreeBuilder {
+    std::vector<CompactFit::Node> nodes;
+    std::vector<uint64_t> categoryDirectionsWide;
+    std::vector<BottomNodeLocation> bottomNodes;
+  };
+  
+  void setBottomNode(CompactFit::Node& node, double value)
+  {
+    node.variableIndex = -1;
+    node.numCategoryWords = 0;
+    node.missingGoesRight = false;
+    node.rightChild = 0;
+    node.value = value;
+  }
+  
+  // reads a node written by writeNode, appending it to builder or, if that is NULL, skipping it
+  int readCompactNode(ext_binaryIO* bio, CompactTreeBuilder* builder, size_t sampleTreeNum, size_t numObservations, size_t numPredictors, bool isTop)
+  {
+    int errorCode = 0;
+    
+    size_t observationOffset;
+    size_t numNodeObservations;
+    unsigned char nodeFlags = 0;
+    uint32_t variableIndex;
+    uint32_t numCategoryWords = 0;
+    uint32_t categoryDirections = 0;
+    uint64_t categoryWord;
+    size_t nodeIndex = 0;
+    
+    if ((errorCode = ext_bio_readSizeType(bio, &observationOffset)) != 0) return errorCode;
+    if (observationOffset >= numObservations) return EINVAL;
+    // enumeration index
+    if ((errorCode = ext_bio_skip(bio, sizeof(uint64_t))) != 0) return errorCode;
+    if ((errorCode = ext_bio_readSizeType(bio, &numNodeObservations)) != 0) return errorCode;
+    // variables available for split
+    if ((errorCode = ext_bio_skip(bio, sizeof(uint64_t))) != 0) return errorCode;
+    
+    if ((errorCode = ext_bio_readChar(bio, reinterpret_cast<char*>(&nodeFlags))) != 0) return errorCode;
+    if (nodeFlags > (NODE_HAS_CHILDREN | NODE_HAS_WIDE_RULE | NODE_MISSING_GOES_RIGHT)) return EINVAL;
+    
+    if (!(nodeFlags & NODE_HAS_CHILDREN)) {
+      // the average and number of effective observations are not the posterior value, which is
+      // looked up in the fits once the whole sample has been read
+      if ((errorCode = ext_bio_skip(bio, 2 * sizeof(double))) != 0) return errorCode;
+      
+      if (builder != NULL) {
+        CompactFit::Node node;
+        setBottomNode(node, 0.0);
+        if (isTop || numNodeObservations > 0) {
+          BottomNodeLocation location = { builder->nodes.size(), sampleTreeNum, observationOffset, isTop };
+          builder->bottomNodes.push_back(location);
+        }
+        builder->nodes.push_back(node);
+      }
+      return 0;
+    }
+    
+    if ((errorCode = ext_bio_readUnsigned32BitInteger(bio, &variableIndex)) != 0) return errorCode;
+    if (variableIndex >= numPredictors) return EINVAL;
+    
+    size_t categoryWordsOffset = builder != NULL ? builder->categoryDirectionsWide.size() : 0;
+    if (nodeFlags & NODE_HAS_WIDE_RULE) {
+      if ((errorCode = ext_bio_readUnsigned32BitInteger(bio, &numCategoryWords)) != 0) return errorCode;
+      if (numCategoryWords == 0 || numCategoryWords > 0xFFFFu) return EINVAL;
+      for (uint32_t i = 0; i < numCategoryWords; ++i) {
+        if ((errorCode = ext_bio_readUnsigned64BitInteger(bio, &categoryWord)) != 0) return errorCode;
+        if (builder != NULL) builder->categoryDirectionsWide.push_back(categoryWord);
+      }
+    } else {
+      if ((errorCode = ext_bio_readUnsigned32BitInteger(bio, &categoryDirections)) != 0) return errorCode;
+    }
+    
+    if (builder != NULL) {
+      CompactFit::Node node;
+      node.variableIndex = static_cast<int32_t>(variableIndex);
+      node.numCategoryWords = static_cast<uint16_t>(numCategoryWords);
+      node.missingGoesRight = (nodeFlags & NODE_MISSING_GOES_RIGHT) != 0;
+      node.rightChild = 0;
+      if (numCategoryWords == 0) node.categoryDirections = categoryDirections;
+      else node.categoryWordsOffset = categoryWordsOffset;
+      
+      nodeIndex = builder->nodes.size();
+      builder->nodes.push_back(node);
+    }
+    
+    if ((errorCode = readCompactNode(bio, builder, sampleTreeNum, numObservations, numPredictors, false)) != 0) return errorCode;
+    if (builder != NULL) builder->nodes[nodeIndex].rightChild = builder->nodes.size();
+    return readCompactNode(bio, builder, sampleTreeNum, numObservations, numPredictors, false);
+  }
+  
+  void decodeCompactNode(dbarts::CompressedSampleReader& reader, CompactTreeBuilder& builder, int32_t parentVariable, size_t numPredictors)
+  {
+    CompactFit::Node node;
+    node.rightChild = 0;
+    
+    if (!reader.readSplit(parentVariable, numPredictors, node.variableIndex, node.missingGoesRight, node.numCategoryWords)) {
+      setBottomNode(node, reader.readDouble());
+      builder.nodes.push_back(node);
+      return;
+    }
+    
+    if (node.numCategoryWords == 0) {
+      node.splitIndex = static_cast<int32_t>(static_cast<uint32_t>(reader.readVarint()));
+    } else {
+      node.categoryWordsOffset = builder.categoryDirectionsWide.size();
+      for (uint32_t i = 0; i < node.numCategoryWords; ++i) builder.categoryDirectionsWide.push_back(reader.readVarint());
+    }
+    
+    size_t nodeIndex = builder.nodes.size();
+    builder.nodes.push_back(node);
+    
+    decodeCompactNode(reader, builder, node.variableIndex, numPredictors);
+    builder.nodes[nodeIndex].rightChild = builder.nodes.size();
+    decodeCompactNode(reader, builder, node.variableIndex, numPredictors);
+  }
+}
+
+namespace dbarts {
+  // Reads the saved samples of the given chains, skipping everything else. Samples saved without
+  // compression keep their values in the fits, which are read only at the observations needed.
+  bool readCompactState(ext_binaryIO* bio, CompactFit& fit, const Control& control, size_t numObservations,
+                        bool hasSplitProbabilities, size_t numSavedSamples, const size_t* chains, const size_t* samples)
+  {
+    int errorCode = 0;
+    size_t numTrees = control.numTrees;
+    size_t chainIndex = 0, sampleIndex, chainNum, sampleNum, treeNum;
+    size_t length, indicesStart, fitsStart, rngStateLength;
+    size_t observationIndex, fitsOffset;
+    bool chainIsLoaded, sampleIsLoaded;
+    unsigned char* buffer = NULL;
+    CompactTreeBuilder builder;
+    
+    fit.treeStarts = new size_t[numTrees * fit.numSamples * fit.numChains];
+    
+    for (chainNum = 0; chainNum < control.numChains && chainIndex < fit.numChains; ++chainNum) {
+      chainIsLoaded = chains[chainIndex] == chainNum;
+      
+      // current trees, their indices, and fits
+      if ((errorCode = ext_bio_skip(bio, sizeof(uint64_t) * numObservations * numTrees)) != 0) goto read_compact_state_cleanup;
+      for (treeNum = 0; treeNum < numTrees; ++treeNum) {
+        if ((errorCode = readCompactNode(bio, NULL, 0, numObservations, fit.numPredictors, true)) != 0) goto read_compact_state_cleanup;
+      }
+      if ((errorCode = ext_bio_skip(bio, sizeof(double) * numObservations * numTrees)) != 0) goto read_compact_state_cleanup;
+      
+      sampleIndex = 0;
+      if (control.compressTrees) {
+        for (sampleNum = 0; sampleNum < numSavedSamples; ++sampleNum) {
+          if ((errorCode = ext_bio_readSizeType(bio, &length)) != 0) goto read_compact_state_cleanup;
+          if (length < DBARTS_COMPRESSED_SAMPLE_HEADER_LENGTH) { errorCode = EINVAL; goto read_compact_state_cleanup; }
+          
+          sampleIsLoaded = chainIsLoaded && sampleIndex < fit.numSamples && samples[sampleIndex] == sampleNum;
+          if (!sampleIsLoaded) {
+            if ((errorCode = ext_bio_skip(bio, length)) != 0) goto read_compact_state_cleanup;
+            continue;
+          }
+          
+          buffer = new unsigned char[length];
+          if ((errorCode = ext_bio_readNChars(bio, reinterpret_cast<char*>(buffer), length)) != 0) goto read_compact_state_cleanup;
+          if (readCompressedSampleLength(buffer) != length) { errorCode = EINVAL; goto read_compact_state_cleanup; }
+          
+          CompressedSampleReader reader = { buffer, length, DBARTS_COMPRESSED_SAMPLE_HEADER_LENGTH };
+          for (treeNum = 0; treeNum < numTrees; ++treeNum) {
+            fit.treeStarts[(chainIndex * fit.numSamples + sampleIndex) * numTrees + treeNum] = builder.nodes.size();
+            decodeCompactNode(reader, builder, 0, fit.numPredictors);
+          }
+          
+          delete [] buffer;
+          buffer = NULL;
+          ++sampleIndex;
+        }
+      } else {
+        // all indices, then all trees, then all fits
+        if ((errorCode = ext_bio_getPosition(bio, &indicesStart)) != 0) goto read_compact_state_cleanup;
+        if ((errorCode = ext_bio_skip(bio, sizeof(uint64_t) * numSavedSamples * numObservations * numTrees)) != 0) goto read_compact_state_cleanup;
+        
+        builder.bottomNodes.clear();
+        for (sampleNum = 0; sampleNum < numSavedSamples; ++sampleNum) {
+          sampleIsLoaded = chainIsLoaded && sampleIndex < fit.numSamples && samples[sampleIndex] == sampleNum;
+          for (treeNum = 0; treeNum < numTrees; ++treeNum) {
+            if (sampleIsLoaded) fit.treeStarts[(chainIndex * fit.numSamples + sampleIndex) * numTrees + treeNum] = builder.nodes.size();
+            if ((errorCode = readCompactNode(bio, sampleIsLoaded ? &builder : NULL, sampleNum * numTrees + treeNum, numObservations, fit.numPredictors, true)) != 0) goto read_compact_state_cleanup;
+          }
+          if (sampleIsLoaded) ++sampleIndex;
+        }
+        
+        if ((errorCode = ext_bio_getPosition(bio, &fitsStart)) != 0) goto read_compact_state_cleanup;
+        for (size_t i = 0; i < builder.bottomNodes.size(); ++i) {
+          const BottomNodeLocation& location(builder.bottomNodes[i]);
+          fitsOffset = location.sampleTreeNum * numObservations;
+          
+          // matches Tree::recoverAveragesFromFits
+          observationIndex = 0;
+          if (!location.isTop) {
+            if ((errorCode = ext_bio_readNSizeTypesAt(bio, indicesStart + sizeof(uint64_t) * (fitsOffset + location.observationOffset), &observationIndex, 1)) != 0) goto read_compact_state_cleanup;
+            if (observationIndex >= numObservations) { errorCode = EINVAL; goto read_compact_state_cleanup; }
+          }
+          if ((errorCode = ext_bio_readNDoublesAt(bio, fitsStart + sizeof(double) * (fitsOffset + observationIndex), &builder.nodes[location.nodeIndex].value, 1)) != 0) goto read_compact_state_cleanup;
+        }
+        
+        if ((errorCode = ext_bio_skip(bio, sizeof(double) * numSavedSamples * numObservations * numTrees)) != 0) goto read_compact_state_cleanup;
+      }
+      
+      if (chainIsLoaded && ++chainIndex == fit.numChains) break;
+      
+      // sigma, split probabilities, and rng state
+      if ((errorCode = ext_bio_skip(bio, sizeof(double) * (1 + (hasSplitProbabilities ? fit.numPredictors : 0)))) != 0) goto read_compact_state_cleanup;
+      if ((errorCode = ext_bio_readSizeType(bio, &rngStateLength)) != 0) goto read_compact_state_cleanup;
+      if ((errorCode = ext_bio_skip(bio, sizeof(uint64_t) * rngStateLength)) != 0) goto read_compact_state_cleanup;
+    }
+    if (chainIndex < fit.numChains) { errorCode = EINVAL; goto read_compact_state_cleanup; }
+    
+    fit.nodes = new CompactFit::Node[builder.nodes.size()];
+    for (size_t i = 0; i < builder.nodes.size(); ++i) fit.nodes[i] = builder.nodes[i];
+    
+    if (!builder.categoryDirectionsWide.empty()) {
+      fit.categoryDirectionsWide = new uint64_t[builder.categoryDirectionsWide.size()];
+      for (size_t i = 0; i < builder.categoryDirectionsWide.size(); ++i) fit.categoryDirectionsWide[i] = builder.categoryDirectionsWide[i];
+    }
+    
+read_compact_state_cleanup:
+    delete [] buffer;
+    
+    if (errorCode != 0) ext_issueWarning("error reading state object: %s", std::strerror(errorCode));
+    
+    return errorCode == 0;
+  }
+}
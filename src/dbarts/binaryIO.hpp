@@ -6,9 +6,11 @@ struct ext_binaryIO;
 #include <cstddef>
 
 namespace dbarts {
+  struct CompactFit;
   struct Control;
   struct Data;
   struct Model;
+  struct SharedScratch;
   struct State;
   
   struct Version {
@@ -23,11 +25,20 @@ namespace dbarts {
   bool writeData(ext_binaryIO* bio, const Data& data);
   bool readData(ext_binaryIO* bio, Data& data);
   
+  bool skipData(ext_binaryIO* bio, std::size_t& numObservations, std::size_t& numPredictors);
+  
+  bool writeCutPoints(ext_binaryIO* bio, const Data& data, const SharedScratch& sharedScratch);
+  bool skipCutPoints(ext_binaryIO* bio);
+  bool readCutPoints(ext_binaryIO* bio, CompactFit& fit);
+  
   bool writeModel(ext_binaryIO* bio, const Model& model);
-  bool readModel(ext_binaryIO* bio, Model& model);
+  bool readModel(ext_binaryIO* bio, Model& model, const Version& version);
   
   bool writeState(ext_binaryIO* bio, const State* state, const Control& control, const Data& data, std::size_t numSamples);
   bool readState(ext_binaryIO* bio, State* state, const Control& control, const Data& data, std::size_t numSamples, const Version& version);
+  // chains and samples hold the indices to keep, in increasing order
+  bool readCompactState(ext_binaryIO* bio, CompactFit& fit, const Control& control, std::size_t numObservations,
+                        bool hasSplitProbabilities, std::size_t numSavedSamples, const std::size_t* chains, const std::size_t* samples);
   
   int readVersion(ext_binaryIO* bio, Version& version, char** versionStringPtr);
 }
@@ -74,7 +74,7 @@ namespace dbarts {
       oldState.store(nodeToChange);
 
       bool exhaustedLeftSplits, exhaustedRightSplits;
-      Rule newRule = fit.model.treePrior->drawRuleAndVariable(fit, state.rng, nodeToChange, &exhaustedLeftSplits, &exhaustedRightSplits);
+      Rule newRule = fit.model.treePrior->drawRuleAndVariable(fit, chainNum, state.rng, nodeToChange, &exhaustedLeftSplits, &exhaustedRightSplits);
       nodeToChange.split(fit, chainNum, newRule, y, exhaustedLeftSplits, exhaustedRightSplits);
       
       // determine how to go backwards
@@ -289,6 +289,7 @@ namespace {
       // successful death step
       delete node.getLeftChild();
       delete node.getRightChild();
+      node.p.rule.releaseCategoryDirections();
     }
   }
   
@@ -299,6 +300,7 @@ namespace {
         // TODO: clean this up
         delete other.leftChild; other.leftChild = NULL;
         delete other.p.rightChild; other.p.rightChild = NULL;
+        other.p.rule.releaseCategoryDirections();
       }
     }
     std::memcpy(static_cast<void*>(&other), static_cast<const void*>(&node), sizeof(Node));
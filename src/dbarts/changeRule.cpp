@@ -30,6 +30,11 @@ using std::uint64_t;
 // note: I got real tired of fixing the unreadable code that went before and haven't managed to
 // re-write this yet
 
+// enumerating all 2^(k - 1) - 1 splits gets out of hand quickly, so past this we propose splits at
+// random and keep the first good one
+#define MAX_NUM_CATEGORIES_TO_ENUMERATE 16
+#define MAX_NUM_CATEGORICAL_RULE_PROPOSALS 100
+
 namespace {
   using namespace dbarts;
   // Since a change rule, well, changes the rule at a node it does not influence the 
@@ -59,8 +64,13 @@ namespace dbarts {
   void findGoodOrdinalRules(const BARTFit& fit, const Node& node, int32_t variableIndex, int32_t* lowerIndex, int32_t* upperIndex);
   void findOrdinalMinMaxSplitIndices(const BARTFit& fit, const Node& node, int32_t variableIndex, int32_t* min, int32_t* max);
   void findGoodCategoricalRules(const BARTFit& fit, const Node& node, int32_t variableIndex, bool* categoryCombinationsAreGood, uint32_t* firstGoodCategory);
+  bool categoryCombinationIsGood(const Node& node, int32_t variableIndex, uint32_t numCategories, const bool* sel, const bool* categoriesGoRight,
+                                 NodeVector& leftBottomVector, bool* leftNodesAreReachable, NodeVector& rightBottomVector, bool* rightNodesAreReachable);
+  bool drawGoodCategoricalRuleByEnumeration(const BARTFit& fit, ext_rng* rng, const Node& node, int32_t variableIndex, bool* sel);
+  bool drawGoodCategoricalRuleByRejection(const BARTFit& fit, ext_rng* rng, const Node& node, int32_t variableIndex, bool* sel);
   bool allTrue(bool* v, size_t length);
   size_t getIndexOfFirstTrueValue(bool* v, size_t length);
+  bool drawMissingGoesRight(const BARTFit& fit, ext_rng* rng, int32_t variableIndex);
   
   
   double changeRule(const BARTFit& fit, size_t chainNum, Tree& tree, const double* y, double sigma, bool* stepTaken)
@@ -86,51 +96,33 @@ namespace dbarts {
     Node& nodeToChange(*notBottomNodes[nodeIndex]);
     
     //given the node, choose a new variable for the new rule
-    int32_t newVariableIndex = fit.model.treePrior->drawSplitVariable(fit, state.rng, nodeToChange);
+    int32_t newVariableIndex = fit.model.treePrior->drawSplitVariable(fit, chainNum, state.rng, nodeToChange);
     
     if (fit.data.variableTypes[newVariableIndex] == CATEGORICAL) {
-      // get the list of good cat rules given var choice
-      uint32_t firstGoodCategory;
-      
       uint32_t numCategories = fit.sharedScratch.numCutsPerVariable[newVariableIndex];
-      size_t numCategoryCombinations = (1 << (numCategories - 1)) - 1;
-      // bool* categoryCombinationsAreGood = new bool[numCategoryCombinations];
-      bool* categoryCombinationsAreGood = ext_stackAllocate(numCategoryCombinations, bool);
       
-      findGoodCategoricalRules(fit, nodeToChange, newVariableIndex, categoryCombinationsAreGood, &firstGoodCategory);
-      uint64_t numGoodRules = countTrueValues(categoryCombinationsAreGood, numCategoryCombinations);
+      // get a good cat rule given var choice, if any
+      bool* sel = ext_stackAllocate(numCategories, bool);
+      bool foundGoodRule = numCategories <= MAX_NUM_CATEGORIES_TO_ENUMERATE ?
+        drawGoodCategoricalRuleByEnumeration(fit, state.rng, nodeToChange, newVariableIndex, sel) :
+        drawGoodCategoricalRuleByRejection(fit, state.rng, nodeToChange, newVariableIndex, sel);
       
-      //if there are any good cat rules
-      if (numGoodRules > 0) {
-        // draw the rule from list of good ones
-        //u=ran1(&idum);
-        uint32_t goodCategoryNumber = static_cast<uint32_t>(ext_rng_simulateUnsignedIntegerUniformInRange(state.rng, 0, numGoodRules));
-        uint32_t categoryCombinationNumber = static_cast<uint32_t>(findIndexOfIthPositiveValue(categoryCombinationsAreGood, numCategoryCombinations, goodCategoryNumber));
-        
-        
+      if (foundGoodRule) {
         //get logpri and logL from current tree (X)
         XLogPi = fit.model.treePrior->computeTreeLogProbability(fit, tree);
         XLogL = computeLogLikelihoodForBranch(fit, chainNum, nodeToChange, y, sigma);
         
-        // copy old rule
+        // copy old rule; the state takes ownership of any category storage it had
         ::State oldState;
         oldState.store(fit, nodeToChange);
         
         // change rule at nodeToChange to the new one
-        bool* sel = ext_stackAllocate(numCategories - 1, bool);
-        setBinaryRepresentation(numCategories - 1, categoryCombinationNumber, sel);
-        
         nodeToChange.p.rule.variableIndex = newVariableIndex;
-        nodeToChange.p.rule.categoryDirections = 0u;
-        for (size_t j = 0; j < firstGoodCategory; ++j) {
-          if (sel[j] == true) nodeToChange.p.rule.setCategoryGoesRight(static_cast<uint32_t>(j));
-          else nodeToChange.p.rule.setCategoryGoesLeft(static_cast<uint32_t>(j));
-        }
-        nodeToChange.p.rule.setCategoryGoesRight(firstGoodCategory);
-        for (size_t j = firstGoodCategory + 1; j < numCategories; ++j) {
-          if (sel[j - 1] == true) nodeToChange.p.rule.setCategoryGoesRight(static_cast<uint32_t>(j));
-          else nodeToChange.p.rule.setCategoryGoesLeft(static_cast<uint32_t>(j));
+        nodeToChange.p.rule.initializeCategoryDirections(numCategories);
+        for (uint32_t j = 0; j < numCategories; ++j) {
+          if (sel[j] == true) nodeToChange.p.rule.setCategoryGoesRight(j);
         }
+        nodeToChange.p.rule.missingGoesRight = drawMissingGoesRight(fit, state.rng, newVariableIndex);
         
         // fix data at nodes below nodeToChange given new rule
         nodeToChange.addObservationsToChildren(fit, chainNum, y);
@@ -148,22 +140,22 @@ namespace dbarts {
         alpha = (alpha > 1.0 ? 1.0 : alpha);
         
         if (ext_rng_simulateBernoulli(state.rng, alpha) == 1) {
+          oldState.rule.releaseCategoryDirections();
           oldState.destroy();
           
           *stepTaken = true;
         } else {
+          nodeToChange.p.rule.releaseCategoryDirections();
           oldState.restore(fit, nodeToChange);
           
           *stepTaken = false;
         }
-        
-        ext_stackFree(sel);
       } else {
         // if no rules for that var abort step
         alpha = -1.0;
       }
       
-      ext_stackFree(categoryCombinationsAreGood);
+      ext_stackFree(sel);
     } else {
       
       //ORD variable
@@ -186,8 +178,10 @@ namespace dbarts {
         oldState.store(fit, nodeToChange);
         
         // change rule at nodeToChange to the new one
-        nodeToChange.p.rule.variableIndex = newVariableIndex;
-        nodeToChange.p.rule.splitIndex    = newRuleIndex;
+        nodeToChange.p.rule.variableIndex    = newVariableIndex;
+        nodeToChange.p.rule.numCategoryWords = 0;
+        nodeToChange.p.rule.splitIndex       = newRuleIndex;
+        nodeToChange.p.rule.missingGoesRight = drawMissingGoesRight(fit, state.rng, newVariableIndex);
         
         nodeToChange.addObservationsToChildren(fit, chainNum, y);
         
@@ -202,6 +196,7 @@ namespace dbarts {
         alpha = (alpha > 1.0 ? 1.0 : alpha);
         
         if (ext_rng_simulateBernoulli(state.rng, alpha) == 1) {	
+          oldState.rule.releaseCategoryDirections();
           oldState.destroy();
           *stepTaken = true;
         } else {
@@ -323,24 +318,8 @@ namespace dbarts {
       for (size_t j = 0; j < *firstGoodCategory; ++j) sel[j] = sel1[j];
       for (size_t j = *firstGoodCategory + 1; j < numCategories; ++j) sel[j] = sel1[j - 1];
       
-      for (size_t j = 0; j < numLeftBottomNodes; ++j) leftNodesAreReachable[j] = false;
-      for (size_t j = 0; j < numRightBottomNodes; ++j) rightNodesAreReachable[j] = true;
-      
-      for (size_t j = 0; j < numCategories; ++j) {
-        if (categoriesGoRight[j] == true) {
-          if (sel[j] == true) {
-            findReachableBottomNodesForCategory(node.getRightChild(), variableIndex, j, rightBottomVector, rightNodesAreReachable);
-          } else {
-            findReachableBottomNodesForCategory(node.getLeftChild(), variableIndex, j, leftBottomVector, leftNodesAreReachable);
-          }
-        }
-        if (allTrue(leftNodesAreReachable, numLeftBottomNodes) &&
-            allTrue(rightNodesAreReachable, numRightBottomNodes))
-        {
-          categoryCombinationsAreGood[i] = true;
-          break;
-        }
-      }
+      categoryCombinationsAreGood[i] = categoryCombinationIsGood(node, variableIndex, numCategories, sel, categoriesGoRight,
+                                                                 leftBottomVector, leftNodesAreReachable, rightBottomVector, rightNodesAreReachable);
     }
     
     ext_stackFree(sel);
@@ -350,6 +329,110 @@ namespace dbarts {
     ext_stackFree(rightNodesAreReachable);
   }
   
+  bool categoryCombinationIsGood(const Node& node, int32_t variableIndex, uint32_t numCategories, const bool* sel, const bool* categoriesGoRight,
+                                 NodeVector& leftBottomVector, bool* leftNodesAreReachable, NodeVector& rightBottomVector, bool* rightNodesAreReachable)
+  {
+    size_t numLeftBottomNodes = leftBottomVector.size();
+    size_t numRightBottomNodes = rightBottomVector.size();
+    
+    for (size_t j = 0; j < numLeftBottomNodes; ++j) leftNodesAreReachable[j] = false;
+    for (size_t j = 0; j < numRightBottomNodes; ++j) rightNodesAreReachable[j] = true;
+    
+    for (size_t j = 0; j < numCategories; ++j) {
+      if (categoriesGoRight[j] == true) {
+        if (sel[j] == true) {
+          findReachableBottomNodesForCategory(node.getRightChild(), variableIndex, j, rightBottomVector, rightNodesAreReachable);
+        } else {
+          findReachableBottomNodesForCategory(node.getLeftChild(), variableIndex, j, leftBottomVector, leftNodesAreReachable);
+        }
+      }
+      if (allTrue(leftNodesAreReachable, numLeftBottomNodes) &&
+          allTrue(rightNodesAreReachable, numRightBottomNodes))
+      {
+        return true;
+      }
+    }
+    
+    return false;
+  }
+  
+  // sel has length numCategories and on a true return holds which categories go right
+  bool drawGoodCategoricalRuleByEnumeration(const BARTFit& fit, ext_rng* rng, const Node& node, int32_t variableIndex, bool* sel)
+  {
+    uint32_t firstGoodCategory;
+    
+    uint32_t numCategories = fit.sharedScratch.numCutsPerVariable[variableIndex];
+    size_t numCategoryCombinations = (1 << (numCategories - 1)) - 1;
+    bool* categoryCombinationsAreGood = ext_stackAllocate(numCategoryCombinations, bool);
+    
+    findGoodCategoricalRules(fit, node, variableIndex, categoryCombinationsAreGood, &firstGoodCategory);
+    uint64_t numGoodRules = countTrueValues(categoryCombinationsAreGood, numCategoryCombinations);
+    
+    if (numGoodRules == 0) {
+      ext_stackFree(categoryCombinationsAreGood);
+      return false;
+    }
+    
+    // draw the rule from list of good ones
+    uint32_t goodCategoryNumber = static_cast<uint32_t>(ext_rng_simulateUnsignedIntegerUniformInRange(rng, 0, numGoodRules));
+    uint32_t categoryCombinationNumber = static_cast<uint32_t>(findIndexOfIthPositiveValue(categoryCombinationsAreGood, numCategoryCombinations, goodCategoryNumber));
+    
+    bool* sel1 = ext_stackAllocate(numCategories - 1, bool);
+    setBinaryRepresentation(numCategories - 1, categoryCombinationNumber, sel1);
+    
+    for (size_t j = 0; j < firstGoodCategory; ++j) sel[j] = sel1[j];
+    sel[firstGoodCategory] = true;
+    for (size_t j = firstGoodCategory + 1; j < numCategories; ++j) sel[j] = sel1[j - 1];
+    
+    ext_stackFree(sel1);
+    ext_stackFree(categoryCombinationsAreGood);
+    
+    return true;
+  }
+  
+  // proposes combinations uniformly and keeps the first good one, so that the result is uniform on
+  // the good combinations; gives up after a fixed number of tries
+  bool drawGoodCategoricalRuleByRejection(const BARTFit& fit, ext_rng* rng, const Node& node, int32_t variableIndex, bool* sel)
+  {
+    uint32_t numCategories = fit.sharedScratch.numCutsPerVariable[variableIndex];
+    
+    bool* categoriesGoRight = ext_stackAllocate(numCategories, bool);
+    setCategoryReachability(fit, node, variableIndex, categoriesGoRight);
+    
+    size_t firstGoodCategory = getIndexOfFirstTrueValue(categoriesGoRight, numCategories);
+    if (firstGoodCategory == numCategories) {
+      ext_stackFree(categoriesGoRight);
+      return false;
+    }
+    
+    NodeVector leftBottomVector(node.getLeftChild()->getBottomVector());
+    bool* leftNodesAreReachable = ext_stackAllocate(leftBottomVector.size(), bool);
+    
+    NodeVector rightBottomVector(node.getRightChild()->getBottomVector());
+    bool* rightNodesAreReachable = ext_stackAllocate(rightBottomVector.size(), bool);
+    
+    bool foundGoodRule = false;
+    for (size_t i = 0; i < MAX_NUM_CATEGORICAL_RULE_PROPOSALS && !foundGoodRule; ++i) {
+      bool allGoRight = true;
+      for (size_t j = 0; j < numCategories; ++j) {
+        if (j == firstGoodCategory) continue;
+        sel[j] = ext_rng_simulateBernoulli(rng, 0.5) == 1;
+        if (!sel[j]) allGoRight = false;
+      }
+      if (allGoRight) continue;
+      sel[firstGoodCategory] = true;
+      
+      foundGoodRule = categoryCombinationIsGood(node, variableIndex, numCategories, sel, categoriesGoRight,
+                                                leftBottomVector, leftNodesAreReachable, rightBottomVector, rightNodesAreReachable);
+    }
+    
+    ext_stackFree(rightNodesAreReachable);
+    ext_stackFree(leftNodesAreReachable);
+    ext_stackFree(categoriesGoRight);
+    
+    return foundGoodRule;
+  }
+  
   bool allTrue(bool* v, size_t length) {
     for (size_t i = 0; i < length; ++i) {
       if (v[i] == false) return false;
@@ -367,6 +450,12 @@ namespace dbarts {
     
     return i;
   }
+  
+  // same coin as in the tree prior, so it cancels in the acceptance ratio
+  bool drawMissingGoesRight(const BARTFit& fit, ext_rng* rng, int32_t variableIndex)
+  {
+    return fit.sharedScratch.variableHasMissingValues[variableIndex] && ext_rng_simulateBernoulli(rng, 0.5) == 1;
+  }
 }
 
 // This is a bit of a mess since I want to use copy constructors as often as
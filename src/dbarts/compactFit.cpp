@@ -0,0 +1,436 @@
+#include "config.hpp"
+#include <dbarts/compactFit.hpp>
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h> // open flags
+
+#include <external/binaryIO.h>
+#include <external/io.h>
+#include <external/linearAlgebra.h>
+
+#include <dbarts/bartFit.hpp>
+#include <dbarts/control.hpp>
+#include <dbarts/model.hpp>
+#include "binaryIO.hpp"
+#include "functions.hpp"
+#include "node.hpp"
+#include "tree.hpp"
+
+using std::size_t;
+using std::uint32_t;
+
+namespace {
+  using dbarts::CompactFit;
+
+  // follows Rule::goesRight
+  double getBottomNodeValue(const CompactFit& fit, const CompactFit::Node* node, const double* x)
+  {
+    while (node->variableIndex >= 0) {
+      double x_j = x[node->variableIndex];
+      bool goesRight;
+
+      if (dbarts::isMissing(x_j)) {
+        goesRight = node->missingGoesRight;
+      } else if (fit.variableTypes[node->variableIndex] == dbarts::CATEGORICAL) {
+        uint32_t categoryId = static_cast<uint32_t>(x_j);
+        if (x_j < 0.0 || categoryId >= fit.numCutsPerVariable[node->variableIndex]) {
+          goesRight = false;
+        } else if (node->numCategoryWords == 0) {
+          goesRight = ((1u << categoryId) & node->categoryDirections) != 0;
+        } else {
+          goesRight = ((fit.categoryDirectionsWide[node->categoryWordsOffset + (categoryId >> 6)] >> (categoryId & 63)) & 1) != 0;
+        }
+      } else {
+        goesRight = x_j > fit.cutPoints[node->variableIndex][node->splitIndex];
+      }
+
+      node = goesRight ? fit.nodes + node->rightChild : node + 1;
+    }
+
+    return node->value;
+  }
+
+  // a single tree, with children and category words indexed from its own start
+  struct FlatTree {
+    std::vector<CompactFit::Node> nodes;
+    std::vector<uint64_t> categoryDirectionsWide;
+  };
+  
+  struct CollapsedFitBuilder {
+    std::vector<CompactFit::Node> nodes;
+    std::vector<uint64_t> categoryDirectionsWide;
+    std::vector<size_t> treeStarts;
+    std::map<std::string, size_t> treeNums; // by structure key
+  };
+  
+  void appendFlatNode(FlatTree& tree, int32_t variableIndex, uint16_t numCategoryWords, bool missingGoesRight,
+                      int32_t splitIndex, const uint64_t* categoryDirectionsWide)
+  {
+    CompactFit::Node node;
+    node.variableIndex = variableIndex;
+    node.numCategoryWords = numCategoryWords;
+    node.missingGoesRight = missingGoesRight;
+    node.rightChild = 0;
+    if (numCategoryWords == 0) {
+      node.splitIndex = splitIndex;
+    } else {
+      node.categoryWordsOffset = tree.categoryDirectionsWide.size();
+      tree.categoryDirectionsWide.insert(tree.categoryDirectionsWide.end(), categoryDirectionsWide, categoryDirectionsWide + numCategoryWords);
+    }
+    tree.nodes.push_back(node);
+  }
+  
+  void appendFlatBottomNode(FlatTree& tree, double value)
+  {
+    CompactFit::Node node;
+    node.variableIndex = -1;
+    node.numCategoryWords = 0;
+    node.missingGoesRight = false;
+    node.rightChild = 0;
+    node.value = value;
+    tree.nodes.push_back(node);
+  }
+  
+  // leaf values are in the order of Node::getBottomVector
+  void flattenNode(const dbarts::Node& node, const double* leafValues, size_t& leafNum, FlatTree& tree)
+  {
+    if (node.isBottom()) {
+      appendFlatBottomNode(tree, leafValues[leafNum++]);
+      return;
+    }
+    
+    const dbarts::Rule& rule(node.p.rule);
+    size_t nodeIndex = tree.nodes.size();
+    appendFlatNode(tree, rule.variableIndex, rule.numCategoryWords, rule.missingGoesRight,
+                   rule.splitIndex, rule.numCategoryWords != 0 ? rule.categoryDirectionsWide : NULL);
+    
+    flattenNode(*node.leftChild, leafValues, leafNum, tree);
+    tree.nodes[nodeIndex].rightChild = tree.nodes.size();
+    flattenNode(*node.p.rightChild, leafValues, leafNum, tree);
+  }
+  
+  void flattenCompactNode(const CompactFit& fit, const CompactFit::Node* node, FlatTree& tree)
+  {
+    if (node->variableIndex < 0) {
+      appendFlatBottomNode(tree, node->value);
+      return;
+    }
+    
+    size_t nodeIndex = tree.nodes.size();
+    appendFlatNode(tree, node->variableIndex, node->numCategoryWords, node->missingGoesRight,
+                   node->splitIndex, node->numCategoryWords != 0 ? fit.categoryDirectionsWide + node->categoryWordsOffset : NULL);
+    
+    flattenCompactNode(fit, node + 1, tree);
+    tree.nodes[nodeIndex].rightChild = tree.nodes.size();
+    flattenCompactNode(fit, fit.nodes + node->rightChild, tree);
+  }
+  
+  // the shape follows from the nodes in pre-order, so only the rules need to be recorded
+  std::string getStructureKey(const FlatTree& tree)
+  {
+    std::string key;
+    for (size_t i = 0; i < tree.nodes.size(); ++i) {
+      const CompactFit::Node& node(tree.nodes[i]);
+      key.append(reinterpret_cast<const char*>(&node.variableIndex), sizeof(node.variableIndex));
+      if (node.variableIndex < 0) continue;
+      
+      key.push_back(node.missingGoesRight ? 1 : 0);
+      if (node.numCategoryWords == 0) {
+        key.append(reinterpret_cast<const char*>(&node.splitIndex), sizeof(node.splitIndex));
+      } else {
+        key.append(reinterpret_cast<const char*>(&node.numCategoryWords), sizeof(node.numCategoryWords));
+        key.append(reinterpret_cast<const char*>(&tree.categoryDirectionsWide[node.categoryWordsOffset]), node.numCategoryWords * sizeof(uint64_t));
+      }
+    }
+    return key;
+  }
+  
+  void addCollapsedTree(CollapsedFitBuilder& builder, const FlatTree& tree, double weight)
+  {
+    std::string key(getStructureKey(tree));
+    std::map<std::string, size_t>::iterator match = builder.treeNums.find(key);
+    
+    if (match == builder.treeNums.end()) {
+      size_t nodesStart = builder.nodes.size();
+      size_t wordsStart = builder.categoryDirectionsWide.size();
+      
+      for (size_t i = 0; i < tree.nodes.size(); ++i) {
+        CompactFit::Node node(tree.nodes[i]);
+        if (node.variableIndex < 0) {
+          node.value = 0.0;
+        } else {
+          node.rightChild += nodesStart;
+          if (node.numCategoryWords != 0) node.categoryWordsOffset += wordsStart;
+        }
+        builder.nodes.push_back(node);
+      }
+      builder.categoryDirectionsWide.insert(builder.categoryDirectionsWide.end(), tree.categoryDirectionsWide.begin(), tree.categoryDirectionsWide.end());
+      
+      match = builder.treeNums.insert(std::make_pair(key, builder.treeStarts.size())).first;
+      builder.treeStarts.push_back(nodesStart);
+    }
+    
+    CompactFit::Node* nodes = &builder.nodes[builder.treeStarts[match->second]];
+    for (size_t i = 0; i < tree.nodes.size(); ++i) {
+      if (tree.nodes[i].variableIndex < 0) nodes[i].value += weight * tree.nodes[i].value;
+    }
+  }
+  
+  // takes the trees from builder; cut points and scale are copied by the caller
+  CompactFit* createCollapsedFit(const CollapsedFitBuilder& builder, size_t numPredictors)
+  {
+    CompactFit* result = new CompactFit;
+    result->numPredictors = numPredictors;
+    result->numTrees   = builder.treeStarts.size();
+    result->numChains  = 1;
+    result->numSamples = 1;
+    
+    result->nodes = new CompactFit::Node[builder.nodes.size() > 0 ? builder.nodes.size() : 1];
+    for (size_t i = 0; i < builder.nodes.size(); ++i) result->nodes[i] = builder.nodes[i];
+    
+    result->treeStarts = new size_t[builder.treeStarts.size() > 0 ? builder.treeStarts.size() : 1];
+    for (size_t i = 0; i < builder.treeStarts.size(); ++i) result->treeStarts[i] = builder.treeStarts[i];
+    
+    if (!builder.categoryDirectionsWide.empty()) {
+      result->categoryDirectionsWide = new uint64_t[builder.categoryDirectionsWide.size()];
+      for (size_t i = 0; i < builder.categoryDirectionsWide.size(); ++i) result->categoryDirectionsWide[i] = builder.categoryDirectionsWide[i];
+    }
+    
+    return result;
+  }
+  
+  void copyCutPoints(CompactFit& fit, const dbarts::VariableType* variableTypes, const uint32_t* numCutsPerVariable,
+                     const double* const* cutPoints)
+  {
+    fit.variableTypes = new dbarts::VariableType[fit.numPredictors];
+    fit.numCutsPerVariable = new uint32_t[fit.numPredictors];
+    fit.cutPoints = new double*[fit.numPredictors];
+    for (size_t j = 0; j < fit.numPredictors; ++j) {
+      fit.variableTypes[j] = variableTypes[j];
+      fit.numCutsPerVariable[j] = numCutsPerVariable[j];
+      fit.cutPoints[j] = new double[numCutsPerVariable[j]];
+      std::memcpy(fit.cutPoints[j], cutPoints[j], numCutsPerVariable[j] * sizeof(double));
+    }
+  }
+  
+  bool indicesAreValid(const size_t* indices, size_t numIndices, size_t bound)
+  {
+    for (size_t i = 0; i < numIndices; ++i) {
+      if (indices[i] >= bound || (i > 0 && indices[i] <= indices[i - 1])) return false;
+    }
+    return true;
+  }
+}
+
+namespace dbarts {
+  CompactFit::CompactFit() :
+    numPredictors(0), numTrees(0), numChains(0), numSamples(0),
+    variableTypes(NULL), numCutsPerVariable(NULL), cutPoints(NULL), dataScaleMin(0.0), dataScaleRange(1.0),
+    nodes(NULL), treeStarts(NULL), categoryDirectionsWide(NULL)
+  {
+  }
+
+  CompactFit::~CompactFit()
+  {
+    delete [] categoryDirectionsWide;
+    delete [] treeStarts;
+    delete [] nodes;
+
+    if (cutPoints != NULL) {
+      for (size_t j = 0; j < numPredictors; ++j) delete [] cutPoints[j];
+      delete [] cutPoints;
+    }
+    delete [] numCutsPerVariable;
+    delete [] variableTypes;
+  }
+
+  void CompactFit::predict(const double* x_test, size_t numTestObservations, const double* testOffset, double* result) const
+  {
+    double* xt_test = new double[numTestObservations * numPredictors];
+    ext_transposeMatrix(x_test, numTestObservations, numPredictors, xt_test);
+
+    for (size_t chainNum = 0; chainNum < numChains; ++chainNum) {
+      for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum) {
+        const size_t* sampleTreeStarts = treeStarts + (chainNum * numSamples + sampleNum) * numTrees;
+        double* result_i = result + (sampleNum + chainNum * numSamples) * numTestObservations;
+
+        for (size_t i = 0; i < numTestObservations; ++i) {
+          const double* x_i = xt_test + i * numPredictors;
+
+          double totalFit = 0.0;
+          for (size_t treeNum = 0; treeNum < numTrees; ++treeNum)
+            totalFit += getBottomNodeValue(*this, nodes + sampleTreeStarts[treeNum], x_i);
+
+          result_i[i] = dataScaleRange * 0.5 + dataScaleMin + dataScaleRange * totalFit;
+        }
+        if (testOffset != NULL) ext_addVectorsInPlace(testOffset, numTestObservations, 1.0, result_i);
+      }
+    }
+
+    delete [] xt_test;
+  }
+
+  CompactFit* CompactFit::collapseSamples() const
+  {
+    CollapsedFitBuilder builder;
+    double weight = 1.0 / static_cast<double>(numChains * numSamples);
+    
+    for (size_t i = 0; i < numChains * numSamples * numTrees; ++i) {
+      FlatTree tree;
+      flattenCompactNode(*this, nodes + treeStarts[i], tree);
+      addCollapsedTree(builder, tree, weight);
+    }
+    
+    CompactFit* result = createCollapsedFit(builder, numPredictors);
+    copyCutPoints(*result, variableTypes, numCutsPerVariable, cutPoints);
+    result->dataScaleMin   = dataScaleMin;
+    result->dataScaleRange = dataScaleRange;
+    
+    return result;
+  }
+  
+  CompactFit* CompactFit::collapseSamples(const BARTFit& fit)
+  {
+    if (!fit.control.keepTrees) ext_throwError("collapsing samples requires 'keepTrees' to be true");
+    
+    CollapsedFitBuilder builder;
+    double weight = 1.0 / static_cast<double>(fit.control.numChains * fit.currentNumSamples);
+    
+    for (size_t chainNum = 0; chainNum < fit.control.numChains; ++chainNum) {
+      const State& state(fit.state[chainNum]);
+      bool samplesAreCompressed = state.compressedSamples != NULL;
+      
+      for (size_t sampleNum = 0; sampleNum < fit.currentNumSamples; ++sampleNum) {
+        state.decompressSample(fit, sampleNum, false);
+        
+        for (size_t treeNum = 0; treeNum < fit.control.numTrees; ++treeNum) {
+          Tree& tree(state.savedTrees[sampleNum][treeNum]);
+          
+          const double* leafValues = samplesAreCompressed ?
+            tree.recoverAveragesFromNodes() :
+            tree.recoverAveragesFromFits(fit, state.savedTreeFits[sampleNum] + treeNum * fit.data.numObservations);
+          
+          FlatTree flatTree;
+          size_t leafNum = 0;
+          flattenNode(tree.top, leafValues, leafNum, flatTree);
+          addCollapsedTree(builder, flatTree, weight);
+          
+          delete [] leafValues;
+        }
+      }
+    }
+    
+    CompactFit* result = createCollapsedFit(builder, fit.data.numPredictors);
+    copyCutPoints(*result, fit.data.variableTypes, fit.sharedScratch.numCutsPerVariable, fit.sharedScratch.cutPoints);
+    result->dataScaleMin   = fit.sharedScratch.dataScale.min;
+    result->dataScaleRange = fit.sharedScratch.dataScale.range;
+    
+    return result;
+  }
+  
+  CompactFit* CompactFit::loadFromFile(const char* fileName, const size_t* chains, size_t numChains,
+                                       const size_t* samples, size_t numSamples)
+  {
+    ext_binaryIO bio;
+    int errorCode = ext_bio_initialize(&bio, fileName, O_RDONLY, 0);
+    if (errorCode != 0) {
+      ext_issueWarning("unable to open file: %s", std::strerror(errorCode));
+      return NULL;
+    }
+
+    Version version;
+    char* versionString = NULL;
+    if ((errorCode = readVersion(&bio, version, &versionString)) != 0) {
+      ext_issueWarning("unable to parse version string '%s': %s", versionString, std::strerror(errorCode));
+      delete [] versionString;
+      ext_bio_invalidate(&bio);
+      return NULL;
+    }
+
+    size_t numSavedSamples;
+    size_t currentSampleNum;
+    size_t numObservations;
+    size_t numPredictors;
+    bool hasSplitProbabilities;
+    size_t* allChains = NULL;
+    size_t* allSamples = NULL;
+
+    Control control;
+    Model model;
+    CompactFit* result = new CompactFit;
+
+    // cut points were first saved in 00.09.05
+    if (version.major == 0 && (version.minor < 9 || (version.minor == 9 && version.revision < 5))) {
+      ext_issueWarning("files saved before version 00.09.05 must be loaded in full");
+      goto load_failed;
+    }
+
+    if ((errorCode = ext_bio_readSizeType(&bio, &numSavedSamples)) != 0) goto load_failed;
+    if ((errorCode = ext_bio_readSizeType(&bio, &currentSampleNum)) != 0) goto load_failed;
+
+    if (readControl(&bio, control, version) == false) goto load_failed;
+    if (!control.keepTrees) {
+      ext_issueWarning("saved fit does not contain trees; 'keepTrees' must be true");
+      goto load_failed;
+    }
+
+    if (chains == NULL) {
+      allChains = new size_t[control.numChains];
+      for (size_t chainNum = 0; chainNum < control.numChains; ++chainNum) allChains[chainNum] = chainNum;
+      chains = allChains;
+      numChains = control.numChains;
+    }
+    if (samples == NULL) {
+      allSamples = new size_t[numSavedSamples];
+      for (size_t sampleNum = 0; sampleNum < numSavedSamples; ++sampleNum) allSamples[sampleNum] = sampleNum;
+      samples = allSamples;
+      numSamples = numSavedSamples;
+    }
+    if (!indicesAreValid(chains, numChains, control.numChains) || !indicesAreValid(samples, numSamples, numSavedSamples)) {
+      ext_issueWarning("chains and samples must be increasing and within those saved");
+      goto load_failed;
+    }
+
+    result->numTrees   = control.numTrees;
+    result->numChains  = numChains;
+    result->numSamples = numSamples;
+
+    if (readCutPoints(&bio, *result) == false) goto load_failed;
+
+    // only needed to know if the state has split probabilities
+    if (readModel(&bio, model, version) == false) goto load_failed;
+    hasSplitProbabilities = model.treePrior->usesSplitProbabilities();
+    delete model.sigmaSqPrior;
+    delete model.muPrior;
+    delete model.treePrior;
+
+    if (skipData(&bio, numObservations, numPredictors) == false) goto load_failed;
+    if (numPredictors != result->numPredictors) {
+      ext_issueWarning("error reading data object: %s", std::strerror(EINVAL));
+      goto load_failed;
+    }
+
+    if (readCompactState(&bio, *result, control, numObservations, hasSplitProbabilities, numSavedSamples, chains, samples) == false) goto load_failed;
+
+    ext_bio_invalidate(&bio);
+    delete [] allSamples;
+    delete [] allChains;
+
+    return result;
+
+load_failed:
+    if (errorCode != 0) ext_issueWarning("error reading file: %s", std::strerror(errorCode));
+
+    ext_bio_invalidate(&bio);
+    delete [] allSamples;
+    delete [] allChains;
+    delete result;
+
+    return NULL;
+  }
+}
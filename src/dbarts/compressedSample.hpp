@@ -0,0 +1,85 @@
+#ifndef DBARTS_COMPRESSED_SAMPLE_HPP
+#define DBARTS_COMPRESSED_SAMPLE_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <dbarts/cstdint.hpp>
+
+#include <external/io.h>
+
+// Compressed samples are a byte stream holding each of a sample's trees in preorder. A bottom
+// node is a zero followed by its value. A split is one plus the zig-zag coded difference between
+// its variable and its parent's, shifted up to make room for a bit giving the direction of
+// missing values; next come the number of wide category words and then either the split index
+// or the words themselves. Integers are base-128 varints and doubles are 8 little-endian bytes.
+// The first 8 bytes give the total length.
+//
+// Each sample is encoded on its own, without reference to the sample kept before it. Saved slots
+// are overwritten in a cycle, recreated individually from tree strings, and read one at a time by
+// CompactFit::loadFromFile, all of which need any sample to be decodable by itself; a delta chain
+// would have to be re-encoded whenever one of its links changed.
+#define DBARTS_COMPRESSED_SAMPLE_HEADER_LENGTH 8
+
+namespace dbarts {
+  struct CompressedSampleReader {
+    const unsigned char* buffer;
+    std::size_t length;
+    std::size_t pos;
+    
+    unsigned char readByte() {
+      if (pos >= length) ext_throwError("compressed sample is truncated");
+      return buffer[pos++];
+    }
+    
+    std::uint64_t readVarint() {
+      std::uint64_t result = 0;
+      for (std::size_t shift = 0; shift < 64; shift += 7) {
+        unsigned char byte = readByte();
+        result |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return result;
+      }
+      ext_throwError("compressed sample contains an invalid integer");
+      return 0;
+    }
+    
+    std::uint64_t readFixed64() {
+      std::uint64_t result = 0;
+      for (std::size_t i = 0; i < 8; ++i) result |= static_cast<std::uint64_t>(readByte()) << (8 * i);
+      return result;
+    }
+    
+    double readDouble() {
+      std::uint64_t u = readFixed64();
+      double result;
+      std::memcpy(&result, &u, sizeof(double));
+      return result;
+    }
+    
+    // returns false for a bottom node; for splits, the split index or category words follow
+    bool readSplit(std::int32_t parentVariable, std::size_t numPredictors, std::int32_t& variableIndex, bool& missingGoesRight, std::uint16_t& numCategoryWords) {
+      std::uint64_t tag = readVarint();
+      if (tag == 0) return false;
+      
+      --tag;
+      missingGoesRight = (tag & 1) != 0;
+      std::uint64_t zigZag = tag >> 1;
+      std::int64_t delta = (zigZag & 1) != 0 ? -static_cast<std::int64_t>(zigZag >> 1) - 1 : static_cast<std::int64_t>(zigZag >> 1);
+      variableIndex = static_cast<std::int32_t>(parentVariable + delta);
+      if (variableIndex < 0 || static_cast<std::size_t>(variableIndex) >= numPredictors)
+        ext_throwError("compressed sample contains an invalid variable");
+      
+      std::uint64_t numWords = readVarint();
+      if (numWords > 0xFFFF) ext_throwError("compressed sample contains an invalid rule");
+      numCategoryWords = static_cast<std::uint16_t>(numWords);
+      
+      return true;
+    }
+  };
+  
+  inline std::size_t readCompressedSampleLength(const unsigned char* buffer) {
+    CompressedSampleReader reader = { buffer, DBARTS_COMPRESSED_SAMPLE_HEADER_LENGTH, 0 };
+    return static_cast<std::size_t>(reader.readFixed64());
+  }
+}
+
+#endif // DBARTS_COMPRESSED_SAMPLE_HPP
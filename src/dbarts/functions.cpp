@@ -1,6 +1,7 @@
 #include "config.hpp"
 #include "functions.hpp"
 
+#include <algorithm> // lower_bound
 #include <vector>
 
 #include <external/io.h>
@@ -77,15 +78,13 @@ namespace dbarts {
       }
       
       if (node->p.rule.variableIndex == variableIndex) {
-        uint32_t categoryMask = 1u;
-        for (size_t i = 0; i < numCategories; ++i) {
+        for (uint32_t i = 0; i < numCategories; ++i) {
           if (catGoesRight[i] == true) {
-            if ((node->p.rule.categoryDirections & categoryMask) != 0) {
+            if (node->p.rule.categoryGoesRight(i)) {
               leftChildCategories[i] = false;
             } else {
               rightChildCategories[i] = false;
             }
-            categoryMask <<= 1;
           }
         }
       }
@@ -130,7 +129,7 @@ namespace dbarts {
   
   void setBinaryRepresentation(uint32_t length, uint32_t ind, bool* d)
   {
-    if (length > 64) ext_throwError("attempt to get binary representation for more than 32 categories not supported.");
+    if (length > 32) ext_throwError("attempt to get binary representation for more than 32 categories not supported.");
     for (uint32_t i = 0; i < length; ++i) {
       d[i] = ((ind & 1) == true);
       ind >>= 1;
@@ -185,6 +184,78 @@ namespace dbarts {
     return DBARTS_INVALID_RULE_VARIABLE;
   }
   
+  // tree[i - 1] holds the sum of weights (i - lowbit(i), i]; built in linear time by pushing each
+  // partial sum up to its parent
+  void buildPartialSumTree(double* weights, size_t length)
+  {
+    for (size_t i = 1; i <= length; ++i) {
+      size_t parent = i + (i & (~i + 1));
+      if (parent <= length) weights[parent - 1] += weights[i - 1];
+    }
+  }
+  
+  double getPartialSumTreeTotal(const double* tree, size_t length)
+  {
+    double result = 0.0;
+    for (size_t i = length; i > 0; i -= (i & (~i + 1))) result += tree[i - 1];
+    return result;
+  }
+  
+  double getPartialSumTreeValue(const double* tree, size_t index)
+  {
+    size_t i = index + 1;
+    double result = tree[i - 1];
+    
+    // subtract the children, which are the nodes reached by stripping low bits down to the parent's
+    size_t stop = i - (i & (~i + 1));
+    for (size_t j = i - 1; j > stop; j -= (j & (~j + 1))) result -= tree[j - 1];
+    
+    return result;
+  }
+  
+  size_t findPartialSumTreeIndex(const double* tree, size_t length, double u)
+  {
+    size_t highBit = 1;
+    while (highBit <= length / 2) highBit <<= 1;
+    
+    size_t position = 0;
+    for (size_t step = highBit; step > 0; step >>= 1) {
+      if (position + step <= length && tree[position + step - 1] <= u) {
+        position += step;
+        u -= tree[position - 1];
+      }
+    }
+    
+    // rounding can push u past the total
+    return position < length ? position : length - 1;
+  }
+  
+  size_t findPartialSumTreeIndexExcluding(const double* tree, size_t length, double u, const size_t* excluded,
+                                          const double* excludedSums, size_t numExcluded)
+  {
+    size_t highBit = 1;
+    while (highBit <= length / 2) highBit <<= 1;
+    
+    // each step covers indices [position, position + step), so the excluded weight within it comes
+    // from the excluded indices between the two ends
+    size_t position = 0;
+    const size_t* excludedEnd = excluded + numExcluded;
+    for (size_t step = highBit; step > 0; step >>= 1) {
+      if (position + step > length) continue;
+      
+      size_t first = static_cast<size_t>(std::lower_bound(excluded, excludedEnd, position) - excluded);
+      size_t last  = static_cast<size_t>(std::lower_bound(excluded + first, excludedEnd, position + step) - excluded);
+      double weight = tree[position + step - 1] - (excludedSums[last] - excludedSums[first]);
+      
+      if (weight <= u) {
+        position += step;
+        u -= weight;
+      }
+    }
+    
+    return position < length ? position : length - 1;
+  }
+  
   // get interval of available splits for ordered variable
   //
   // we go up from bottom of tree, and when we find our variable:
@@ -6,6 +6,9 @@
 
 #include <dbarts/types.hpp>
 
+#include <external/io.h>
+#include <external/memory.h>
+
 namespace dbarts {
   struct BARTFit;
   struct State;
@@ -24,6 +27,32 @@ namespace dbarts {
   int32_t findIndexOfIthPositiveValue(bool* values, std::size_t numValues, std::size_t i);
   void setCategoryReachability(const BARTFit& fit, const Node& node, std::int32_t variableIndex, bool* categoriesCanReachNode);
   void setSplitInterval(const BARTFit& fit, const Node& startNode, std::int32_t variableIndex, std::int32_t* leftIndex, std::int32_t* rightIndex);
+  
+  // partial sum (Fenwick) trees over non-negative weights, for O(log n) weighted draws; trees
+  // are stored in place of the weights themselves
+  void buildPartialSumTree(double* weights, std::size_t length);
+  double getPartialSumTreeTotal(const double* tree, std::size_t length);
+  double getPartialSumTreeValue(const double* tree, std::size_t index);
+  // smallest index whose cumulative weight exceeds u
+  std::size_t findPartialSumTreeIndex(const double* tree, std::size_t length, double u);
+  // as above, but as if the weights at the increasing indices in excluded were zero; excludedSums
+  // has numExcluded + 1 entries, with excludedSums[k] the total weight of the first k of them
+  std::size_t findPartialSumTreeIndexExcluding(const double* tree, std::size_t length, double u, const std::size_t* excluded,
+                                               const double* excludedSums, std::size_t numExcluded);
+  
+  // missing values arrive as NaN, R's NA_real_ included
+  inline bool isMissing(double x) { return x != x; }
+  
+  // for the large per-observation arrays that are swept every iteration; see external/memory.h
+  template <typename T>
+  T* createAlignedArray(std::size_t length) {
+    if (length > static_cast<std::size_t>(-1) / sizeof(T)) ext_throwError("array of length %lu is too large to allocate", static_cast<unsigned long int>(length));
+    T* result = static_cast<T*>(ext_alignedAlloc(length * sizeof(T)));
+    if (result == NULL) ext_throwError("unable to allocate array of length %lu", static_cast<unsigned long int>(length));
+    return result;
+  }
+  template <typename T>
+  void deleteAlignedArray(T* array) { ext_alignedFree(const_cast<void*>(static_cast<const void*>(array))); }
 }
 
 #endif
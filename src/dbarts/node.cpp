@@ -1,7 +1,7 @@
 #include "config.hpp"
 #include "node.hpp"
 
-#include <cstring>    // memcpy
+#include <cstring>    // memcpy, memmove, memcmp, memset
 #include <algorithm>  // int max
 
 #include <external/alloca.h>
@@ -16,6 +16,9 @@
 #include <dbarts/scratch.hpp>
 #include "functions.hpp"
 
+using std::int32_t;
+using std::uint16_t;
+using std::uint32_t;
 using std::uint64_t;
 using std::size_t;
 
@@ -31,15 +34,42 @@ namespace dbarts {
   
   void Rule::invalidate() {
     variableIndex = DBARTS_INVALID_RULE_VARIABLE;
+    numCategoryWords = 0;
+    missingGoesRight = false;
     splitIndex = DBARTS_INVALID_RULE_VARIABLE;
   }
   
+  void Rule::initializeCategoryDirections(uint32_t numCategories)
+  {
+    if (numCategories <= DBARTS_MAX_NUM_INLINE_CATEGORIES) {
+      numCategoryWords = 0;
+      categoryDirections = 0u;
+      return;
+    }
+    
+    numCategoryWords = static_cast<uint16_t>((numCategories + 63) / 64);
+    categoryDirectionsWide = new uint64_t[numCategoryWords];
+    std::memset(categoryDirectionsWide, 0, numCategoryWords * sizeof(uint64_t));
+  }
+  
+  void Rule::releaseCategoryDirections()
+  {
+    if (numCategoryWords == 0) return;
+    
+    delete [] categoryDirectionsWide;
+    numCategoryWords = 0;
+    categoryDirections = 0u;
+  }
+  
   bool Rule::goesRight(const BARTFit& fit, const double* x) const
   {
+    if (isMissing(x[variableIndex])) return missingGoesRight;
+    
     if (fit.data.variableTypes[variableIndex] == CATEGORICAL) {
-      // x is a double, but that is 64 bits wide, and as such we can treat it as
-      // a 64 bit integer
-      uint32_t categoryId = static_cast<uint32_t>(*(reinterpret_cast<const uint64_t*>(x + variableIndex)));
+      // categorical predictors are coded as 0, 1, ..., numCategories - 1; levels not seen
+      // when fitting, e.g. in test data, go left
+      uint32_t categoryId = static_cast<uint32_t>(x[variableIndex]);
+      if (x[variableIndex] < 0.0 || categoryId >= fit.sharedScratch.numCutsPerVariable[variableIndex]) return false;
       
       return categoryGoesRight(categoryId);
     } else {
@@ -49,16 +79,23 @@ namespace dbarts {
     }
   }
   
+  // does not release any storage currently held, as this is called on uninitialized rules
   void Rule::copyFrom(const Rule& other)
   {
     if (other.variableIndex == DBARTS_INVALID_RULE_VARIABLE) {
-      variableIndex = DBARTS_INVALID_RULE_VARIABLE;
-      splitIndex    = DBARTS_INVALID_RULE_VARIABLE;
+      invalidate();
       return;
     }
     
-    variableIndex = other.variableIndex;
-    splitIndex    = other.splitIndex;
+    variableIndex    = other.variableIndex;
+    numCategoryWords = other.numCategoryWords;
+    missingGoesRight = other.missingGoesRight;
+    if (numCategoryWords == 0) {
+      splitIndex = other.splitIndex;
+    } else {
+      categoryDirectionsWide = new uint64_t[numCategoryWords];
+      std::memcpy(categoryDirectionsWide, other.categoryDirectionsWide, numCategoryWords * sizeof(uint64_t));
+    }
   }
   
   void Rule::swapWith(Rule& other)
@@ -69,7 +106,12 @@ namespace dbarts {
   }
 
   bool Rule::equals(const Rule& other) const {
-    if (variableIndex != other.variableIndex) return false;
+    if (variableIndex != other.variableIndex || missingGoesRight != other.missingGoesRight) return false;
+    
+    if (numCategoryWords != 0 || other.numCategoryWords != 0) {
+      if (numCategoryWords != other.numCategoryWords) return false;
+      return std::memcmp(categoryDirectionsWide, other.categoryDirectionsWide, numCategoryWords * sizeof(uint64_t)) == 0;
+    }
     
     // since is a union of variables of the same width, bit-wise equality is sufficient
     return splitIndex == other.splitIndex;
@@ -97,6 +139,7 @@ namespace dbarts {
       delete p.rightChild;
       
       leftChild = NULL;
+      p.rule.releaseCategoryDirections();
       p.rule.invalidate();
     }
     clearObservations();
@@ -161,6 +204,7 @@ namespace dbarts {
     if (leftChild != NULL) {
       delete leftChild; leftChild = NULL;
       delete p.rightChild; p.rightChild = NULL;
+      p.rule.releaseCategoryDirections();
     }
     delete [] variablesAvailableForSplit; variablesAvailableForSplit = NULL;
   }
@@ -199,7 +243,7 @@ namespace dbarts {
       
       if (fit.data.variableTypes[p.rule.variableIndex] == CATEGORICAL) {
         ext_printf("CATRule: ");
-        for (size_t i = 0; 0 < fit.sharedScratch.numCutsPerVariable[p.rule.variableIndex]; ++i) ext_printf(" %u", (p.rule.categoryDirections >> i) & 1);
+        for (uint32_t i = 0; i < fit.sharedScratch.numCutsPerVariable[p.rule.variableIndex]; ++i) ext_printf(" %u", p.rule.categoryGoesRight(i) ? 1u : 0u);
       } else {
         ext_printf("ORDRule: (%d)=%f", p.rule.splitIndex, p.rule.getSplitValue(fit));
       }
@@ -377,23 +421,88 @@ namespace dbarts {
     
     return leftChild->findBottomNode(fit, x);
   }
+  
+  bool Node::hasSameStructureAs(const Node& other) const
+  {
+    if (leftChild == NULL || other.leftChild == NULL) return leftChild == NULL && other.leftChild == NULL;
+    
+    return p.rule.equals(other.p.rule) &&
+           leftChild->hasSameStructureAs(*other.leftChild) &&
+           p.rightChild->hasSameStructureAs(*other.p.rightChild);
+  }
 }
 
 
 namespace {
   using namespace dbarts;
   
-  struct IndexOrdering {
-    const BARTFit& fit;
-    const Rule &rule;
+  // Columns of x as seen by the partition orderings. Dense columns are read with a stride from xt;
+  // sparse columns are merged against the observation indices, see partitionSparseIndices.
+  struct DenseColumn {
+    const double* x;
+    size_t stride;
+    
+    DenseColumn(const BARTFit& fit, int32_t variableIndex) :
+      x(fit.sharedScratch.xt + variableIndex), stride(fit.data.numPredictors) { }
+    
+    double operator[](size_t i) const { return x[i * stride]; }
+  };
+  
+  struct SparseColumn {
+    const double* values;
+    const int32_t* rowIndices;
+    size_t numNonZeros;
+    
+    SparseColumn(const BARTFit& fit, int32_t variableIndex) :
+      values(fit.data.x_sparse.values + fit.data.x_sparse.columnStarts[variableIndex]),
+      rowIndices(fit.data.x_sparse.rowIndices + fit.data.x_sparse.columnStarts[variableIndex]),
+      numNonZeros(static_cast<size_t>(fit.data.x_sparse.columnStarts[variableIndex + 1] - fit.data.x_sparse.columnStarts[variableIndex])) { }
+  };
+  
+  // Orderings read straight from the rule's column so that the variable type and storage are resolved
+  // once per partition instead of once per observation.
+  template <typename Column>
+  struct OrdinalIndexOrdering {
+    Column x;
+    double splitValue;
+    
+    bool missingGoesRight;
     
-    IndexOrdering(const BARTFit& fit, const Rule &rule) : fit(fit), rule(rule) { }
+    OrdinalIndexOrdering(const BARTFit& fit, const Rule& rule) :
+      x(fit, rule.variableIndex), splitValue(fit.sharedScratch.cutPoints[rule.variableIndex][rule.splitIndex]),
+      missingGoesRight(rule.missingGoesRight) { }
     
-    bool operator()(size_t i) const { return rule.goesRight(fit, fit.sharedScratch.xt + i * fit.data.numPredictors); }
+    // comparisons with NaN are false, so missing values only need a second look when they go right
+    bool valueGoesRight(double x_i) const { return x_i > splitValue || (missingGoesRight && isMissing(x_i)); }
+    bool operator()(size_t i) const { return valueGoesRight(x[i]); }
+  };
+  
+  // Tests category membership a word at a time; narrow rules are widened into a single word so that
+  // both layouts share the same loop.
+  template <typename Column>
+  struct CategoricalIndexOrdering {
+    Column x;
+    uint64_t inlineDirections;
+    const uint64_t* directions;
+    bool missingGoesRight;
+    
+    CategoricalIndexOrdering(const BARTFit& fit, const Rule& rule) :
+      x(fit, rule.variableIndex),
+      inlineDirections(rule.numCategoryWords == 0 ? static_cast<uint64_t>(rule.categoryDirections) : 0),
+      directions(rule.numCategoryWords == 0 ? &inlineDirections : rule.categoryDirectionsWide),
+      missingGoesRight(rule.missingGoesRight) { }
+    
+    bool valueGoesRight(double x_i) const {
+      if (isMissing(x_i)) return missingGoesRight;
+      uint32_t categoryId = static_cast<uint32_t>(x_i);
+      return ((directions[categoryId >> 6] >> (categoryId & 63)) & 1) != 0;
+    }
+    bool operator()(size_t i) const { return valueGoesRight(x[i]); }
   };
   
   // returns how many observations are on the "left"
-  size_t partitionRange(size_t* restrict indices, size_t startIndex, size_t length, IndexOrdering& restrict indexGoesRight) {
+  template <typename IndexOrdering>
+  size_t partitionRange(size_t* restrict indices, size_t startIndex, size_t length, const IndexOrdering& indexGoesRight) {
     size_t lengthOfLeft;
     
     size_t lh = 0, rh = length - 1;
@@ -420,7 +529,8 @@ namespace {
     return lengthOfLeft;
   }
   
-  size_t partitionIndices(size_t* restrict indices, size_t length, IndexOrdering& restrict indexGoesRight) {
+  template <typename IndexOrdering>
+  size_t partitionIndices(size_t* restrict indices, size_t length, const IndexOrdering& indexGoesRight) {
     if (length == 0) return 0;
     
     size_t lengthOfLeft;
@@ -449,6 +559,108 @@ namespace {
     return lengthOfLeft;
   }
   
+  // first element of the sorted range [begin, end) that is not less than value, found by doubling
+  // steps out from begin so that short advances stay cheap
+  template <typename T, typename U>
+  const T* gallopToLowerBound(const T* begin, const T* end, U value) {
+    if (begin == end || !(static_cast<U>(*begin) < value)) return begin;
+    
+    const T* lower = begin;
+    size_t step = 1;
+    while (step < static_cast<size_t>(end - lower) && static_cast<U>(lower[step]) < value) {
+      lower += step;
+      step *= 2;
+    }
+    const T* upper = step < static_cast<size_t>(end - lower) ? lower + step : end;
+    
+    ++lower;
+    while (lower < upper) {
+      const T* middle = lower + (upper - lower) / 2;
+      if (static_cast<U>(*middle) < value) lower = middle + 1; else upper = middle;
+    }
+    return lower;
+  }
+  
+  // Sparse partitions are stable, so as the top node starts with its observations in order every
+  // node's indices are sorted and can be merged against the column's row indices. Rows between two
+  // non-zeros are implicitly zero and are moved to the same side as a block; both sequences are
+  // advanced by galloping, so the work scales with the node size and the column's non-zeros
+  // rather than with their product. Observations going right are held in the caller's buffer, which
+  // is at least length long, until they are copied in after those going left.
+  template <typename IndexOrdering>
+  size_t partitionSparseIndices(size_t* indices, size_t length, const IndexOrdering& indexGoesRight, size_t* right) {
+    if (length == 0) return 0;
+    
+    const SparseColumn& x(indexGoesRight.x);
+    bool zeroGoesRight = indexGoesRight.valueGoesRight(0.0);
+    
+    size_t numOnLeft = 0, numOnRight = 0;
+    
+    const int32_t* nonZero = x.rowIndices;
+    const int32_t* nonZerosEnd = x.rowIndices + x.numNonZeros;
+    
+    size_t r = 0;
+    while (r < length) {
+      nonZero = gallopToLowerBound(nonZero, nonZerosEnd, indices[r]);
+      
+      size_t runEnd = nonZero == nonZerosEnd ? length :
+        static_cast<size_t>(gallopToLowerBound(indices + r, indices + length, static_cast<size_t>(*nonZero)) - indices);
+      if (runEnd > r) {
+        if (zeroGoesRight) {
+          std::memcpy(right + numOnRight, indices + r, (runEnd - r) * sizeof(size_t));
+          numOnRight += runEnd - r;
+        } else {
+          std::memmove(indices + numOnLeft, indices + r, (runEnd - r) * sizeof(size_t));
+          numOnLeft += runEnd - r;
+        }
+        r = runEnd;
+        if (r == length) break;
+      }
+      
+      if (indices[r] == static_cast<size_t>(*nonZero)) {
+        if (indexGoesRight.valueGoesRight(x.values[nonZero - x.rowIndices]))
+          right[numOnRight++] = indices[r];
+        else
+          indices[numOnLeft++] = indices[r];
+        ++r;
+        ++nonZero;
+      }
+    }
+    
+    std::memcpy(indices + numOnLeft, right, numOnRight * sizeof(size_t));
+    
+    return numOnLeft;
+  }
+  
+  template <typename IndexOrdering>
+  size_t partitionDenseNode(const Node& node, const IndexOrdering& ordering) {
+    return node.isTop() ?
+      partitionRange(node.observationIndices, 0, node.numObservations, ordering) :
+      partitionIndices(node.observationIndices, node.numObservations, ordering);
+  }
+  
+  template <typename IndexOrdering>
+  size_t partitionSparseNode(const Node& node, const IndexOrdering& ordering, size_t* partitionScratch) {
+    if (node.isTop())
+      for (size_t i = 0; i < node.numObservations; ++i) node.observationIndices[i] = i;
+    
+    return partitionSparseIndices(node.observationIndices, node.numObservations, ordering, partitionScratch);
+  }
+  
+  size_t partitionObservations(const BARTFit& fit, const Node& node, size_t* partitionScratch)
+  {
+    const Rule& rule(node.p.rule);
+    bool isCategorical = fit.data.variableTypes[rule.variableIndex] == CATEGORICAL;
+    
+    if (fit.data.predictorsAreSparse()) {
+      if (isCategorical) return partitionSparseNode(node, CategoricalIndexOrdering<SparseColumn>(fit, rule), partitionScratch);
+      return partitionSparseNode(node, OrdinalIndexOrdering<SparseColumn>(fit, rule), partitionScratch);
+    }
+    
+    if (isCategorical) return partitionDenseNode(node, CategoricalIndexOrdering<DenseColumn>(fit, rule));
+    return partitionDenseNode(node, OrdinalIndexOrdering<DenseColumn>(fit, rule));
+  }
+  
   /*
    // http://en.wikipedia.org/wiki/XOR_swap_algorithm
    void ext_swapVectors(size_t* restrict x, size_t* restrict y, size_t length)
@@ -550,21 +762,35 @@ namespace {
 // #define MIN_NUM_OBSERVATIONS_IN_NODE_PER_THREAD 5000
 
 namespace dbarts {
+  // a node's descendants never hold more observations than it does, so one buffer serves the whole
+  // recursion
   void Node::addObservationsToChildren(const BARTFit& fit, size_t chainNum, const double* y) {
+    size_t* partitionScratch = fit.data.predictorsAreSparse() && !isBottom() && numObservations > 0 ? new size_t[numObservations] : NULL;
+    addObservationsToChildren(fit, chainNum, y, partitionScratch);
+    delete [] partitionScratch;
+  }
+  
+  void Node::addObservationsToChildren(const BARTFit& fit) {
+    size_t* partitionScratch = fit.data.predictorsAreSparse() && !isBottom() && numObservations > 0 ? new size_t[numObservations] : NULL;
+    addObservationsToChildren(fit, partitionScratch);
+    delete [] partitionScratch;
+  }
+  
+  void Node::addObservationsToChildren(const BARTFit& fit, size_t chainNum, const double* y, size_t* partitionScratch) {
     if (isBottom()) {
       if (isTop()) {
-        if (fit.data.weights == NULL) {
+        if (fit.sharedScratch.weights == NULL) {
           m.average = ext_htm_computeMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, numObservations);
           m.numEffectiveObservations = static_cast<double>(numObservations);
         } else {
-          m.average = ext_htm_computeWeightedMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, numObservations, fit.data.weights, &m.numEffectiveObservations);
+          m.average = ext_htm_computeWeightedMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, numObservations, fit.sharedScratch.weights, &m.numEffectiveObservations);
         }
       } else {
-        if (fit.data.weights == NULL) {
+        if (fit.sharedScratch.weights == NULL) {
           m.average = ext_htm_computeIndexedMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, observationIndices, numObservations);
           m.numEffectiveObservations = static_cast<double>(numObservations);
         } else {
-          m.average = ext_htm_computeIndexedWeightedMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, observationIndices, numObservations, fit.data.weights, &m.numEffectiveObservations);
+          m.average = ext_htm_computeIndexedWeightedMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, observationIndices, numObservations, fit.sharedScratch.weights, &m.numEffectiveObservations);
         }
       }
       
@@ -581,12 +807,9 @@ namespace dbarts {
     
     if (numObservations > 0) {
       size_t numOnLeft = 0;
-      IndexOrdering ordering(fit, p.rule);
     
       //if (numThreads <= 1) {
-        numOnLeft = (isTop() ?
-                     partitionRange(observationIndices, 0, numObservations, ordering) :
-                     partitionIndices(observationIndices, numObservations, ordering));
+        numOnLeft = partitionObservations(fit, *this, partitionScratch);
       /*} else {
         PartitionThreadData* threadData = ext_stackAllocate(numThreads, PartitionThreadData);
         void** threadDataPtrs = ext_stackAllocate(numThreads, void*);
@@ -623,12 +846,12 @@ namespace dbarts {
       p.rightChild->numObservations = numObservations - numOnLeft;
       
       
-      leftChild->addObservationsToChildren(fit, chainNum, y);
-      p.rightChild->addObservationsToChildren(fit, chainNum, y);
+      leftChild->addObservationsToChildren(fit, chainNum, y, partitionScratch);
+      p.rightChild->addObservationsToChildren(fit, chainNum, y, partitionScratch);
     }
   }
   
-  void Node::addObservationsToChildren(const BARTFit& fit) {
+  void Node::addObservationsToChildren(const BARTFit& fit, size_t* partitionScratch) {
     if (isBottom()) {
       m.average = 0.0;
       return;
@@ -638,19 +861,15 @@ namespace dbarts {
     p.rightChild->clearObservations();
     
     if (numObservations > 0) {
-      IndexOrdering ordering(fit, p.rule);
-    
-      size_t numOnLeft = (isTop() ?
-                   partitionRange(observationIndices, 0, numObservations, ordering) :
-                   partitionIndices(observationIndices, numObservations, ordering));
+      size_t numOnLeft = partitionObservations(fit, *this, partitionScratch);
       
       leftChild->observationIndices = observationIndices;
       leftChild->numObservations = numOnLeft;
       p.rightChild->observationIndices = observationIndices + numOnLeft;
       p.rightChild->numObservations = numObservations - numOnLeft;
     
-      leftChild->addObservationsToChildren(fit);
-      p.rightChild->addObservationsToChildren(fit);
+      leftChild->addObservationsToChildren(fit, partitionScratch);
+      p.rightChild->addObservationsToChildren(fit, partitionScratch);
     }
   }
   
@@ -659,17 +878,17 @@ namespace dbarts {
     leftChild = NULL;
         
     if (isTop()) {
-      if (fit.data.weights == NULL) {
+      if (fit.sharedScratch.weights == NULL) {
         m.average = ext_htm_computeMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, numObservations);
         m.numEffectiveObservations = static_cast<double>(numObservations);
       }
-      else m.average = ext_htm_computeWeightedMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, numObservations, fit.data.weights, &m.numEffectiveObservations);
+      else m.average = ext_htm_computeWeightedMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, numObservations, fit.sharedScratch.weights, &m.numEffectiveObservations);
     } else {
-      if (fit.data.weights == NULL) {
+      if (fit.sharedScratch.weights == NULL) {
         m.average = ext_htm_computeIndexedMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, observationIndices, numObservations);
         m.numEffectiveObservations = static_cast<double>(numObservations);
       }
-      else m.average = ext_htm_computeIndexedWeightedMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, observationIndices, numObservations, fit.data.weights, &m.numEffectiveObservations);
+      else m.average = ext_htm_computeIndexedWeightedMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, observationIndices, numObservations, fit.sharedScratch.weights, &m.numEffectiveObservations);
     }
   }
   
@@ -687,16 +906,16 @@ namespace dbarts {
   double Node::computeVariance(const BARTFit& fit, size_t chainNum, const double* y) const
   {
     if (isTop()) {
-      if (fit.data.weights == NULL) {
+      if (fit.sharedScratch.weights == NULL) {
         return ext_htm_computeVarianceForKnownMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, numObservations, getAverage());
       } else {
-        return ext_htm_computeWeightedVarianceForKnownMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, numObservations, fit.data.weights, getAverage());
+        return ext_htm_computeWeightedVarianceForKnownMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, numObservations, fit.sharedScratch.weights, getAverage());
       }
     } else {
-      if (fit.data.weights == NULL) {
+      if (fit.sharedScratch.weights == NULL) {
         return ext_htm_computeIndexedVarianceForKnownMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, observationIndices, numObservations, getAverage());
       } else {
-        return ext_htm_computeIndexedWeightedVarianceForKnownMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, observationIndices, numObservations, fit.data.weights, getAverage());
+        return ext_htm_computeIndexedWeightedVarianceForKnownMean(fit.threadManager, fit.chainScratch[chainNum].taskId, y, observationIndices, numObservations, fit.sharedScratch.weights, getAverage());
       }
     }
   }
@@ -14,16 +14,27 @@ namespace dbarts {
   struct EndNodePrior;
   
 #define DBARTS_INVALID_RULE_VARIABLE -1
+// categorical variables with more levels than this keep their directions out of line
+#define DBARTS_MAX_NUM_INLINE_CATEGORIES 32
+#define DBARTS_MAX_NUM_CATEGORIES (64u * 65535u)
   struct Rule {
     std::int32_t variableIndex;
+    std::uint16_t numCategoryWords; // 0 unless categoryDirectionsWide is in use
+    bool missingGoesRight;          // direction for NaN, only drawn for variables with missing values
     
     union {
       std::int32_t splitIndex;
       std::uint32_t categoryDirections;
+      std::uint64_t* categoryDirectionsWide;
     };
     
     void invalidate();
     
+    // sets every category to go left, allocating storage when there are too many to fit inline;
+    // rules own their wide storage, so a node that loses its children has to release it
+    void initializeCategoryDirections(std::uint32_t numCategories);
+    void releaseCategoryDirections();
+    
     bool goesRight(const BARTFit& fit, const double* x) const;
     bool categoryGoesRight(std::uint32_t categoryId) const;
     void setCategoryGoesRight(std::uint32_t categoryId);
@@ -101,6 +112,7 @@ namespace dbarts {
     NodeVector getAndEnumerateBottomVector(); // the nodes will have their enumeration indices set to their array index
     
     Node* findBottomNode(const BARTFit& fit, const double* x) const;
+    bool hasSameStructureAs(const Node& other) const; // same shape and rules, ignoring leaf values
         
     void print(const BARTFit& fit, std::size_t indentation) const;
     
@@ -116,6 +128,9 @@ namespace dbarts {
     std::size_t getNumObservations() const;
     void addObservationsToChildren(const BARTFit& fit);
     void addObservationsToChildren(const BARTFit& fit, std::size_t chainNum, const double* y); // computes averages in bottom nodes as it goes
+    // as above, with sparse partitions using a buffer of at least numObservations; NULL for dense predictors
+    void addObservationsToChildren(const BARTFit& fit, std::size_t* partitionScratch);
+    void addObservationsToChildren(const BARTFit& fit, std::size_t chainNum, const double* y, std::size_t* partitionScratch);
     void setObservationIndices(std::size_t* indices);
     void clearObservations();
     void clear();
@@ -177,9 +192,18 @@ namespace dbarts {
   inline void Node::setNumEffectiveObservations(double n) { leftChild = NULL; m.numEffectiveObservations = n; }
   inline void Node::setObservationIndices(std::size_t* indices) { observationIndices = indices; }
   
-  inline bool Rule::categoryGoesRight(std::uint32_t categoryId) const { return ((1u << categoryId) & categoryDirections) != 0; }
-  inline void Rule::setCategoryGoesRight(std::uint32_t categoryId) { categoryDirections |= (1u << categoryId); }
-  inline void Rule::setCategoryGoesLeft(std::uint32_t categoryId) { categoryDirections &= ~(1u << categoryId); }
+  inline bool Rule::categoryGoesRight(std::uint32_t categoryId) const {
+    if (numCategoryWords == 0) return ((1u << categoryId) & categoryDirections) != 0;
+    return ((categoryDirectionsWide[categoryId >> 6] >> (categoryId & 63)) & 1) != 0;
+  }
+  inline void Rule::setCategoryGoesRight(std::uint32_t categoryId) {
+    if (numCategoryWords == 0) categoryDirections |= (1u << categoryId);
+    else categoryDirectionsWide[categoryId >> 6] |= (static_cast<std::uint64_t>(1) << (categoryId & 63));
+  }
+  inline void Rule::setCategoryGoesLeft(std::uint32_t categoryId) {
+    if (numCategoryWords == 0) categoryDirections &= ~(1u << categoryId);
+    else categoryDirectionsWide[categoryId >> 6] &= ~(static_cast<std::uint64_t>(1) << (categoryId & 63));
+  }
 }
 
 #endif
@@ -19,6 +19,7 @@ using std::snprintf;
 #include <dbarts/bartFit.hpp>
 #include <dbarts/control.hpp>
 #include <dbarts/data.hpp>
+#include "compressedSample.hpp"
 #include "functions.hpp"
 #include "node.hpp"
 #include "tree.hpp"
@@ -27,6 +28,9 @@ using std::snprintf;
 #define INT_BUFFER_SIZE 16
 
 using std::size_t;
+using std::uint16_t;
+using std::uint32_t;
+using std::uint64_t;
 
 namespace {
   using namespace dbarts;
@@ -39,6 +43,215 @@ namespace {
       setNewObservationIndices(*newNode.getRightChild(), indices + oldNode.getLeftChild()->getNumObservations(), *oldNode.getRightChild());
     }
   }
+  
+#define INVALID_SAMPLE_NUM static_cast<size_t>(-1)
+  
+  // see compressedSample.hpp for the format
+  
+  struct ByteWriter {
+    unsigned char* buffer;
+    size_t length;
+    size_t pos;
+    
+    void reserve(size_t numBytes) {
+      if (pos + numBytes <= length) return;
+      
+      size_t newLength = std::max(2 * length, pos + numBytes);
+      unsigned char* temp = new unsigned char[newLength];
+      std::memcpy(temp, const_cast<const unsigned char*>(buffer), pos);
+      
+      delete [] buffer;
+      buffer = temp;
+      length = newLength;
+    }
+    
+    void writeVarint(uint64_t u) {
+      reserve(10);
+      while (u >= 0x80) {
+        buffer[pos++] = static_cast<unsigned char>((u & 0x7f) | 0x80);
+        u >>= 7;
+      }
+      buffer[pos++] = static_cast<unsigned char>(u);
+    }
+    
+    void writeFixed64(uint64_t u) {
+      reserve(8);
+      for (size_t i = 0; i < 8; ++i) buffer[pos++] = static_cast<unsigned char>((u >> (8 * i)) & 0xff);
+    }
+    
+    void writeDouble(double d) {
+      uint64_t u;
+      std::memcpy(&u, &d, sizeof(double));
+      writeFixed64(u);
+    }
+    
+    void writeNode(const Node& node, int32_t parentVariable, const double* treeFits) {
+      if (node.isBottom()) {
+        writeVarint(0);
+        // the value of a bottom node is recovered from the fits of any observation in it
+        writeDouble(node.isTop() ? treeFits[0] : (node.numObservations > 0 ? treeFits[node.observationIndices[0]] : 0.0));
+        return;
+      }
+      
+      const Rule& rule(node.p.rule);
+      
+      int64_t delta = static_cast<int64_t>(rule.variableIndex) - static_cast<int64_t>(parentVariable);
+      uint64_t zigZag = delta < 0 ? (static_cast<uint64_t>(-(delta + 1)) << 1) | 1 : static_cast<uint64_t>(delta) << 1;
+      writeVarint(1 + ((zigZag << 1) | (rule.missingGoesRight ? 1 : 0)));
+      
+      writeVarint(rule.numCategoryWords);
+      if (rule.numCategoryWords == 0) {
+        writeVarint(static_cast<uint32_t>(rule.splitIndex));
+      } else {
+        for (uint32_t i = 0; i < rule.numCategoryWords; ++i) writeVarint(rule.categoryDirectionsWide[i]);
+      }
+      
+      writeNode(*node.getLeftChild(), rule.variableIndex, treeFits);
+      writeNode(*node.getRightChild(), rule.variableIndex, treeFits);
+    }
+  };
+  
+  void readCompressedNode(CompressedSampleReader& reader, Node& node, int32_t parentVariable, size_t numPredictors)
+  {
+    Rule& rule(node.p.rule);
+    
+    if (!reader.readSplit(parentVariable, numPredictors, rule.variableIndex, rule.missingGoesRight, rule.numCategoryWords)) {
+      node.m.average = reader.readDouble();
+      node.m.numEffectiveObservations = 0.0;
+      return;
+    }
+    
+    if (rule.numCategoryWords == 0) {
+      rule.splitIndex = static_cast<int32_t>(static_cast<uint32_t>(reader.readVarint()));
+    } else {
+      rule.categoryDirectionsWide = new uint64_t[rule.numCategoryWords];
+      for (uint32_t i = 0; i < rule.numCategoryWords; ++i) rule.categoryDirectionsWide[i] = reader.readVarint();
+    }
+    
+    node.leftChild    = new Node(node, numPredictors);
+    node.p.rightChild = new Node(node, numPredictors);
+    
+    readCompressedNode(reader, *node.getLeftChild(), rule.variableIndex, numPredictors);
+    readCompressedNode(reader, *node.getRightChild(), rule.variableIndex, numPredictors);
+  }
+  
+  unsigned char* compressSample(const Tree* trees, const double* treeFits, size_t numTrees, size_t numObservations)
+  {
+    ByteWriter writer = { new unsigned char[64 * numTrees + DBARTS_COMPRESSED_SAMPLE_HEADER_LENGTH], 64 * numTrees + DBARTS_COMPRESSED_SAMPLE_HEADER_LENGTH, DBARTS_COMPRESSED_SAMPLE_HEADER_LENGTH };
+    
+    for (size_t treeNum = 0; treeNum < numTrees; ++treeNum)
+      writer.writeNode(trees[treeNum].top, 0, treeFits + treeNum * numObservations);
+    
+    size_t length = writer.pos;
+    writer.pos = 0;
+    writer.writeFixed64(length);
+    
+    // trimmed, as thousands of these are kept
+    unsigned char* result = new unsigned char[length];
+    std::memcpy(result, const_cast<const unsigned char*>(writer.buffer), length);
+    delete [] writer.buffer;
+    
+    return result;
+  }
+  
+  unsigned char* createEmptyCompressedSample(size_t numTrees)
+  {
+    ByteWriter writer = { new unsigned char[9 * numTrees + DBARTS_COMPRESSED_SAMPLE_HEADER_LENGTH], 9 * numTrees + DBARTS_COMPRESSED_SAMPLE_HEADER_LENGTH, 0 };
+    
+    writer.writeFixed64(writer.length);
+    for (size_t treeNum = 0; treeNum < numTrees; ++treeNum) {
+      writer.writeVarint(0);
+      writer.writeDouble(0.0);
+    }
+    
+    return writer.buffer;
+  }
+  
+  void allocateSavedSample(State& state, size_t sampleNum, const Data& data, size_t numTrees)
+  {
+    size_t* treeIndices = createAlignedArray<size_t>(data.numObservations * numTrees);
+    
+    Tree* trees = static_cast<Tree*>(::operator new (numTrees * sizeof(Tree)));
+    for (size_t treeNum = 0; treeNum < numTrees; ++treeNum)
+      new (trees + treeNum) Tree(treeIndices + treeNum * data.numObservations, data.numObservations, data.numPredictors);
+    
+    double* treeFits = createAlignedArray<double>(data.numObservations * numTrees);
+    ext_setVectorToConstant(treeFits, data.numObservations * numTrees, 0.0);
+    
+    state.savedTreeIndices[sampleNum] = treeIndices;
+    state.savedTrees[sampleNum]       = trees;
+    state.savedTreeFits[sampleNum]    = treeFits;
+  }
+  
+  void deleteSavedSample(State& state, size_t sampleNum, size_t numTrees)
+  {
+    if (state.savedTrees[sampleNum] == NULL) return;
+    
+    deleteAlignedArray(state.savedTreeFits[sampleNum]);
+    for (size_t treeNum = numTrees; treeNum > 0; --treeNum)
+      state.savedTrees[sampleNum][treeNum - 1].~Tree();
+    ::operator delete (state.savedTrees[sampleNum]);
+    deleteAlignedArray(state.savedTreeIndices[sampleNum]);
+    
+    state.savedTreeFits[sampleNum]    = NULL;
+    state.savedTrees[sampleNum]       = NULL;
+    state.savedTreeIndices[sampleNum] = NULL;
+  }
+  
+  void releaseDecodedSample(State& state, size_t numTrees)
+  {
+    if (state.decodedSampleNum == INVALID_SAMPLE_NUM) return;
+    
+    deleteSavedSample(state, state.decodedSampleNum, numTrees);
+    state.decodedSampleNum = INVALID_SAMPLE_NUM;
+  }
+  
+  void allocateSavedSamples(State& state, const Data& data, const Control& control, size_t numSamples)
+  {
+    state.savedTreeIndices = new size_t*[numSamples];
+    state.savedTrees       = new Tree*[numSamples];
+    state.savedTreeFits    = new double*[numSamples];
+    state.decodedSampleNum = INVALID_SAMPLE_NUM;
+    state.decodedSampleHasObservations = false;
+    
+    if (control.compressTrees) {
+      state.compressedSamples = new unsigned char*[numSamples];
+      for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum) {
+        state.savedTreeIndices[sampleNum] = NULL;
+        state.savedTrees[sampleNum]       = NULL;
+        state.savedTreeFits[sampleNum]    = NULL;
+        state.compressedSamples[sampleNum] = createEmptyCompressedSample(control.numTrees);
+      }
+    } else {
+      state.compressedSamples = NULL;
+      for (size_t sampleNum = 0; sampleNum < numSamples; ++sampleNum)
+        allocateSavedSample(state, sampleNum, data, control.numTrees);
+    }
+  }
+  
+  void deleteSavedSamples(State& state, size_t numTrees, size_t numSamples)
+  {
+    if (state.savedTrees == NULL) return;
+    
+    for (size_t sampleNum = numSamples; sampleNum > 0; --sampleNum)
+      deleteSavedSample(state, sampleNum - 1, numTrees);
+    
+    if (state.compressedSamples != NULL) {
+      for (size_t sampleNum = numSamples; sampleNum > 0; --sampleNum)
+        delete [] state.compressedSamples[sampleNum - 1];
+      delete [] state.compressedSamples;
+    }
+    
+    delete [] state.savedTreeFits;
+    delete [] state.savedTrees;
+    delete [] state.savedTreeIndices;
+    
+    state.compressedSamples = NULL;
+    state.savedTreeFits     = NULL;
+    state.savedTrees        = NULL;
+    state.savedTreeIndices  = NULL;
+    state.decodedSampleNum  = INVALID_SAMPLE_NUM;
+  }
 }
 
 namespace dbarts {
@@ -46,50 +259,41 @@ namespace dbarts {
   {
     size_t totalNumTrees = control.numTrees;
     
-    treeIndices = new size_t[data.numObservations * totalNumTrees];
+    treeIndices = createAlignedArray<size_t>(data.numObservations * totalNumTrees);
     
     trees = static_cast<Tree*>(::operator new (totalNumTrees * sizeof(Tree)));
     for (size_t treeNum = 0; treeNum < totalNumTrees; ++treeNum)
       new (trees + treeNum) Tree(treeIndices + treeNum * data.numObservations, data.numObservations, data.numPredictors);
     
-    treeFits = new double[data.numObservations * totalNumTrees];
+    treeFits = createAlignedArray<double>(data.numObservations * totalNumTrees);
     ext_setVectorToConstant(treeFits, data.numObservations * totalNumTrees, 0.0);
     
+    decodedSampleNum = INVALID_SAMPLE_NUM;
+    decodedSampleHasObservations = false;
     if (control.keepTrees) {
-      totalNumTrees *= control.defaultNumSamples;
-      
-      savedTreeIndices = new size_t[data.numObservations * totalNumTrees];
-      
-      savedTrees = static_cast<Tree*>(::operator new (totalNumTrees * sizeof(Tree)));
-      for (size_t treeNum = 0; treeNum < totalNumTrees; ++treeNum)
-        new (savedTrees + treeNum) Tree(savedTreeIndices + treeNum * data.numObservations, data.numObservations, data.numPredictors);
-      
-      savedTreeFits = new double[data.numObservations * totalNumTrees];
-      ext_setVectorToConstant(savedTreeFits, data.numObservations * totalNumTrees, 0.0);
+      allocateSavedSamples(*this, data, control, control.defaultNumSamples);
     } else {
       savedTreeIndices = NULL;
       savedTrees = NULL;
       savedTreeFits = NULL;
+      compressedSamples = NULL;
     }
-        
+    
+    splitProbabilities = NULL;
+    
     rng = NULL;
   }
   
   void State::invalidate(size_t numTrees, size_t numSamples) {
-    delete [] savedTreeFits;
-    if (savedTrees != NULL) {
-      for (size_t treeNum = numTrees * numSamples; treeNum > 0; --treeNum)
-        savedTrees[treeNum - 1].~Tree();
-      ::operator delete (savedTrees);
-    }
-    delete [] savedTreeIndices;
-
+    delete [] splitProbabilities;
     
-    delete [] treeFits;
+    deleteSavedSamples(*this, numTrees, numSamples);
+    
+    deleteAlignedArray(treeFits);
     for (size_t treeNum = numTrees; treeNum > 0; --treeNum)
       trees[treeNum - 1].~Tree();
     ::operator delete (trees);
-    delete [] treeIndices;
+    deleteAlignedArray(treeIndices);
   }
 }
 
@@ -167,14 +371,15 @@ namespace dbarts {
     const Control& oldControl(fit.control);
     const Data& data(fit.data);
    
-    if (oldControl.keepTrees == newControl.keepTrees && oldControl.numTrees == newControl.numTrees) return false;
+    if (oldControl.keepTrees == newControl.keepTrees && oldControl.numTrees == newControl.numTrees &&
+        (!newControl.keepTrees || oldControl.compressTrees == newControl.compressTrees)) return false;
     
     State oldState = *this;
     
     if (oldControl.numTrees != newControl.numTrees) {
-      treeIndices = new size_t[data.numObservations * newControl.numTrees];
+      treeIndices = createAlignedArray<size_t>(data.numObservations * newControl.numTrees);
       trees       = static_cast<Tree*>(::operator new (newControl.numTrees * sizeof(Tree)));
-      treeFits    = new double[data.numObservations * newControl.numTrees];
+      treeFits    = createAlignedArray<double>(data.numObservations * newControl.numTrees);
       
       TreeData oldTrees = { oldState.treeIndices, oldState.trees, oldState.treeFits };
       TreeData newTrees = { treeIndices, trees, treeFits };
@@ -182,51 +387,72 @@ namespace dbarts {
       
       copyTreesForSample(resizeData, 0, 0);
       
-      delete [] oldState.treeFits;
+      deleteAlignedArray(oldState.treeFits);
       ::operator delete (oldState.trees);
-      delete [] oldState.treeIndices;
+      deleteAlignedArray(oldState.treeIndices);
     }
     
-    if (newControl.keepTrees) {
-      size_t totalNumTrees = newControl.numTrees * fit.currentNumSamples;
+    if (newControl.keepTrees && oldControl.keepTrees) {
+      bool oldIsCompressed = compressedSamples != NULL;
       
-      savedTreeIndices = new size_t[data.numObservations * totalNumTrees];
-      savedTrees = static_cast<Tree*>(::operator new (totalNumTrees * sizeof(Tree)));
-      savedTreeFits = new double[data.numObservations * totalNumTrees];
+      if (newControl.compressTrees && !oldIsCompressed) {
+        compressedSamples = new unsigned char*[fit.currentNumSamples];
+        for (size_t sampleNum = 0; sampleNum < fit.currentNumSamples; ++sampleNum) compressedSamples[sampleNum] = NULL;
+      }
       
-      if (oldControl.keepTrees) {
-        TreeData oldTrees = { oldState.savedTreeIndices, oldState.savedTrees, oldState.savedTreeFits };
-        TreeData newTrees = { savedTreeIndices, savedTrees, savedTreeFits };
-        ResizeData resizeData = { fit.data, oldControl, newControl, oldTrees, newTrees };
+      // samples are converted one at a time, so at most one extra sample is ever held
+      for (size_t sampleNum = 0; sampleNum < fit.currentNumSamples; ++sampleNum) {
+        if (oldIsCompressed) {
+          // takes ownership of the decoded trees
+          decompressSample(fit, sampleNum, true);
+          decodedSampleNum = INVALID_SAMPLE_NUM;
+        }
         
-        for (size_t sampleNum = 0; sampleNum < fit.currentNumSamples; ++sampleNum)
-          copyTreesForSample(resizeData, sampleNum, sampleNum);
+        if (oldControl.numTrees != newControl.numTrees) {
+          size_t* newTreeIndices = createAlignedArray<size_t>(data.numObservations * newControl.numTrees);
+          Tree*   newTrees       = static_cast<Tree*>(::operator new (newControl.numTrees * sizeof(Tree)));
+          double* newTreeFits    = createAlignedArray<double>(data.numObservations * newControl.numTrees);
+          
+          TreeData oldSample = { savedTreeIndices[sampleNum], savedTrees[sampleNum], savedTreeFits[sampleNum] };
+          TreeData newSample = { newTreeIndices, newTrees, newTreeFits };
+          ResizeData resizeData = { fit.data, oldControl, newControl, oldSample, newSample };
+          
+          copyTreesForSample(resizeData, 0, 0);
+          
+          deleteAlignedArray(savedTreeFits[sampleNum]);
+          ::operator delete (savedTrees[sampleNum]);
+          deleteAlignedArray(savedTreeIndices[sampleNum]);
+          
+          savedTreeIndices[sampleNum] = newTreeIndices;
+          savedTrees[sampleNum]       = newTrees;
+          savedTreeFits[sampleNum]    = newTreeFits;
+        }
         
-        delete [] oldState.savedTreeFits;
-        ::operator delete (oldState.savedTrees);
-        delete [] oldState.savedTreeIndices;
-      } else {
-        for (size_t treeNum = 0; treeNum < totalNumTrees; ++treeNum)
-          new (savedTrees + treeNum) Tree(savedTreeIndices + treeNum * data.numObservations, data.numObservations, data.numPredictors);
-        ext_setVectorToConstant(savedTreeFits, data.numObservations * totalNumTrees, 0.0);
+        if (newControl.compressTrees) {
+          delete [] compressedSamples[sampleNum];
+          compressedSamples[sampleNum] = compressSample(savedTrees[sampleNum], savedTreeFits[sampleNum], newControl.numTrees, data.numObservations);
+          deleteSavedSample(*this, sampleNum, newControl.numTrees);
+        }
       }
-    } else {
-      savedTreeIndices = NULL;
-      savedTrees = NULL;
-      savedTreeFits = NULL;
       
-      if (oldControl.keepTrees) {
-        delete [] oldState.savedTreeFits;
-        for (size_t treeNum = oldControl.numTrees * fit.currentNumSamples; treeNum > 0; --treeNum)
-          oldState.savedTrees[treeNum - 1].~Tree();
-        ::operator delete (oldState.savedTrees);
-        delete [] oldState.savedTreeIndices;
+      if (oldIsCompressed && !newControl.compressTrees) {
+        for (size_t sampleNum = fit.currentNumSamples; sampleNum > 0; --sampleNum)
+          delete [] compressedSamples[sampleNum - 1];
+        delete [] compressedSamples;
+        compressedSamples = NULL;
       }
+    } else if (newControl.keepTrees) {
+      allocateSavedSamples(*this, data, newControl, fit.currentNumSamples);
+    } else if (oldControl.keepTrees) {
+      deleteSavedSamples(*this, oldControl.numTrees, fit.currentNumSamples);
     }
     
     return true;
   }
   
+  // Keeps the most recent samples in the order in which they were drawn, with the oldest
+  // (or any newly created samples) at the front so that writing resumes at sample 0. Only
+  // the per-sample pointers move; the samples themselves are never copied.
   bool State::resize(const BARTFit& fit, size_t newNumSamples) {
     const Control& control(fit.control);
     const Data& data(fit.data);
@@ -235,50 +461,52 @@ namespace dbarts {
     
     if (newNumSamples == oldNumSamples || !control.keepTrees) return false;
     
+    releaseDecodedSample(*this, control.numTrees);
+    
     State oldState = *this;
     
-    size_t totalNumTrees = control.numTrees * newNumSamples;
+    savedTreeIndices = new size_t*[newNumSamples];
+    savedTrees       = new Tree*[newNumSamples];
+    savedTreeFits    = new double*[newNumSamples];
+    if (oldState.compressedSamples != NULL) compressedSamples = new unsigned char*[newNumSamples];
     
-    savedTreeIndices = new size_t[data.numObservations * totalNumTrees];
-    savedTrees = static_cast<Tree*>(::operator new (totalNumTrees * sizeof(Tree)));
-    savedTreeFits = new double[data.numObservations * totalNumTrees];
+    // when the ring has wrapped around, the oldest sample is the one due to be overwritten next
+    size_t oldestSampleNum = oldNumSamples > 0 ? fit.currentSampleNum % oldNumSamples : 0;
     
-    TreeData oldTrees = { oldState.savedTreeIndices, oldState.savedTrees, oldState.savedTreeFits };
-    TreeData newTrees = { savedTreeIndices, savedTrees, savedTreeFits };
-    ResizeData resizeData = { fit.data, control, control, oldTrees, newTrees };
-        
-    size_t numSamplesToCopy, oldSampleStart, newSampleStart;
-    if (oldNumSamples > newNumSamples) {
-      numSamplesToCopy = newNumSamples;
-      oldSampleStart = oldNumSamples - newNumSamples;
-      newSampleStart = 0;
-      
-      for (size_t sampleNum = oldNumSamples - newNumSamples; sampleNum > 0; --sampleNum) {
-        for (size_t treeNum = control.numTrees; treeNum > 0; --treeNum) {
-          size_t treeOffset = (treeNum - 1) + (sampleNum - 1) * control.numTrees;
-          oldState.trees[treeOffset].~Tree();
-        }
-      }
-    } else {
-      numSamplesToCopy = oldNumSamples;
-      oldSampleStart = 0;
-      newSampleStart = newNumSamples - oldNumSamples;
-      
-      for (size_t sampleNum = 0; sampleNum < newNumSamples - oldNumSamples; ++sampleNum) {
-        size_t sampleOffset = sampleNum * control.numTrees;
-        for (size_t treeNum = 0; treeNum < control.numTrees; ++treeNum) {
-          new (trees + treeNum + sampleOffset)
-            Tree(treeIndices + data.numObservations * (treeNum + sampleOffset), data.numObservations, data.numPredictors);
-        }
+    size_t numSamplesToKeep = std::min(oldNumSamples, newNumSamples);
+    size_t numSamplesToDrop = oldNumSamples - numSamplesToKeep;
+    size_t newSampleStart   = newNumSamples - numSamplesToKeep;
+    
+    for (size_t sampleNum = 0; sampleNum < numSamplesToDrop; ++sampleNum) {
+      size_t oldSampleNum = (oldestSampleNum + sampleNum) % oldNumSamples;
+      deleteSavedSample(oldState, oldSampleNum, control.numTrees);
+      if (compressedSamples != NULL) delete [] oldState.compressedSamples[oldSampleNum];
+    }
+    
+    for (size_t sampleNum = 0; sampleNum < newSampleStart; ++sampleNum) {
+      if (compressedSamples != NULL) {
+        savedTreeIndices[sampleNum] = NULL;
+        savedTrees[sampleNum]       = NULL;
+        savedTreeFits[sampleNum]    = NULL;
+        compressedSamples[sampleNum] = createEmptyCompressedSample(control.numTrees);
+      } else {
+        allocateSavedSample(*this, sampleNum, data, control.numTrees);
       }
     }
-        
-    for (size_t sampleNum = 0; sampleNum < numSamplesToCopy; ++sampleNum)
-      copyTreesForSample(resizeData, oldSampleStart + sampleNum, newSampleStart + sampleNum);
     
-    delete [] oldState.treeFits;
-     ::operator delete (oldState.trees);
-    delete [] oldState.treeIndices;
+    for (size_t sampleNum = 0; sampleNum < numSamplesToKeep; ++sampleNum) {
+      size_t oldSampleNum = (oldestSampleNum + numSamplesToDrop + sampleNum) % oldNumSamples;
+      
+      savedTreeIndices[newSampleStart + sampleNum] = oldState.savedTreeIndices[oldSampleNum];
+      savedTrees[newSampleStart + sampleNum]       = oldState.savedTrees[oldSampleNum];
+      savedTreeFits[newSampleStart + sampleNum]    = oldState.savedTreeFits[oldSampleNum];
+      if (compressedSamples != NULL) compressedSamples[newSampleStart + sampleNum] = oldState.compressedSamples[oldSampleNum];
+    }
+    
+    delete [] oldState.compressedSamples;
+    delete [] oldState.savedTreeFits;
+    delete [] oldState.savedTrees;
+    delete [] oldState.savedTreeIndices;
     
     return true;
   }
@@ -310,6 +538,11 @@ namespace {
       writeString(intBuffer, static_cast<size_t>(bytesWritten));
     }
     
+    void writeHexWord(uint64_t u) {
+      const char* const digits = "0123456789abcdef";
+      for (int shift = 60; shift >= 0; shift -= 4) writeChar(digits[(u >> shift) & 0xf]);
+    }
+    
     /* void writeUInt(uint32_t u) {
       char intBuffer[INT_BUFFER_SIZE];
       int bytesWritten = snprintf(intBuffer, INT_BUFFER_SIZE, "%u", u);
@@ -322,9 +555,20 @@ namespace {
         return;
       }
       
+      // rules that send missing values right are marked with a leading '~'
+      if (node.p.rule.missingGoesRight) writeChar('~');
       writeInt(node.p.rule.variableIndex);
       writeChar(' ');
-      writeInt(node.p.rule.splitIndex);
+      if (node.p.rule.numCategoryWords == 0) {
+        writeInt(node.p.rule.splitIndex);
+      } else {
+        // wide categorical rules are written as '#' followed by comma separated hex words
+        writeChar('#');
+        for (uint32_t i = 0; i < node.p.rule.numCategoryWords; ++i) {
+          if (i > 0) writeChar(',');
+          writeHexWord(node.p.rule.categoryDirectionsWide[i]);
+        }
+      }
       writeChar(' ');
       
       writeNode(*node.getLeftChild());
@@ -343,6 +587,43 @@ namespace {
 
   using namespace dbarts;
   
+  // reads words of the form written by writeHexWord up to and including the trailing space
+  size_t readWideCategoryDirections(Rule& rule, const char* treeString) {
+    size_t numWords = 1;
+    size_t pos = 0;
+    for ( ; treeString[pos] != ' '; ++pos) {
+      if (treeString[pos] == '\0') ext_throwError("Unable to parse tree string: unterminated category directions.");
+      if (treeString[pos] == ',') ++numWords;
+    }
+    
+    rule.numCategoryWords = static_cast<uint16_t>(numWords);
+    rule.categoryDirectionsWide = new uint64_t[numWords];
+    
+    size_t wordNum = 0;
+    uint64_t word = 0;
+    for (size_t i = 0; i < pos; ++i) {
+      char c = treeString[i];
+      if (c == ',') {
+        rule.categoryDirectionsWide[wordNum++] = word;
+        word = 0;
+        continue;
+      }
+      
+      uint64_t digit;
+      if (c >= '0' && c <= '9') digit = static_cast<uint64_t>(c - '0');
+      else if (c >= 'a' && c <= 'f') digit = static_cast<uint64_t>(c - 'a' + 10);
+      else {
+        delete [] rule.categoryDirectionsWide;
+        rule.numCategoryWords = 0;
+        ext_throwError("Unable to parse tree string: expected hexadecimal digit.");
+      }
+      word = (word << 4) | digit;
+    }
+    rule.categoryDirectionsWide[wordNum] = word;
+    
+    return pos + 1;
+  }
+  
   size_t readNode(Node& node, const char* treeString, size_t numPredictors) {
     if (treeString[0] == '\0') return 0;
     if (treeString[0] == '.') return 1;
@@ -350,14 +631,18 @@ namespace {
     
     size_t pos = 0;
     
+    node.p.rule.missingGoesRight = treeString[0] == '~';
+    if (node.p.rule.missingGoesRight) ++pos;
+    
     char buffer[INT_BUFFER_SIZE];
-    while (treeString[pos] != ' ' && pos < INT_BUFFER_SIZE) {
-      buffer[pos] = treeString[pos];
-      ++pos;
+    size_t bufferPos = 0;
+    while (treeString[pos] != ' ' && bufferPos < INT_BUFFER_SIZE) {
+      buffer[bufferPos++] = treeString[pos++];
     }
     
-    if (pos == INT_BUFFER_SIZE) ext_throwError("Unable to parse tree string: expected integer.");
-    buffer[pos++] = '\0';
+    if (bufferPos == INT_BUFFER_SIZE) ext_throwError("Unable to parse tree string: expected integer.");
+    buffer[bufferPos] = '\0';
+    ++pos;
     
     
     errno = 0;
@@ -365,20 +650,25 @@ namespace {
     if (node.p.rule.variableIndex == 0 && errno != 0)
       ext_throwError("Unable to parse tree string: %s", std::strerror(errno));
     
-    size_t bufferPos = 0;
-    while (treeString[pos] != ' ' && bufferPos < INT_BUFFER_SIZE) {
-      buffer[bufferPos++] = treeString[pos++];
+    if (treeString[pos] == '#') {
+      pos += readWideCategoryDirections(node.p.rule, treeString + pos + 1) + 1;
+    } else {
+      bufferPos = 0;
+      while (treeString[pos] != ' ' && bufferPos < INT_BUFFER_SIZE) {
+        buffer[bufferPos++] = treeString[pos++];
+      }
+      
+      if (bufferPos == INT_BUFFER_SIZE) ext_throwError("Unable to parse tree string: expected integer.");
+      buffer[bufferPos++] = '\0';
+      ++pos;
+      
+      errno = 0;
+      node.p.rule.numCategoryWords = 0;
+      node.p.rule.splitIndex = static_cast<int32_t>(std::strtol(buffer, NULL, 10));
+      if (node.p.rule.splitIndex == 0 && errno != 0)
+        ext_throwError("Unable to parse tree string: %s", std::strerror(errno));
     }
     
-    if (pos == INT_BUFFER_SIZE) ext_throwError("Unable to parse tree string: expected integer.");
-    buffer[bufferPos++] = '\0';
-    ++pos;
-    
-    errno = 0;
-    node.p.rule.splitIndex = static_cast<int32_t>(std::strtol(buffer, NULL, 10));
-    if (node.p.rule.splitIndex == 0 && errno != 0)
-      ext_throwError("Unable to parse tree string: %s", std::strerror(errno));
-    
     node.leftChild  = new Node(node, numPredictors);
     node.p.rightChild = new Node(node, numPredictors);
     
@@ -387,6 +677,18 @@ namespace {
     
     return pos;
   }
+  
+  void recreateTreeFromString(const BARTFit& fit, Tree& tree, const char* treeString)
+  {
+    tree.top.clear();
+    readNode(tree.top, treeString, fit.data.numPredictors);
+    
+    if (!tree.top.isBottom()) {
+      updateVariablesAvailable(fit, tree.top, tree.top.p.rule.variableIndex);
+      
+      tree.top.addObservationsToChildren(fit);
+    }
+  }
 }
 
 
@@ -395,23 +697,19 @@ namespace dbarts {
   {
     StringWriter writer;
     
-    size_t numTrees;
-    const Tree* targetTrees;
-    if (!useSavedTrees || !fit.control.keepTrees) {
-      numTrees = fit.control.numTrees;
-      targetTrees = trees;
-    } else {
-      numTrees = fit.control.numTrees * fit.currentNumSamples;
-      targetTrees = savedTrees;
-    }
+    bool targetIsSaved = useSavedTrees && fit.control.keepTrees;
+    size_t numTrees = fit.control.numTrees * (targetIsSaved ? fit.currentNumSamples : 1);
     
     char** result = new char*[numTrees];
     for (size_t i = 0; i < numTrees; ++i) {
+      if (targetIsSaved && i % fit.control.numTrees == 0) decompressSample(fit, i / fit.control.numTrees, false);
+      const Tree& tree(targetIsSaved ? savedTrees[i / fit.control.numTrees][i % fit.control.numTrees] : trees[i]);
+      
       writer.buffer = new char[BASE_BUFFER_SIZE];
       writer.length = BASE_BUFFER_SIZE;
       writer.pos = 0;
       
-      writer.writeNode(targetTrees[i].top);
+      writer.writeNode(tree.top);
      
       writer.writeChar('\0');
       
@@ -423,25 +721,142 @@ namespace dbarts {
   
   void State::recreateTreesFromStrings(const BARTFit& fit, const char* const* treeStrings, bool useSavedTrees)
   {
-    size_t numTrees;
-    Tree* targetTrees;
-    if (!useSavedTrees || !fit.control.keepTrees) {
-      numTrees = fit.control.numTrees;
-      targetTrees = trees;
-    } else {
-      numTrees = fit.control.numTrees * fit.currentNumSamples;
-      targetTrees = savedTrees;
+    if (useSavedTrees && fit.control.keepTrees) {
+      // fits are left as they were
+      for (size_t sampleNum = 0; sampleNum < fit.currentNumSamples; ++sampleNum) {
+        decompressSample(fit, sampleNum, true);
+        recreateSavedSampleFromStrings(fit, sampleNum, treeStrings + sampleNum * fit.control.numTrees, savedTreeFits[sampleNum]);
+      }
+      return;
     }
     
-    for (size_t i = 0; i < numTrees; ++i) {
-      targetTrees[i].top.clear();
-      readNode(targetTrees[i].top, treeStrings[i], fit.data.numPredictors);
+    for (size_t treeNum = 0; treeNum < fit.control.numTrees; ++treeNum)
+      recreateTreeFromString(fit, trees[treeNum], treeStrings[treeNum]);
+  }
+  
+  void State::recreateSavedSampleFromStrings(const BARTFit& fit, size_t sampleNum, const char* const* treeStrings, const double* treeFits)
+  {
+    decompressSample(fit, sampleNum, false);
+    
+    for (size_t treeNum = 0; treeNum < fit.control.numTrees; ++treeNum)
+      recreateTreeFromString(fit, savedTrees[sampleNum][treeNum], treeStrings[treeNum]);
+    
+    if (treeFits != savedTreeFits[sampleNum])
+      std::memcpy(savedTreeFits[sampleNum], treeFits, fit.data.numObservations * fit.control.numTrees * sizeof(double));
+    
+    storeSample(fit, sampleNum, savedTrees[sampleNum], savedTreeFits[sampleNum]);
+    // partitioning zeroed the values in the decoded nodes
+    discardDecodedSample(fit);
+  }
+  
+  void State::decompressSample(const BARTFit& fit, size_t sampleNum, bool withObservations) const
+  {
+    if (compressedSamples == NULL) return;
+    if (decodedSampleNum == sampleNum && (decodedSampleHasObservations || !withObservations)) return;
+    
+    const Data& data(fit.data);
+    size_t numTrees = fit.control.numTrees;
+    
+    // the decoded sample is a cache, so is updated from const contexts
+    State& self(const_cast<State&>(*this));
+    
+    if (decodedSampleNum != INVALID_SAMPLE_NUM && decodedSampleNum != sampleNum) {
+      // reuse the storage of the previously decoded sample
+      self.savedTreeIndices[sampleNum] = savedTreeIndices[decodedSampleNum];
+      self.savedTrees[sampleNum]       = savedTrees[decodedSampleNum];
+      self.savedTreeFits[sampleNum]    = savedTreeFits[decodedSampleNum];
+      self.savedTreeIndices[decodedSampleNum] = NULL;
+      self.savedTrees[decodedSampleNum]       = NULL;
+      self.savedTreeFits[decodedSampleNum]    = NULL;
+    }
+    decodedSampleNum = INVALID_SAMPLE_NUM;
+    
+    if (savedTrees[sampleNum] != NULL && savedTrees[sampleNum][0].top.numObservations != data.numObservations)
+      deleteSavedSample(self, sampleNum, numTrees);
+    if (savedTrees[sampleNum] == NULL)
+      allocateSavedSample(self, sampleNum, data, numTrees);
+    
+    const unsigned char* buffer = compressedSamples[sampleNum];
+    CompressedSampleReader reader = { buffer, readCompressedSampleLength(buffer), DBARTS_COMPRESSED_SAMPLE_HEADER_LENGTH };
+    
+    for (size_t treeNum = 0; treeNum < numTrees; ++treeNum) {
+      Tree& tree(savedTrees[sampleNum][treeNum]);
+      
+      tree.top.clear();
+      readCompressedNode(reader, tree.top, 0, data.numPredictors);
       
-      if (!targetTrees[i].top.isBottom()) {
-        updateVariablesAvailable(fit, targetTrees[i].top, targetTrees[i].top.p.rule.variableIndex);
+      if (!withObservations) continue;
       
-        targetTrees[i].top.addObservationsToChildren(fit);
+      // partitioning clears the values in the bottom nodes, so they are set aside first
+      NodeVector bottomNodes(tree.top.getBottomVector());
+      size_t numBottomNodes = bottomNodes.size();
+      
+      double* nodeValues = new double[numBottomNodes];
+      for (size_t i = 0; i < numBottomNodes; ++i) nodeValues[i] = bottomNodes[i]->getAverage();
+      
+      if (!tree.top.isBottom()) {
+        updateVariablesAvailable(fit, tree.top, tree.top.p.rule.variableIndex);
+        tree.top.addObservationsToChildren(fit);
       }
+      
+      double* treeFits = savedTreeFits[sampleNum] + treeNum * data.numObservations;
+      for (size_t i = 0; i < numBottomNodes; ++i) {
+        bottomNodes[i]->setPredictions(treeFits, nodeValues[i]);
+        bottomNodes[i]->m.average = nodeValues[i];
+      }
+      
+      delete [] nodeValues;
     }
+    
+    decodedSampleNum = sampleNum;
+    decodedSampleHasObservations = withObservations;
+  }
+  
+  void State::storeSample(const BARTFit& fit, size_t sampleNum, const Tree* sourceTrees, const double* sourceFits)
+  {
+    size_t numTrees = fit.control.numTrees;
+    size_t numObservations = fit.data.numObservations;
+    
+    if (compressedSamples == NULL) {
+      if (sourceTrees != savedTrees[sampleNum]) {
+        for (size_t treeNum = 0; treeNum < numTrees; ++treeNum)
+          savedTrees[sampleNum][treeNum].copyFrom(fit, sourceTrees[treeNum]);
+      }
+      if (sourceFits != savedTreeFits[sampleNum])
+        std::memcpy(savedTreeFits[sampleNum], sourceFits, numObservations * numTrees * sizeof(double));
+      return;
+    }
+    
+    unsigned char* buffer = compressSample(sourceTrees, sourceFits, numTrees, numObservations);
+    delete [] compressedSamples[sampleNum];
+    compressedSamples[sampleNum] = buffer;
+    
+    // a decoded copy is only still valid if it is what was just stored
+    if (decodedSampleNum == sampleNum && sourceTrees != savedTrees[sampleNum]) releaseDecodedSample(*this, numTrees);
+  }
+  
+  void State::discardDecodedSample(const BARTFit& fit)
+  {
+    if (compressedSamples != NULL) releaseDecodedSample(*this, fit.control.numTrees);
+  }
+  
+  size_t State::getCompressedSampleLength(size_t sampleNum) const
+  {
+    return readCompressedSampleLength(compressedSamples[sampleNum]);
+  }
+  
+  void State::getSplitProbabilities(size_t numPredictors, double* result) const
+  {
+    if (splitProbabilities == NULL) return;
+    
+    for (size_t j = 0; j < numPredictors; ++j) result[j] = getPartialSumTreeValue(splitProbabilities, j);
+  }
+  
+  void State::setSplitProbabilities(size_t numPredictors, const double* probabilities)
+  {
+    if (splitProbabilities == NULL) return;
+    
+    std::memcpy(splitProbabilities, probabilities, numPredictors * sizeof(double));
+    buildPartialSumTree(splitProbabilities, numPredictors);
   }
 }
@@ -200,6 +200,7 @@ namespace dbarts {
           oldState.destroy();
           // accept, so make right rule copy deep and trash old
           rightChild.p.rule.copyFrom(leftChild.p.rule);
+          oldRightChildRule.releaseCategoryDirections();
           
           *stepTaken = true;
         } else {
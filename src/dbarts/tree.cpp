@@ -117,6 +117,17 @@ namespace dbarts {
     return(result);
   }
   
+  double* Tree::recoverAveragesFromNodes() const
+  {
+    NodeVector bottomNodes(top.getBottomVector());
+    size_t numBottomNodes = bottomNodes.size();
+    
+    double* result = new double[numBottomNodes];
+    for (size_t i = 0; i < numBottomNodes; ++i) result[i] = bottomNodes[i]->getAverage();
+    
+    return(result);
+  }
+  
   void Tree::setCurrentFitsFromAverages(const BARTFit& fit, const double* posteriorPredictions, double* trainingFits, double* testFits)
   {
     NodeVector bottomNodes(top.getAndEnumerateBottomVector());
@@ -145,13 +156,25 @@ namespace dbarts {
     for (size_t i = 0; i < numObservations; ++i) fits[i] = posteriorPredictions[observationNodeMap[i]];
     delete [] observationNodeMap;
   }
+  
+  size_t* Tree::mapObservationsToBottomNodes(const BARTFit& fit, const double* xt, size_t numObservations)
+  {
+    top.enumerateBottomNodes();
+    
+    return createObservationToNodeIndexMap(fit, top, xt, numObservations);
+  }
+  
+  size_t* Tree::mapObservationsToEnumeratedBottomNodes(const BARTFit& fit, const double* xt, size_t numObservations) const
+  {
+    return createObservationToNodeIndexMap(fit, top, xt, numObservations);
+  }
 }
 
 namespace {
   using namespace dbarts;
   void mapCutPoints(Node& n, const BARTFit& fit, const double* const* oldCutPoints, double* posteriorPredictions, int32_t* minIndices, int32_t* maxIndices, int32_t depth);
   void collapseEmptyNodes(Node& n, const BARTFit& fit, double* posteriorPredictions, int depth);
-  void sampleFromPrior(const BARTFit& fit, ext_rng* rng, Node& n);
+  void sampleFromPrior(const BARTFit& fit, std::size_t chainNum, ext_rng* rng, Node& n);
 }
 
 namespace dbarts {
@@ -209,9 +232,9 @@ namespace dbarts {
     return true;
   }
   
-  void Tree::sampleFromPrior(const BARTFit& fit, ext_rng* rng) {
+  void Tree::sampleFromPrior(const BARTFit& fit, std::size_t chainNum, ext_rng* rng) {
     top.clear();
-    ::sampleFromPrior(fit, rng, top);
+    ::sampleFromPrior(fit, chainNum, rng, top);
   }
 }
 
@@ -247,6 +270,7 @@ namespace {
         size_t leftMostEnumerationIndex = bottomNodes[0]->enumerationIndex;
         delete n.getLeftChild();
         delete n.getRightChild();
+        n.p.rule.releaseCategoryDirections();
         n.leftChild = NULL;
       
         posteriorPredictions[leftMostEnumerationIndex] = param;
@@ -291,12 +315,13 @@ namespace {
       
       for (size_t i = 0; i < numBottomNodes; ++i) {
         Node& bottomNode(*bottomNodes[i]);
-        weights[i] = fit.data.weights == NULL ? static_cast<double>(bottomNode.getNumObservations()) : ext_sumIndexedVectorElements(fit.data.weights, bottomNode.observationIndices, bottomNode.getNumObservations());
+        weights[i] = fit.sharedScratch.weights == NULL ? static_cast<double>(bottomNode.getNumObservations()) : ext_sumIndexedVectorElements(fit.sharedScratch.weights, bottomNode.observationIndices, bottomNode.getNumObservations());
         params[i] = posteriorPredictions[bottomNodes[i]->enumerationIndex];
       }
       size_t leftMostEnumerationIndex = bottomNodes[0]->enumerationIndex;
       delete n.getLeftChild();
       delete n.getRightChild();
+      n.p.rule.releaseCategoryDirections();
       n.leftChild = NULL;
       
       if (weights[0] == 0.0 && ext_vectorIsConstant(weights, numBottomNodes)) {
@@ -314,15 +339,15 @@ namespace {
     }
   }
   
-  void sampleFromPrior(const BARTFit& fit, ext_rng* rng, Node& n) {
+  void sampleFromPrior(const BARTFit& fit, std::size_t chainNum, ext_rng* rng, Node& n) {
     double parentPriorGrowthProbability = fit.model.treePrior->computeGrowthProbability(fit, n);
     if (parentPriorGrowthProbability <= 0.0 || ext_rng_simulateBernoulli(rng, parentPriorGrowthProbability) == 0) return;
     
     bool exhaustedLeftSplits, exhaustedRightSplits;
-    Rule newRule = fit.model.treePrior->drawRuleAndVariable(fit, rng, n, &exhaustedLeftSplits, &exhaustedRightSplits);
+    Rule newRule = fit.model.treePrior->drawRuleAndVariable(fit, chainNum, rng, n, &exhaustedLeftSplits, &exhaustedRightSplits);
     n.split(fit, newRule, exhaustedLeftSplits, exhaustedRightSplits);
     
-    sampleFromPrior(fit, rng, *n.leftChild);
-    sampleFromPrior(fit, rng, *n.p.rightChild);
+    sampleFromPrior(fit, chainNum, rng, *n.leftChild);
+    sampleFromPrior(fit, chainNum, rng, *n.p.rightChild);
   }
 }
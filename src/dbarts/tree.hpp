@@ -19,16 +19,21 @@ namespace dbarts {
     
     void sampleAveragesAndSetFits(const BARTFit& fit, std::size_t chainNum, double sigma, double* trainingFits, double* testFits);
     double* recoverAveragesFromFits(const BARTFit& fit, const double* treeFits); // allocates result; are ordered as bottom nodes are
+    double* recoverAveragesFromNodes() const; // as above, for trees whose bottom nodes hold their values
     void setCurrentFitsFromAverages(const BARTFit& fit, const double* posteriorPredictions, double* trainingFits, double* testFits);
     void setCurrentFitsFromAverages(const BARTFit& fit, const double* posteriorPredictions, const double* xt, std::size_t numObservations, double* fits);
+    std::size_t* mapObservationsToBottomNodes(const BARTFit& fit, const double* xt, std::size_t numObservations); // allocates result; indexes bottom nodes in order
+    // as above, for trees whose bottom nodes have already been enumerated; can be called concurrently
+    std::size_t* mapObservationsToEnumeratedBottomNodes(const BARTFit& fit, const double* xt, std::size_t numObservations) const;
     
     void mapOldCutPointsOntoNew(const BARTFit& fit, const double* const* oldCutPoints, double* posteriorPredictions);
     void collapseEmptyNodes(const BARTFit& fit, double* posteriorPredictions);
     
-    void sampleFromPrior(const BARTFit& fit, ext_rng* rng);
+    void sampleFromPrior(const BARTFit& fit, std::size_t chainNum, ext_rng* rng);
     
     Node* getTop() const;
     bool hasSingleNode() const;
+    bool hasSameStructureAs(const Tree& other) const;
     
     std::size_t getNumBottomNodes() const;
     std::size_t getNumNotBottomNodes() const;
@@ -67,6 +72,7 @@ namespace dbarts {
   
   inline Node* Tree::getTop() const { return const_cast<Node*>(&top); }
   inline bool Tree::hasSingleNode() const { return top.isBottom(); }
+  inline bool Tree::hasSameStructureAs(const Tree& other) const { return top.hasSameStructureAs(other.top); }
   
   inline std::size_t Tree::getNumBottomNodes() const { return top.getNumBottomNodes(); }
   inline std::size_t Tree::getNumNotBottomNodes() const { return top.getNumNotBottomNodes(); }
@@ -6,11 +6,13 @@
 
 #include <external/alloca.h>
 #include <external/io.h>
+#include <external/random.h>
 #include <external/stats.h>
 
 #include <dbarts/bartFit.hpp>
 #include <dbarts/data.hpp>
 #include <dbarts/scratch.hpp>
+#include <dbarts/state.hpp>
 #include <dbarts/types.hpp>
 #include "functions.hpp"
 #include "node.hpp"
@@ -20,6 +22,9 @@ using std::uint32_t;
 using std::uint64_t;
 using std::int32_t;
 
+// tries at a weighted draw that lands on a variable available at the node before giving up and
+// walking the available variables
+#define MAX_NUM_SPLIT_VARIABLE_PROPOSALS 32
 
 
 namespace {
@@ -68,8 +73,10 @@ namespace dbarts {
       uint32_t numCategoriesCanReachNode = 0;
       for (size_t i = 0; i < numCategories; ++i) if (categoriesCanReachNode[i]) ++numCategoriesCanReachNode;
       
-      result  = std::log(std::pow(2.0, static_cast<double>(numCategoriesCanReachNode) - 1.0) - 1.0);
-      result -= std::log(std::pow(2.0, static_cast<double>(numCategories - numCategoriesCanReachNode)));
+      // log(2^(n - 1) - 1) - (k - n) log(2), written so that it doesn't overflow for many categories
+      double log2 = std::log(2.0);
+      result  = (static_cast<double>(numCategoriesCanReachNode) - 1.0) * log2 + std::log(1.0 - std::pow(2.0, 1.0 - static_cast<double>(numCategoriesCanReachNode)));
+      result -= static_cast<double>(numCategories - numCategoriesCanReachNode) * log2;
       
       ext_stackFree(categoriesCanReachNode);
     } else {
@@ -81,14 +88,56 @@ namespace dbarts {
     return result;
   }
   
-  Rule CGMPrior::drawRuleAndVariable(const BARTFit& fit, ext_rng* rng, const Node& node, bool* exhaustedLeftSplits, bool* exhaustedRightSplits) const
+  Rule CGMPrior::drawRuleAndVariable(const BARTFit& fit, size_t chainNum, ext_rng* rng, const Node& node, bool* exhaustedLeftSplits, bool* exhaustedRightSplits) const
   {
-    int32_t variableIndex = drawSplitVariable(fit, rng, node);
+    int32_t variableIndex = drawSplitVariable(fit, chainNum, rng, node);
     return drawRuleForVariable(fit, rng, node, variableIndex, exhaustedLeftSplits, exhaustedRightSplits);
   }
   
-  int32_t CGMPrior::drawSplitVariable(const BARTFit& fit, ext_rng* rng, const Node& node) const
+  int32_t CGMPrior::drawSplitVariable(const BARTFit& fit, size_t chainNum, ext_rng* rng, const Node& node) const
   {
+    const double* splitProbabilities = fit.state[chainNum].splitProbabilities;
+    if (sparse && splitProbabilities != NULL) {
+      size_t numPredictors = fit.data.numPredictors;
+      double total = getPartialSumTreeTotal(splitProbabilities, numPredictors);
+      
+      // unavailable variables are rare and draws are O(log p), so rejection is cheapest
+      for (size_t i = 0; i < MAX_NUM_SPLIT_VARIABLE_PROPOSALS && total > 0.0; ++i) {
+        size_t variableIndex = findPartialSumTreeIndex(splitProbabilities, numPredictors, total * ext_rng_simulateContinuousUniform(rng));
+        if (node.variablesAvailableForSplit[variableIndex]) return static_cast<int32_t>(variableIndex);
+      }
+      
+      // almost all of the mass is on unavailable variables, so their weights are taken out of the
+      // tree as it is descended; only the unavailable variables' weights are looked up
+      size_t* unavailable = fit.chainScratch[chainNum].unavailableVariables;
+      double* unavailableSums = fit.chainScratch[chainNum].unavailableSums;
+      size_t numUnavailable = 0;
+      for (size_t j = 0; j < numPredictors; ++j)
+        if (!node.variablesAvailableForSplit[j]) unavailable[numUnavailable++] = j;
+      
+      unavailableSums[0] = 0.0;
+      for (size_t k = 0; k < numUnavailable; ++k)
+        unavailableSums[k + 1] = unavailableSums[k] + getPartialSumTreeValue(splitProbabilities, unavailable[k]);
+      
+      double availableTotal = total - unavailableSums[numUnavailable];
+      int32_t result = DBARTS_INVALID_RULE_VARIABLE;
+      if (availableTotal > 0.0 && numUnavailable < numPredictors) {
+        size_t variableIndex = findPartialSumTreeIndexExcluding(splitProbabilities, numPredictors, availableTotal * ext_rng_simulateContinuousUniform(rng),
+                                                                unavailable, unavailableSums, numUnavailable);
+        // rounding can land on an unavailable neighbor, so move to the closest available one
+        size_t j = variableIndex;
+        while (j > 0 && !node.variablesAvailableForSplit[j]) --j;
+        if (!node.variablesAvailableForSplit[j]) {
+          j = variableIndex;
+          while (j < numPredictors - 1 && !node.variablesAvailableForSplit[j]) ++j;
+        }
+        if (node.variablesAvailableForSplit[j]) result = static_cast<int32_t>(j);
+      }
+      
+      if (result != DBARTS_INVALID_RULE_VARIABLE) return result;
+      // nothing to go on, fall through to uniform
+    }
+    
     size_t numGoodVariables = node.getNumVariablesAvailableForSplit(fit.data.numPredictors);
     
     size_t variableNumber = ext_rng_simulateUnsignedIntegerUniformInRange(rng, 0, numGoodVariables);
@@ -96,9 +145,38 @@ namespace dbarts {
     return findIndexOfIthPositiveValue(node.variablesAvailableForSplit, fit.data.numPredictors, variableNumber);
   }
   
+  // s | counts ~ Dirichlet(concentration / p + counts), drawn through normalized gammas. Shapes can
+  // be tiny when p is large, so gammas are drawn on the log scale using
+  // Gamma(a) = Gamma(a + 1) * U^(1 / a).
+  void CGMPrior::updateSplitProbabilities(const BARTFit& fit, size_t chainNum, ext_rng* rng, const uint32_t* variableCounts) const
+  {
+    double* splitProbabilities = fit.state[chainNum].splitProbabilities;
+    if (!sparse || splitProbabilities == NULL) return;
+    
+    size_t numPredictors = fit.data.numPredictors;
+    double priorShape = concentration / static_cast<double>(numPredictors);
+    
+    double maxLogGamma = -HUGE_VAL;
+    for (size_t j = 0; j < numPredictors; ++j) {
+      double shape = priorShape + static_cast<double>(variableCounts[j]);
+      double logGamma = std::log(ext_rng_simulateGamma(rng, shape + 1.0, 1.0)) + std::log(ext_rng_simulateContinuousUniform(rng)) / shape;
+      splitProbabilities[j] = logGamma;
+      if (logGamma > maxLogGamma) maxLogGamma = logGamma;
+    }
+    
+    double total = 0.0;
+    for (size_t j = 0; j < numPredictors; ++j) {
+      splitProbabilities[j] = std::exp(splitProbabilities[j] - maxLogGamma);
+      total += splitProbabilities[j];
+    }
+    for (size_t j = 0; j < numPredictors; ++j) splitProbabilities[j] /= total;
+    
+    buildPartialSumTree(splitProbabilities, numPredictors);
+  }
+  
   Rule CGMPrior::drawRuleForVariable(const BARTFit& fit, ext_rng* rng, const Node& node, int32_t variableIndex, bool* exhaustedLeftSplits, bool* exhaustedRightSplits) const
   {
-    Rule result = { DBARTS_INVALID_RULE_VARIABLE, { DBARTS_INVALID_RULE_VARIABLE } };
+    Rule result = { DBARTS_INVALID_RULE_VARIABLE, 0, false, { DBARTS_INVALID_RULE_VARIABLE } };
     
     result.variableIndex = variableIndex;
     
@@ -109,8 +187,6 @@ namespace dbarts {
       uint32_t numCategories = fit.sharedScratch.numCutsPerVariable[variableIndex];
       
       bool* categoriesCanReachNode = ext_stackAllocate(numCategories, bool);
-      // result.categoryDirections = new CategoryBranchingType[numCategories];
-      result.categoryDirections = 0l;
       
       setCategoryReachability(fit, node, variableIndex, categoriesCanReachNode);
       
@@ -121,11 +197,26 @@ namespace dbarts {
         ext_throwError("error in TreePrior::drawRule: less than 2 values left for cat var\n");
       }
       
+      result.initializeCategoryDirections(numCategories);
+      
       bool* sendCategoriesRight = ext_stackAllocate(numCategoriesCanReachNode, bool);
       sendCategoriesRight[0] = true; // the first value always goes right so that at least one does
       
-      uint64_t categoryIndex = ext_rng_simulateUnsignedIntegerUniformInRange(rng, 0, static_cast<uint64_t>(std::pow(2.0, static_cast<double>(numCategoriesCanReachNode) - 1.0) - 1.0));
-      setBinaryRepresentation(numCategoriesCanReachNode - 1, static_cast<uint32_t>(categoryIndex), sendCategoriesRight + 1);
+      if (numCategoriesCanReachNode - 1 <= DBARTS_MAX_NUM_INLINE_CATEGORIES) {
+        uint64_t categoryIndex = ext_rng_simulateUnsignedIntegerUniformInRange(rng, 0, static_cast<uint64_t>(std::pow(2.0, static_cast<double>(numCategoriesCanReachNode) - 1.0) - 1.0));
+        setBinaryRepresentation(numCategoriesCanReachNode - 1, static_cast<uint32_t>(categoryIndex), sendCategoriesRight + 1);
+      } else {
+        // too many to index the combinations directly, so flip a coin for each and reject the one
+        // combination that leaves nothing on the left; same uniform distribution as above
+        bool allGoRight;
+        do {
+          allGoRight = true;
+          for (uint32_t i = 1; i < numCategoriesCanReachNode; ++i) {
+            sendCategoriesRight[i] = ext_rng_simulateBernoulli(rng, 0.5) == 1;
+            if (!sendCategoriesRight[i]) allGoRight = false;
+          }
+        } while (allGoRight);
+      }
       
       uint32_t sendIndex = 0;
       for (uint32_t i = 0; i < numCategories; ++i) {
@@ -165,6 +256,9 @@ namespace dbarts {
       if (result.splitIndex == rightIndex) *exhaustedRightSplits = true;
     }
     
+    // a fair coin for where NaN goes; it is its own proposal, so it drops out of acceptance ratios
+    result.missingGoesRight = fit.sharedScratch.variableHasMissingValues[variableIndex] && ext_rng_simulateBernoulli(rng, 0.5) == 1;
+    
     return result;
   } 
 }
@@ -23,16 +23,16 @@
 #  include <windows.h>
 #endif
 
-#if defined(__GNUC__) && (\
-  (!defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6))) || \
-  ( defined(__clang__) && (__GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 7))))
-#  define SUPPRESS_DIAGNOSTIC 1
-#endif
-
 #ifndef EOVERFLOW // needed for mingw
 #define EOVERFLOW EFBIG
 #endif
 
+// Reads and writes go through the buffer so that a file is moved in a few large system calls
+// rather than one per value. Typed arrays are converted and byte-swapped directly into or out of
+// the buffer, and reads large enough to fill it go straight to their destination and are swapped
+// in place.
+#define EXT_BIO_MIN_BUFFER_LENGTH ((size_t) 262144)
+
 #ifndef WORDS_BIGENDIAN
 #define XOR_SWAP(_X_, _Y_) { (_X_) ^= (_Y_); (_Y_) ^= (_X_); (_X_) ^= (_Y_); }
 
@@ -54,12 +54,25 @@ static void swapEndiannessFor4ByteWords(char* c, size_t length);
 static void swapEndiannessFor8ByteWords(char* c, size_t length);
 #endif // WORDS_BIGENDIAN
 
-static size_t fillBufferFromSizeTypes(ext_binaryIO* restrict bio, const size_t* restrict v, size_t length);
-static size_t fillSizeTypesFromBuffer(ext_binaryIO* restrict bio, size_t* restrict v, size_t length);
-static size_t fillBufferFromDoubles(ext_binaryIO* restrict bio, const double* restrict v, size_t length);
-static size_t fillDoublesFromBuffer(ext_binaryIO* restrict bio, double* restrict v, size_t length);  
-static size_t fillBufferFromUnsigned32BitIntegers(ext_binaryIO* restrict bio, const uint32_t* restrict v, size_t length);
-static size_t fillUnsigned32BitIntegersFromBuffer(ext_binaryIO* restrict bio, uint32_t* restrict v, size_t length);
+static int flushBuffer(ext_binaryIO* bio);
+static int refillBuffer(ext_binaryIO* bio);
+static int writeBytes(ext_binaryIO* bio, const void* c, size_t length);
+static int readBytes(ext_binaryIO* bio, void* c, size_t length);
+
+// the fill functions convert as many items as fit in the space given, returning how many that was
+typedef size_t (*fillBufferFunction)(char* restrict buffer, size_t bufferLength, const void* restrict v, size_t length);
+typedef size_t (*fillItemsFunction)(void* restrict v, size_t length, const char* restrict buffer, size_t bufferLength);
+
+// itemSize is as items are in the file, memoryItemSize as they are in v
+static int writeItems(ext_binaryIO* bio, const void* v, size_t length, size_t itemSize, size_t memoryItemSize, fillBufferFunction fillBuffer);
+static int readItems(ext_binaryIO* bio, void* v, size_t length, size_t itemSize, size_t memoryItemSize, fillItemsFunction fillItems);
+
+static size_t fillBufferFromSizeTypes(char* restrict buffer, size_t bufferLength, const void* restrict v, size_t length);
+static size_t fillSizeTypesFromBuffer(void* restrict v, size_t length, const char* restrict buffer, size_t bufferLength);
+static size_t fillBufferFrom8ByteWords(char* restrict buffer, size_t bufferLength, const void* restrict v, size_t length);
+static size_t fill8ByteWordsFromBuffer(void* restrict v, size_t length, const char* restrict buffer, size_t bufferLength);
+static size_t fillBufferFrom4ByteWords(char* restrict buffer, size_t bufferLength, const void* restrict v, size_t length);
+static size_t fill4ByteWordsFromBuffer(void* restrict v, size_t length, const char* restrict buffer, size_t bufferLength);
 
 ext_binaryIO* ext_bio_create(const char* fileName, int openFlag, int permissionsFlag)
 {
@@ -90,6 +103,8 @@ int ext_bio_initialize(ext_binaryIO* bio, const char* fileName, int openFlag, in
   
   bio->buffer = NULL;
   bio->bufferLength = 0;
+  bio->bufferPosition = 0;
+  bio->bufferEnd = 0;
   
   bio->fileDescriptor = open(fileName, openFlag, permissionsFlag);
   if (bio->fileDescriptor == -1) return errno;
@@ -111,8 +126,8 @@ int ext_bio_initialize(ext_binaryIO* bio, const char* fileName, int openFlag, in
   if (pageSize <= 0 || errno != 0) pageSize = 4096; // sure, why not?
   bio->bufferLength = (size_t) pageSize;
   
-  // practically needs to hold at least one 64 bit int
-  while (bio->bufferLength < sizeof(uint64_t)) bio->bufferLength <<= 1;
+  // a whole number of pages, large enough that system calls are amortized over many values
+  while (bio->bufferLength < EXT_BIO_MIN_BUFFER_LENGTH) bio->bufferLength <<= 1;
   
   size_t alignment = sizeof(uint64_t);
   if (alignment % sizeof(void*) != 0) alignment *= sizeof(void*);
@@ -136,6 +151,11 @@ int ext_bio_initialize(ext_binaryIO* bio, const char* fileName, int openFlag, in
     return errorCode;
   }
   
+#if defined(POSIX_FADV_SEQUENTIAL) && !defined(_WIN32)
+  // files are read front to back, so the kernel can read ahead aggressively; purely advisory
+  if ((openFlag & O_ACCMODE) == O_RDONLY) (void) posix_fadvise(bio->fileDescriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  
   return 0;
 }
 
@@ -144,6 +164,8 @@ void ext_bio_invalidate(ext_binaryIO* bio)
   if (bio == NULL) return;
   
   if (bio->fileDescriptor != -1) {
+    // errors are lost here; call ext_bio_flush first to see them
+    (void) flushBuffer(bio);
     close(bio->fileDescriptor);
     bio->fileDescriptor = -1;
   }
@@ -158,18 +180,22 @@ void ext_bio_invalidate(ext_binaryIO* bio)
   }
   
   bio->bufferLength = 0;
+  bio->bufferPosition = 0;
+  bio->bufferEnd = 0;
 }
 
-int ext_bio_writeChar(ext_binaryIO* bio, char c)
+int ext_bio_flush(ext_binaryIO* bio)
 {
   if (bio == NULL) return EFAULT;
   
-  ssize_t bytesWritten = write(bio->fileDescriptor, &c, sizeof(char));
-  
-  if (bytesWritten == 0) return EIO;
-  if (bytesWritten < 0) return errno;
+  return flushBuffer(bio);
+}
+
+int ext_bio_writeChar(ext_binaryIO* bio, char c)
+{
+  if (bio == NULL) return EFAULT;
   
-  return 0;
+  return writeBytes(bio, &c, sizeof(char));
 }
 
 int ext_bio_writeChars(ext_binaryIO* bio, const char* c, size_t length)
@@ -186,29 +212,19 @@ int ext_bio_writeNChars(ext_binaryIO* bio, const char* c, size_t length)
 {
   if (bio == NULL) return EFAULT;
   
-  size_t totalBytesWritten = 0;
-  while (totalBytesWritten < length) {
-    ssize_t bytesWritten = write(bio->fileDescriptor, c + totalBytesWritten, length - totalBytesWritten);
-    if (bytesWritten == 0) return EIO;
-    if (bytesWritten < 0) return errno;
-    totalBytesWritten += (size_t) bytesWritten;
-  }
-  
-  return 0;
+  return writeBytes(bio, c, length);
 }
 
 int ext_bio_writeSizeType(ext_binaryIO* bio, size_t s)
 {
+  if (bio == NULL) return EFAULT;
+  
   uint64_t u = (uint64_t) s;
 #ifndef WORDS_BIGENDIAN
   swapEndiannessFor8ByteWord((char*) &u);
 #endif
   
-  ssize_t bytesWritten = write(bio->fileDescriptor, &u, sizeof(uint64_t));
-  if (bytesWritten == 0) return EIO;
-  if (bytesWritten < 0) return errno;
-  
-  return 0;
+  return writeBytes(bio, &u, sizeof(uint64_t));
 }
 
 int ext_bio_writeSizeTypes(ext_binaryIO* bio, const size_t* v, size_t length)
@@ -225,37 +241,18 @@ int ext_bio_writeNSizeTypes(ext_binaryIO* bio, const size_t* v, size_t length)
 {
   if (bio == NULL) return EFAULT;
   
-  size_t totalItemsWritten = 0;
-  while (totalItemsWritten < length) {
-    size_t itemsWritten = fillBufferFromSizeTypes(bio, v + totalItemsWritten, length - totalItemsWritten);
-    
-    size_t totalBytesWritten = 0;
-    size_t bytesToWrite = itemsWritten * sizeof(uint64_t);
-    
-    while (totalBytesWritten < bytesToWrite) {
-      ssize_t bytesWritten = write(bio->fileDescriptor, (char*) bio->buffer, bytesToWrite - totalBytesWritten);
-      if (bytesWritten == 0) return EIO;
-      if (bytesWritten < 0) return errno;
-      totalBytesWritten += (size_t) bytesWritten;
-    }
-    
-    totalItemsWritten += itemsWritten;
-  }
-  
-  return 0;
+  return writeItems(bio, v, length, sizeof(uint64_t), sizeof(size_t), &fillBufferFromSizeTypes);
 }
 
 int ext_bio_writeUnsigned32BitInteger(ext_binaryIO* bio, uint32_t u)
 {
+  if (bio == NULL) return EFAULT;
+  
 #ifndef WORDS_BIGENDIAN
   swapEndiannessFor4ByteWord((char*) &u);
 #endif
   
-  ssize_t bytesWritten = write(bio->fileDescriptor, &u, sizeof(uint32_t));
-  if (bytesWritten == 0) return EIO;
-  if (bytesWritten < 0) return errno;
-  
-  return 0;
+  return writeBytes(bio, &u, sizeof(uint32_t));
 }
 
 int ext_bio_writeUnsigned32BitIntegers(ext_binaryIO* bio, const uint32_t* u, size_t length)
@@ -270,48 +267,34 @@ int ext_bio_writeUnsigned32BitIntegers(ext_binaryIO* bio, const uint32_t* u, siz
 
 int ext_bio_writeNUnsigned32BitIntegers(ext_binaryIO* bio, const uint32_t* u, size_t length)
 {
-  size_t totalItemsWritten = 0;
-  while (totalItemsWritten < length) {
-    size_t itemsWritten = fillBufferFromUnsigned32BitIntegers(bio, u + totalItemsWritten, length - totalItemsWritten);
-    
-    size_t totalBytesWritten = 0;
-    size_t bytesToWrite = itemsWritten * sizeof(uint32_t);
-    
-    while (totalBytesWritten < bytesToWrite) {
-      ssize_t bytesWritten = write(bio->fileDescriptor, (char*) bio->buffer, bytesToWrite - totalBytesWritten);
-      if (bytesWritten == 0) return EIO;
-      if (bytesWritten < 0) return errno;
-      totalBytesWritten += (size_t) bytesWritten;
-    }
-    
-    totalItemsWritten += itemsWritten;
-  }
+  if (bio == NULL) return EFAULT;
   
-  return 0;
+  return writeItems(bio, u, length, sizeof(uint32_t), sizeof(uint32_t), &fillBufferFrom4ByteWords);
 }
 
 int ext_bio_writeUnsigned64BitInteger(ext_binaryIO* bio, uint64_t u)
 {
+  if (bio == NULL) return EFAULT;
+  
 #ifndef WORDS_BIGENDIAN
   swapEndiannessFor8ByteWord((char*) &u);
 #endif
   
-  ssize_t bytesWritten = write(bio->fileDescriptor, &u, sizeof(uint64_t));
-  if (bytesWritten == 0) return EIO;
-  if (bytesWritten < 0) return errno;
+  return writeBytes(bio, &u, sizeof(uint64_t));
+}
+
+int ext_bio_writeNUnsigned64BitIntegers(ext_binaryIO* bio, const uint64_t* u, size_t length)
+{
+  if (bio == NULL) return EFAULT;
   
-  return 0;
+  return writeItems(bio, u, length, sizeof(uint64_t), sizeof(uint64_t), &fillBufferFrom8ByteWords);
 }
 
 int ext_bio_writeDouble(ext_binaryIO* bio, double d)
 {
   if (bio == NULL) return EFAULT;
   
-  ssize_t bytesWritten = write(bio->fileDescriptor, &d, sizeof(double));
-  if (bytesWritten == 0) return EIO;
-  if (bytesWritten < 0) return errno;
-  
-  return 0;
+  return writeBytes(bio, &d, sizeof(double));
 } 
 
 int ext_bio_writeDoubles(ext_binaryIO* bio, const double* d, size_t length)
@@ -326,24 +309,9 @@ int ext_bio_writeDoubles(ext_binaryIO* bio, const double* d, size_t length)
 
 int ext_bio_writeNDoubles(ext_binaryIO* bio, const double* d, size_t length)
 {
-  size_t totalItemsWritten = 0;
-  while (totalItemsWritten < length) {
-    size_t itemsWritten = fillBufferFromDoubles(bio, d + totalItemsWritten, length - totalItemsWritten);
-    
-    size_t totalBytesWritten = 0;
-    size_t bytesToWrite = itemsWritten * sizeof(double);
-    
-    while (totalBytesWritten < bytesToWrite) {
-      ssize_t bytesWritten = write(bio->fileDescriptor, (char*) bio->buffer, bytesToWrite - totalBytesWritten);
-      if (bytesWritten == 0) return EIO;
-      if (bytesWritten < 0) return errno;
-      totalBytesWritten += (size_t) bytesWritten;
-    }
-    
-    totalItemsWritten += itemsWritten;
-  }
+  if (bio == NULL) return EFAULT;
   
-  return 0;
+  return writeItems(bio, d, length, sizeof(double), sizeof(double), &fillBufferFrom8ByteWords);
 }
 
 int ext_bio_writeNInts(ext_binaryIO* bio, const int* i, size_t length)
@@ -362,12 +330,7 @@ int ext_bio_readChar(ext_binaryIO* bio, char *c)
 {
   if (bio == NULL) return EFAULT;
   
-  ssize_t bytesRead = read(bio->fileDescriptor, c, sizeof(char));
-  
-  if (bytesRead == 0) return EIO;
-  if (bytesRead < 0) return errno;
-  
-  return 0;
+  return readBytes(bio, c, sizeof(char));
 }
 
 char* ext_bio_readChars(ext_binaryIO* bio, size_t* length)
@@ -394,15 +357,7 @@ int ext_bio_readNChars(ext_binaryIO* bio, char* c, size_t length)
 {
   if (bio == NULL) return EFAULT;
   
-  size_t totalBytesRead = 0;
-  while (totalBytesRead < length) {
-    ssize_t bytesRead = read(bio->fileDescriptor, c + totalBytesRead, length - totalBytesRead);
-    if (bytesRead == 0) return EIO;
-    if (bytesRead < 0) return errno;
-    totalBytesRead += (size_t) bytesRead;
-  }
-  
-  return 0;
+  return readBytes(bio, c, length);
 }
 
 
@@ -412,9 +367,8 @@ int ext_bio_readSizeType(ext_binaryIO* bio, size_t* s)
   
   uint64_t u;
   
-  ssize_t bytesRead = read(bio->fileDescriptor, &u, sizeof(uint64_t));
-  if (bytesRead == 0) return EIO;
-  if (bytesRead < 0) return errno;
+  int errorCode = readBytes(bio, &u, sizeof(uint64_t));
+  if (errorCode != 0) return errorCode;
   
 #ifndef WORDS_BIGENDIAN
   swapEndiannessFor8ByteWord((char*) &u);
@@ -449,38 +403,20 @@ size_t* ext_bio_readSizeTypes(ext_binaryIO* bio, size_t* length)
 
 int ext_bio_readNSizeTypes(ext_binaryIO* bio, size_t* s, size_t length)
 {
-  if (bio == NULL) return errno = EFAULT;
+  if (bio == NULL) return EFAULT;
   
-  size_t totalItemsRead = 0;
-  while (totalItemsRead < length) {
-    size_t itemsToRead = (bio->bufferLength / sizeof(uint64_t)) < (length - totalItemsRead) ? bio->bufferLength / sizeof(uint64_t) : length - totalItemsRead;
-    
-    size_t totalBytesRead = 0;
-    size_t bytesToRead = itemsToRead * sizeof(uint64_t);
-    
-    while (totalBytesRead < bytesToRead) {
-      ssize_t bytesRead = read(bio->fileDescriptor, (char*) bio->buffer, bytesToRead - totalBytesRead);
-      if (bytesRead == 0) return EIO;
-      if (bytesRead < 0) return errno;
-      totalBytesRead += (size_t) bytesRead;
-    }
-    
-    size_t itemsRead = fillSizeTypesFromBuffer(bio, s + totalItemsRead, itemsToRead);
-    if (itemsRead == 0) return errno;
-    
-    totalItemsRead += itemsRead;
-  }
+  if (sizeof(size_t) == sizeof(uint64_t))
+    return readItems(bio, s, length, sizeof(uint64_t), sizeof(uint64_t), &fill8ByteWordsFromBuffer);
   
-  return 0;
+  return readItems(bio, s, length, sizeof(uint64_t), sizeof(size_t), &fillSizeTypesFromBuffer);
 }
 
 int ext_bio_readUnsigned32BitInteger(ext_binaryIO* bio, uint32_t* u)
 {
   if (bio == NULL) return EFAULT;
   
-  ssize_t bytesRead = read(bio->fileDescriptor, u, sizeof(uint32_t));
-  if (bytesRead == 0) return EIO;
-  if (bytesRead < 0) return errno;
+  int errorCode = readBytes(bio, u, sizeof(uint32_t));
+  if (errorCode != 0) return errorCode;
   
 #ifndef WORDS_BIGENDIAN
   swapEndiannessFor4ByteWord((char*) u);
@@ -506,40 +442,22 @@ uint32_t* ext_bio_readUnsigned32BitIntegers(ext_binaryIO* bio, size_t* length)
     return NULL;
   }
   
-  return 0;
+  return u;
 }
 
 int ext_bio_readNUnsigned32BitIntegers(ext_binaryIO* bio, uint32_t* u, size_t length)
 {
   if (bio == NULL) return EFAULT;
   
-  size_t totalItemsRead = 0;
-  while (totalItemsRead < length) {
-    size_t itemsToRead = (bio->bufferLength / sizeof(uint32_t)) < (length - totalItemsRead) ? bio->bufferLength / sizeof(uint32_t) : length - totalItemsRead;
-    
-    size_t totalBytesRead = 0;
-    size_t bytesToRead = itemsToRead * sizeof(uint32_t);
-    
-    while (totalBytesRead < bytesToRead) {
-      ssize_t bytesRead = read(bio->fileDescriptor, (char*) bio->buffer, bytesToRead - totalBytesRead);
-      if (bytesRead == 0) return EIO;
-      if (bytesRead < 0) return errno;
-      totalBytesRead += (size_t) bytesRead;
-    }
-    
-    totalItemsRead += fillUnsigned32BitIntegersFromBuffer(bio, u + totalItemsRead, itemsToRead);
-  }
-  
-  return 0;
+  return readItems(bio, u, length, sizeof(uint32_t), sizeof(uint32_t), &fill4ByteWordsFromBuffer);
 }
 
 int ext_bio_readUnsigned64BitInteger(ext_binaryIO* bio, uint64_t* u)
 {
   if (bio == NULL) return EFAULT;
   
-  ssize_t bytesRead = read(bio->fileDescriptor, u, sizeof(uint64_t));
-  if (bytesRead == 0) return EIO;
-  if (bytesRead < 0) return errno;
+  int errorCode = readBytes(bio, u, sizeof(uint64_t));
+  if (errorCode != 0) return errorCode;
   
 #ifndef WORDS_BIGENDIAN
   swapEndiannessFor8ByteWord((char*) u);
@@ -548,15 +466,18 @@ int ext_bio_readUnsigned64BitInteger(ext_binaryIO* bio, uint64_t* u)
   return 0;
 }
 
+int ext_bio_readNUnsigned64BitIntegers(ext_binaryIO* bio, uint64_t* u, size_t length)
+{
+  if (bio == NULL) return EFAULT;
+  
+  return readItems(bio, u, length, sizeof(uint64_t), sizeof(uint64_t), &fill8ByteWordsFromBuffer);
+}
+
 int ext_bio_readDouble(ext_binaryIO* bio, double* d)
 {
   if (bio == NULL) return EFAULT;
   
-  ssize_t bytesRead = read(bio->fileDescriptor, d, sizeof(double));
-  if (bytesRead == 0) return EIO;
-  if (bytesRead < 0) return errno;
-    
-  return 0;
+  return readBytes(bio, d, sizeof(double));
 }
 
 double* ext_bio_readDoubles(ext_binaryIO* bio, size_t* length)
@@ -576,31 +497,14 @@ double* ext_bio_readDoubles(ext_binaryIO* bio, size_t* length)
     return NULL;
   }
   
-  return 0;
+  return d;
 }
 
 int ext_bio_readNDoubles(ext_binaryIO* bio, double* d, size_t length)
 {
   if (bio == NULL) return EFAULT;
   
-  size_t totalItemsRead = 0;
-  while (totalItemsRead < length) {
-    size_t itemsToRead = (bio->bufferLength / sizeof(double)) < (length - totalItemsRead) ? bio->bufferLength / sizeof(double) : length - totalItemsRead;
-    
-    size_t totalBytesRead = 0;
-    size_t bytesToRead = itemsToRead * sizeof(double);
-    
-    while (totalBytesRead < bytesToRead) {
-      ssize_t bytesRead = read(bio->fileDescriptor, (char*) bio->buffer, bytesToRead - totalBytesRead);
-      if (bytesRead == 0) return EIO;
-      if (bytesRead < 0) return errno;
-      totalBytesRead += (size_t) bytesRead;
-    }
-    
-    totalItemsRead += fillDoublesFromBuffer(bio, d + totalItemsRead, itemsToRead);
-  }
-  
-  return 0;
+  return readItems(bio, d, length, sizeof(double), sizeof(double), &fill8ByteWordsFromBuffer);
 }
 
 int ext_bio_readNInts(ext_binaryIO* bio, int* i, size_t length)
@@ -614,240 +518,467 @@ int ext_bio_readNInts(ext_binaryIO* bio, int* i, size_t length)
   return errorCode;
 }
 
+int ext_bio_getPosition(ext_binaryIO* bio, size_t* position)
+{
+  if (bio == NULL) return EFAULT;
+  
+  off_t filePosition = lseek(bio->fileDescriptor, 0, SEEK_CUR);
+  if (filePosition == (off_t) -1) return errno;
+  
+  // reads run ahead of the caller and writes lag behind
+  if (bio->bufferEnd > 0)
+    *position = (size_t) filePosition - (bio->bufferEnd - bio->bufferPosition);
+  else
+    *position = (size_t) filePosition + bio->bufferPosition;
+  
+  return 0;
+}
+
+int ext_bio_skip(ext_binaryIO* bio, size_t length)
+{
+  if (bio == NULL) return EFAULT;
+  
+  size_t numBufferedBytes = bio->bufferEnd - bio->bufferPosition;
+  if (length <= numBufferedBytes) {
+    bio->bufferPosition += length;
+    return 0;
+  }
+  
+  if (lseek(bio->fileDescriptor, (off_t) (length - numBufferedBytes), SEEK_CUR) == (off_t) -1) return errno;
+  bio->bufferPosition = 0;
+  bio->bufferEnd = 0;
+  
+  return 0;
+}
 
-// upcast to 64_bit ints
-static size_t fillBufferFromSizeTypes(ext_binaryIO* restrict bio, const size_t* restrict v, size_t length)
+// leaves the buffer and the file position as they were
+static int readBytesAt(ext_binaryIO* bio, void* v, size_t length, size_t position)
 {
-  if (length == 0) return 0;
+  char* c = (char*) v;
   
-  // purposefully aligned this stupid pointer
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic push
-#  pragma GCC diagnostic ignored "-Wcast-align"
+#ifdef _WIN32
+  off_t filePosition = lseek(bio->fileDescriptor, 0, SEEK_CUR);
+  if (filePosition == (off_t) -1) return errno;
+  if (lseek(bio->fileDescriptor, (off_t) position, SEEK_SET) == (off_t) -1) return errno;
+  int errorCode = 0;
+#endif
+  
+  size_t totalBytesRead = 0;
+  while (totalBytesRead < length) {
+#ifdef _WIN32
+    ssize_t bytesRead = read(bio->fileDescriptor, c + totalBytesRead, length - totalBytesRead);
+    if (bytesRead == 0) { errorCode = EIO; break; }
+    if (bytesRead < 0) {
+      if (errno == EINTR) continue;
+      errorCode = errno;
+      break;
+    }
+#else
+    ssize_t bytesRead = pread(bio->fileDescriptor, c + totalBytesRead, length - totalBytesRead, (off_t) (position + totalBytesRead));
+    if (bytesRead == 0) return EIO;
+    if (bytesRead < 0) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
 #endif
-  uint64_t* restrict buffer = (uint64_t* restrict) bio->buffer;
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic pop
+    totalBytesRead += (size_t) bytesRead;
+  }
+  
+#ifdef _WIN32
+  if (lseek(bio->fileDescriptor, filePosition, SEEK_SET) == (off_t) -1 && errorCode == 0) errorCode = errno;
+  return errorCode;
+#else
+  return 0;
 #endif
-  size_t bufferLength = bio->bufferLength / sizeof(uint64_t);
-  size_t fillLength = (length < bufferLength ? length : bufferLength);
+}
+
+int ext_bio_readNSizeTypesAt(ext_binaryIO* bio, size_t position, size_t* s, size_t length)
+{
+  if (bio == NULL) return EFAULT;
   
-  if (sizeof(size_t) == sizeof(uint64_t)) {
-    memcpy(buffer, v, fillLength * sizeof(uint64_t));
+  uint64_t u;
+  for (size_t i = 0; i < length; ++i) {
+    int errorCode = readBytesAt(bio, &u, sizeof(uint64_t), position + i * sizeof(uint64_t));
+    if (errorCode != 0) return errorCode;
 #ifndef WORDS_BIGENDIAN
-   swapEndiannessFor8ByteWords((char*) buffer, fillLength);
+    swapEndiannessFor8ByteWord((char*) &u);
 #endif
-    return fillLength;
+    if (u > (uint64_t) SIZE_MAX) return EOVERFLOW;
+    s[i] = (size_t) u;
   }
+  
+  return 0;
+}
 
-  size_t lengthMod5 = fillLength % 5;
-  size_t i = 0;
-  for ( ; i < lengthMod5; ++i) buffer[i] = (uint64_t) v[i];
-  
-  for ( ; i < fillLength; i += 5) {
-    buffer[    i] = (uint64_t) v[i];
-    buffer[i + 1] = (uint64_t) v[i + 1];
-    buffer[i + 2] = (uint64_t) v[i + 2];
-    buffer[i + 3] = (uint64_t) v[i + 3];
-    buffer[i + 4] = (uint64_t) v[i + 4];
-  }
+int ext_bio_readNDoublesAt(ext_binaryIO* bio, size_t position, double* d, size_t length)
+{
+  if (bio == NULL) return EFAULT;
+  
+  int errorCode = readBytesAt(bio, d, length * sizeof(double), position);
+  if (errorCode != 0) return errorCode;
   
 #ifndef WORDS_BIGENDIAN
-   swapEndiannessFor8ByteWords((char*) buffer, fillLength);
+  swapEndiannessFor8ByteWords((char*) d, length);
 #endif
   
-  return fillLength;
+  return 0;
 }
 
-// upcast to 64_bit ints
-static size_t fillSizeTypesFromBuffer(ext_binaryIO* restrict bio, size_t* restrict v, size_t length)
+// the file position is left as it was
+static int writeBytesAt(ext_binaryIO* bio, const void* v, size_t length, size_t position)
 {
-  if (length == 0) return 0;
+  const char* c = (const char*) v;
   
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic push
-#  pragma GCC diagnostic ignored "-Wcast-align"
+#ifdef _WIN32
+  off_t filePosition = lseek(bio->fileDescriptor, 0, SEEK_CUR);
+  if (filePosition == (off_t) -1) return errno;
+  if (lseek(bio->fileDescriptor, (off_t) position, SEEK_SET) == (off_t) -1) return errno;
+  int errorCode = 0;
 #endif
-  uint64_t* restrict buffer = (uint64_t* restrict) bio->buffer;
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic pop
+  
+  size_t totalBytesWritten = 0;
+  while (totalBytesWritten < length) {
+#ifdef _WIN32
+    ssize_t bytesWritten = write(bio->fileDescriptor, c + totalBytesWritten, length - totalBytesWritten);
+    if (bytesWritten == 0) { errorCode = EIO; break; }
+    if (bytesWritten < 0) {
+      if (errno == EINTR) continue;
+      errorCode = errno;
+      break;
+    }
+#else
+    ssize_t bytesWritten = pwrite(bio->fileDescriptor, c + totalBytesWritten, length - totalBytesWritten, (off_t) (position + totalBytesWritten));
+    if (bytesWritten == 0) return EIO;
+    if (bytesWritten < 0) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
 #endif
-  size_t bufferLength = bio->bufferLength / sizeof(uint64_t);
-  size_t fillLength = (length < bufferLength ? length : bufferLength);
+    totalBytesWritten += (size_t) bytesWritten;
+  }
   
-#ifndef WORDS_BIGENDIAN
-  swapEndiannessFor8ByteWords((char*) buffer, fillLength);
+#ifdef _WIN32
+  if (lseek(bio->fileDescriptor, filePosition, SEEK_SET) == (off_t) -1 && errorCode == 0) errorCode = errno;
+  return errorCode;
+#else
+  return 0;
 #endif
+}
+
+int ext_bio_writeNDoublesAt(ext_binaryIO* bio, size_t position, const double* d, size_t length)
+{
+  if (bio == NULL) return EFAULT;
   
-  if (sizeof(size_t) == sizeof(uint64_t)) {
-    memcpy(v, buffer, fillLength * sizeof(uint64_t));
-    
-    return fillLength;
+#ifdef WORDS_BIGENDIAN
+  return writeBytesAt(bio, d, length * sizeof(double), position);
+#else
+  // converted a buffer's worth at a time, since the caller's array can't be swapped in place
+  char* buffer = (char*) malloc(EXT_BIO_MIN_BUFFER_LENGTH);
+  if (buffer == NULL) return ENOMEM;
+  
+  int errorCode = 0;
+  size_t numDoublesPerWrite = EXT_BIO_MIN_BUFFER_LENGTH / sizeof(double);
+  for (size_t offset = 0; offset < length && errorCode == 0; offset += numDoublesPerWrite) {
+    size_t numDoubles = length - offset < numDoublesPerWrite ? length - offset : numDoublesPerWrite;
+    memcpy(buffer, d + offset, numDoubles * sizeof(double));
+    swapEndiannessFor8ByteWords(buffer, numDoubles);
+    errorCode = writeBytesAt(bio, buffer, numDoubles * sizeof(double), position + offset * sizeof(double));
   }
   
-  size_t i = 0;
-  for ( ; i < fillLength; ++i) {
-    if (buffer[i] > (uint64_t) SIZE_MAX) {
-      errno = EOVERFLOW;
-      return 0;
+  free(buffer);
+  return errorCode;
+#endif
+}
+
+static int flushBuffer(ext_binaryIO* bio)
+{
+  const char* buffer = (const char*) bio->buffer;
+  
+  size_t totalBytesWritten = 0;
+  while (totalBytesWritten < bio->bufferPosition) {
+    ssize_t bytesWritten = write(bio->fileDescriptor, buffer + totalBytesWritten, bio->bufferPosition - totalBytesWritten);
+    if (bytesWritten == 0) return EIO;
+    if (bytesWritten < 0) {
+      if (errno == EINTR) continue;
+      return errno;
     }
-  } 
-  size_t lengthMod5 = fillLength % 5;
-  for ( ; i < lengthMod5; ++i) v[i] = (size_t) buffer[i];
-  
-  for ( ; i < fillLength; i += 5) {
-    v[    i] = (size_t) buffer[i];
-    v[i + 1] = (size_t) buffer[i + 1];
-    v[i + 2] = (size_t) buffer[i + 2];
-    v[i + 3] = (size_t) buffer[i + 3];
-    v[i + 4] = (size_t) buffer[i + 4];
+    totalBytesWritten += (size_t) bytesWritten;
   }
+  bio->bufferPosition = 0;
   
-  return fillLength;
+  return 0;
 }
 
-static size_t fillBufferFromDoubles(ext_binaryIO* restrict bio, const double* restrict d, size_t length)
+// keeps whatever has not been consumed and reads in as much as will fit after it; end of file is
+// only an error if nothing more could be read
+static int refillBuffer(ext_binaryIO* bio)
 {
-  if (length == 0) return 0;
+  char* buffer = (char*) bio->buffer;
   
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic push
-#  pragma GCC diagnostic ignored "-Wcast-align"
-#endif
-  double* restrict buffer = (double* restrict) bio->buffer;
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic pop
+  size_t numUnreadBytes = bio->bufferEnd - bio->bufferPosition;
+  if (numUnreadBytes > 0 && bio->bufferPosition > 0) memmove(buffer, buffer + bio->bufferPosition, numUnreadBytes);
+  bio->bufferPosition = 0;
+  bio->bufferEnd = numUnreadBytes;
+  
+  ssize_t bytesRead;
+  do {
+    bytesRead = read(bio->fileDescriptor, buffer + bio->bufferEnd, bio->bufferLength - bio->bufferEnd);
+  } while (bytesRead < 0 && errno == EINTR);
+  
+  if (bytesRead == 0) return EIO;
+  if (bytesRead < 0) return errno;
+  bio->bufferEnd += (size_t) bytesRead;
+  
+  return 0;
+}
+
+static int writeBytes(ext_binaryIO* bio, const void* v, size_t length)
+{
+  const char* c = (const char*) v;
+  int errorCode;
+  
+  if (bio->bufferPosition + length > bio->bufferLength && (errorCode = flushBuffer(bio)) != 0) return errorCode;
+  
+  if (length >= bio->bufferLength) {
+    size_t totalBytesWritten = 0;
+    while (totalBytesWritten < length) {
+      ssize_t bytesWritten = write(bio->fileDescriptor, c + totalBytesWritten, length - totalBytesWritten);
+      if (bytesWritten == 0) return EIO;
+      if (bytesWritten < 0) {
+        if (errno == EINTR) continue;
+        return errno;
+      }
+      totalBytesWritten += (size_t) bytesWritten;
+    }
+    return 0;
+  }
+  
+  memcpy((char*) bio->buffer + bio->bufferPosition, c, length);
+  bio->bufferPosition += length;
+  
+  return 0;
+}
+
+static int readBytes(ext_binaryIO* bio, void* v, size_t length)
+{
+  char* c = (char*) v;
+  int errorCode;
+  
+  size_t numBufferedBytes = bio->bufferEnd - bio->bufferPosition;
+  size_t numBytesToCopy = length < numBufferedBytes ? length : numBufferedBytes;
+  memcpy(c, (const char*) bio->buffer + bio->bufferPosition, numBytesToCopy);
+  bio->bufferPosition += numBytesToCopy;
+  
+  size_t totalBytesRead = numBytesToCopy;
+  
+  if (length - totalBytesRead >= bio->bufferLength) {
+    // too big to be worth staging
+    while (totalBytesRead < length) {
+      ssize_t bytesRead = read(bio->fileDescriptor, c + totalBytesRead, length - totalBytesRead);
+      if (bytesRead == 0) return EIO;
+      if (bytesRead < 0) {
+        if (errno == EINTR) continue;
+        return errno;
+      }
+      totalBytesRead += (size_t) bytesRead;
+    }
+    return 0;
+  }
+  
+  while (totalBytesRead < length) {
+    if ((errorCode = refillBuffer(bio)) != 0) return errorCode;
+    
+    numBufferedBytes = bio->bufferEnd;
+    numBytesToCopy = length - totalBytesRead < numBufferedBytes ? length - totalBytesRead : numBufferedBytes;
+    memcpy(c + totalBytesRead, (const char*) bio->buffer, numBytesToCopy);
+    bio->bufferPosition = numBytesToCopy;
+    totalBytesRead += numBytesToCopy;
+  }
+  
+  return 0;
+}
+
+static int writeItems(ext_binaryIO* bio, const void* v, size_t length, size_t itemSize, size_t memoryItemSize, fillBufferFunction fillBuffer)
+{
+  int errorCode;
+  size_t totalItemsWritten = 0;
+  
+  while (totalItemsWritten < length) {
+    if (bio->bufferLength - bio->bufferPosition < itemSize && (errorCode = flushBuffer(bio)) != 0) return errorCode;
+    
+    size_t itemsWritten = fillBuffer((char*) bio->buffer + bio->bufferPosition, bio->bufferLength - bio->bufferPosition,
+                                     (const char*) v + totalItemsWritten * memoryItemSize, length - totalItemsWritten);
+    bio->bufferPosition += itemsWritten * itemSize;
+    totalItemsWritten += itemsWritten;
+  }
+  
+  return 0;
+}
+
+static int readItems(ext_binaryIO* bio, void* v, size_t length, size_t itemSize, size_t memoryItemSize, fillItemsFunction fillItems)
+{
+  int errorCode;
+  size_t totalItemsRead = 0;
+  
+  while (totalItemsRead < length) {
+    if (bio->bufferEnd - bio->bufferPosition < itemSize) {
+      // large native-width arrays skip the buffer and are swapped where they land
+      if (memoryItemSize == itemSize && bio->bufferEnd == bio->bufferPosition &&
+          (length - totalItemsRead) * itemSize >= bio->bufferLength)
+      {
+        size_t numItems = length - totalItemsRead;
+        char* c = (char*) v + totalItemsRead * itemSize;
+        if ((errorCode = readBytes(bio, c, numItems * itemSize)) != 0) return errorCode;
+#ifndef WORDS_BIGENDIAN
+        if (itemSize == sizeof(uint64_t)) swapEndiannessFor8ByteWords(c, numItems);
+        else swapEndiannessFor4ByteWords(c, numItems);
 #endif
-  size_t bufferLength = bio->bufferLength / sizeof(double);
-  size_t fillLength = (length < bufferLength ? length : bufferLength);
+        return 0;
+      }
+      if ((errorCode = refillBuffer(bio)) != 0) return errorCode;
+      continue;
+    }
+    
+    size_t itemsRead = fillItems((char*) v + totalItemsRead * memoryItemSize, length - totalItemsRead,
+                                 (const char*) bio->buffer + bio->bufferPosition, bio->bufferEnd - bio->bufferPosition);
+    if (itemsRead == 0) return errno;
+    
+    bio->bufferPosition += itemsRead * itemSize;
+    totalItemsRead += itemsRead;
+  }
   
-  memcpy(buffer, d, fillLength * sizeof(double));
+  return 0;
+}
+
+// upcast to 64_bit ints
+static size_t fillBufferFromSizeTypes(char* restrict buffer, size_t bufferLength, const void* restrict v, size_t length)
+{
+  if (sizeof(size_t) == sizeof(uint64_t)) return fillBufferFrom8ByteWords(buffer, bufferLength, v, length);
+  
+  const size_t* restrict s = (const size_t* restrict) v;
+  size_t fillLength = bufferLength / sizeof(uint64_t);
+  if (length < fillLength) fillLength = length;
+  
+  for (size_t i = 0; i < fillLength; ++i) {
+    uint64_t u = (uint64_t) s[i];
+    memcpy(buffer + i * sizeof(uint64_t), &u, sizeof(uint64_t));
+  }
   
 #ifndef WORDS_BIGENDIAN
-  swapEndiannessFor8ByteWords((char*) buffer, fillLength);
+  swapEndiannessFor8ByteWords(buffer, fillLength);
 #endif
-   
+  
   return fillLength;
 }
 
-static size_t fillDoublesFromBuffer(ext_binaryIO* restrict bio, double* restrict d, size_t length)
+// downcast from 64_bit ints, when size_t is narrower
+static size_t fillSizeTypesFromBuffer(void* restrict v, size_t length, const char* restrict buffer, size_t bufferLength)
 {
-  if (length == 0) return 0;
+  size_t* restrict s = (size_t* restrict) v;
+  size_t fillLength = bufferLength / sizeof(uint64_t);
+  if (length < fillLength) fillLength = length;
   
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic push
-#  pragma GCC diagnostic ignored "-Wcast-align"
-#endif
-  double* restrict buffer = (double* restrict) bio->buffer;
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic pop
+  for (size_t i = 0; i < fillLength; ++i) {
+    uint64_t u;
+    memcpy(&u, buffer + i * sizeof(uint64_t), sizeof(uint64_t));
+#ifndef WORDS_BIGENDIAN
+    swapEndiannessFor8ByteWord((char*) &u);
 #endif
-  size_t bufferLength = bio->bufferLength / sizeof(double);
-  size_t fillLength = (length < bufferLength ? length : bufferLength);
+    if (u > (uint64_t) SIZE_MAX) {
+      errno = EOVERFLOW;
+      return 0;
+    }
+    s[i] = (size_t) u;
+  }
+  
+  return fillLength;
+}
+
+static size_t fillBufferFrom8ByteWords(char* restrict buffer, size_t bufferLength, const void* restrict v, size_t length)
+{
+  size_t fillLength = bufferLength / 8;
+  if (length < fillLength) fillLength = length;
+  
+  memcpy(buffer, v, fillLength * 8);
   
 #ifndef WORDS_BIGENDIAN
-  swapEndiannessFor8ByteWords((char*) buffer, fillLength);
+  swapEndiannessFor8ByteWords(buffer, fillLength);
 #endif
-  
-  memcpy(d, buffer, fillLength * sizeof(double));
    
   return fillLength;
 }
 
-static size_t fillBufferFromUnsigned32BitIntegers(ext_binaryIO* restrict bio, const uint32_t* restrict v, size_t length)
+static size_t fill8ByteWordsFromBuffer(void* restrict v, size_t length, const char* restrict buffer, size_t bufferLength)
 {
-  if (length == 0) return 0;
+  size_t fillLength = bufferLength / 8;
+  if (length < fillLength) fillLength = length;
   
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic push
-#  pragma GCC diagnostic ignored "-Wcast-align"
-#endif
-  uint32_t* restrict buffer = (uint32_t* restrict) bio->buffer;
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic pop
+  memcpy(v, buffer, fillLength * 8);
+  
+#ifndef WORDS_BIGENDIAN
+  swapEndiannessFor8ByteWords((char*) v, fillLength);
 #endif
-  size_t bufferLength = bio->bufferLength / sizeof(uint32_t);
-  size_t fillLength = (length < bufferLength ? length : bufferLength);
+   
+  return fillLength;
+}
+
+static size_t fillBufferFrom4ByteWords(char* restrict buffer, size_t bufferLength, const void* restrict v, size_t length)
+{
+  size_t fillLength = bufferLength / 4;
+  if (length < fillLength) fillLength = length;
   
-  memcpy(buffer, v, fillLength * sizeof(uint32_t));
+  memcpy(buffer, v, fillLength * 4);
   
 #ifndef WORDS_BIGENDIAN
-  swapEndiannessFor4ByteWords((char*) buffer, fillLength);
+  swapEndiannessFor4ByteWords(buffer, fillLength);
 #endif
    
   return fillLength;
 }
 
-static size_t fillUnsigned32BitIntegersFromBuffer(ext_binaryIO* restrict bio, uint32_t* restrict v, size_t length)
+static size_t fill4ByteWordsFromBuffer(void* restrict v, size_t length, const char* restrict buffer, size_t bufferLength)
 {
-  if (length == 0) return 0;
+  size_t fillLength = bufferLength / 4;
+  if (length < fillLength) fillLength = length;
   
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic push
-#  pragma GCC diagnostic ignored "-Wcast-align"
-#endif
-  uint32_t* restrict buffer = (uint32_t* restrict) bio->buffer;
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic pop
-#endif
-  size_t bufferLength = bio->bufferLength / sizeof(uint32_t);
-  size_t fillLength = (length < bufferLength ? length : bufferLength);
+  memcpy(v, buffer, fillLength * 4);
   
 #ifndef WORDS_BIGENDIAN
-  swapEndiannessFor4ByteWords((char*) buffer, fillLength);
+  swapEndiannessFor4ByteWords((char*) v, fillLength);
 #endif
-  
-  memcpy(v, buffer, fillLength * sizeof(uint32_t));
    
   return fillLength;
 }
 
 #ifndef WORDS_BIGENDIAN
+// words are addressed bytewise, as they can sit at any offset in the buffer
 static void swapEndiannessFor4ByteWords(char* c, size_t length)
 {
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic push
-#  pragma GCC diagnostic ignored "-Wcast-align"
-#endif
-  uint32_t* u = (uint32_t*) c;
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic pop
-#endif
-  
   size_t lengthMod5 = length % 5;
   size_t i = 0;
-  for ( ; i < lengthMod5; ++i) swapEndiannessFor4ByteWord((char*) (u + i));
+  for ( ; i < lengthMod5; ++i) swapEndiannessFor4ByteWord(c + 4 * i);
   
   for ( ; i < length; i += 5) {
-    swapEndiannessFor4ByteWord((char*) (u + i));
-    swapEndiannessFor4ByteWord((char*) (u + i + 1));
-    swapEndiannessFor4ByteWord((char*) (u + i + 2));
-    swapEndiannessFor4ByteWord((char*) (u + i + 3));
-    swapEndiannessFor4ByteWord((char*) (u + i + 4));
+    swapEndiannessFor4ByteWord(c + 4 * i);
+    swapEndiannessFor4ByteWord(c + 4 * (i + 1));
+    swapEndiannessFor4ByteWord(c + 4 * (i + 2));
+    swapEndiannessFor4ByteWord(c + 4 * (i + 3));
+    swapEndiannessFor4ByteWord(c + 4 * (i + 4));
   }
 }
 
 static void swapEndiannessFor8ByteWords(char* c, size_t length)
 {
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic push
-#  pragma GCC diagnostic ignored "-Wcast-align"
-#endif
-  uint64_t* u = (uint64_t*) c;
-#ifdef SUPPRESS_DIAGNOSTIC
-#  pragma GCC diagnostic pop
-#endif
-  
   size_t lengthMod5 = length % 5;
   size_t i = 0;
-  for ( ; i < lengthMod5; ++i) swapEndiannessFor8ByteWord((char*) (u + i));
+  for ( ; i < lengthMod5; ++i) swapEndiannessFor8ByteWord(c + 8 * i);
   
   for ( ; i < length; i += 5) {
-    swapEndiannessFor8ByteWord((char*) (u + i));
-    swapEndiannessFor8ByteWord((char*) (u + i + 1));
-    swapEndiannessFor8ByteWord((char*) (u + i + 2));
-    swapEndiannessFor8ByteWord((char*) (u + i + 3));
-    swapEndiannessFor8ByteWord((char*) (u + i + 4));
+    swapEndiannessFor8ByteWord(c + 8 * i);
+    swapEndiannessFor8ByteWord(c + 8 * (i + 1));
+    swapEndiannessFor8ByteWord(c + 8 * (i + 2));
+    swapEndiannessFor8ByteWord(c + 8 * (i + 3));
+    swapEndiannessFor8ByteWord(c + 8 * (i + 4));
   }
 }
 
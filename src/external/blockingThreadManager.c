@@ -68,8 +68,14 @@ typedef struct _ext_btm_manager_t {
   Condition threadIsActive;
   Condition threadIsWaiting;
   
+  ext_btm_batchTaskFunction_t batchTask;
+  void** batchItems;
+  size_t numBatchItems;
+  size_t batchCapacity;
 } _ext_btm_manager_t;
 
+static void runQueuedBatch(ext_btm_manager_t manager);
+
 #include <stdio.h>
 
 int ext_btm_create(ext_btm_manager_t* managerPtr, size_t numThreads)
@@ -169,9 +175,12 @@ int ext_btm_runTasks(ext_btm_manager_t restrict manager, ext_btm_taskFunction_t
   lockMutex(manager->mutex);
   
   for (size_t i = 0; i < numTasks; /* */ ) {
-    while (getNumElementsInQueue(&manager->threadQueue) == 0 && getNumElementsInQueue(&manager->parentTaskQueue) == 0)
+    while (getNumElementsInQueue(&manager->threadQueue) == 0 && getNumElementsInQueue(&manager->parentTaskQueue) == 0 &&
+           manager->numBatchItems == 0)
       waitOnCondition(manager->threadIsWaiting, manager->mutex);
     
+    runQueuedBatch(manager);
+    
     while (getNumElementsInQueue(&manager->parentTaskQueue) != 0) {
       size_t j = pop(&manager->parentTaskQueue);
       
@@ -193,8 +202,13 @@ int ext_btm_runTasks(ext_btm_manager_t restrict manager, ext_btm_taskFunction_t
     }
   }
   
-  while (manager->numThreadsRunning > 0) {
-    waitOnCondition(manager->threadIsWaiting, manager->mutex);
+  // the mutex is released while a batch runs, so signals sent then are lost and the wait has to
+  // re-check everything that a thread could have queued
+  while (manager->numThreadsRunning > 0 || getNumElementsInQueue(&manager->parentTaskQueue) != 0 ||
+         manager->numBatchItems > 0) {
+    while (getNumElementsInQueue(&manager->parentTaskQueue) == 0 && manager->numBatchItems == 0 &&
+           manager->numThreadsRunning > 0)
+      waitOnCondition(manager->threadIsWaiting, manager->mutex);
     
     while (getNumElementsInQueue(&manager->parentTaskQueue) != 0) {
       size_t j = pop(&manager->parentTaskQueue);
@@ -204,6 +218,8 @@ int ext_btm_runTasks(ext_btm_manager_t restrict manager, ext_btm_taskFunction_t
       
       signalCondition(threadData[j].parentTaskComplete);
     }
+    
+    runQueuedBatch(manager);
   }
   
   unlockMutex(manager->mutex);
@@ -211,6 +227,55 @@ int ext_btm_runTasks(ext_btm_manager_t restrict manager, ext_btm_taskFunction_t
   return result;
 }
 
+int ext_btm_queueForParentThread(ext_btm_manager_t restrict manager, ext_btm_batchTaskFunction_t task, void* restrict data)
+{
+  if (manager->threads == NULL || manager->threadData == NULL ||
+      manager->numThreadsActive == 0) return EINVAL;
+  
+  lockMutex(manager->mutex);
+  
+  if (manager->numBatchItems == manager->batchCapacity) {
+    size_t newCapacity = manager->batchCapacity == 0 ? manager->numThreads : 2 * manager->batchCapacity;
+    void** newItems = (void**) realloc(manager->batchItems, newCapacity * sizeof(void*));
+    if (newItems == NULL) {
+      unlockMutex(manager->mutex);
+      return ENOMEM;
+    }
+    manager->batchItems = newItems;
+    manager->batchCapacity = newCapacity;
+  }
+  
+  manager->batchTask = task;
+  manager->batchItems[manager->numBatchItems++] = data;
+  
+  signalCondition(manager->threadIsWaiting);
+  
+  unlockMutex(manager->mutex);
+  
+  return 0;
+}
+
+// called with the mutex held; releases it while the task runs so that threads can keep queueing
+static void runQueuedBatch(ext_btm_manager_t manager)
+{
+  if (manager->numBatchItems == 0) return;
+  
+  ext_btm_batchTaskFunction_t task = manager->batchTask;
+  void** items = manager->batchItems;
+  size_t numItems = manager->numBatchItems;
+  
+  manager->batchItems = NULL;
+  manager->numBatchItems = 0;
+  manager->batchCapacity = 0;
+  
+  unlockMutex(manager->mutex);
+  
+  task(items, numItems);
+  free(items);
+  
+  lockMutex(manager->mutex);
+}
+
 int ext_btm_runTaskInParentThread(ext_btm_manager_t restrict manager, size_t threadId, ext_btm_taskFunction_t task, void* restrict data)
 {
   if (manager->threads == NULL || manager->threadData == NULL ||
@@ -297,6 +362,8 @@ int ext_btm_destroy(ext_btm_manager_t manager)
   invalidateIndexArrayQueue(&manager->parentTaskQueue);
   invalidateIndexArrayQueue(&manager->threadQueue);
   
+  if (manager->batchItems != NULL) { free(manager->batchItems); manager->batchItems = NULL; }
+  
   if (manager->threads != NULL) { free(manager->threads); manager->threads = NULL; }
   
   if (manager->threadData != NULL) {
@@ -326,6 +393,11 @@ static int initializeManager(ext_btm_manager_t manager, size_t numThreads)
   manager->threads = NULL;
   manager->threadData = NULL;
   manager->threadsShouldExit = false;
+  
+  manager->batchTask = NULL;
+  manager->batchItems = NULL;
+  manager->numBatchItems = 0;
+  manager->batchCapacity = 0;
     
   bool mutexInitialized = false;
   bool threadIsActiveInitialized = false;
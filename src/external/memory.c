@@ -0,0 +1,57 @@
+#include <external/memory.h>
+#include "config.h"
+
+#ifdef __STRICT_ANSI__
+#  define __USE_XOPEN2K 1 // gets posix_memalign when strict ANSI
+#endif
+#include <stdlib.h>   // free, posix_memalign
+#undef __USE_XOPEN2K
+
+#if !defined(HAVE_POSIX_MEMALIGN) && defined(HAVE_MALLOC_H)
+#  include <malloc.h>   // memalign, __mingw_aligned_malloc
+#endif
+#include <stdint.h>   // uintptr_t
+
+#ifndef _WIN32
+#  include <sys/mman.h> // madvise
+#endif
+
+void* ext_alignedAlloc(size_t numBytes)
+{
+  // padding is never read, but keeps whole cache lines to ourselves
+  if (numBytes > (size_t) -1 - EXT_CACHE_LINE_SIZE) return NULL;
+  numBytes = numBytes == 0 ? EXT_CACHE_LINE_SIZE : (numBytes + EXT_CACHE_LINE_SIZE - 1) & ~((size_t) EXT_CACHE_LINE_SIZE - 1);
+
+  void* result;
+#ifdef HAVE_POSIX_MEMALIGN
+  if (posix_memalign(&result, EXT_CACHE_LINE_SIZE, numBytes) != 0) return NULL;
+#elif defined(__MINGW32__)
+  result = __mingw_aligned_malloc(numBytes, EXT_CACHE_LINE_SIZE);
+  if (result == NULL) return NULL;
+#else
+  result = memalign(EXT_CACHE_LINE_SIZE, numBytes);
+  if (result == NULL) return NULL;
+#endif
+
+#ifdef MADV_HUGEPAGE
+  // only the huge pages wholly inside the block can be advised; purely advisory, so failure is ignored
+  if (numBytes >= EXT_HUGE_PAGE_THRESHOLD) {
+    uintptr_t start = ((uintptr_t) result + EXT_HUGE_PAGE_SIZE - 1) & ~((uintptr_t) EXT_HUGE_PAGE_SIZE - 1);
+    uintptr_t end   = ((uintptr_t) result + numBytes) & ~((uintptr_t) EXT_HUGE_PAGE_SIZE - 1);
+    if (end > start) (void) madvise((void*) start, end - start, MADV_HUGEPAGE);
+  }
+#endif
+
+  return result;
+}
+
+void ext_alignedFree(void* block)
+{
+  if (block == NULL) return;
+
+#if defined(HAVE_POSIX_MEMALIGN) || !defined(__MINGW32__)
+  free(block);
+#else
+  __mingw_aligned_free(block);
+#endif
+}
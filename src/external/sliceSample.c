@@ -0,0 +1,67 @@
+#include <external/sliceSample.h>
+
+#include <errno.h>
+#include <math.h>
+
+static double evaluate(ext_sliceSample_logDensity_t logDensity, void* data, double x, double lowerBound, double upperBound)
+{
+  if (x <= lowerBound || x >= upperBound) return -HUGE_VAL;
+  double result = logDensity(x, data);
+  return isnan(result) ? -HUGE_VAL : result;
+}
+
+int ext_sliceSample(ext_rng* generator, ext_sliceSample_logDensity_t logDensity, void* data,
+                    double* x, double width, double lowerBound, double upperBound,
+                    ext_size_t maxNumStepsOut, ext_size_t numIterations)
+{
+  if (generator == NULL || logDensity == NULL || x == NULL) return EINVAL;
+  if (!isfinite(width) || width <= 0.0 || !(lowerBound < upperBound)) return EINVAL;
+
+  double x_0 = *x;
+  double f_0 = evaluate(logDensity, data, x_0, lowerBound, upperBound);
+  if (!isfinite(f_0)) return EINVAL;
+
+  for (ext_size_t i = 0; i < numIterations; ++i) {
+    // slice is { x : f(x) > f_0 - Exp(1) }, which is the log of a uniform height under exp(f_0)
+    double height = f_0 - ext_rng_simulateExponential(generator, 1.0);
+
+    double left  = x_0 - width * ext_rng_simulateContinuousUniform(generator);
+    double right = left + width;
+
+    // split the step budget randomly between the two sides so that the transition stays reversible
+    ext_size_t numStepsLeft  = (ext_size_t) (ext_rng_simulateContinuousUniform(generator) * (double) maxNumStepsOut);
+    if (numStepsLeft >= maxNumStepsOut && maxNumStepsOut > 0) numStepsLeft = maxNumStepsOut - 1;
+    ext_size_t numStepsRight = maxNumStepsOut > 0 ? maxNumStepsOut - 1 - numStepsLeft : 0;
+
+    while (numStepsLeft > 0 && left > lowerBound && evaluate(logDensity, data, left, lowerBound, upperBound) > height) {
+      left -= width;
+      --numStepsLeft;
+    }
+    while (numStepsRight > 0 && right < upperBound && evaluate(logDensity, data, right, lowerBound, upperBound) > height) {
+      right += width;
+      --numStepsRight;
+    }
+    if (left < lowerBound) left = lowerBound;
+    if (right > upperBound) right = upperBound;
+
+    // shrink towards the current point until a draw lands in the slice; x_0 is always in it, so
+    // once the interval collapses onto x_0 under rounding the chain stays put
+    while (1) {
+      double x_1 = left + (right - left) * ext_rng_simulateContinuousUniform(generator);
+      if (x_1 == x_0 || !(left < x_1 && x_1 < right)) break;
+
+      double f_1 = evaluate(logDensity, data, x_1, lowerBound, upperBound);
+      if (f_1 > height) {
+        x_0 = x_1;
+        f_0 = f_1;
+        break;
+      }
+
+      if (x_1 < x_0) left = x_1; else right = x_1;
+    }
+  }
+
+  *x = x_0;
+
+  return 0;
+}
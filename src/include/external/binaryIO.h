@@ -18,14 +18,20 @@ typedef struct ext_binaryIO
   int fileDescriptor;
   void* buffer;
   ext_size_t bufferLength;
+  ext_size_t bufferPosition; // next byte to be written, or to be read
+  ext_size_t bufferEnd;      // when reading, one past the last byte read in
   
 } ext_binaryIO;
 
+// Files are buffered and should be opened for either reading or writing, not both. Writes may
+// not reach the file until ext_bio_flush or ext_bio_invalidate is called.
+
 // open flags are in fcntl.h; permissions in sys/stat.h
 ext_binaryIO* ext_bio_create(const char* fileName, int openFlag, int permissionsFlag);
 void ext_bio_destroy(ext_binaryIO* bio);
 int ext_bio_initialize(ext_binaryIO* bio, const char* fileName, int openFlag, int permissionsFlag);
 void ext_bio_invalidate(ext_binaryIO* bio);
+int ext_bio_flush(ext_binaryIO* bio);
 
 // write specifies the length before the array is written; writeN just writes N items
 // returns 0 on success, otherwise an error code
@@ -39,6 +45,7 @@ int ext_bio_writeUnsigned32BitInteger(ext_binaryIO* bio, uint32_t u);
 int ext_bio_writeUnsigned32BitIntegers(ext_binaryIO* bio, const uint32_t* u, ext_size_t length);
 int ext_bio_writeNUnsigned32BitIntegers(ext_binaryIO* bio, const uint32_t* u, ext_size_t length);
 int ext_bio_writeUnsigned64BitInteger(ext_binaryIO* bio, uint64_t u);
+int ext_bio_writeNUnsigned64BitIntegers(ext_binaryIO* bio, const uint64_t* u, ext_size_t length);
 int ext_bio_writeDouble(ext_binaryIO* bio, double d);
 int ext_bio_writeDoubles(ext_binaryIO* bio, const double* d, ext_size_t length);
 int ext_bio_writeNDoubles(ext_binaryIO* bio, const double* d, ext_size_t length);
@@ -57,6 +64,7 @@ int ext_bio_readUnsigned32BitInteger(ext_binaryIO* bio, uint32_t* u);
 uint32_t* ext_bio_readUnsigned32BitIntegers(ext_binaryIO* bio, ext_size_t* length);
 int ext_bio_readNUnsigned32BitIntegers(ext_binaryIO* bio, uint32_t* u, ext_size_t length);
 int ext_bio_readUnsigned64BitInteger(ext_binaryIO* bio, uint64_t *u);
+int ext_bio_readNUnsigned64BitIntegers(ext_binaryIO* bio, uint64_t* u, ext_size_t length);
 int ext_bio_readDouble(ext_binaryIO* bio, double* d);
 double* ext_bio_readDoubles(ext_binaryIO* bio, ext_size_t* length);
 int ext_bio_readNDoubles(ext_binaryIO* bio, double* d, ext_size_t length);
@@ -64,6 +72,17 @@ int ext_bio_readNDoubles(ext_binaryIO* bio, double* d, ext_size_t length);
 // reads in ints from 64 bit unsigned - can result in loss of precision
 int ext_bio_readNInts(ext_binaryIO* bio, int* i, ext_size_t length);
 
+// for files being read; position is in bytes from the start of the file. The At functions read
+// from anywhere in the file without disturbing sequential reads.
+int ext_bio_getPosition(ext_binaryIO* bio, ext_size_t* position);
+int ext_bio_skip(ext_binaryIO* bio, ext_size_t length);
+int ext_bio_readNSizeTypesAt(ext_binaryIO* bio, ext_size_t position, ext_size_t* s, ext_size_t length);
+int ext_bio_readNDoublesAt(ext_binaryIO* bio, ext_size_t position, double* d, ext_size_t length);
+
+// for files being written only through it; bypasses the buffer, so can be called concurrently for
+// non-overlapping positions. Writing past the end of the file extends it.
+int ext_bio_writeNDoublesAt(ext_binaryIO* bio, ext_size_t position, const double* d, ext_size_t length);
+
 #ifdef __cplusplus
 }
 #endif
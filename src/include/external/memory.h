@@ -0,0 +1,28 @@
+#ifndef EXTERNAL_MEMORY_H
+#define EXTERNAL_MEMORY_H
+
+#include "stddef.h"
+
+// Allocation for large arrays that are streamed over repeatedly. Blocks start on a cache line
+// and are padded to a whole number of them, so that vectorized loops can run off the end of
+// the data without leaving the block. Blocks of at least EXT_HUGE_PAGE_THRESHOLD bytes are
+// advised to be backed by transparent huge pages where the system supports it, reducing TLB
+// misses when they are accessed out of order.
+
+#define EXT_CACHE_LINE_SIZE 64
+#define EXT_HUGE_PAGE_SIZE ((size_t) 1 << 21)
+#define EXT_HUGE_PAGE_THRESHOLD (2 * EXT_HUGE_PAGE_SIZE)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// returns NULL on failure; blocks must be released with ext_alignedFree
+void* ext_alignedAlloc(size_t numBytes);
+void ext_alignedFree(void* block);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EXTERNAL_MEMORY_H
@@ -0,0 +1,30 @@
+#ifndef EXTERNAL_SLICE_SAMPLE_H
+#define EXTERNAL_SLICE_SAMPLE_H
+
+#include "stddef.h"
+#include "random.h"
+
+// Univariate slice sampling with stepping out and shrinkage, following Neal (2003). The target
+// is given by its log density up to an additive constant; values outside of its support should
+// be -HUGE_VAL, and NaNs are treated as such. Nothing is allocated and there is no global state,
+// so parameters can be updated concurrently as long as each thread has its own generator.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef double (*ext_sliceSample_logDensity_t)(double x, void* data);
+
+// Runs numIterations transitions starting from *x and leaves the last state in *x. width is the
+// initial interval size, bounds are exclusive and may be infinite, and stepping out expands the
+// interval at most maxNumStepsOut times per iteration. Returns 0 on success or EINVAL if an
+// argument is invalid or the log density at the start is not finite.
+int ext_sliceSample(ext_rng* generator, ext_sliceSample_logDensity_t logDensity, void* data,
+                    double* x, double width, double lowerBound, double upperBound,
+                    ext_size_t maxNumStepsOut, ext_size_t numIterations);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EXTERNAL_SLICE_SAMPLE_H
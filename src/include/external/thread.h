@@ -85,6 +85,13 @@ bool ext_btm_isNull(ext_btm_manager_t manager);
 
 int ext_btm_runTaskInParentThread(ext_btm_manager_t restrict manager, ext_size_t threadId, ext_btm_taskFunction_t task, void* restrict data);
 
+// Queues data for the parent thread and returns without waiting. Whatever has been queued when
+// the parent is next free is passed to task in a single call, in the order queued, so every item
+// queued on a manager must be meant for the same task. Anything queued is run before runTasks
+// returns; items are owned by the caller.
+typedef void (*ext_btm_batchTaskFunction_t)(void** data, ext_size_t numItems);
+int ext_btm_queueForParentThread(ext_btm_manager_t restrict manager, ext_btm_batchTaskFunction_t task, void* restrict data);
+
 
 #ifdef __cplusplus
 }
@@ -9,9 +9,11 @@
 
 #include <external/alloca.h>
 #include <external/linearAlgebra.h>
+#include <external/thread.h>
 
 #include <external/Rinternals.h> // SEXP
 
+#include <rc/bounds.h>
 #include <rc/util.h>
 
 typedef enum {
@@ -25,6 +27,28 @@ typedef enum {
   INVALID
 } column_type;
 
+// Names and drop patterns need the R API, so they are worked out one column at a time; what
+// remains is a list of independent column fills that can be split across threads.
+typedef enum {
+  COPY_REAL = 0,
+  CONVERT_INTEGER,
+  FACTOR_INDICATOR,
+  FACTOR_CODE
+} fill_type;
+
+typedef struct {
+  fill_type type;
+  const void* source;
+  int level; // for indicators, as coded by R
+} ColumnFill;
+
+typedef struct {
+  const ColumnFill* fills;
+  size_t numFills;
+  size_t numRows;
+  double* result;
+} FillThreadData;
+
 static bool numericVectorIsConstant(SEXP x, column_type t);
 static bool integerVectorIsConstant(const int* i, size_t n);
 
@@ -32,20 +56,26 @@ static size_t getNumRowsForDataFrame(SEXP x);
 
 static void getColumnTypes(SEXP x, column_type* columnTypes);
 static void tableFactor(SEXP x, int* instanceCount);
-static void countMatrixColumns(SEXP x, const column_type* columnTypes, SEXP dropPatternExpr, bool createDropPattern, size_t* result);
-static int createMatrix(SEXP x, size_t numRows, SEXP result, const column_type* columnTypes, SEXP dropPatternExpr);
+static void countMatrixColumns(SEXP x, const column_type* columnTypes, SEXP dropPatternExpr, bool createDropPattern, bool factorsAreCategorical, size_t* result);
+static int createMatrix(SEXP x, size_t numRows, SEXP result, const column_type* columnTypes, SEXP dropPatternExpr, bool factorsAreCategorical, ext_mt_manager_t threadManager);
+static void fillColumns(const ColumnFill* fills, size_t numFills, size_t numRows, double* result);
+static void fillColumnsTask(void* data);
 static int setFactorColumnName(SEXP dfNames, size_t dfIndex, SEXP levelNames, size_t levelIndex, SEXP resultNames, size_t resultIndex);
 
 
 char* concatenateStrings(const char* s1, const char* s2);
 
-SEXP dbarts_makeModelMatrixFromDataFrame(SEXP x, SEXP dropColumnsExpr)
+SEXP dbarts_makeModelMatrixFromDataFrame(SEXP x, SEXP dropColumnsExpr, SEXP categoricalExpr, SEXP numThreadsExpr)
 {
   int errorCode = 0;
   SEXP result = R_NilValue;
   SEXP dropPatternExpr = R_NilValue;
   size_t protectCount = 0;
   
+  bool factorsAreCategorical = rc_getBool(categoricalExpr, "categorical", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_NA | RC_NO, RC_END);
+  size_t numThreads = (size_t) rc_getInt(numThreadsExpr, "number of threads", RC_LENGTH | RC_EQ, rc_asRLength(1), RC_VALUE | RC_GEQ, 1, RC_END);
+  ext_mt_manager_t threadManager = NULL;
+  
   size_t numInputColumns = (size_t) rc_getLength(x);
   size_t numOutputColumns = 0;
   
@@ -65,7 +95,7 @@ SEXP dbarts_makeModelMatrixFromDataFrame(SEXP x, SEXP dropColumnsExpr)
     dropPatternExpr = dropColumnsExpr;
   }
   
-  countMatrixColumns(x, columnTypes, dropPatternExpr, createDropPattern, &numOutputColumns);
+  countMatrixColumns(x, columnTypes, dropPatternExpr, createDropPattern, factorsAreCategorical, &numOutputColumns);
   
   size_t numRows = getNumRowsForDataFrame(x);
   
@@ -83,7 +113,13 @@ SEXP dbarts_makeModelMatrixFromDataFrame(SEXP x, SEXP dropColumnsExpr)
   UNPROTECT(1);
   SET_VECTOR_ELT(dimNamesExpr, 1, rc_newCharacter(numOutputColumns));
   
-  errorCode = createMatrix(x, numRows, result, columnTypes, dropPatternExpr);
+  // not worth starting threads for a single column
+  if (numThreads > 1 && numOutputColumns > 1 && (errorCode = ext_mt_create(&threadManager, numThreads)) != 0)
+    goto mkmm_cleanup;
+  
+  errorCode = createMatrix(x, numRows, result, columnTypes, dropPatternExpr, factorsAreCategorical, threadManager);
+  
+  if (threadManager != NULL) ext_mt_destroy(threadManager);
   
 mkmm_cleanup:
   if (errorCode != 0) {
@@ -145,7 +181,7 @@ static void tableFactor(SEXP x, int* instanceCounts)
     
   int* columnData = INTEGER(x);
   size_t columnLength = (size_t) rc_getLength(x);
-  for (size_t i = 0; i < columnLength; ++i) ++instanceCounts[columnData[i] - 1];
+  for (size_t i = 0; i < columnLength; ++i) if (columnData[i] != NA_INTEGER) ++instanceCounts[columnData[i] - 1];
 }
 
 static bool numericVectorIsConstant(SEXP x, column_type t) {
@@ -171,7 +207,7 @@ static bool integerVectorIsConstant(const int* i, size_t n) {
   return true;
 }
 
-void countMatrixColumns(SEXP x, const column_type* columnTypes, SEXP dropPatternExpr, bool createDropPattern, size_t* result)
+void countMatrixColumns(SEXP x, const column_type* columnTypes, SEXP dropPatternExpr, bool createDropPattern, bool factorsAreCategorical, size_t* result)
 {
   size_t numColumns = (size_t) rc_getLength(x);
   bool dropColumn;
@@ -271,13 +307,13 @@ void countMatrixColumns(SEXP x, const column_type* columnTypes, SEXP dropPattern
           size_t numLevelsPerFactor = 0;
           for (size_t j = 0; j < numLevels; ++j) if (factorInstanceCounts[j] > 0) ++numLevelsPerFactor;
           
-          if (numLevelsPerFactor == 2) {
+          if (numLevelsPerFactor == 2 || (factorsAreCategorical && numLevelsPerFactor > 2)) {
             *result += 1;
           } else if (numLevelsPerFactor > 2) {
             *result += numLevelsPerFactor;
           }
         } else {
-          *result += (numLevels <= 2 ? 1 : numLevels);
+          *result += (numLevels <= 2 || factorsAreCategorical ? 1 : numLevels);
         }
       }
       default:
@@ -286,7 +322,8 @@ void countMatrixColumns(SEXP x, const column_type* columnTypes, SEXP dropPattern
   }
 }
 
-static int createMatrix(SEXP x, size_t numRows, SEXP resultExpr, const column_type* columnTypes, SEXP dropPatternExpr)
+static int createMatrix(SEXP x, size_t numRows, SEXP resultExpr, const column_type* columnTypes, SEXP dropPatternExpr,
+                        bool factorsAreCategorical, ext_mt_manager_t threadManager)
 {
   SEXP names = rc_getNames(x);
   size_t protectCount = 0;
@@ -298,70 +335,43 @@ static int createMatrix(SEXP x, size_t numRows, SEXP resultExpr, const column_ty
   SEXP resultNames = VECTOR_ELT(rc_getDimNames(resultExpr), 1);
   
   size_t numColumns = (size_t) rc_getLength(x);
+  size_t numResultColumns = (size_t) rc_getLength(resultNames);
   size_t resultCol = 0;
   
+  ColumnFill* fills = (ColumnFill*) malloc((numResultColumns > 0 ? numResultColumns : 1) * sizeof(ColumnFill));
+  if (fills == NULL) { UNPROTECT(protectCount); return ENOMEM; }
+  
   for (size_t i = 0; i < numColumns; ++i) {
     SEXP col = VECTOR_ELT(x, i);
     switch (columnTypes[i]) {
       case REAL_VECTOR:
-      if (dropPatternExpr == R_NilValue || LOGICAL(VECTOR_ELT(dropPatternExpr, i))[0] == FALSE) {
-        memcpy(result + numRows * resultCol, (const double*) REAL(col), numRows * sizeof(double));
-        if (names != R_NilValue) SET_STRING_ELT(resultNames, resultCol, STRING_ELT(names, i));
-        ++resultCol; 
-      }
-      break;
-      
       case INTEGER_VECTOR:
       case LOGICAL_VECTOR:
       if (dropPatternExpr == R_NilValue || LOGICAL(VECTOR_ELT(dropPatternExpr, i))[0] == FALSE) {
-        int* colData = INTEGER(col);
-        for (size_t j = 0; j < numRows; ++j) result[j + numRows * resultCol] = (double) colData[j];
+        fills[resultCol].type = columnTypes[i] == REAL_VECTOR ? COPY_REAL : CONVERT_INTEGER;
+        fills[resultCol].source = columnTypes[i] == REAL_VECTOR ? (const void*) REAL(col) : (const void*) INTEGER(col);
         if (names != R_NilValue) SET_STRING_ELT(resultNames, resultCol, STRING_ELT(names, i));
         ++resultCol;
       }
       break;
       
-      
       case REAL_MATRIX:
-      {
-        size_t numElementCols = INTEGER(rc_getDims(col))[1];
-        double* colData = REAL(col);
-        SEXP colNames = rc_getDimNames(col) == R_NilValue ? R_NilValue : VECTOR_ELT(rc_getDimNames(col), 1);
-        int* dropPattern = dropPatternExpr == R_NilValue ? NULL : INTEGER(VECTOR_ELT(dropPatternExpr, i));
-        
-        for (size_t j = 0; j < numElementCols; ++j) {
-          if (dropPattern == NULL || dropPattern[j] == FALSE) {
-            memcpy(result + numRows * resultCol, colData + numRows * j, numRows * sizeof(double));
-            if (names != R_NilValue && colNames != R_NilValue) {
-              char* colName = concatenateStrings(CHAR(STRING_ELT(names, i)), CHAR(STRING_ELT(colNames, j)));
-              SET_STRING_ELT(resultNames, resultCol, Rf_mkChar(colName));
-              free(colName);
-            } else if (names != R_NilValue) {
-              char buffer[16];
-              snprintf(buffer, 16, "%lu", j + 1);
-              char* colName = concatenateStrings(CHAR(STRING_ELT(names, i)), buffer);
-              SET_STRING_ELT(resultNames, resultCol, Rf_mkChar(colName));
-              free(colName);
-            } else if (colNames != R_NilValue) {
-              SET_STRING_ELT(resultNames, resultCol, STRING_ELT(colNames, j));
-            }
-            ++resultCol;
-          }
-        }
-      }
-      break;
-      
       case INTEGER_MATRIX:
       case LOGICAL_MATRIX:
       {
         size_t numElementCols = INTEGER(rc_getDims(col))[1];
-        int* colData = INTEGER(col);
         SEXP colNames = rc_getDimNames(col) == R_NilValue ? R_NilValue : VECTOR_ELT(rc_getDimNames(col), 1);
         int* dropPattern = dropPatternExpr == R_NilValue ? NULL : INTEGER(VECTOR_ELT(dropPatternExpr, i));
         
         for (size_t j = 0; j < numElementCols; ++j) {
           if (dropPattern == NULL || dropPattern[j] == FALSE) {
-            for (size_t k = 0; k < numRows; ++k) result[k + numRows * resultCol] = colData[k + numRows * j];
+            if (columnTypes[i] == REAL_MATRIX) {
+              fills[resultCol].type = COPY_REAL;
+              fills[resultCol].source = REAL(col) + numRows * j;
+            } else {
+              fills[resultCol].type = CONVERT_INTEGER;
+              fills[resultCol].source = INTEGER(col) + numRows * j;
+            }
             if (names != R_NilValue && colNames != R_NilValue) {
               char* colName = concatenateStrings(CHAR(STRING_ELT(names, i)), CHAR(STRING_ELT(colNames, j)));
               SET_STRING_ELT(resultNames, resultCol, Rf_mkChar(colName));
@@ -386,42 +396,62 @@ static int createMatrix(SEXP x, size_t numRows, SEXP resultExpr, const column_ty
       {
         SEXP levels = rc_getLevels(col);
         size_t levelsLength = (size_t) rc_getLength(levels);
-        int* colData = INTEGER(col);
+        const int* colData = INTEGER(col);
         size_t numLevelsPerFactor;
+        int* factorInstanceCounts = NULL;
         
         if (dropPatternExpr == R_NilValue) {
           numLevelsPerFactor = levelsLength;
+        } else {
+          numLevelsPerFactor = 0;
+          factorInstanceCounts = INTEGER(VECTOR_ELT(dropPatternExpr, i));
+          for (size_t j = 0; j < levelsLength; ++j) if (factorInstanceCounts[j] > 0) ++numLevelsPerFactor;
+        }
+        
+        if (factorsAreCategorical) {
+          // a single column of zero-based level codes, split on natively by the sampler
+          if (factorInstanceCounts == NULL || numLevelsPerFactor >= 2) {
+            fills[resultCol].type = FACTOR_CODE;
+            fills[resultCol].source = colData;
+            if (names != R_NilValue) SET_STRING_ELT(resultNames, resultCol, STRING_ELT(names, i));
+            ++resultCol;
+          }
+        } else if (factorInstanceCounts == NULL) {
           if (numLevelsPerFactor <= 2) {
             int levelToKeep = numLevelsPerFactor == 2 ? 2 : 1;
-            for (size_t j = 0; j < numRows; ++j) result[j + numRows * resultCol] = (colData[j] == levelToKeep ? 1 : 0);
-            if (setFactorColumnName(names, i, levels, levelToKeep - 1, resultNames, resultCol) != 0) { UNPROTECT(protectCount); return ENOMEM; }
+            fills[resultCol].type = FACTOR_INDICATOR;
+            fills[resultCol].source = colData;
+            fills[resultCol].level = levelToKeep;
+            if (setFactorColumnName(names, i, levels, levelToKeep - 1, resultNames, resultCol) != 0) { free(fills); UNPROTECT(protectCount); return ENOMEM; }
             ++resultCol;
           } else {
             for (int j = 0; j < (int) levelsLength; ++j) {
-              for (size_t k = 0; k < numRows; ++k) result[k + numRows * resultCol] = (colData[k] == (j + 1) ? 1 : 0);
-              if (setFactorColumnName(names, i, levels, j, resultNames, resultCol) != 0) { UNPROTECT(protectCount); return ENOMEM; }
+              fills[resultCol].type = FACTOR_INDICATOR;
+              fills[resultCol].source = colData;
+              fills[resultCol].level = j + 1;
+              if (setFactorColumnName(names, i, levels, j, resultNames, resultCol) != 0) { free(fills); UNPROTECT(protectCount); return ENOMEM; }
               ++resultCol;
             }
           }
         } else {
-          numLevelsPerFactor = 0;
-          int* factorInstanceCounts = INTEGER(VECTOR_ELT(dropPatternExpr, i));
-          for (size_t j = 0; j < levelsLength; ++j) if (factorInstanceCounts[j] > 0) ++numLevelsPerFactor;
-          
           if (numLevelsPerFactor == 2) {
             int lastIndex;
             // skip until we find the last level that is actually in the column, make that 1
             for (lastIndex = levelsLength - 1; factorInstanceCounts[lastIndex] == 0 && lastIndex >= 0; --lastIndex) { /* */ }
             // R has factors coded with 1 based indexing
             ++lastIndex;
-            for (size_t j = 0; j < numRows; ++j) result[j + numRows * resultCol] = (colData[j] == lastIndex ? 1 : 0);
-            if (setFactorColumnName(names, i, levels, lastIndex - 1, resultNames, resultCol) != 0) { UNPROTECT(protectCount); return ENOMEM; }
+            fills[resultCol].type = FACTOR_INDICATOR;
+            fills[resultCol].source = colData;
+            fills[resultCol].level = lastIndex;
+            if (setFactorColumnName(names, i, levels, lastIndex - 1, resultNames, resultCol) != 0) { free(fills); UNPROTECT(protectCount); return ENOMEM; }
             ++resultCol;
           } else if (numLevelsPerFactor > 2) {
             for (int j = 0; j < (int) levelsLength; ++j) {
               if (factorInstanceCounts[j] > 0) {
-                for (size_t k = 0; k < numRows; ++k) result[k + numRows * resultCol] = (colData[k] == (j + 1) ? 1 : 0);
-                if (setFactorColumnName(names, i, levels, j, resultNames, resultCol) != 0) { UNPROTECT(protectCount); return ENOMEM; }
+                fills[resultCol].type = FACTOR_INDICATOR;
+                fills[resultCol].source = colData;
+                fills[resultCol].level = j + 1;
+                if (setFactorColumnName(names, i, levels, j, resultNames, resultCol) != 0) { free(fills); UNPROTECT(protectCount); return ENOMEM; }
                 ++resultCol;
               }
             }
@@ -435,11 +465,84 @@ static int createMatrix(SEXP x, size_t numRows, SEXP resultExpr, const column_ty
     }
   } // close for loop over columns
   
+  if (factorsAreCategorical) {
+    SEXP varTypesExpr = PROTECT(rc_newInteger(numResultColumns));
+    int* varTypes = INTEGER(varTypesExpr);
+    for (size_t j = 0; j < numResultColumns; ++j) varTypes[j] = fills[j].type == FACTOR_CODE ? 1 : 0;
+    Rf_setAttrib(resultExpr, Rf_install("varTypes"), varTypesExpr);
+    UNPROTECT(1);
+  }
+  
+  size_t numThreads, numFillsPerThread, offByOneIndex;
+  ext_mt_getNumThreadsForJob(threadManager, numResultColumns, 1, &numThreads, &numFillsPerThread, &offByOneIndex);
+  
+  if (numThreads <= 1) {
+    fillColumns(fills, numResultColumns, numRows, result);
+  } else {
+    FillThreadData threadData[numThreads];
+    void* threadDataPtrs[numThreads];
+    
+    size_t i = 0, fillStart = 0;
+    for ( ; i < numThreads; ++i) {
+      threadData[i].fills = fills + fillStart;
+      threadData[i].numFills = i < offByOneIndex ? numFillsPerThread : numFillsPerThread - 1;
+      threadData[i].numRows = numRows;
+      threadData[i].result = result + numRows * fillStart;
+      threadDataPtrs[i] = (void*) &threadData[i];
+      fillStart += threadData[i].numFills;
+    }
+    
+    ext_mt_runTasks(threadManager, &fillColumnsTask, threadDataPtrs, numThreads);
+  }
+  
+  free(fills);
   UNPROTECT(protectCount);
   
   return 0;
 }
 
+static void fillColumns(const ColumnFill* fills, size_t numFills, size_t numRows, double* result)
+{
+  for (size_t i = 0; i < numFills; ++i) {
+    double* restrict resultCol = result + numRows * i;
+    
+    switch (fills[i].type) {
+      case COPY_REAL:
+      memcpy(resultCol, fills[i].source, numRows * sizeof(double));
+      break;
+      
+      case CONVERT_INTEGER:
+      {
+        const int* restrict colData = (const int*) fills[i].source;
+        for (size_t j = 0; j < numRows; ++j) resultCol[j] = (double) colData[j];
+      }
+      break;
+      
+      case FACTOR_INDICATOR:
+      {
+        const int* restrict colData = (const int*) fills[i].source;
+        int level = fills[i].level;
+        for (size_t j = 0; j < numRows; ++j) resultCol[j] = colData[j] == level ? 1.0 : 0.0;
+      }
+      break;
+      
+      case FACTOR_CODE:
+      {
+        const int* restrict colData = (const int*) fills[i].source;
+        for (size_t j = 0; j < numRows; ++j) resultCol[j] = colData[j] == NA_INTEGER ? NA_REAL : (double) (colData[j] - 1);
+      }
+      break;
+    }
+  }
+}
+
+static void fillColumnsTask(void* v_data)
+{
+  FillThreadData* data = (FillThreadData*) v_data;
+  
+  fillColumns(data->fills, data->numFills, data->numRows, data->result);
+}
+
 static int setFactorColumnName(SEXP dfNames, size_t dfIndex, SEXP levelNames, size_t levelIndex,
                                SEXP resultNames, size_t resultIndex)
 {
@@ -7,7 +7,7 @@
 extern "C" {
 #endif
 
-SEXP dbarts_makeModelMatrixFromDataFrame(SEXP x, SEXP dropColumns);
+SEXP dbarts_makeModelMatrixFromDataFrame(SEXP x, SEXP dropColumns, SEXP categorical, SEXP numThreads);
 
 #ifdef __cplusplus
 }